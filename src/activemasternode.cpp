@@ -297,6 +297,7 @@ bool CActiveMasternode::Register(CTxIn vin, CService service, CKey keyCollateral
         mnodeman.Add(mn);
     } else {
         pmn->UpdateFromNewBroadcast(mnb);
+        mnodeman.UpdateIndexes(*pmn);
     }
 
     //send to all peers
@@ -10,6 +10,10 @@
 
 using namespace std;
 
+//! markers for vAddrIndex slots that hold no entry
+static const int ADDRINDEX_EMPTY = -1;
+static const int ADDRINDEX_DELETED = -2;
+
 int CAddrInfo::GetTriedBucket(const uint256& nKey) const
 {
     uint64_t hash1 = (CHashWriter(SER_GETHASH, 0) << nKey << GetKey()).GetHash().GetLow64();
@@ -73,29 +77,105 @@ double CAddrInfo::GetChance(int64_t nNow) const
     return fChance;
 }
 
+size_t CAddrMan::IndexStart(const CNetAddr& addr) const
+{
+    unsigned char vch[16];
+    for (int i = 0; i < 16; i++)
+        vch[i] = addr.GetByte(15 - i);
+    return CSipHasher(nIndexKey0, nIndexKey1).Write(vch, sizeof(vch)).Finalize() & (vAddrIndex.size() - 1);
+}
+
+int CAddrMan::IndexFind(const CNetAddr& addr) const
+{
+    if (vAddrIndex.empty())
+        return -1;
+    // at least a quarter of the slots are empty, so the probe ends
+    size_t nMask = vAddrIndex.size() - 1;
+    for (size_t pos = IndexStart(addr);; pos = (pos + 1) & nMask) {
+        int nId = vAddrIndex[pos];
+        if (nId == ADDRINDEX_EMPTY)
+            return -1;
+        if (nId != ADDRINDEX_DELETED && (const CNetAddr&)vInfo[nId] == addr)
+            return nId;
+    }
+}
+
+void CAddrMan::IndexInsert(int nId)
+{
+    if ((nAddrIndexUsed + 1) * 4 > vAddrIndex.size() * 3) {
+        // Sized from the live entries, so this also drops deleted markers
+        size_t nSlots = 64;
+        while (nSlots < (vRandom.size() + 1) * 2)
+            nSlots *= 2;
+        IndexRebuild(nSlots);
+    }
+    size_t nMask = vAddrIndex.size() - 1;
+    size_t pos = IndexStart(vInfo[nId]);
+    while (vAddrIndex[pos] >= 0)
+        pos = (pos + 1) & nMask;
+    if (vAddrIndex[pos] == ADDRINDEX_EMPTY)
+        nAddrIndexUsed++;
+    vAddrIndex[pos] = nId;
+}
+
+void CAddrMan::IndexErase(int nId)
+{
+    size_t nMask = vAddrIndex.size() - 1;
+    size_t pos = IndexStart(vInfo[nId]);
+    while (vAddrIndex[pos] != nId) {
+        assert(vAddrIndex[pos] != ADDRINDEX_EMPTY);
+        pos = (pos + 1) & nMask;
+    }
+    // A slot followed by an empty one ends no other probe and can be emptied outright
+    if (vAddrIndex[(pos + 1) & nMask] == ADDRINDEX_EMPTY) {
+        vAddrIndex[pos] = ADDRINDEX_EMPTY;
+        nAddrIndexUsed--;
+    } else {
+        vAddrIndex[pos] = ADDRINDEX_DELETED;
+    }
+}
+
+void CAddrMan::IndexRebuild(size_t nSlots)
+{
+    vAddrIndex.assign(nSlots, ADDRINDEX_EMPTY);
+    nAddrIndexUsed = 0;
+    size_t nMask = nSlots - 1;
+    for (size_t i = 0; i < vRandom.size(); i++) {
+        size_t pos = IndexStart(vInfo[vRandom[i]]);
+        while (vAddrIndex[pos] != ADDRINDEX_EMPTY)
+            pos = (pos + 1) & nMask;
+        vAddrIndex[pos] = vRandom[i];
+        nAddrIndexUsed++;
+    }
+}
+
 CAddrInfo* CAddrMan::Find(const CNetAddr& addr, int* pnId)
 {
-    std::map<CNetAddr, int>::iterator it = mapAddr.find(addr);
-    if (it == mapAddr.end())
+    int nId = IndexFind(addr);
+    if (nId == -1)
         return NULL;
     if (pnId)
-        *pnId = (*it).second;
-    std::map<int, CAddrInfo>::iterator it2 = mapInfo.find((*it).second);
-    if (it2 != mapInfo.end())
-        return &(*it2).second;
-    return NULL;
+        *pnId = nId;
+    return &vInfo[nId];
 }
 
 CAddrInfo* CAddrMan::Create(const CAddress& addr, const CNetAddr& addrSource, int* pnId)
 {
-    int nId = nIdCount++;
-    mapInfo[nId] = CAddrInfo(addr, addrSource);
-    mapAddr[addr] = nId;
-    mapInfo[nId].nRandomPos = vRandom.size();
+    int nId;
+    if (!vFreeIds.empty()) {
+        nId = vFreeIds.back();
+        vFreeIds.pop_back();
+        vInfo[nId] = CAddrInfo(addr, addrSource);
+    } else {
+        nId = vInfo.size();
+        vInfo.push_back(CAddrInfo(addr, addrSource));
+    }
+    IndexInsert(nId);
+    vInfo[nId].nRandomPos = vRandom.size();
     vRandom.push_back(nId);
     if (pnId)
         *pnId = nId;
-    return &mapInfo[nId];
+    return &vInfo[nId];
 }
 
 void CAddrMan::SwapRandom(unsigned int nRndPos1, unsigned int nRndPos2)
@@ -108,11 +188,11 @@ void CAddrMan::SwapRandom(unsigned int nRndPos1, unsigned int nRndPos2)
     int nId1 = vRandom[nRndPos1];
     int nId2 = vRandom[nRndPos2];
 
-    assert(mapInfo.count(nId1) == 1);
-    assert(mapInfo.count(nId2) == 1);
+    assert(HasId(nId1));
+    assert(HasId(nId2));
 
-    mapInfo[nId1].nRandomPos = nRndPos2;
-    mapInfo[nId2].nRandomPos = nRndPos1;
+    vInfo[nId1].nRandomPos = nRndPos2;
+    vInfo[nId2].nRandomPos = nRndPos1;
 
     vRandom[nRndPos1] = nId2;
     vRandom[nRndPos2] = nId1;
@@ -120,15 +200,16 @@ void CAddrMan::SwapRandom(unsigned int nRndPos1, unsigned int nRndPos2)
 
 void CAddrMan::Delete(int nId)
 {
-    assert(mapInfo.count(nId) != 0);
-    CAddrInfo& info = mapInfo[nId];
+    assert(HasId(nId));
+    CAddrInfo& info = vInfo[nId];
     assert(!info.fInTried);
     assert(info.nRefCount == 0);
 
     SwapRandom(info.nRandomPos, vRandom.size() - 1);
     vRandom.pop_back();
-    mapAddr.erase(info);
-    mapInfo.erase(nId);
+    IndexErase(nId);
+    info = CAddrInfo();
+    vFreeIds.push_back(nId);
     nNew--;
 }
 
@@ -137,7 +218,7 @@ void CAddrMan::ClearNew(int nUBucket, int nUBucketPos)
     // if there is an entry in the specified bucket, delete it.
     if (vvNew[nUBucket][nUBucketPos] != -1) {
         int nIdDelete = vvNew[nUBucket][nUBucketPos];
-        CAddrInfo& infoDelete = mapInfo[nIdDelete];
+        CAddrInfo& infoDelete = vInfo[nIdDelete];
         assert(infoDelete.nRefCount > 0);
         infoDelete.nRefCount--;
         vvNew[nUBucket][nUBucketPos] = -1;
@@ -169,8 +250,8 @@ void CAddrMan::MakeTried(CAddrInfo& info, int nId)
     if (vvTried[nKBucket][nKBucketPos] != -1) {
         // find an item to evict
         int nIdEvict = vvTried[nKBucket][nKBucketPos];
-        assert(mapInfo.count(nIdEvict) == 1);
-        CAddrInfo& infoOld = mapInfo[nIdEvict];
+        assert(HasId(nIdEvict));
+        CAddrInfo& infoOld = vInfo[nIdEvict];
 
         // Remove the to-be-evicted item from the tried set.
         infoOld.fInTried = false;
@@ -293,7 +374,7 @@ bool CAddrMan::Add_(const CAddress& addr, const CNetAddr& source, int64_t nTimeP
     if (vvNew[nUBucket][nUBucketPos] != nId) {
         bool fInsert = vvNew[nUBucket][nUBucketPos] == -1;
         if (!fInsert) {
-            CAddrInfo& infoExisting = mapInfo[vvNew[nUBucket][nUBucketPos]];
+            CAddrInfo& infoExisting = vInfo[vvNew[nUBucket][nUBucketPos]];
             if (infoExisting.IsTerrible() || (infoExisting.nRefCount > 1 && pinfo->nRefCount == 0)) {
                 // Overwrite the existing new table entry.
                 fInsert = true;
@@ -336,19 +417,21 @@ CAddress CAddrMan::Select_()
     if (size() == 0)
         return CAddress();
 
+    int64_t nNow = GetAdjustedTime();
+
     // Use a 50% chance for choosing between tried and new table entries.
-    if (nTried > 0 && (nNew == 0 || GetRandInt(2) == 0)) {
+    if (nTried > 0 && (nNew == 0 || insecure_rand.rand32() % 2 == 0)) {
         // use a tried node
         double fChanceFactor = 1.0;
         while (1) {
-            int nKBucket = GetRandInt(ADDRMAN_TRIED_BUCKET_COUNT);
-            int nKBucketPos = GetRandInt(ADDRMAN_BUCKET_SIZE);
+            int nKBucket = insecure_rand.rand32() % ADDRMAN_TRIED_BUCKET_COUNT;
+            int nKBucketPos = insecure_rand.rand32() % ADDRMAN_BUCKET_SIZE;
             if (vvTried[nKBucket][nKBucketPos] == -1)
                 continue;
             int nId = vvTried[nKBucket][nKBucketPos];
-            assert(mapInfo.count(nId) == 1);
-            CAddrInfo& info = mapInfo[nId];
-            if (GetRandInt(1 << 30) < fChanceFactor * info.GetChance() * (1 << 30))
+            assert(HasId(nId));
+            CAddrInfo& info = vInfo[nId];
+            if ((insecure_rand.rand32() % (1 << 30)) < fChanceFactor * info.GetChance(nNow) * (1 << 30))
                 return info;
             fChanceFactor *= 1.2;
         }
@@ -356,14 +439,14 @@ CAddress CAddrMan::Select_()
         // use a new node
         double fChanceFactor = 1.0;
         while (1) {
-            int nUBucket = GetRandInt(ADDRMAN_NEW_BUCKET_COUNT);
-            int nUBucketPos = GetRandInt(ADDRMAN_BUCKET_SIZE);
+            int nUBucket = insecure_rand.rand32() % ADDRMAN_NEW_BUCKET_COUNT;
+            int nUBucketPos = insecure_rand.rand32() % ADDRMAN_BUCKET_SIZE;
             if (vvNew[nUBucket][nUBucketPos] == -1)
                 continue;
             int nId = vvNew[nUBucket][nUBucketPos];
-            assert(mapInfo.count(nId) == 1);
-            CAddrInfo& info = mapInfo[nId];
-            if (GetRandInt(1 << 30) < fChanceFactor * info.GetChance() * (1 << 30))
+            assert(HasId(nId));
+            CAddrInfo& info = vInfo[nId];
+            if ((insecure_rand.rand32() % (1 << 30)) < fChanceFactor * info.GetChance(nNow) * (1 << 30))
                 return info;
             fChanceFactor *= 1.2;
         }
@@ -379,9 +462,10 @@ int CAddrMan::Check_()
     if (vRandom.size() != nTried + nNew)
         return -7;
 
-    for (std::map<int, CAddrInfo>::iterator it = mapInfo.begin(); it != mapInfo.end(); it++) {
-        int n = (*it).first;
-        CAddrInfo& info = (*it).second;
+    for (int n = 0; n < (int)vInfo.size(); n++) {
+        if (!HasId(n))
+            continue;
+        CAddrInfo& info = vInfo[n];
         if (info.fInTried) {
             if (!info.nLastSuccess)
                 return -1;
@@ -395,7 +479,7 @@ int CAddrMan::Check_()
                 return -4;
             mapNew[n] = info.nRefCount;
         }
-        if (mapAddr[info] != n)
+        if (IndexFind(info) != n)
             return -5;
         if (info.nRandomPos < 0 || info.nRandomPos >= vRandom.size() || vRandom[info.nRandomPos] != n)
             return -14;
@@ -415,9 +499,9 @@ int CAddrMan::Check_()
             if (vvTried[n][i] != -1) {
                 if (!setTried.count(vvTried[n][i]))
                     return -11;
-                if (mapInfo[vvTried[n][i]].GetTriedBucket(nKey) != n)
+                if (vInfo[vvTried[n][i]].GetTriedBucket(nKey) != n)
                     return -17;
-                if (mapInfo[vvTried[n][i]].GetBucketPosition(nKey, false, n) != i)
+                if (vInfo[vvTried[n][i]].GetBucketPosition(nKey, false, n) != i)
                     return -18;
                 setTried.erase(vvTried[n][i]);
             }
@@ -429,7 +513,7 @@ int CAddrMan::Check_()
             if (vvNew[n][i] != -1) {
                 if (!mapNew.count(vvNew[n][i]))
                     return -12;
-                if (mapInfo[vvNew[n][i]].GetBucketPosition(nKey, true, n) != i)
+                if (vInfo[vvNew[n][i]].GetBucketPosition(nKey, true, n) != i)
                     return -19;
                 if (--mapNew[vvNew[n][i]] == 0)
                     mapNew.erase(vvNew[n][i]);
@@ -461,9 +545,9 @@ void CAddrMan::GetAddr_(std::vector<CAddress>& vAddr)
 
         int nRndPos = GetRandInt(vRandom.size() - n) + n;
         SwapRandom(n, nRndPos);
-        assert(mapInfo.count(vRandom[n]) == 1);
+        assert(HasId(vRandom[n]));
 
-        const CAddrInfo& ai = mapInfo[vRandom[n]];
+        const CAddrInfo& ai = vInfo[vRandom[n]];
         if (!ai.IsTerrible())
             vAddr.push_back(ai);
     }
@@ -12,6 +12,7 @@
 #include "timedata.h"
 #include "util.h"
 
+#include <limits>
 #include <map>
 #include <set>
 #include <stdint.h>
@@ -124,6 +125,8 @@ public:
  *      be observable by adversaries.
  *    * Several indexes are kept for high performance. Defining DEBUG_ADDRMAN will introduce frequent (and expensive)
  *      consistency checks for the entire data structure.
+ *    * Entries live in one flat vector indexed by nId, and addresses are looked up through an open-addressing
+ *      hash table, so neither lookups nor selection walk node-based maps.
  */
 
 //! total number of buckets for tried addresses
@@ -174,14 +177,23 @@ private:
     //! secret key to randomize bucket select with
     uint256 nKey;
 
-    //! last used nId
-    int nIdCount;
+    //! table with information about all nIds; unused positions have nRandomPos == -1
+    std::vector<CAddrInfo> vInfo;
 
-    //! table with information about all nIds
-    std::map<int, CAddrInfo> mapInfo;
+    //! unused positions in vInfo, handed out again before vInfo grows
+    std::vector<int> vFreeIds;
 
-    //! find an nId based on its network address
-    std::map<CNetAddr, int> mapAddr;
+    //! find an nId based on its network address: open-addressing hash table of nIds, size a power of two
+    std::vector<int> vAddrIndex;
+
+    //! slots of vAddrIndex that are not empty, deleted markers included
+    size_t nAddrIndexUsed;
+
+    //! secret key to hash addresses into vAddrIndex with
+    uint64_t nIndexKey0, nIndexKey1;
+
+    //! source of the many draws Select_ makes while probing buckets
+    FastRandomContext insecure_rand;
 
     //! randomly-ordered vector of all nIds
     std::vector<int> vRandom;
@@ -199,6 +211,24 @@ private:
     int vvNew[ADDRMAN_NEW_BUCKET_COUNT][ADDRMAN_BUCKET_SIZE];
 
 protected:
+    //! Whether nId refers to a live entry.
+    bool HasId(int nId) const { return nId >= 0 && (size_t)nId < vInfo.size() && vInfo[nId].nRandomPos >= 0; }
+
+    //! Slot of vAddrIndex where probing for addr starts.
+    size_t IndexStart(const CNetAddr& addr) const;
+
+    //! Look up the nId of addr in vAddrIndex, or -1.
+    int IndexFind(const CNetAddr& addr) const;
+
+    //! Add entry nId to vAddrIndex, growing or cleaning it up if needed.
+    void IndexInsert(int nId);
+
+    //! Remove entry nId from vAddrIndex.
+    void IndexErase(int nId);
+
+    //! Rehash all entries in vRandom into a vAddrIndex of nSlots slots.
+    void IndexRebuild(size_t nSlots);
+
     //! Find an entry.
     CAddrInfo* Find(const CNetAddr& addr, int* pnId = NULL);
 
@@ -260,7 +290,7 @@ public:
      * as incompatible. This is necessary because it did not check the version number on
      * deserialization.
      *
-     * Notice that vvTried, mapAddr and vVector are never encoded explicitly;
+     * Notice that vvTried, vAddrIndex and vRandom are never encoded explicitly;
      * they are instead reconstructed from the other information.
      *
      * vvNew is serialized, but only used if ADDRMAN_UNKOWN_BUCKET_COUNT didn't change,
@@ -286,20 +316,20 @@ public:
 
         int nUBuckets = ADDRMAN_NEW_BUCKET_COUNT ^ (1 << 30);
         s << nUBuckets;
-        std::map<int, int> mapUnkIds;
+        std::vector<int> vUnkIds(vInfo.size(), -1);
         int nIds = 0;
-        for (std::map<int, CAddrInfo>::const_iterator it = mapInfo.begin(); it != mapInfo.end(); it++) {
-            mapUnkIds[(*it).first] = nIds;
-            const CAddrInfo& info = (*it).second;
+        for (size_t n = 0; n < vInfo.size(); n++) {
+            const CAddrInfo& info = vInfo[n];
             if (info.nRefCount) {
                 assert(nIds != nNew); // this means nNew was wrong, oh ow
                 s << info;
+                vUnkIds[n] = nIds;
                 nIds++;
             }
         }
         nIds = 0;
-        for (std::map<int, CAddrInfo>::const_iterator it = mapInfo.begin(); it != mapInfo.end(); it++) {
-            const CAddrInfo& info = (*it).second;
+        for (size_t n = 0; n < vInfo.size(); n++) {
+            const CAddrInfo& info = vInfo[n];
             if (info.fInTried) {
                 assert(nIds != nTried); // this means nTried was wrong, oh ow
                 s << info;
@@ -315,7 +345,7 @@ public:
             s << nSize;
             for (int i = 0; i < ADDRMAN_BUCKET_SIZE; i++) {
                 if (vvNew[bucket][i] != -1) {
-                    int nIndex = mapUnkIds[vvNew[bucket][i]];
+                    int nIndex = vUnkIds[vvNew[bucket][i]];
                     s << nIndex;
                 }
             }
@@ -343,11 +373,15 @@ public:
             nUBuckets ^= (1 << 30);
         }
 
+        if (nNew < 0 || nTried < 0)
+            throw std::ios_base::failure("Invalid table size in addrman deserialization");
+
         // Deserialize entries from the new table.
+        vInfo.resize(nNew);
         for (int n = 0; n < nNew; n++) {
-            CAddrInfo& info = mapInfo[n];
+            CAddrInfo& info = vInfo[n];
             s >> info;
-            mapAddr[info] = n;
+            IndexInsert(n);
             info.nRandomPos = vRandom.size();
             vRandom.push_back(n);
             if (nVersion != 1 || nUBuckets != ADDRMAN_NEW_BUCKET_COUNT) {
@@ -361,7 +395,6 @@ public:
                 }
             }
         }
-        nIdCount = nNew;
 
         // Deserialize entries from the tried table.
         int nLost = 0;
@@ -371,13 +404,13 @@ public:
             int nKBucket = info.GetTriedBucket(nKey);
             int nKBucketPos = info.GetBucketPosition(nKey, false, nKBucket);
             if (vvTried[nKBucket][nKBucketPos] == -1) {
-                info.nRandomPos = vRandom.size();
+                int nId = vInfo.size();
                 info.fInTried = true;
-                vRandom.push_back(nIdCount);
-                mapInfo[nIdCount] = info;
-                mapAddr[info] = nIdCount;
-                vvTried[nKBucket][nKBucketPos] = nIdCount;
-                nIdCount++;
+                vInfo.push_back(info);
+                IndexInsert(nId);
+                vInfo[nId].nRandomPos = vRandom.size();
+                vRandom.push_back(nId);
+                vvTried[nKBucket][nKBucketPos] = nId;
             } else {
                 nLost++;
             }
@@ -392,7 +425,7 @@ public:
                 int nIndex = 0;
                 s >> nIndex;
                 if (nIndex >= 0 && nIndex < nNew) {
-                    CAddrInfo& info = mapInfo[nIndex];
+                    CAddrInfo& info = vInfo[nIndex];
                     int nUBucketPos = info.GetBucketPosition(nKey, true, bucket);
                     if (nVersion == 1 && nUBuckets == ADDRMAN_NEW_BUCKET_COUNT && vvNew[bucket][nUBucketPos] == -1 && info.nRefCount < ADDRMAN_NEW_BUCKETS_PER_ADDRESS) {
                         info.nRefCount++;
@@ -404,13 +437,10 @@ public:
 
         // Prune new entries with refcount 0 (as a result of collisions).
         int nLostUnk = 0;
-        for (std::map<int, CAddrInfo>::const_iterator it = mapInfo.begin(); it != mapInfo.end();) {
-            if (it->second.fInTried == false && it->second.nRefCount == 0) {
-                std::map<int, CAddrInfo>::const_iterator itCopy = it++;
-                Delete(itCopy->first);
+        for (size_t n = 0; n < vInfo.size(); n++) {
+            if (HasId(n) && vInfo[n].fInTried == false && vInfo[n].nRefCount == 0) {
+                Delete(n);
                 nLostUnk++;
-            } else {
-                it++;
             }
         }
         if (nLost + nLostUnk > 0) {
@@ -428,7 +458,13 @@ public:
     void Clear()
     {
         std::vector<int>().swap(vRandom);
+        std::vector<CAddrInfo>().swap(vInfo);
+        std::vector<int>().swap(vFreeIds);
+        std::vector<int>().swap(vAddrIndex);
+        nAddrIndexUsed = 0;
         nKey = GetRandHash();
+        nIndexKey0 = GetRand(std::numeric_limits<uint64_t>::max());
+        nIndexKey1 = GetRand(std::numeric_limits<uint64_t>::max());
         for (size_t bucket = 0; bucket < ADDRMAN_NEW_BUCKET_COUNT; bucket++) {
             for (size_t entry = 0; entry < ADDRMAN_BUCKET_SIZE; entry++) {
                 vvNew[bucket][entry] = -1;
@@ -440,7 +476,6 @@ public:
             }
         }
 
-        nIdCount = 0;
         nTried = 0;
         nNew = 0;
     }
@@ -0,0 +1,177 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Copyright (c) 2021 The Uidd developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+
+#include "crypto/common.h"
+#include "crypto/sha256.h"
+#include "hash.h"
+#include "random.h"
+#include "streams.h"
+#include "txmempool.h"
+#include "util.h"
+
+#include <map>
+
+#include <boost/foreach.hpp>
+
+CBlockHeaderAndShortTxIDs::CBlockHeaderAndShortTxIDs(const CBlock& block) : nonce(GetRand(std::numeric_limits<uint64_t>::max())),
+                                                                            header(block.GetBlockHeader()),
+                                                                            vchBlockSig(block.vchBlockSig)
+{
+    FillShortTxIDSelector();
+
+    // The coinbase and coinstake are prefilled, everything else goes by short id
+    size_t nPrefilled = block.IsProofOfStake() ? 2 : 1;
+    if (nPrefilled > block.vtx.size())
+        nPrefilled = block.vtx.size();
+    prefilledtxn.resize(nPrefilled);
+    for (size_t i = 0; i < nPrefilled; i++) {
+        prefilledtxn[i].index = 0; // differentially encoded, consecutive from 0
+        prefilledtxn[i].tx = block.vtx[i];
+    }
+
+    shorttxids.resize(block.vtx.size() - nPrefilled);
+    for (size_t i = nPrefilled; i < block.vtx.size(); i++)
+        shorttxids[i - nPrefilled] = GetShortID(block.vtx[i].GetHash());
+}
+
+void CBlockHeaderAndShortTxIDs::FillShortTxIDSelector() const
+{
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << header << nonce;
+    CSHA256 hasher;
+    hasher.Write((unsigned char*)&(*stream.begin()), stream.end() - stream.begin());
+    unsigned char shorttxidhash[CSHA256::OUTPUT_SIZE];
+    hasher.Finalize(shorttxidhash);
+    shorttxidk0 = ReadLE64(shorttxidhash);
+    shorttxidk1 = ReadLE64(shorttxidhash + 8);
+}
+
+uint64_t CBlockHeaderAndShortTxIDs::GetShortID(const uint256& txhash) const
+{
+    return SipHashUint256(shorttxidk0, shorttxidk1, txhash) & 0xffffffffffffL;
+}
+
+ReadStatus PartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& cmpctblock, const CTxMemPool& pool)
+{
+    if (cmpctblock.header.IsNull() || (cmpctblock.shorttxids.empty() && cmpctblock.prefilledtxn.empty()))
+        return READ_STATUS_INVALID;
+    if (cmpctblock.BlockTxCount() > MAX_COMPACT_BLOCK_TXS)
+        return READ_STATUS_INVALID;
+
+    header = cmpctblock.header;
+    vchBlockSig = cmpctblock.vchBlockSig;
+    txn_available.assign(cmpctblock.BlockTxCount(), CTransaction());
+    vHave.assign(cmpctblock.BlockTxCount(), false);
+
+    int32_t lastprefilledindex = -1;
+    for (size_t i = 0; i < cmpctblock.prefilledtxn.size(); i++) {
+        if (cmpctblock.prefilledtxn[i].tx.IsNull())
+            return READ_STATUS_INVALID;
+
+        lastprefilledindex += cmpctblock.prefilledtxn[i].index + 1;
+        if (lastprefilledindex > std::numeric_limits<uint16_t>::max())
+            return READ_STATUS_INVALID;
+        if ((uint32_t)lastprefilledindex > cmpctblock.shorttxids.size() + i) {
+            // If we are inserting a tx at an index greater than our full list of shorttxids
+            // plus the number of prefilled txn we've inserted, then we have txn for which we
+            // have neither a prefilled txn or a shorttxid!
+            return READ_STATUS_INVALID;
+        }
+        txn_available[lastprefilledindex] = cmpctblock.prefilledtxn[i].tx;
+        vHave[lastprefilledindex] = true;
+    }
+    prefilled_count = cmpctblock.prefilledtxn.size();
+
+    // Map each short id to its position in the block. An id that shows up
+    // twice can't be resolved from the mempool, so give up on the compact
+    // form right away.
+    std::map<uint64_t, uint16_t> mapShortIDs;
+    uint16_t index_offset = 0;
+    for (size_t i = 0; i < cmpctblock.shorttxids.size(); i++) {
+        while (vHave[i + index_offset])
+            index_offset++;
+        if (!mapShortIDs.insert(std::make_pair(cmpctblock.shorttxids[i], i + index_offset)).second)
+            return READ_STATUS_FAILED;
+    }
+
+    // Ids matched by more than one mempool transaction are left for the peer to send
+    std::vector<bool> vCollided(txn_available.size(), false);
+    {
+        LOCK(pool.cs);
+        for (std::map<uint256, CTxMemPoolEntry>::const_iterator it = pool.mapTx.begin(); it != pool.mapTx.end(); ++it) {
+            std::map<uint64_t, uint16_t>::iterator idit = mapShortIDs.find(cmpctblock.GetShortID(it->first));
+            if (idit == mapShortIDs.end())
+                continue;
+            uint16_t nIndex = idit->second;
+            if (vCollided[nIndex])
+                continue;
+            if (!vHave[nIndex]) {
+                txn_available[nIndex] = it->second.GetTx();
+                vHave[nIndex] = true;
+                mempool_count++;
+            } else {
+                txn_available[nIndex] = CTransaction();
+                vHave[nIndex] = false;
+                vCollided[nIndex] = true;
+                mempool_count--;
+            }
+            // Stop scanning once every short id is matched
+            if (mempool_count == mapShortIDs.size())
+                break;
+        }
+    }
+
+    LogPrint("cmpctblock", "Initialized PartiallyDownloadedBlock for block %s using a cmpctblock of size %lu\n", cmpctblock.header.GetHash().ToString(), GetSerializeSize(cmpctblock, SER_NETWORK, PROTOCOL_VERSION));
+
+    return READ_STATUS_OK;
+}
+
+bool PartiallyDownloadedBlock::IsTxAvailable(size_t index) const
+{
+    assert(!header.IsNull());
+    assert(index < vHave.size());
+    return vHave[index];
+}
+
+void PartiallyDownloadedBlock::GetMissing(std::vector<uint16_t>& vIndexes) const
+{
+    vIndexes.clear();
+    for (size_t i = 0; i < vHave.size(); i++)
+        if (!vHave[i])
+            vIndexes.push_back(i);
+}
+
+ReadStatus PartiallyDownloadedBlock::FillBlock(CBlock& block, const std::vector<CTransaction>& vtx_missing) const
+{
+    assert(!header.IsNull());
+    block = header;
+    block.vchBlockSig = vchBlockSig;
+    block.vtx.resize(txn_available.size());
+
+    size_t tx_missing_offset = 0;
+    for (size_t i = 0; i < txn_available.size(); i++) {
+        if (vHave[i]) {
+            block.vtx[i] = txn_available[i];
+        } else {
+            if (vtx_missing.size() <= tx_missing_offset)
+                return READ_STATUS_INVALID;
+            block.vtx[i] = vtx_missing[tx_missing_offset++];
+        }
+    }
+    if (vtx_missing.size() != tx_missing_offset)
+        return READ_STATUS_INVALID;
+
+    // A short id collision with a mempool transaction shows up as a merkle
+    // root mismatch; the peer isn't at fault, fetch the full block instead.
+    bool mutated = false;
+    if (block.BuildMerkleTree(&mutated) != block.hashMerkleRoot || mutated)
+        return READ_STATUS_FAILED;
+
+    LogPrint("cmpctblock", "Successfully reconstructed block %s with %lu txn prefilled, %lu txn from mempool and %lu txn requested\n", header.GetHash().ToString(), prefilled_count, mempool_count, vtx_missing.size());
+
+    return READ_STATUS_OK;
+}
@@ -0,0 +1,192 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Copyright (c) 2021 The Uidd developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKENCODINGS_H
+#define BITCOIN_BLOCKENCODINGS_H
+
+#include "primitives/block.h"
+#include "serialize.h"
+#include "uint256.h"
+
+#include <limits>
+#include <stdint.h>
+#include <vector>
+
+class CTxMemPool;
+
+/** Upper bound on the transactions a compact block may announce, the range of getblocktxn indexes */
+static const unsigned int MAX_COMPACT_BLOCK_TXS = std::numeric_limits<uint16_t>::max();
+
+/** A request for the transactions at the given positions of a block, sent as "getblocktxn" */
+class BlockTransactionsRequest
+{
+public:
+    // A BlockTransactionsRequest message
+    uint256 blockhash;
+    std::vector<uint16_t> indexes;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(blockhash);
+        uint64_t indexes_size = (uint64_t)indexes.size();
+        READWRITE(COMPACTSIZE(indexes_size));
+        if (ser_action.ForRead() && indexes_size > MAX_COMPACT_BLOCK_TXS)
+            throw std::ios_base::failure("getblocktxn indexes overflowed");
+        indexes.resize(indexes_size);
+
+        // Indexes go over the wire differentially encoded: each is sent as the
+        // distance from the previous one, minus one.
+        uint64_t nOffset = 0;
+        for (size_t i = 0; i < indexes.size(); i++) {
+            uint64_t nDiff = indexes[i] - nOffset;
+            READWRITE(COMPACTSIZE(nDiff));
+            if (nDiff + nOffset > std::numeric_limits<uint16_t>::max())
+                throw std::ios_base::failure("getblocktxn index overflowed");
+            indexes[i] = nDiff + nOffset;
+            nOffset = indexes[i] + 1;
+        }
+    }
+};
+
+/** The transactions answering a BlockTransactionsRequest, sent as "blocktxn" */
+class BlockTransactions
+{
+public:
+    // A BlockTransactions message
+    uint256 blockhash;
+    std::vector<CTransaction> txn;
+
+    BlockTransactions() {}
+    BlockTransactions(const BlockTransactionsRequest& req) : blockhash(req.blockhash), txn(req.indexes.size()) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(blockhash);
+        READWRITE(txn);
+    }
+};
+
+/** A transaction sent in full inside a compact block, with its index differentially encoded */
+struct PrefilledTransaction {
+    uint16_t index;
+    CTransaction tx;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        uint64_t nIndex = index;
+        READWRITE(COMPACTSIZE(nIndex));
+        if (nIndex > std::numeric_limits<uint16_t>::max())
+            throw std::ios_base::failure("index overflowed 16 bits");
+        index = nIndex;
+        READWRITE(tx);
+    }
+};
+
+/**
+ * A block announced by its header and 6-byte short ids of its transactions,
+ * sent as "cmpctblock". Short ids are SipHash-2-4 of the txid, keyed from the
+ * header and a per-announcement nonce so collisions can't be precomputed.
+ *
+ * The coinbase, and for proof-of-stake blocks the coinstake, are never in a
+ * peer's mempool and are always sent in full, together with the block
+ * signature.
+ */
+class CBlockHeaderAndShortTxIDs
+{
+private:
+    mutable uint64_t shorttxidk0, shorttxidk1;
+    uint64_t nonce;
+
+    void FillShortTxIDSelector() const;
+
+    friend class PartiallyDownloadedBlock;
+
+protected:
+    std::vector<uint64_t> shorttxids;
+    std::vector<PrefilledTransaction> prefilledtxn;
+
+public:
+    static const int SHORTTXIDS_LENGTH = 6;
+
+    CBlockHeader header;
+    std::vector<unsigned char> vchBlockSig;
+
+    // Dummy for deserialization
+    CBlockHeaderAndShortTxIDs() {}
+
+    CBlockHeaderAndShortTxIDs(const CBlock& block);
+
+    uint64_t GetShortID(const uint256& txhash) const;
+
+    size_t BlockTxCount() const { return shorttxids.size() + prefilledtxn.size(); }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(header);
+        READWRITE(vchBlockSig);
+        READWRITE(nonce);
+
+        uint64_t shorttxids_size = (uint64_t)shorttxids.size();
+        READWRITE(COMPACTSIZE(shorttxids_size));
+        if (ser_action.ForRead() && shorttxids_size > MAX_COMPACT_BLOCK_TXS)
+            throw std::ios_base::failure("cmpctblock short ids overflowed");
+        shorttxids.resize(shorttxids_size);
+        for (size_t i = 0; i < shorttxids.size(); i++) {
+            uint32_t lsb = shorttxids[i] & 0xffffffff;
+            uint16_t msb = (shorttxids[i] >> 32) & 0xffff;
+            READWRITE(lsb);
+            READWRITE(msb);
+            shorttxids[i] = (uint64_t(msb) << 32) | uint64_t(lsb);
+        }
+
+        READWRITE(prefilledtxn);
+
+        if (ser_action.ForRead())
+            FillShortTxIDSelector();
+    }
+};
+
+enum ReadStatus {
+    READ_STATUS_OK,
+    READ_STATUS_INVALID, //! Invalid object, peer should be punished
+    READ_STATUS_FAILED,  //! Failed to process object, e.g. short id collision; fall back to the full block
+};
+
+/** A block being rebuilt from a compact announcement, the mempool, and a "blocktxn" reply */
+class PartiallyDownloadedBlock
+{
+protected:
+    std::vector<CTransaction> txn_available;
+    std::vector<bool> vHave;
+    size_t prefilled_count, mempool_count;
+
+public:
+    CBlockHeader header;
+    std::vector<unsigned char> vchBlockSig;
+
+    PartiallyDownloadedBlock() : prefilled_count(0), mempool_count(0) {}
+
+    ReadStatus InitData(const CBlockHeaderAndShortTxIDs& cmpctblock, const CTxMemPool& pool);
+    bool IsTxAvailable(size_t index) const;
+    /** Indexes of the transactions still missing after InitData */
+    void GetMissing(std::vector<uint16_t>& vIndexes) const;
+    ReadStatus FillBlock(CBlock& block, const std::vector<CTransaction>& vtx_missing) const;
+
+    size_t GetMempoolCount() const { return mempool_count; }
+};
+
+#endif // BITCOIN_BLOCKENCODINGS_H
@@ -7,8 +7,10 @@
 
 #include "serialize.h"
 
+#include <stdint.h>
 #include <vector>
 
+class CInv;
 class COutPoint;
 class CTransaction;
 class uint256;
@@ -97,4 +99,52 @@ public:
     void UpdateEmptyFull();
 };
 
+/**
+ * RollingBloomFilter is a probabilistic "keep track of most recently inserted" set.
+ * Construct it with the number of items to keep track of, and a false-positive
+ * rate. Unlike CBloomFilter, its memory use is fixed at construction and it
+ * never fills up: items older than nElements insertions age out.
+ *
+ * contains(item) will always return true if item was one of the last nElements
+ * items inserted; items inserted before that return false, except for the
+ * false positives.
+ *
+ * Items are hashed once with SipHash, keyed randomly per filter, and the
+ * positions for every hash function are derived from that single hash, so
+ * insert and contains don't allocate.
+ */
+class CRollingBloomFilter
+{
+public:
+    // A random bloom filter calls GetRand() at creation time.
+    // Don't create global CRollingBloomFilter objects, as they may be
+    // constructed before the randomizer is properly initialized.
+    CRollingBloomFilter(unsigned int nElements, double nFPRate);
+
+    void insert(const std::vector<unsigned char>& vKey);
+    void insert(const uint256& hash);
+    //! Keyed by type and hash, so a tx and its lock request are told apart
+    void insert(const CInv& inv);
+    bool contains(const std::vector<unsigned char>& vKey) const;
+    bool contains(const uint256& hash) const;
+    bool contains(const CInv& inv) const;
+
+    //! Forget everything, and pick a new key so earlier false positives don't repeat
+    void reset();
+
+    //! Bytes used by the filter itself
+    size_t DynamicMemoryUsage() const { return data.size() * sizeof(uint64_t); }
+
+private:
+    void insertHash(uint64_t nHash);
+    bool containsHash(uint64_t nHash) const;
+
+    int nEntriesPerGeneration;
+    int nEntriesThisGeneration;
+    int nGeneration;
+    std::vector<uint64_t> data;
+    uint64_t nKey0, nKey1;
+    int nHashFuncs;
+};
+
 #endif // BITCOIN_BLOOM_H
@@ -0,0 +1,255 @@
+// Copyright (c) 2021 The Uidd developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "coinselection.h"
+
+#include "random.h"
+#include "util.h"
+#include "utilmoneystr.h"
+#include "wallet.h"
+
+#include <algorithm>
+#include <iterator>
+#include <limits>
+
+#include <boost/foreach.hpp>
+
+using namespace std;
+
+struct CompareEffectiveValueDesc {
+    bool operator()(const CSelectCoin& a, const CSelectCoin& b) const
+    {
+        return a.nEffectiveValue > b.nEffectiveValue;
+    }
+};
+
+/** Partition predicate for a descending view: true while the coin is at least nValue */
+struct EffectiveValueAtLeast {
+    bool operator()(const CSelectCoin& coin, const CAmount& nValue) const
+    {
+        return coin.nEffectiveValue >= nValue;
+    }
+};
+
+/** Partition predicate for a descending view: true while the coin is above nValue */
+struct EffectiveValueAbove {
+    bool operator()(const CSelectCoin& coin, const CAmount& nValue) const
+    {
+        return coin.nEffectiveValue > nValue;
+    }
+};
+
+static const int nDepthClassMin[] = {std::numeric_limits<int>::min(), 1, 6};
+static const int nDepthClassMax[] = {0, 5, std::numeric_limits<int>::max()};
+
+CCoinSelector::CCoinSelector(const CWallet& wallet, const vector<COutput>& vCoinsIn, CAmount nInputCostIn) : vCoins(vCoinsIn), nCoins(0), nInputCost(nInputCostIn)
+{
+    BOOST_FOREACH (const COutput& out, vCoins) {
+        if (!out.fSpendable)
+            continue;
+
+        CSelectCoin coin;
+        coin.nValue = out.tx->vout[out.i].nValue;
+        coin.nEffectiveValue = coin.nValue - nInputCost;
+        coin.tx = out.tx;
+        coin.i = out.i;
+        coin.nDepth = out.nDepth;
+
+        // not worth spending at this input cost
+        if (coin.nEffectiveValue <= 0)
+            continue;
+
+        vBuckets[BucketIndex(wallet.IsDenominatedAmount(coin.nValue), out.tx->IsFromMe(ISMINE_ALL), out.nDepth)].push_back(coin);
+        nCoins++;
+    }
+
+    // Shuffle before the stable sort so equal-valued coins are picked in random order
+    for (int b = 0; b < nBuckets; b++) {
+        random_shuffle(vBuckets[b].begin(), vBuckets[b].end(), GetRandInt);
+        stable_sort(vBuckets[b].begin(), vBuckets[b].end(), CompareEffectiveValueDesc());
+    }
+}
+
+int CCoinSelector::BucketIndex(bool fDenom, bool fFromMe, int nDepth)
+{
+    int nClass = nDepth >= nDepthClassMin[DEPTH_MATURE] ? DEPTH_MATURE : (nDepth >= nDepthClassMin[DEPTH_RECENT] ? DEPTH_RECENT : DEPTH_UNCONFIRMED);
+    return ((fDenom ? 1 : 0) * 2 + (fFromMe ? 1 : 0)) * DEPTH_CLASSES + nClass;
+}
+
+const CCoinSelector::CMergedView& CCoinSelector::GetView(int nConfMine, int nConfTheirs, bool fIncludeDenom) const
+{
+    std::pair<std::pair<int, int>, bool> key = make_pair(make_pair(nConfMine, nConfTheirs), fIncludeDenom);
+    map<std::pair<std::pair<int, int>, bool>, CMergedView>::iterator it = mapViews.find(key);
+    if (it != mapViews.end())
+        return it->second;
+
+    CMergedView& view = mapViews[key];
+    vector<CSelectCoin> vEligible, vMerged;
+    for (int b = 0; b < nBuckets; b++) {
+        bool fDenom = b / (2 * DEPTH_CLASSES) == 1;
+        bool fFromMe = (b / DEPTH_CLASSES) % 2 == 1;
+        int nClass = b % DEPTH_CLASSES;
+        int nRequired = fFromMe ? nConfMine : nConfTheirs;
+
+        if (vBuckets[b].empty() || (fDenom && !fIncludeDenom) || nDepthClassMax[nClass] < nRequired)
+            continue;
+
+        const vector<CSelectCoin>* pSource = &vBuckets[b];
+        if (nDepthClassMin[nClass] < nRequired) {
+            // only part of this depth class qualifies
+            vEligible.clear();
+            BOOST_FOREACH (const CSelectCoin& coin, vBuckets[b])
+                if (coin.nDepth >= nRequired)
+                    vEligible.push_back(coin);
+            pSource = &vEligible;
+        }
+
+        vMerged.clear();
+        vMerged.reserve(view.vCoins.size() + pSource->size());
+        merge(view.vCoins.begin(), view.vCoins.end(), pSource->begin(), pSource->end(), back_inserter(vMerged), CompareEffectiveValueDesc());
+        view.vCoins.swap(vMerged);
+    }
+
+    view.vSuffix.assign(view.vCoins.size() + 1, 0);
+    for (size_t i = view.vCoins.size(); i > 0; i--)
+        view.vSuffix[i - 1] = view.vSuffix[i] + view.vCoins[i - 1].nEffectiveValue;
+
+    return view;
+}
+
+bool CCoinSelector::Select(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, set<pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet) const
+{
+    setCoinsRet.clear();
+    nValueRet = 0;
+
+    const CMergedView* pview = NULL;
+    size_t nLower = 0;
+    CAmount nTotalLower = 0;
+
+    // try to find nondenom first to prevent unneeded spending of mixed coins
+    for (unsigned int tryDenom = 0; tryDenom < 2; tryDenom++) {
+        if (fDebug) LogPrint("selectcoins", "tryDenom: %d\n", tryDenom);
+        pview = &GetView(nConfMine, nConfTheirs, tryDenom == 1);
+        const vector<CSelectCoin>& vView = pview->vCoins;
+
+        // everything before nLower is at least a cent above the target
+        nLower = lower_bound(vView.begin(), vView.end(), nTargetValue + CENT, EffectiveValueAtLeast()) - vView.begin();
+        nTotalLower = pview->vSuffix[nLower];
+
+        size_t nExact = lower_bound(vView.begin() + nLower, vView.end(), nTargetValue, EffectiveValueAbove()) - vView.begin();
+        if (nExact < vView.size() && vView[nExact].nEffectiveValue == nTargetValue) {
+            setCoinsRet.insert(make_pair(vView[nExact].tx, vView[nExact].i));
+            nValueRet += vView[nExact].nValue;
+            return true;
+        }
+
+        if (nTotalLower == nTargetValue) {
+            for (size_t i = nLower; i < vView.size(); ++i) {
+                setCoinsRet.insert(make_pair(vView[i].tx, vView[i].i));
+                nValueRet += vView[i].nValue;
+            }
+            return true;
+        }
+
+        if (nTotalLower < nTargetValue) {
+            if (nLower == 0) // there is no input larger than nTargetValue
+            {
+                if (tryDenom == 0)
+                    // we didn't look at denom yet, let's do it
+                    continue;
+                else
+                    // we looked at everything possible and didn't find anything, no luck
+                    return false;
+            }
+            const CSelectCoin& coin = vView[nLower - 1];
+            setCoinsRet.insert(make_pair(coin.tx, coin.i));
+            nValueRet += coin.nValue;
+            return true;
+        }
+
+        // nTotalLower > nTargetValue
+        break;
+    }
+
+    const vector<CSelectCoin>& vView = pview->vCoins;
+    vector<size_t> vBest;
+    CAmount nBest;
+
+    if (!SelectBranchAndBound(vView, pview->vSuffix, nLower, nTargetValue, vBest, nBest) && nTotalLower >= nTargetValue + CENT)
+        SelectBranchAndBound(vView, pview->vSuffix, nLower, nTargetValue + CENT, vBest, nBest);
+
+    // If we have a bigger coin and (either the search didn't find a good solution,
+    //                               or the next bigger coin is closer), return the bigger coin
+    if (nLower > 0 &&
+        ((nBest != nTargetValue && nBest < nTargetValue + CENT) || vView[nLower - 1].nEffectiveValue <= nBest)) {
+        const CSelectCoin& coin = vView[nLower - 1];
+        setCoinsRet.insert(make_pair(coin.tx, coin.i));
+        nValueRet += coin.nValue;
+    } else {
+        string s = "CCoinSelector::Select best subset: ";
+        BOOST_FOREACH (size_t i, vBest) {
+            setCoinsRet.insert(make_pair(vView[i].tx, vView[i].i));
+            nValueRet += vView[i].nValue;
+            s += FormatMoney(vView[i].nValue) + " ";
+        }
+        LogPrintf("%s - total %s\n", s, FormatMoney(nBest));
+    }
+
+    return true;
+}
+
+bool SelectBranchAndBound(const vector<CSelectCoin>& vCoins, const vector<CAmount>& vSuffix, size_t nBegin, const CAmount& nTargetValue, vector<size_t>& vBest, CAmount& nBest, size_t nMaxTries)
+{
+    vBest.clear();
+    nBest = std::numeric_limits<CAmount>::max();
+
+    vector<size_t> vSelected;
+    CAmount nCurrent = 0;
+    size_t i = nBegin;
+
+    for (size_t nTries = 0; nTries < nMaxTries; nTries++) {
+        bool fBacktrack = false;
+        if (nCurrent >= nTargetValue) {
+            if (nCurrent < nBest) {
+                nBest = nCurrent;
+                vBest = vSelected;
+                if (nBest == nTargetValue)
+                    return true;
+            }
+            fBacktrack = true;
+        } else if (i >= vCoins.size() || nCurrent + vSuffix[i] < nTargetValue) {
+            // not enough left to reach the target down this branch
+            fBacktrack = true;
+        } else if (nCurrent + vCoins[i].nEffectiveValue >= nBest) {
+            // including this coin can't beat what we have, jump to the first one that could
+            i = lower_bound(vCoins.begin() + i, vCoins.end(), nBest - nCurrent, EffectiveValueAtLeast()) - vCoins.begin();
+            continue;
+        }
+
+        if (fBacktrack) {
+            if (vSelected.empty())
+                break;
+            size_t j = vSelected.back();
+            vSelected.pop_back();
+            nCurrent -= vCoins[j].nEffectiveValue;
+
+            // Exclude coin j. Equal-valued coins right after it would only
+            // rebuild subsets already explored while j was included.
+            i = j + 1;
+            while (i < vCoins.size() && vCoins[i].nEffectiveValue == vCoins[j].nEffectiveValue)
+                i++;
+        } else {
+            if (nCurrent + vCoins[i].nEffectiveValue >= nTargetValue) {
+                // Any of the coins from here down to the last one covering the
+                // gap completes the selection; the smallest of them is best.
+                i = lower_bound(vCoins.begin() + i, vCoins.end(), nTargetValue - nCurrent, EffectiveValueAtLeast()) - vCoins.begin() - 1;
+            }
+            vSelected.push_back(i);
+            nCurrent += vCoins[i].nEffectiveValue;
+            i++;
+        }
+    }
+
+    return nBest == nTargetValue;
+}
@@ -0,0 +1,88 @@
+// Copyright (c) 2021 The Uidd developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_COINSELECTION_H
+#define BITCOIN_COINSELECTION_H
+
+#include "amount.h"
+
+#include <map>
+#include <set>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+class COutput;
+class CWallet;
+class CWalletTx;
+
+/** Upper bound on the number of search steps taken by the branch-and-bound solver */
+static const size_t COINSELECT_MAX_TRIES = 100000;
+
+/** A spendable output as seen by the coin selector */
+struct CSelectCoin {
+    CAmount nValue;
+    CAmount nEffectiveValue; //! nValue minus the cost of spending it
+    const CWalletTx* tx;
+    unsigned int i;
+    int nDepth;
+};
+
+/**
+ * Coin selection engine over a presorted set of available outputs.
+ *
+ * Outputs are split once into buckets by (denominated, from-me, depth class)
+ * and each bucket is sorted by effective value, largest first. A selection
+ * only merges the buckets that can satisfy its confirmation requirements;
+ * merged views are cached so CreateTransaction's fee loop can call Select()
+ * repeatedly without re-scanning or re-sorting the wallet.
+ *
+ * Subsets are found with a depth-first branch-and-bound search that stops on
+ * an exact match and otherwise keeps the smallest overshoot it saw within
+ * COINSELECT_MAX_TRIES steps.
+ */
+class CCoinSelector
+{
+public:
+    CCoinSelector(const CWallet& wallet, const std::vector<COutput>& vCoinsIn, CAmount nInputCostIn = 0);
+
+    bool Select(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, std::set<std::pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet) const;
+
+    /** The outputs this selector was built from, in their original order */
+    const std::vector<COutput>& GetCoins() const { return vCoins; }
+    size_t size() const { return nCoins; }
+
+private:
+    enum {
+        DEPTH_UNCONFIRMED = 0,
+        DEPTH_RECENT,  //! 1 to 5 confirmations
+        DEPTH_MATURE,  //! 6 or more confirmations
+        DEPTH_CLASSES
+    };
+    static const int nBuckets = 2 * 2 * DEPTH_CLASSES;
+
+    static int BucketIndex(bool fDenom, bool fFromMe, int nDepth);
+
+    /** Sorted view over the buckets eligible for a selection, plus suffix sums for pruning */
+    struct CMergedView {
+        std::vector<CSelectCoin> vCoins;
+        std::vector<CAmount> vSuffix;
+    };
+
+    const CMergedView& GetView(int nConfMine, int nConfTheirs, bool fIncludeDenom) const;
+
+    std::vector<COutput> vCoins;
+    std::vector<CSelectCoin> vBuckets[nBuckets];
+    size_t nCoins;
+    CAmount nInputCost;
+    mutable std::map<std::pair<std::pair<int, int>, bool>, CMergedView> mapViews;
+};
+
+/**
+ * Find the subset of vCoins (sorted by effective value, largest first) with the
+ * smallest total at or above nTargetValue. Returns true if the total is exact.
+ */
+bool SelectBranchAndBound(const std::vector<CSelectCoin>& vCoins, const std::vector<CAmount>& vSuffix, size_t nBegin, const CAmount& nTargetValue, std::vector<size_t>& vBest, CAmount& nBest, size_t nMaxTries = COINSELECT_MAX_TRIES);
+
+#endif // BITCOIN_COINSELECTION_H
@@ -92,6 +92,10 @@ typedef u_int SOCKET;
 size_t strnlen( const char *start, size_t max_len);
 #endif // HAVE_DECL_STRNLEN
 
+#ifdef HAVE_SYS_EPOLL_H
+#define USE_EPOLL
+#endif
+
 bool static inline IsSelectableSocket(SOCKET s)
 {
 #ifdef WIN32
@@ -0,0 +1,148 @@
+// Copyright (c) 2021 The Uidd developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_EXPIRYMAP_H
+#define BITCOIN_EXPIRYMAP_H
+
+#include <map>
+#include <set>
+#include <stddef.h>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+/** Expiry of a value that is its own expiry time or height */
+struct expiry_is_value {
+    template <typename V>
+    int64_t operator()(const V& v) const { return v; }
+};
+
+/**
+ * STL-like map that also orders its keys by expiry, so dropping what expired
+ * only visits the entries that are due instead of the whole map. An entry's
+ * expiry is GetExpiry(value), read again when the entry comes due, so values
+ * may be changed in place as long as that only pushes their expiry later.
+ * Holds at most nMaxSize entries, inserting past that evicts the ones due
+ * soonest.
+ */
+template <typename K, typename V, typename E = expiry_is_value>
+class expirymap
+{
+public:
+    typedef K key_type;
+    typedef V mapped_type;
+    typedef std::pair<const key_type, mapped_type> value_type;
+    typedef typename std::map<K, V>::iterator iterator;
+    typedef typename std::map<K, V>::const_iterator const_iterator;
+    typedef typename std::map<K, V>::size_type size_type;
+
+protected:
+    std::map<K, V> map;
+    //! keys by their expiry when last looked at, entries of erased or refiled keys are dropped once due
+    std::set<std::pair<int64_t, K> > setExpiry;
+    size_type nMaxSize;
+    E GetExpiry;
+
+    /**
+     * Take the entry due soonest off setExpiry. Returns the entry of the map it is due for,
+     * or end() if it was stale, filing entries whose value was pushed later again.
+     */
+    iterator pop_expiry()
+    {
+        std::pair<int64_t, K> entry = *setExpiry.begin();
+        setExpiry.erase(setExpiry.begin());
+
+        iterator it = map.find(entry.second);
+        if (it == map.end())
+            return map.end();
+        int64_t nExpiry = GetExpiry(it->second);
+        if (nExpiry != entry.first) {
+            // changed since it was filed, make sure it is filed under its current expiry
+            setExpiry.insert(std::make_pair(nExpiry, entry.second));
+            return map.end();
+        }
+        return it;
+    }
+
+public:
+    expirymap(size_type nMaxSizeIn = 0, const E& getExpiryIn = E()) : nMaxSize(nMaxSizeIn), GetExpiry(getExpiryIn) {}
+
+    iterator begin() { return map.begin(); }
+    const_iterator begin() const { return map.begin(); }
+    iterator end() { return map.end(); }
+    const_iterator end() const { return map.end(); }
+    size_type size() const { return map.size(); }
+    bool empty() const { return map.empty(); }
+    iterator find(const key_type& k) { return map.find(k); }
+    const_iterator find(const key_type& k) const { return map.find(k); }
+    size_type count(const key_type& k) const { return map.count(k); }
+
+    /** Insert x unless its key is there, appending the entries evicted to make room to pvErased if given */
+    std::pair<iterator, bool> insert(const value_type& x, std::vector<std::pair<K, V> >* pvErased = NULL)
+    {
+        if (nMaxSize && map.size() >= nMaxSize && !map.count(x.first)) {
+            while (map.size() >= nMaxSize && !setExpiry.empty()) {
+                iterator it = pop_expiry();
+                if (it == map.end())
+                    continue;
+                if (pvErased)
+                    pvErased->push_back(*it);
+                map.erase(it);
+            }
+        }
+        std::pair<iterator, bool> ret = map.insert(x);
+        if (ret.second)
+            setExpiry.insert(std::make_pair(GetExpiry(x.second), x.first));
+        return ret;
+    }
+
+    mapped_type& operator[](const key_type& k)
+    {
+        iterator it = map.find(k);
+        if (it == map.end())
+            it = insert(value_type(k, mapped_type())).first;
+        return it->second;
+    }
+
+    /** File an entry again under its current expiry, needed after changing it to expire sooner */
+    void refile(const_iterator it) { setExpiry.insert(std::make_pair(GetExpiry(it->second), it->first)); }
+
+    void erase(iterator it)
+    {
+        setExpiry.erase(std::make_pair(GetExpiry(it->second), it->first));
+        map.erase(it);
+    }
+
+    size_type erase(const key_type& k)
+    {
+        iterator it = map.find(k);
+        if (it == map.end())
+            return 0;
+        erase(it);
+        return 1;
+    }
+
+    void clear()
+    {
+        map.clear();
+        setExpiry.clear();
+    }
+
+    /** Erase the entries that expire before nTime, appending them to pvErased if given */
+    void expire(int64_t nTime, std::vector<std::pair<K, V> >* pvErased = NULL)
+    {
+        while (!setExpiry.empty() && setExpiry.begin()->first < nTime) {
+            iterator it = pop_expiry();
+            if (it == map.end())
+                continue;
+            if (pvErased)
+                pvErased->push_back(*it);
+            map.erase(it);
+        }
+    }
+
+    size_type max_size() const { return nMaxSize; }
+};
+
+#endif // BITCOIN_EXPIRYMAP_H
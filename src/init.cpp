@@ -28,6 +28,7 @@
 #include "miner.h"
 #include "net.h"
 #include "rpcserver.h"
+#include "script/sign.h"
 #include "script/standard.h"
 #include "scheduler.h"
 #include "spork.h"
@@ -165,6 +166,14 @@ public:
 static CCoinsViewDB* pcoinsdbview = NULL;
 static CCoinsViewErrorCatcher* pcoinscatcher = NULL;
 
+#ifdef ENABLE_WALLET
+static void RunWalletMaintenance()
+{
+    if (pwalletMain)
+        pwalletMain->RunMaintenance();
+}
+#endif
+
 void Interrupt(boost::thread_group& threadGroup)
 {
     InterruptHTTPServer();
@@ -202,8 +211,8 @@ void PrepareShutdown()
     GenerateBitcoins(false, NULL, 0);
 #endif
     StopNode();
-    DumpMasternodes();
-    DumpMasternodePayments();
+    CloseMasternodes();
+    CloseMasternodePayments();
     UnregisterNodeSignals(GetNodeSignals());
 
     if (fFeeEstimatesInitialized) {
@@ -351,6 +360,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-version", _("Print version and exit"));
     strUsage += HelpMessageOpt("-alertnotify=<cmd>", _("Execute command when a relevant alert is received or we see a really long fork (%s in cmd is replaced by message)"));
     strUsage += HelpMessageOpt("-alerts", strprintf(_("Receive and display P2P network alerts (default: %u)"), DEFAULT_ALERTS));
+    strUsage += HelpMessageOpt("-blockmsgcache=<n>", strprintf(_("Keep up to <n> megabytes of recent blocks serialized for sending to peers (default: %u)"), DEFAULT_BLOCK_MSG_CACHE));
     strUsage += HelpMessageOpt("-blocknotify=<cmd>", _("Execute command when the best block changes (%s in cmd is replaced by block hash)"));
     strUsage += HelpMessageOpt("-blocksizenotify=<cmd>", _("Execute command when the best block changes and its size is over (%s in cmd is replaced by block hash, %d with the block size)"));
     strUsage += HelpMessageOpt("-checkblocks=<n>", strprintf(_("How many blocks to check at startup (default: %u, 0 = all)"), 500));
@@ -412,6 +422,9 @@ std::string HelpMessage(HelpMessageMode mode)
 #else
     strUsage += HelpMessageOpt("-upnp", strprintf(_("Use UPnP to map the listening port (default: %u)"), 0));
 #endif
+#endif
+#ifdef USE_EPOLL
+    strUsage += HelpMessageOpt("-useepoll", strprintf(_("Wait for socket events with epoll instead of select(), allowing more than %u connections (default: %u)"), FD_SETSIZE, DEFAULT_USE_EPOLL));
 #endif
     strUsage += HelpMessageOpt("-whitebind=<addr>", _("Bind to given address and whitelist peers connecting to it. Use [host]:port notation for IPv6"));
     strUsage += HelpMessageOpt("-whitelist=<netmask>", _("Whitelist peers connecting from the given netmask or IP address. Can be specified multiple times.") +
@@ -469,7 +482,7 @@ std::string HelpMessage(HelpMessageMode mode)
         strUsage += HelpMessageOpt("-stopafterblockimport", strprintf(_("Stop running after importing blocks from disk (default: %u)"), 0));
         strUsage += HelpMessageOpt("-sporkkey=<privkey>", _("Enable spork administration functionality with the appropriate private key."));
     }
-    string debugCategories = "addrman, alert, bench, coindb, db, lock, rand, rpc, selectcoins, tor, mempool, net, proxy, http, libevent, uidd, (obfuscation, swiftx, masternode, mnpayments, mnbudget, zero, net)"; // Don't translate these and qt below
+    string debugCategories = "addrman, alert, bench, cmpctblock, coindb, db, lock, rand, rpc, selectcoins, tor, mempool, net, proxy, http, libevent, uidd, (obfuscation, swiftx, masternode, mnpayments, mnbudget, zero, net)"; // Don't translate these and qt below
     if (mode == HMM_BITCOIN_QT)
         debugCategories += ", qt";
     strUsage += HelpMessageOpt("-debug=<category>", strprintf(_("Output debugging information (default: %u, supplying <category> is optional)"), 0) + ". " +
@@ -842,7 +855,13 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     // Make sure enough file descriptors are available
     int nBind = std::max((int)mapArgs.count("-bind") + (int)mapArgs.count("-whitebind"), 1);
     nMaxConnections = GetArg("-maxconnections", 125);
-    nMaxConnections = std::max(std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS)), 0);
+    int nMaxSockets = FD_SETSIZE;
+#ifdef USE_EPOLL
+    // Only the descriptor limit below applies to epoll
+    if (GetBoolArg("-useepoll", DEFAULT_USE_EPOLL))
+        nMaxSockets = std::numeric_limits<int>::max() - MIN_CORE_FILEDESCRIPTORS;
+#endif
+    nMaxConnections = std::max(std::min(nMaxConnections, (int)(nMaxSockets - nBind - MIN_CORE_FILEDESCRIPTORS)), 0);
     int nFD = RaiseFileDescriptorLimit(nMaxConnections + MIN_CORE_FILEDESCRIPTORS);
     if (nFD < MIN_CORE_FILEDESCRIPTORS)
         return InitError(_("Not enough file descriptors available."));
@@ -1014,6 +1033,8 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
         for (int i = 0; i < nScriptCheckThreads - 1; i++)
             threadGroup.create_thread(&ThreadScriptCheck);
     }
+    StartMasternodeSigCheckThreads(threadGroup);
+    StartSigningThreads(threadGroup);
 
     if (mapArgs.count("-sporkkey")) // spork priv key
     {
@@ -1354,6 +1375,7 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     size_t nCoinDBCache = nTotalCache / 2; // use half of the remaining cache for coindb cache
     nTotalCache -= nCoinDBCache;
     nCoinCacheSize = nTotalCache / 300; // coins in memory require around 300 bytes
+    blockMessageCache.SetMaxBytes(std::max((int64_t)0, GetArg("-blockmsgcache", DEFAULT_BLOCK_MSG_CACHE)) << 20);
 
     bool fLoaded = false;
     while (!fLoaded) {
@@ -1651,32 +1673,11 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
 
     uiInterface.InitMessage(_("Loading masternode cache..."));
 
-    CMasternodeDB mndb;
-    CMasternodeDB::ReadResult readResult = mndb.Read(mnodeman);
-    if (readResult == CMasternodeDB::FileError)
-        LogPrintf("Missing masternode cache file - mncache.dat, will try to recreate\n");
-    else if (readResult != CMasternodeDB::Ok) {
-        LogPrintf("Error reading mncache.dat: ");
-        if (readResult == CMasternodeDB::IncorrectFormat)
-            LogPrintf("magic is ok but data has invalid format, will try to recreate\n");
-        else
-            LogPrintf("file format is unknown or invalid, please fix it manually\n");
-    }
+    LoadMasternodes();
 
     uiInterface.InitMessage(_("Loading masternode payment cache..."));
 
-    CMasternodePaymentDB mnpayments;
-    CMasternodePaymentDB::ReadResult readResult3 = mnpayments.Read(masternodePayments);
-
-    if (readResult3 == CMasternodePaymentDB::FileError)
-        LogPrintf("Missing masternode payment cache - mnpayments.dat, will try to recreate\n");
-    else if (readResult3 != CMasternodePaymentDB::Ok) {
-        LogPrintf("Error reading mnpayments.dat: ");
-        if (readResult3 == CMasternodePaymentDB::IncorrectFormat)
-            LogPrintf("magic is ok but data has invalid format, will try to recreate\n");
-        else
-            LogPrintf("file format is unknown or invalid, please fix it manually\n");
-    }
+    LoadMasternodePayments();
 
     fMasterNode = GetBoolArg("-masternode", false);
 
@@ -1791,6 +1792,7 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     obfuScationPool.InitCollateralAddress();
 
     threadGroup.create_thread(boost::bind(&ThreadCheckObfuScationPool));
+    threadGroup.create_thread(boost::bind(&ThreadObfuscationPool));
 
     // ********************************************************* Step 11: start node
 
@@ -1821,6 +1823,10 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     // Generate coins in the background
     if (pwalletMain)
         GenerateBitcoins(GetBoolArg("-gen", false), pwalletMain, GetArg("-genproclimit", 1));
+
+    // MultiSend and dust combining run on the scheduler, off the block validation path
+    if (pwalletMain)
+        scheduler.scheduleEvery(&RunWalletMaintenance, WALLET_MAINTENANCE_INTERVAL);
 #endif
 
     // ********************************************************* Step 12: finished
@@ -1836,6 +1842,9 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
         // Run a thread to flush wallet periodically
         threadGroup.create_thread(boost::bind(&ThreadFlushWalletDB, boost::ref(pwalletMain->strWalletFile)));
 
+        // Run a thread to refill the keypool in the background
+        threadGroup.create_thread(boost::bind(&CWallet::ThreadKeyPoolTopUp, pwalletMain));
+
 		LogPrint("masternode", "%s finished. balance: %d. chainActive.Height(): %d. nChainWork: %s\n", __func__, pwalletMain ? pwalletMain->GetBalance() : 0, chainActive.Height(), chainActive.Tip()->nChainWork.ToString());
     }
 #endif
@@ -11,6 +11,7 @@
 #include "accumulators.h"
 #include "addrman.h"
 #include "alert.h"
+#include "blockencodings.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
@@ -19,6 +20,7 @@
 #include "masternode-payments.h"
 #include "masternodeman.h"
 #include "merkleblock.h"
+#include "mruset.h"
 #include "net.h"
 #include "obfuscation.h"
 #include "pow.h"
@@ -91,6 +93,12 @@ CFeeRate minRelayTxFee = CFeeRate(1600);
 
 CTxMemPool mempool(::minRelayTxFee);
 
+/** "block" messages for recently requested blocks, filled by the first getdata outside cs_main */
+CNetMessageCache blockMessageCache;
+/** Serialized "cmpctblock" messages for recent blocks, one nonce shared by every peer */
+static CNetMessageCache cmpctBlockMessageCache(1 << 20);
+
+
 struct COrphanTx {
     CTransaction tx;
     NodeId fromPeer;
@@ -232,8 +240,13 @@ struct CNodeState {
     int nBlocksInFlight;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
+    //! The block announced in this peer's last cmpctblock, waiting for the missing transactions.
+    uint256 hashPartialBlock;
+    PartiallyDownloadedBlock partialBlock;
+    //! Compact blocks asked for in answer to a block inv, which aren't tracked as in flight.
+    mruset<uint256> setCmpctBlocksRequested;
 
-    CNodeState()
+    CNodeState() : setCmpctBlocksRequested(MAX_CMPCTBLOCKS_REQUESTED)
     {
         fCurrentlyConnected = false;
         nMisbehavior = 0;
@@ -245,6 +258,7 @@ struct CNodeState {
         nStallingSince = 0;
         nBlocksInFlight = 0;
         fPreferredDownload = false;
+        hashPartialBlock = uint256(0);
     }
 };
 
@@ -3165,6 +3179,7 @@ bool static DisconnectTip(CValidationState& state)
     mempool.check(pcoinsTip);
     // Update chainActive and related variables.
     UpdateTip(pindexDelete->pprev);
+    mnCollateralWatch.BlockDisconnected(block);
     // Let wallets know transactions went from 1-confirmed to
     // 0-confirmed or conflicted:
     BOOST_FOREACH (const CTransaction& tx, block.vtx) {
@@ -3240,6 +3255,7 @@ bool static ConnectTip(CValidationState& state, CBlockIndex* pindexNew, CBlock*
     mempool.check(pcoinsTip);
     // Update chainActive & related variables.
     UpdateTip(pindexNew);
+    mnCollateralWatch.BlockConnected(*pblock);
     // Tell wallet about transactions that went from mempool
     // to conflicted:
     BOOST_FOREACH (const CTransaction& tx, txConflicted) {
@@ -4067,6 +4083,26 @@ bool ContextualCheckBlockHeader(const CBlockHeader& block, CValidationState& sta
     return true;
 }
 
+bool CheckUnindexedBlockHeader(const CBlockHeader& block, CValidationState& state)
+{
+    AssertLockHeld(cs_main);
+    BlockMap::iterator miSelf = mapBlockIndex.find(block.GetHash());
+    if (miSelf != mapBlockIndex.end() && (miSelf->second->nStatus & BLOCK_FAILED_MASK))
+        return state.Invalid(error("%s : block is marked invalid", __func__), 0, "duplicate");
+
+    if (!CheckBlockHeader(block, state, false))
+        return false;
+
+    BlockMap::iterator mi = mapBlockIndex.find(block.hashPrevBlock);
+    if (mi == mapBlockIndex.end())
+        return state.DoS(0, error("%s : prev block %s not found", __func__, block.hashPrevBlock.ToString().c_str()), 0, "bad-prevblk");
+    CBlockIndex* pindexPrev = (*mi).second;
+    if (pindexPrev->nStatus & BLOCK_FAILED_MASK)
+        return state.DoS(100, error("%s : prev block invalid", __func__), REJECT_INVALID, "bad-prevblk");
+
+    return ContextualCheckBlockHeader(block, state, pindexPrev);
+}
+
 bool IsBlockHashInChain(const uint256& hashBlock)
 {
     if (hashBlock == 0 || !mapBlockIndex.count(hashBlock))
@@ -4387,16 +4423,6 @@ bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDis
         }
     }
 
-    if (pwalletMain) {
-        // If turned on MultiSend will send a transaction (or more) on the after maturity of a stake
-        if (pwalletMain->isMultiSendEnabled())
-            pwalletMain->MultiSend();
-
-        // If turned on Auto Combine will scan wallet for dust to combine
-        if (pwalletMain->fCombineDust)
-            pwalletMain->AutoCombineDust();
-    }
-
     LogPrintf("%s : ACCEPTED in %ld milliseconds with size=%d\n", __func__, GetTimeMillis() - nStartTime,
               pblock->GetSerializeSize(SER_DISK, CLIENT_VERSION));
 	LogPrint("masternode", "ProcessNewBlock - done\n");
@@ -5093,12 +5119,14 @@ bool static AlreadyHave(const CInv& inv)
         return mapTxLockVote.count(inv.hash);
     case MSG_SPORK:
         return mapSporks.count(inv.hash);
-    case MSG_MASTERNODE_WINNER:
+    case MSG_MASTERNODE_WINNER: {
+        LOCK(cs_mapMasternodePayeeVotes);
         if (masternodePayments.mapMasternodePayeeVotes.count(inv.hash)) {
             masternodeSync.AddedMasternodeWinner(inv.hash);
             return true;
         }
         return false;
+    }
     case MSG_MASTERNODE_ANNOUNCE:
         if (mnodeman.mapSeenMasternodeBroadcast.count(inv.hash)) {
             masternodeSync.AddedMasternodeList(inv.hash);
@@ -5119,8 +5147,6 @@ void static ProcessGetData(CNode* pfrom)
 
     vector<CInv> vNotFound;
 
-    LOCK(cs_main);
-
     while (it != pfrom->vRecvGetData.end()) {
         // Don't bother if send buffer is too full to respond anyway
         if (pfrom->nSendSize >= SendBufferSize())
@@ -5131,33 +5157,65 @@ void static ProcessGetData(CNode* pfrom)
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK) {
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK) {
                 bool send = false;
-                BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
-                if (mi != mapBlockIndex.end()) {
-                    if (chainActive.Contains(mi->second)) {
-                        send = true;
-                    } else {
-                        // To prevent fingerprinting attacks, only send blocks outside of the active
-                        // chain if they are valid, and no more than a max reorg depth than the best header
-                        // chain we know about.
-                        send = mi->second->IsValid(BLOCK_VALID_SCRIPTS) && (pindexBestHeader != NULL) &&
-                               (chainActive.Height() - mi->second->nHeight < Params().MaxReorganizationDepth());
-                        if (!send) {
-                            LogPrintf("ProcessGetData(): ignoring request from peer=%i for old block that isn't in the main chain\n", pfrom->GetId());
+                bool fCompact = false;
+                CDiskBlockPos pos;
+                uint256 hashContinueTip = 0;
+                {
+                    LOCK(cs_main);
+                    BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
+                    if (mi != mapBlockIndex.end()) {
+                        if (chainActive.Contains(mi->second)) {
+                            send = true;
+                        } else {
+                            // To prevent fingerprinting attacks, only send blocks outside of the active
+                            // chain if they are valid, and no more than a max reorg depth than the best header
+                            // chain we know about.
+                            send = mi->second->IsValid(BLOCK_VALID_SCRIPTS) && (pindexBestHeader != NULL) &&
+                                   (chainActive.Height() - mi->second->nHeight < Params().MaxReorganizationDepth());
+                            if (!send) {
+                                LogPrintf("ProcessGetData(): ignoring request from peer=%i for old block that isn't in the main chain\n", pfrom->GetId());
+                            }
                         }
                     }
+                    // Don't send not-validated blocks
+                    send = send && (mi->second->nStatus & BLOCK_HAVE_DATA);
+                    if (send) {
+                        pos = mi->second->GetBlockPos();
+                        fCompact = inv.type == MSG_CMPCT_BLOCK && chainActive.Height() - mi->second->nHeight < MAX_CMPCTBLOCK_DEPTH;
+                        if (inv.hash == pfrom->hashContinue)
+                            hashContinueTip = chainActive.Tip()->GetBlockHash();
+                    }
                 }
-                // Don't send not-validated blocks
-                if (send && (mi->second->nStatus & BLOCK_HAVE_DATA)) {
-                    // Send block from disk
-                    CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second))
-                        assert(!"cannot load block from disk");
-                    if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
-                    else // MSG_FILTERED_BLOCK)
+
+                // Block files are append-only, so the data can be read and sent without cs_main
+                if (send) {
+                    if (fCompact) {
+                        CSerializedNetMsg msg = cmpctBlockMessageCache.Get(inv.hash);
+                        if (!msg) {
+                            CBlock block;
+                            if (!ReadBlockFromDisk(block, pos) || block.GetHash() != inv.hash)
+                                assert(!"cannot load block from disk");
+                            msg = MakeNetMessage("cmpctblock", CBlockHeaderAndShortTxIDs(block));
+                            cmpctBlockMessageCache.Insert(inv.hash, msg);
+                        }
+                        pfrom->PushSerializedMessage(msg);
+                    } else if (inv.type == MSG_BLOCK || inv.type == MSG_CMPCT_BLOCK) {
+                        CSerializedNetMsg msg = blockMessageCache.Get(inv.hash);
+                        if (!msg) {
+                            CBlock block;
+                            if (!ReadBlockFromDisk(block, pos) || block.GetHash() != inv.hash)
+                                assert(!"cannot load block from disk");
+                            msg = MakeNetMessage("block", block);
+                            blockMessageCache.Insert(inv.hash, msg);
+                        }
+                        pfrom->PushSerializedMessage(msg);
+                    } else // MSG_FILTERED_BLOCK)
                     {
+                        CBlock block;
+                        if (!ReadBlockFromDisk(block, pos) || block.GetHash() != inv.hash)
+                            assert(!"cannot load block from disk");
                         LOCK(pfrom->cs_filter);
                         if (pfrom->pfilter) {
                             CMerkleBlock merkleBlock(block, *pfrom->pfilter);
@@ -5169,8 +5227,9 @@ void static ProcessGetData(CNode* pfrom)
                             // Thus, the protocol spec specified allows for us to provide duplicate txn here,
                             // however we MUST always provide at least what the remote peer needs
                             typedef std::pair<unsigned int, uint256> PairType;
+                            LOCK(pfrom->cs_inventory);
                             BOOST_FOREACH (PairType& pair, merkleBlock.vMatchedTxn)
-                                if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
+                                if (!pfrom->filterInventoryKnown.contains(CInv(MSG_TX, pair.second)))
                                     pfrom->PushMessage("tx", block.vtx[pair.first]);
                         }
                         // else
@@ -5178,24 +5237,25 @@ void static ProcessGetData(CNode* pfrom)
                     }
 
                     // Trigger them to send a getblocks request for the next batch of inventory
-                    if (inv.hash == pfrom->hashContinue) {
+                    if (hashContinueTip != 0) {
                         // Bypass PushInventory, this must send even if redundant,
                         // and we want it right after the last block so they don't
                         // wait for other stuff first.
                         vector<CInv> vInv;
-                        vInv.push_back(CInv(MSG_BLOCK, chainActive.Tip()->GetBlockHash()));
+                        vInv.push_back(CInv(MSG_BLOCK, hashContinueTip));
                         pfrom->PushMessage("inv", vInv);
                         pfrom->hashContinue = 0;
                     }
                 }
             } else if (inv.IsKnownType()) {
+                LOCK(cs_main);
                 // Send stream from relay memory
                 bool pushed = false;
                 {
                     LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
+                    map<CInv, CSerializedNetMsg>::iterator mi = mapRelay.find(inv);
                     if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
+                        pfrom->PushSerializedMessage((*mi).second);
                         pushed = true;
                     }
                 }
@@ -5238,6 +5298,7 @@ void static ProcessGetData(CNode* pfrom)
                     }
                 }
                 if (!pushed && inv.type == MSG_MASTERNODE_WINNER) {
+                    LOCK(cs_mapMasternodePayeeVotes);
                     if (masternodePayments.mapMasternodePayeeVotes.count(inv.hash)) {
                         CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
                         ss.reserve(1000);
@@ -5307,6 +5368,68 @@ void static ProcessGetData(CNode* pfrom)
 }
 
 bool fRequestedSporksIDB = false;
+/** Handle a block received from a peer, in full or rebuilt from a compact block */
+bool static ProcessBlockMessage(CNode* pfrom, CBlock& block)
+{
+    uint256 hashBlock = block.GetHash();
+    CInv inv(MSG_BLOCK, hashBlock);
+    LogPrint("net", "received block %s peer=%d\n", inv.hash.ToString(), pfrom->id);
+
+    //sometimes we will be sent their most recent block and its not the one we want, in that case tell where we are
+    if (!mapBlockIndex.count(block.hashPrevBlock)) {
+        if (find(pfrom->vBlockRequested.begin(), pfrom->vBlockRequested.end(), hashBlock) != pfrom->vBlockRequested.end()) {
+            //we already asked for this block, so lets work backwards and ask for the previous block
+            pfrom->PushMessage("getblocks", chainActive.GetLocator(), block.hashPrevBlock);
+            pfrom->vBlockRequested.push_back(block.hashPrevBlock);
+        } else {
+            //ask to sync to this block
+            pfrom->PushMessage("getblocks", chainActive.GetLocator(), hashBlock);
+            pfrom->vBlockRequested.push_back(hashBlock);
+        }
+    }
+		else
+		{
+        pfrom->AddInventoryKnown(inv);
+
+        CValidationState state;
+        if (!mapBlockIndex.count(block.GetHash())) {
+            ProcessNewBlock(state, pfrom, &block);
+            int nDoS;
+            if(state.IsInvalid(nDoS)) {
+					LogPrint("masternode", "Rejected a block: %s peer=%d\n", state.GetRejectReason(), pfrom->id);
+                pfrom->PushMessage("reject", string("block"), state.GetRejectCode(),
+                                   state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
+                if(nDoS > 0) {
+                    TRY_LOCK(cs_main, lockMain);
+                    if(lockMain) Misbehaving(pfrom->GetId(), nDoS);
+                }
+            }
+            //disconnect this node if its old protocol version
+            pfrom->DisconnectOldProtocol(ActiveProtocol(), "block");
+        }
+			else
+			{
+				LogPrint("net", "%s : Already processed block %s, skipping ProcessNewBlock()\n", __func__, block.GetHash().GetHex());
+
+				// Check if that block is newer than our newest block. If so, call ActivateBestChain(), just in case.
+				CBlockIndex* pindex = chainActive.Tip();
+				if (pindex == NULL) return false;
+				if (block.nTime > pindex->nTime/* + (block.IsProofOfStake() ? 40 : 7200)*/)
+				{
+					/*static int64_t LastActivateBestChainCallTime = 0;
+					int64_t aCurrentTime = GetTime();
+					if(LastActivateBestChainCallTime + 1 < aCurrentTime) // This variable ensures that ActivateBestChain isn't called too often by this. At least 2 seconds need to pass between calls by this.
+					{*/
+						ActivateBestChain(state, &block);
+						//LastActivateBestChainCallTime = aCurrentTime;
+					//}
+				}
+			}
+    }
+
+    return true;
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     RandAddSeedPerfmon();
@@ -5483,7 +5606,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 {
                     LOCK(cs_vNodes);
                     // Use deterministic randomness to send to the same nodes for 24 hours
-                    // at a time so the setAddrKnowns of the chosen nodes prevent repeats
+                    // at a time so the filterAddrKnowns of the chosen nodes prevent repeats
                     static uint256 hashSalt;
                     if (hashSalt == 0)
                         hashSalt = GetRandHash();
@@ -5560,6 +5683,14 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             }
         }
 
+        // A lone block announcement is a new tip rather than a batch answering
+        // getblocks; ask for it in compact form so transactions already in our
+        // mempool don't cross the wire again.
+        if (vToFetch.size() == 1 && pfrom->nVersion >= COMPACT_BLOCKS_VERSION && !IsInitialBlockDownload()) {
+            vToFetch[0].type = MSG_CMPCT_BLOCK;
+            State(pfrom->GetId())->setCmpctBlocksRequested.insert(vToFetch[0].hash);
+        }
+
         if (!vToFetch.empty())
             pfrom->PushMessage("getdata", vToFetch);
     }
@@ -5874,61 +6005,155 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     {
         CBlock block;
         vRecv >> block;
-        uint256 hashBlock = block.GetHash();
-        CInv inv(MSG_BLOCK, hashBlock);
-        LogPrint("net", "received block %s peer=%d\n", inv.hash.ToString(), pfrom->id);
-
-        //sometimes we will be sent their most recent block and its not the one we want, in that case tell where we are
-        if (!mapBlockIndex.count(block.hashPrevBlock)) {
-            if (find(pfrom->vBlockRequested.begin(), pfrom->vBlockRequested.end(), hashBlock) != pfrom->vBlockRequested.end()) {
-                //we already asked for this block, so lets work backwards and ask for the previous block
-                pfrom->PushMessage("getblocks", chainActive.GetLocator(), block.hashPrevBlock);
-                pfrom->vBlockRequested.push_back(block.hashPrevBlock);
-            } else {
-                //ask to sync to this block
-                pfrom->PushMessage("getblocks", chainActive.GetLocator(), hashBlock);
-                pfrom->vBlockRequested.push_back(hashBlock);
+        return ProcessBlockMessage(pfrom, block);
+    }
+
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex) {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+        uint256 hashBlock = cmpctblock.header.GetHash();
+        LogPrint("net", "received cmpctblock %s (%u txn) peer=%d\n", hashBlock.ToString(), cmpctblock.BlockTxCount(), pfrom->id);
+
+        CBlock block;
+        {
+            LOCK(cs_main);
+            CNodeState* nodestate = State(pfrom->GetId());
+
+            // Only reconstruct blocks we asked this peer for, matching them
+            // against the mempool isn't free
+            map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hashBlock);
+            bool fRequested = (itInFlight != mapBlocksInFlight.end() && itInFlight->second.first == pfrom->GetId());
+            if (nodestate->setCmpctBlocksRequested.count(hashBlock))
+                fRequested = true;
+            if (!fRequested) {
+                LogPrint("net", "ignoring unrequested cmpctblock %s peer=%d\n", hashBlock.ToString(), pfrom->id);
+                return true;
             }
-        }
-		else
-		{
-            pfrom->AddInventoryKnown(inv);
 
+            BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
+            if (mi != mapBlockIndex.end() && (mi->second->nStatus & BLOCK_HAVE_DATA))
+                return true;
+
+            // Let the full block path work out how it connects to our chain
+            if (!mapBlockIndex.count(cmpctblock.header.hashPrevBlock)) {
+                vector<CInv> vInv(1, CInv(MSG_BLOCK, hashBlock));
+                pfrom->PushMessage("getdata", vInv);
+                return true;
+            }
+
+            // The header has to be valid before any work goes into the transactions.
+            // It isn't indexed here: ProcessNewBlock() skips blocks it already
+            // knows, and the index entry needs the rebuilt block's transactions
             CValidationState state;
-            if (!mapBlockIndex.count(block.GetHash())) {
-                ProcessNewBlock(state, pfrom, &block);
+            if (!CheckUnindexedBlockHeader(cmpctblock.header, state)) {
                 int nDoS;
-                if(state.IsInvalid(nDoS)) {
-					LogPrint("masternode", "Rejected a block: %s peer=%d\n", state.GetRejectReason(), pfrom->id);
-                    pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
-                                       state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-                    if(nDoS > 0) {
-                        TRY_LOCK(cs_main, lockMain);
-                        if(lockMain) Misbehaving(pfrom->GetId(), nDoS);
-                    }
-                }
-                //disconnect this node if its old protocol version
-                pfrom->DisconnectOldProtocol(ActiveProtocol(), strCommand);
+                if (state.IsInvalid(nDoS) && nDoS > 0)
+                    Misbehaving(pfrom->GetId(), nDoS);
+                return error("invalid cmpctblock header %s from peer=%d", hashBlock.ToString(), pfrom->id);
             }
-			else
-			{
-				LogPrint("net", "%s : Already processed block %s, skipping ProcessNewBlock()\n", __func__, block.GetHash().GetHex());
 
-				// Check if that block is newer than our newest block. If so, call ActivateBestChain(), just in case.
-				CBlockIndex* pindex = chainActive.Tip();
-				if (pindex == NULL) return false;
-				if (block.nTime > pindex->nTime/* + (block.IsProofOfStake() ? 40 : 7200)*/)
-				{
-					/*static int64_t LastActivateBestChainCallTime = 0;
-					int64_t aCurrentTime = GetTime();
-					if(LastActivateBestChainCallTime + 1 < aCurrentTime) // This variable ensures that ActivateBestChain isn't called too often by this. At least 2 seconds need to pass between calls by this.
-					{*/
-						ActivateBestChain(state, &block);
-						//LastActivateBestChainCallTime = aCurrentTime;
-					//}
-				}
-			}
+            nodestate->hashPartialBlock = 0;
+            nodestate->partialBlock = PartiallyDownloadedBlock();
+            ReadStatus status = nodestate->partialBlock.InitData(cmpctblock, mempool);
+            if (status == READ_STATUS_INVALID) {
+                Misbehaving(pfrom->GetId(), 100);
+                return error("invalid cmpctblock %s from peer=%d", hashBlock.ToString(), pfrom->id);
+            }
+
+            std::vector<uint16_t> vMissing;
+            if (status == READ_STATUS_OK)
+                nodestate->partialBlock.GetMissing(vMissing);
+            if (status == READ_STATUS_OK && !vMissing.empty()) {
+                nodestate->hashPartialBlock = hashBlock;
+                BlockTransactionsRequest req;
+                req.blockhash = hashBlock;
+                req.indexes = vMissing;
+                LogPrint("net", "requesting %u of %u txn of cmpctblock %s peer=%d\n", vMissing.size(), cmpctblock.BlockTxCount(), hashBlock.ToString(), pfrom->id);
+                pfrom->PushMessage("getblocktxn", req);
+                return true;
+            }
+
+            if (status == READ_STATUS_OK)
+                status = nodestate->partialBlock.FillBlock(block, std::vector<CTransaction>());
+            nodestate->partialBlock = PartiallyDownloadedBlock();
+            if (status != READ_STATUS_OK) {
+                // Short id collision, fall back to the full block
+                vector<CInv> vInv(1, CInv(MSG_BLOCK, hashBlock));
+                pfrom->PushMessage("getdata", vInv);
+                return true;
+            }
         }
+        return ProcessBlockMessage(pfrom, block);
+    }
+
+    else if (strCommand == "getblocktxn") {
+        BlockTransactionsRequest req;
+        vRecv >> req;
+
+        bool fRecent = false;
+        CDiskBlockPos pos;
+        {
+            LOCK(cs_main);
+            BlockMap::iterator mi = mapBlockIndex.find(req.blockhash);
+            if (mi == mapBlockIndex.end() || !(mi->second->nStatus & BLOCK_HAVE_DATA)) {
+                LogPrint("net", "peer=%d sent us a getblocktxn for a block we don't have\n", pfrom->id);
+                return true;
+            }
+            fRecent = chainActive.Contains(mi->second) && chainActive.Height() - mi->second->nHeight < MAX_BLOCKTXN_DEPTH;
+            pos = mi->second->GetBlockPos();
+        }
+
+        // Anything older goes through getdata, which decides whether to serve it at all
+        if (!fRecent) {
+            pfrom->vRecvGetData.push_back(CInv(MSG_BLOCK, req.blockhash));
+            ProcessGetData(pfrom);
+            return true;
+        }
+
+        CBlock block;
+        if (!ReadBlockFromDisk(block, pos) || block.GetHash() != req.blockhash)
+            assert(!"cannot load block from disk");
+
+        BlockTransactions resp(req);
+        for (size_t i = 0; i < req.indexes.size(); i++) {
+            if (req.indexes[i] >= block.vtx.size()) {
+                LOCK(cs_main);
+                Misbehaving(pfrom->GetId(), 100);
+                return error("peer=%d sent us a getblocktxn with out-of-bounds tx indices", pfrom->id);
+            }
+            resp.txn[i] = block.vtx[req.indexes[i]];
+        }
+        pfrom->PushMessage("blocktxn", resp);
+    }
+
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex) {
+        BlockTransactions resp;
+        vRecv >> resp;
+
+        CBlock block;
+        {
+            LOCK(cs_main);
+            CNodeState* nodestate = State(pfrom->GetId());
+            if (nodestate->hashPartialBlock == 0 || nodestate->hashPartialBlock != resp.blockhash) {
+                LogPrint("net", "peer=%d sent us blocktxn for a block we weren't expecting\n", pfrom->id);
+                return true;
+            }
+
+            ReadStatus status = nodestate->partialBlock.FillBlock(block, resp.txn);
+            nodestate->hashPartialBlock = 0;
+            nodestate->partialBlock = PartiallyDownloadedBlock();
+            if (status == READ_STATUS_INVALID) {
+                Misbehaving(pfrom->GetId(), 100);
+                return error("invalid blocktxn %s from peer=%d", resp.blockhash.ToString(), pfrom->id);
+            }
+            if (status == READ_STATUS_FAILED) {
+                // Short id collision, fall back to the full block
+                vector<CInv> vInv(1, CInv(MSG_BLOCK, resp.blockhash));
+                pfrom->PushMessage("getdata", vInv);
+                return true;
+            }
+        }
+        return ProcessBlockMessage(pfrom, block);
     }
 
 
@@ -5938,7 +6163,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     // Making users (which are behind NAT and can only make outgoing connections) ignore
     // getaddr message mitigates the attack.
     else if ((strCommand == "getaddr") && (pfrom->fInbound)) {
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_addrKnown);
+            pfrom->vAddrToSend.clear();
+        }
         vector<CAddress> vAddr = addrman.GetAddr();
         BOOST_FOREACH (const CAddress& addr, vAddr)
             pfrom->PushAddress(addr);
@@ -5996,6 +6224,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         bool bPingFinished = false;
         std::string sProblem;
 
+        LOCK(pfrom->cs_ping);
         if (nAvail >= sizeof(nonce)) {
             vRecv >> nonce;
 
@@ -6171,6 +6400,44 @@ int ActiveProtocol()
     return MIN_PEER_PROTO_VERSION_BEFORE_ENFORCEMENT;
 }
 
+/** Process a message whose header and checksum have been checked */
+static bool ProcessNetMessage(CNode* pfrom, CNetMessage& msg)
+{
+    string strCommand = msg.hdr.GetCommand();
+    unsigned int nMessageSize = msg.hdr.nMessageSize;
+    CDataStream& vRecv = msg.vRecv;
+
+    bool fRet = false;
+    int64_t nStart = GetTimeMicros();
+    try {
+        fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
+        boost::this_thread::interruption_point();
+    } catch (std::ios_base::failure& e) {
+        pfrom->PushMessage("reject", strCommand, REJECT_MALFORMED, string("error parsing message"));
+        if (strstr(e.what(), "end of data")) {
+            // Allow exceptions from under-length message on vRecv
+            LogPrintf("ProcessMessages(%s, %u bytes): Exception '%s' caught, normally caused by a message being shorter than its stated length\n", SanitizeString(strCommand), nMessageSize, e.what());
+        } else if (strstr(e.what(), "size too large")) {
+            // Allow exceptions from over-long size
+            LogPrintf("ProcessMessages(%s, %u bytes): Exception '%s' caught\n", SanitizeString(strCommand), nMessageSize, e.what());
+        } else {
+            PrintExceptionContinue(&e, "ProcessMessages()");
+        }
+    } catch (boost::thread_interrupted) {
+        throw;
+    } catch (std::exception& e) {
+        PrintExceptionContinue(&e, "ProcessMessages()");
+    } catch (...) {
+        PrintExceptionContinue(NULL, "ProcessMessages()");
+    }
+    pfrom->RecordMsgProcessed(msg.nMsgType, GetTimeMicros() - nStart);
+
+    if (!fRet)
+        LogPrintf("ProcessMessage(%s, %u bytes) FAILED peer=%d\n", SanitizeString(strCommand), nMessageSize, pfrom->id);
+
+    return fRet;
+}
+
 // requires LOCK(cs_vRecvMsg)
 bool ProcessMessages(CNode* pfrom)
 {
@@ -6232,9 +6499,8 @@ bool ProcessMessages(CNode* pfrom)
         // Message size
         unsigned int nMessageSize = hdr.nMessageSize;
 
-        // Checksum
-        CDataStream& vRecv = msg.vRecv;
-        uint256 hash = Hash(vRecv.begin(), vRecv.begin() + nMessageSize);
+        // Checksum, hashed by the socket thread as the payload came in
+        const uint256& hash = msg.GetMessageHash();
         unsigned int nChecksum = 0;
         memcpy(&nChecksum, &hash, sizeof(nChecksum));
         if (nChecksum != hdr.nChecksum) {
@@ -6243,33 +6509,11 @@ bool ProcessMessages(CNode* pfrom)
             continue;
         }
 
-        // Process message
-        bool fRet = false;
-        try {
-            fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
-            boost::this_thread::interruption_point();
-        } catch (std::ios_base::failure& e) {
-            pfrom->PushMessage("reject", strCommand, REJECT_MALFORMED, string("error parsing message"));
-            if (strstr(e.what(), "end of data")) {
-                // Allow exceptions from under-length message on vRecv
-                LogPrintf("ProcessMessages(%s, %u bytes): Exception '%s' caught, normally caused by a message being shorter than its stated length\n", SanitizeString(strCommand), nMessageSize, e.what());
-            } else if (strstr(e.what(), "size too large")) {
-                // Allow exceptions from over-long size
-                LogPrintf("ProcessMessages(%s, %u bytes): Exception '%s' caught\n", SanitizeString(strCommand), nMessageSize, e.what());
-            } else {
-                PrintExceptionContinue(&e, "ProcessMessages()");
-            }
-        } catch (boost::thread_interrupted) {
-            throw;
-        } catch (std::exception& e) {
-            PrintExceptionContinue(&e, "ProcessMessages()");
-        } catch (...) {
-            PrintExceptionContinue(NULL, "ProcessMessages()");
-        }
-
-        if (!fRet)
-            LogPrintf("ProcessMessage(%s, %u bytes) FAILED peer=%d\n", SanitizeString(strCommand), nMessageSize, pfrom->id);
+        // Masternode list sync sends thousands of signed messages, check them in batches
+        if (pfrom->fSuccessfullyConnected)
+            mnodeman.PrecheckSignatures(it - 1, pfrom->vRecvMsg.end());
 
+        ProcessNetMessage(pfrom, msg);
         break;
     }
 
@@ -6281,6 +6525,58 @@ bool ProcessMessages(CNode* pfrom)
 }
 
 
+/**
+ * Whether a transaction announced outside a trickle round waits for the next
+ * one. The choice depends only on the txid, so 1/4 of transactions blast to
+ * every peer at once while the rest trickle out to all of them.
+ */
+static bool IsTrickleWait(const uint256& hash)
+{
+    static const uint64_t nTrickleK0 = GetRand(std::numeric_limits<uint64_t>::max());
+    static const uint64_t nTrickleK1 = GetRand(std::numeric_limits<uint64_t>::max());
+    return (SipHashUint256(nTrickleK0, nTrickleK1, hash) & 3) != 0;
+}
+
+/** Announcement order of an inventory type: blocks, then SwiftTX locks, then other network objects, then transactions */
+static int InvSendPriority(int type)
+{
+    switch (type) {
+    case MSG_BLOCK:
+    case MSG_FILTERED_BLOCK:
+    case MSG_CMPCT_BLOCK:
+        return 0;
+    case MSG_TXLOCK_REQUEST:
+    case MSG_TXLOCK_VOTE:
+        return 1;
+    case MSG_TX:
+        return 3;
+    default:
+        return 2;
+    }
+}
+
+/** Order inventory so the most valuable data goes out first under load; transactions by fee rate, highest first */
+static void SortInventoryForSend(vector<CInv>& vInv)
+{
+    vector<pair<pair<int, CAmount>, CInv> > vSort;
+    vSort.reserve(vInv.size());
+    {
+        LOCK(mempool.cs);
+        BOOST_FOREACH (const CInv& inv, vInv) {
+            CAmount nFeeRate = 0;
+            if (inv.type == MSG_TX) {
+                std::map<uint256, CTxMemPoolEntry>::const_iterator it = mempool.mapTx.find(inv.hash);
+                if (it != mempool.mapTx.end())
+                    nFeeRate = CFeeRate(it->second.GetFee(), it->second.GetTxSize()).GetFeePerK();
+            }
+            vSort.push_back(make_pair(make_pair(InvSendPriority(inv.type), -nFeeRate), inv));
+        }
+    }
+    sort(vSort.begin(), vSort.end());
+    for (size_t i = 0; i < vSort.size(); i++)
+        vInv[i] = vSort[i].second;
+}
+
 bool SendMessages(CNode* pto, bool fSendTrickle)
 {
     {
@@ -6292,29 +6588,32 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Message: ping
         //
         bool pingSend = false;
-        if (pto->fPingQueued) {
-            // RPC ping request by user
-            pingSend = true;
-        }
-        if (pto->nPingNonceSent == 0 && pto->nPingUsecStart + PING_INTERVAL * 1000000 < GetTimeMicros()) {
-            // Ping automatically sent as a latency probe & keepalive.
-            pingSend = true;
+        uint64_t nonce = 0;
+        {
+            LOCK(pto->cs_ping);
+            if (pto->fPingQueued) {
+                // RPC ping request by user
+                pingSend = true;
+            }
+            if (pto->nPingNonceSent == 0 && pto->nPingUsecStart + PING_INTERVAL * 1000000 < GetTimeMicros()) {
+                // Ping automatically sent as a latency probe & keepalive.
+                pingSend = true;
+            }
+            if (pingSend) {
+                while (nonce == 0) {
+                    GetRandBytes((unsigned char*)&nonce, sizeof(nonce));
+                }
+                pto->fPingQueued = false;
+                pto->nPingUsecStart = GetTimeMicros();
+                // Peer is too old to support ping command with nonce, pong will never arrive.
+                pto->nPingNonceSent = pto->nVersion > BIP0031_VERSION ? nonce : 0;
+            }
         }
         if (pingSend) {
-            uint64_t nonce = 0;
-            while (nonce == 0) {
-                GetRandBytes((unsigned char*)&nonce, sizeof(nonce));
-            }
-            pto->fPingQueued = false;
-            pto->nPingUsecStart = GetTimeMicros();
-            if (pto->nVersion > BIP0031_VERSION) {
-                pto->nPingNonceSent = nonce;
+            if (pto->nVersion > BIP0031_VERSION)
                 pto->PushMessage("ping", nonce);
-            } else {
-                // Peer is too old to support ping command with nonce, pong will never arrive.
-                pto->nPingNonceSent = 0;
+            else
                 pto->PushMessage("ping");
-            }
         }
 
         TRY_LOCK(cs_main, lockMain); // Acquire cs_main for IsInitialBlockDownload() and CNodeState()
@@ -6326,9 +6625,11 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         if (!IsInitialBlockDownload() && (GetTime() - nLastRebroadcast > 24 * 60 * 60)) {
             LOCK(cs_vNodes);
             BOOST_FOREACH (CNode* pnode, vNodes) {
-                // Periodically clear setAddrKnown to allow refresh broadcasts
-                if (nLastRebroadcast)
-                    pnode->setAddrKnown.clear();
+                // Periodically clear filterAddrKnown to allow refresh broadcasts
+                if (nLastRebroadcast) {
+                    LOCK(pnode->cs_addrKnown);
+                    pnode->filterAddrKnown.reset();
+                }
 
                 // Rebroadcast our address
                 AdvertizeLocal(pnode);
@@ -6341,22 +6642,23 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Message: addr
         //
         if (fSendTrickle) {
-            vector<CAddress> vAddr;
-            vAddr.reserve(pto->vAddrToSend.size());
-            BOOST_FOREACH (const CAddress& addr, pto->vAddrToSend) {
-                // returns true if wasn't already contained in the set
-                if (pto->setAddrKnown.insert(addr).second) {
-                    vAddr.push_back(addr);
-                    // receiver rejects addr messages larger than 1000
-                    if (vAddr.size() >= 1000) {
-                        pto->PushMessage("addr", vAddr);
-                        vAddr.clear();
+            vector<CAddress> vAddrNew;
+            {
+                LOCK(pto->cs_addrKnown);
+                vAddrNew.reserve(pto->vAddrToSend.size());
+                BOOST_FOREACH (const CAddress& addr, pto->vAddrToSend) {
+                    if (!pto->filterAddrKnown.contains(addr.GetKey())) {
+                        pto->filterAddrKnown.insert(addr.GetKey());
+                        vAddrNew.push_back(addr);
                     }
                 }
+                pto->vAddrToSend.clear();
             }
-            pto->vAddrToSend.clear();
-            if (!vAddr.empty())
+            // receiver rejects addr messages larger than 1000
+            for (size_t nPos = 0; nPos < vAddrNew.size(); nPos += 1000) {
+                vector<CAddress> vAddr(vAddrNew.begin() + nPos, vAddrNew.begin() + std::min(nPos + 1000, vAddrNew.size()));
                 pto->PushMessage("addr", vAddr);
+            }
         }
 
         CNodeState& state = *State(pto->GetId());
@@ -6411,38 +6713,27 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             vInv.reserve(pto->vInventoryToSend.size());
             vInvWait.reserve(pto->vInventoryToSend.size());
             BOOST_FOREACH (const CInv& inv, pto->vInventoryToSend) {
-                if (pto->setInventoryKnown.count(inv))
+                if (pto->filterInventoryKnown.contains(inv))
                     continue;
 
                 // trickle out tx inv to protect privacy
-                if (inv.type == MSG_TX && !fSendTrickle) {
-                    // 1/4 of tx invs blast to all immediately
-                    static uint256 hashSalt;
-                    if (hashSalt == 0)
-                        hashSalt = GetRandHash();
-                    uint256 hashRand = inv.hash ^ hashSalt;
-                    hashRand = Hash(BEGIN(hashRand), END(hashRand));
-                    bool fTrickleWait = ((hashRand & 3) != 0);
-
-                    if (fTrickleWait) {
-                        vInvWait.push_back(inv);
-                        continue;
-                    }
+                if (inv.type == MSG_TX && !fSendTrickle && IsTrickleWait(inv.hash)) {
+                    vInvWait.push_back(inv);
+                    continue;
                 }
 
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second) {
-                    vInv.push_back(inv);
-                    if (vInv.size() >= 1000) {
-                        pto->PushMessage("inv", vInv);
-                        vInv.clear();
-                    }
-                }
+                pto->filterInventoryKnown.insert(inv);
+                vInv.push_back(inv);
+            }
+            pto->vInventoryToSend.swap(vInvWait);
+        }
+        if (!vInv.empty()) {
+            SortInventoryForSend(vInv);
+            for (size_t i = 0; i < vInv.size(); i += 1000) {
+                size_t nEnd = std::min(vInv.size(), i + 1000);
+                pto->PushMessage("inv", vector<CInv>(vInv.begin() + i, vInv.begin() + nEnd));
             }
-            pto->vInventoryToSend = vInvWait;
         }
-        if (!vInv.empty())
-            pto->PushMessage("inv", vInv);
 
         // Detect whether we're stalling
         int64_t nNow = GetTimeMicros();
@@ -6472,7 +6763,9 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             NodeId staller = -1;
             FindNextBlocksToDownload(pto->GetId(), MAX_BLOCKS_IN_TRANSIT_PER_PEER - state.nBlocksInFlight, vToDownload, staller);
             BOOST_FOREACH (CBlockIndex* pindex, vToDownload) {
-                vGetData.push_back(CInv(MSG_BLOCK, pindex->GetBlockHash()));
+                // A block that extends our tip is most likely made of transactions we already have
+                bool fCompact = pindex->pprev == chainActive.Tip() && pto->nVersion >= COMPACT_BLOCKS_VERSION && !IsInitialBlockDownload();
+                vGetData.push_back(CInv(fCompact ? MSG_CMPCT_BLOCK : MSG_BLOCK, pindex->GetBlockHash()));
                 MarkBlockAsInFlight(pto->GetId(), pindex->GetBlockHash(), pindex);
                 LogPrintf("Requesting block %s (%d) peer=%d\n", pindex->GetBlockHash().ToString(),
                     pindex->nHeight, pto->id);
@@ -6488,8 +6781,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         // Message: getdata (non-blocks)
         //
-        while (!pto->fDisconnect && !pto->mapAskFor.empty() && (*pto->mapAskFor.begin()).first <= nNow) {
-            const CInv& inv = (*pto->mapAskFor.begin()).second;
+        vector<CInv> vAskDue;
+        if (!pto->fDisconnect)
+            pto->askForWheel.pop_due(nNow, vAskDue);
+        BOOST_FOREACH (const CInv& inv, vAskDue) {
             if (!AlreadyHave(inv)) {
                 if (fDebug)
                     LogPrint("net", "Requesting %s peer=%d\n", inv.ToString(), pto->id);
@@ -6499,7 +6794,6 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                     vGetData.clear();
                 }
             }
-            pto->mapAskFor.erase(pto->mapAskFor.begin());
         }
         if (!vGetData.empty())
             pto->PushMessage("getdata", vGetData);
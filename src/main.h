@@ -77,6 +77,8 @@ static const unsigned int MAX_TX_SIGOPS_CURRENT = MAX_BLOCK_SIGOPS_CURRENT / 2;
 static const unsigned int MAX_TX_SIGOPS_LEGACY = MAX_BLOCK_SIGOPS_LEGACY / 2;
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 10000;
+/** Default for -blockmsgcache, megabytes of serialized blocks kept ready to send to peers */
+static const unsigned int DEFAULT_BLOCK_MSG_CACHE = 16;
 /** The maximum size of a blk?????.dat file (since 0.8) */
 static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 /** The pre-allocation chunk size for blk?????.dat files (since 0.8) */
@@ -95,6 +97,12 @@ static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 44; // was 16 in PIVX but that's annoyingly slower.
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
 static const unsigned int BLOCK_STALLING_TIMEOUT = 2;
+/** Maximum depth below the tip at which a compact block request is answered in compact form */
+static const int MAX_CMPCTBLOCK_DEPTH = 5;
+/** Maximum depth below the tip at which missing transactions of a compact block are served */
+static const int MAX_BLOCKTXN_DEPTH = 10;
+/** Number of compact blocks asked for from a single peer outside of block download that are remembered */
+static const unsigned int MAX_CMPCTBLOCKS_REQUESTED = 16;
 /** Number of headers sent in one getheaders result. We rely on the assumption that if a peer sends
  *  less than this number, we reached their tip. Changing this value is a protocol upgrade. */
 static const unsigned int MAX_HEADERS_RESULTS = 2000;
@@ -128,6 +136,7 @@ struct BlockHasher {
 extern CScript COINBASE_FLAGS;
 extern CCriticalSection cs_main;
 extern CTxMemPool mempool;
+extern CNetMessageCache blockMessageCache;
 typedef boost::unordered_map<uint256, CBlockIndex*, BlockHasher> BlockMap;
 extern BlockMap mapBlockIndex;
 extern uint64_t nLastBlockTx;
@@ -477,6 +486,8 @@ bool CheckWork(const CBlock block, CBlockIndex* const pindexPrev);
 /** Context-dependent validity checks */
 bool ContextualCheckBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex* pindexPrev);
 bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindexPrev);
+/** Run the header checks of AcceptBlockHeader() without adding the block to mapBlockIndex, for a block that isn't rebuilt yet */
+bool CheckUnindexedBlockHeader(const CBlockHeader& block, CValidationState& state);
 
 /** Check a block is completely valid from start to finish (only works on top of our current best block, with cs_main held) */
 bool TestBlockValidity(CValidationState& state, const CBlock& block, CBlockIndex* pindexPrev, bool fCheckPOW = true, bool fCheckMerkleRoot = true);
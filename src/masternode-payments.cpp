@@ -28,148 +28,133 @@ CCriticalSection cs_mapMasternodePayeeVotes;
 // CMasternodePaymentDB
 //
 
-CMasternodePaymentDB::CMasternodePaymentDB()
-{
-    pathDB = GetDataDir() / "mnpayments.dat";
-    strMagicMessage = "MasternodePayments";
-}
+/** Feeds the records of a CMasternodePaymentDB into a CMasternodePayments */
+struct CMasternodePaymentDB::CLoader {
+    CMasternodePaymentDB& db;
+    CMasternodePayments& objToLoad;
 
-bool CMasternodePaymentDB::Write(const CMasternodePayments& objToSave)
-{
-    int64_t nStart = GetTimeMillis();
+    CLoader(CMasternodePaymentDB& dbIn, CMasternodePayments& objIn) : db(dbIn), objToLoad(objIn) {}
 
-    // serialize, checksum data up to that point, then append checksum
-    CDataStream ssObj(SER_DISK, CLIENT_VERSION);
-    ssObj << strMagicMessage;                   // masternode cache file specific magic message
-    ssObj << FLATDATA(Params().MessageStart()); // network specific magic number
-    ssObj << objToSave;
-    uint256 hash = Hash(ssObj.begin(), ssObj.end());
-    ssObj << hash;
-
-    // open output file, and associate with CAutoFile
-    FILE* file = fopen(pathDB.string().c_str(), "wb");
-    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
-    if (fileout.IsNull())
-        return error("%s : Failed to open file %s", __func__, pathDB.string());
-
-    // Write and commit header, data
-    try {
-        fileout << ssObj;
-    } catch (std::exception& e) {
-        return error("%s : Serialize or I/O error - %s", __func__, e.what());
+    bool operator()(CDataStream& ssKey, CDataStream& ssValue)
+    {
+        return db.LoadRecord(objToLoad, ssKey, ssValue);
     }
-    fileout.fclose();
+};
 
-    LogPrint("masternode","Written info to mnpayments.dat  %dms\n", GetTimeMillis() - nStart);
+CMasternodePaymentDB::CMasternodePaymentDB(size_t nCacheSize, bool fWipe) : CMasternodeStateDB("mnpayments", nCacheSize, fWipe) {}
 
-    return true;
-}
-
-CMasternodePaymentDB::ReadResult CMasternodePaymentDB::Read(CMasternodePayments& objToLoad, bool fDryRun)
+bool CMasternodePaymentDB::Write(const CMasternodePayments& objToSave)
 {
     int64_t nStart = GetTimeMillis();
-    // open input file, and associate with CAutoFile
-    FILE* file = fopen(pathDB.string().c_str(), "rb");
-    CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull()) {
-        error("%s : Failed to open file %s", __func__, pathDB.string());
-        return FileError;
-    }
-
-    // use file size to size memory buffer
-    int fileSize = boost::filesystem::file_size(pathDB);
-    int dataSize = fileSize - sizeof(uint256);
-    // Don't try to resize to a negative number if file is small
-    if (dataSize < 0)
-        dataSize = 0;
-    vector<unsigned char> vchData;
-    vchData.resize(dataSize);
-    uint256 hashIn;
-
-    // read data and checksum from file
-    try {
-        filein.read((char*)&vchData[0], dataSize);
-        filein >> hashIn;
-    } catch (std::exception& e) {
-        error("%s : Deserialize or I/O error - %s", __func__, e.what());
-        return HashReadError;
-    }
-    filein.fclose();
 
-    CDataStream ssObj(vchData, SER_DISK, CLIENT_VERSION);
+    LOCK2(cs, cs_mapMasternodePayeeVotes);
+    LOCK(cs_mapMasternodeBlocks);
+    for (CMasternodePayments::vote_map_t::const_iterator it = objToSave.mapMasternodePayeeVotes.begin(); it != objToSave.mapMasternodePayeeVotes.end(); ++it)
+        Update(make_pair('v', it->first), it->second);
+    for (std::map<int, CMasternodeBlockPayees>::const_iterator it = objToSave.mapMasternodeBlocks.begin(); it != objToSave.mapMasternodeBlocks.end(); ++it)
+        Update(make_pair('k', it->first), it->second);
+    Update('s', map<CNetAddr, CMasternodeSyncVersion>(objToSave.mapSyncedVoteVersions.begin(), objToSave.mapSyncedVoteVersions.end()));
 
-    // verify stored checksum matches input data
-    uint256 hashTmp = Hash(ssObj.begin(), ssObj.end());
-    if (hashIn != hashTmp) {
-        error("%s : Checksum mismatch, data corrupted", __func__);
-        return IncorrectHash;
-    }
+    unsigned int nWritten, nErased;
+    if (!Commit(nWritten, nErased))
+        return error("%s : Failed to write masternode payment cache", __func__);
 
-    unsigned char pchMsgTmp[4];
-    std::string strMagicMessageTmp;
-    try {
-        // de-serialize file header (masternode cache file specific magic message) and ..
-        ssObj >> strMagicMessageTmp;
+    LogPrint("masternode","Written %u and erased %u records in mnpayments  %dms\n", nWritten, nErased, GetTimeMillis() - nStart);
 
-        // ... verify the message matches predefined one
-        if (strMagicMessage != strMagicMessageTmp) {
-            error("%s : Invalid masternode payement cache magic message", __func__);
-            return IncorrectMagicMessage;
-        }
+    return true;
+}
 
+bool CMasternodePaymentDB::LoadRecord(CMasternodePayments& objToLoad, CDataStream& ssKey, CDataStream& ssValue)
+{
+    char chType;
+    ssKey >> chType;
 
-        // de-serialize file header (network specific magic number) and ..
-        ssObj >> FLATDATA(pchMsgTmp);
+    if (chType == 'v') {
+        uint256 hash;
+        CMasternodePaymentWinner winner;
+        ssKey >> hash;
+        ssValue >> winner;
+        if (objToLoad.mapMasternodePayeeVotes.insert(make_pair(hash, winner)).second)
+            objToLoad.voteVersions.touch(hash);
+    } else if (chType == 'k') {
+        int nHeight;
+        CMasternodeBlockPayees blockPayees;
+        ssKey >> nHeight;
+        ssValue >> blockPayees;
+        objToLoad.IndexBlockPayees(objToLoad.mapMasternodeBlocks.insert(make_pair(nHeight, blockPayees)).first->second);
+    } else if (chType == 's') {
+        map<CNetAddr, CMasternodeSyncVersion> mapSynced;
+        ssValue >> mapSynced;
+        for (map<CNetAddr, CMasternodeSyncVersion>::const_iterator it = mapSynced.begin(); it != mapSynced.end(); ++it)
+            objToLoad.mapSyncedVoteVersions.insert(*it);
+    } else {
+        return false;
+    }
+    return true;
+}
 
-        // ... verify the network matches ours
-        if (memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp))) {
-            error("%s : Invalid network magic number", __func__);
-            return IncorrectMagicNumber;
-        }
+void CMasternodePaymentDB::Read(CMasternodePayments& objToLoad)
+{
+    int64_t nStart = GetTimeMillis();
 
-        // de-serialize data into CMasternodePayments object
-        ssObj >> objToLoad;
-    } catch (std::exception& e) {
-        objToLoad.Clear();
-        error("%s : Deserialize or I/O error - %s", __func__, e.what());
-        return IncorrectFormat;
+    {
+        LOCK2(cs, cs_mapMasternodePayeeVotes);
+        LOCK(cs_mapMasternodeBlocks);
+        objToLoad.mapMasternodePayeeVotes.clear();
+        objToLoad.mapMasternodeBlocks.clear();
+        objToLoad.mapPayeePaidHeights.clear();
+        objToLoad.mapSyncedVoteVersions.clear();
+        objToLoad.voteVersions.clear();
+
+        // records come straight into objToLoad, one at a time
+        CLoader loader(*this, objToLoad);
+        unsigned int nLoaded, nSkipped;
+        Load(loader, nLoaded, nSkipped);
+
+        LogPrint("masternode","Loaded %u records from mnpayments, skipped %u  %dms\n", nLoaded, nSkipped, GetTimeMillis() - nStart);
+        LogPrint("masternode","  %s\n", objToLoad.ToString());
     }
 
-    LogPrint("masternode","Loaded info from mnpayments.dat  %dms\n", GetTimeMillis() - nStart);
+    LogPrint("masternode","Masternode payments manager - cleaning....\n");
+    objToLoad.CleanPaymentList();
+    LogPrint("masternode","Masternode payments manager - result:\n");
     LogPrint("masternode","  %s\n", objToLoad.ToString());
-    if (!fDryRun) {
-        LogPrint("masternode","Masternode payments manager - cleaning....\n");
-        objToLoad.CleanPaymentList();
-        LogPrint("masternode","Masternode payments manager - result:\n");
-        LogPrint("masternode","  %s\n", objToLoad.ToString());
-    }
+}
+
+// guards ppaymentdb, which is opened at startup and closed at shutdown
+static CCriticalSection cs_paymentdb;
+static CMasternodePaymentDB* ppaymentdb = NULL;
 
-    return Ok;
+void LoadMasternodePayments()
+{
+    LOCK(cs_paymentdb);
+    delete ppaymentdb;
+    ppaymentdb = NULL;
+    try {
+        ppaymentdb = new CMasternodePaymentDB(0);
+    } catch (const leveldb_error& e) {
+        // it's only a cache, start over with an empty one
+        LogPrintf("Error opening masternode payment cache: %s, will try to recreate\n", e.what());
+        ppaymentdb = new CMasternodePaymentDB(0, true);
+    }
+    ppaymentdb->Read(masternodePayments);
 }
 
 void DumpMasternodePayments()
 {
-    int64_t nStart = GetTimeMillis();
+    LOCK(cs_paymentdb);
+    if (ppaymentdb == NULL)
+        return;
+    ppaymentdb->Write(masternodePayments);
+}
 
-    CMasternodePaymentDB paymentdb;
-    CMasternodePayments tempPayments;
-
-    LogPrint("masternode","Verifying mnpayments.dat format...\n");
-    CMasternodePaymentDB::ReadResult readResult = paymentdb.Read(tempPayments, true);
-    // there was an error and it was not an error on file opening => do not proceed
-    if (readResult == CMasternodePaymentDB::FileError)
-        LogPrint("masternode","Missing file - mnpayments.dat, will try to recreate\n");
-    else if (readResult != CMasternodePaymentDB::Ok) {
-        LogPrint("masternode","Error reading mnpayments.dat: ");
-        if (readResult == CMasternodePaymentDB::IncorrectFormat)
-            LogPrint("masternode","magic is ok but data has invalid format, will try to recreate\n");
-        else {
-            LogPrint("masternode","file format is unknown or invalid, please fix it manually\n");
-            return;
-        }
-    }
-    LogPrint("masternode","Writting info to mnpayments.dat...\n");
-    paymentdb.Write(masternodePayments);
+void CloseMasternodePayments()
+{
+    DumpMasternodePayments();
+
+    LOCK(cs_paymentdb);
+    delete ppaymentdb;
+    ppaymentdb = NULL;
 }
 
 bool IsBlockPayeeValid(const CBlock& block, int nBlockHeight)
@@ -218,7 +203,7 @@ bool CMasternodePayments::FillBlockPayee(CMutableTransaction& txNew, bool fProof
     //spork
     if (!masternodePayments.GetBlockPayee(pindexPrev->nHeight + 1, payee)) {
         //no masternode detected
-        CMasternode* winningNode = mnodeman.GetCurrentMasterNode(1);
+        CMasternode* winningNode = mnodeman.GetCurrentMasterNode();
         if (winningNode) {
             payee = GetScriptForDestination(winningNode->pubKeyCollateralAddress.GetID());
         } else {
@@ -273,6 +258,12 @@ void CMasternodePayments::ProcessMessageMasternodePayments(CNode* pfrom, std::st
         int nCountNeeded;
         vRecv >> nCountNeeded;
 
+        // newer peers send the vote version we last synced them, to get only what came in since
+        CMasternodeSyncVersion syncFrom;
+        bool fVersioned = !vRecv.empty();
+        if (fVersioned)
+            vRecv >> syncFrom.hashList >> syncFrom.nVersion;
+
         if (Params().NetworkID() == CBaseChainParams::MAIN) {
             if (pfrom->HasFulfilledRequest("mnget")) {
                 LogPrint("masternode","mnget - peer already asked me for the list\n");
@@ -282,7 +273,7 @@ void CMasternodePayments::ProcessMessageMasternodePayments(CNode* pfrom, std::st
         }
 
         pfrom->FulfilledRequest("mnget");
-        masternodePayments.Sync(pfrom, nCountNeeded);
+        masternodePayments.Sync(pfrom, nCountNeeded, fVersioned ? &syncFrom : NULL);
         LogPrint("mnpayments", "mnget - Sent Masternode winners to peer %i\n", pfrom->GetId());
     } else if (strCommand == "mnw") { //Masternode Payments Declare Winner
         //this is required in litemodef
@@ -298,10 +289,13 @@ void CMasternodePayments::ProcessMessageMasternodePayments(CNode* pfrom, std::st
             nHeight = chainActive.Tip()->nHeight;
         }
 
-        if (masternodePayments.mapMasternodePayeeVotes.count(winner.GetHash())) {
-            LogPrint("mnpayments", "mnw - Already seen - %s bestHeight %d\n", winner.GetHash().ToString().c_str(), nHeight);
-            masternodeSync.AddedMasternodeWinner(winner.GetHash());
-            return;
+        {
+            LOCK(cs_mapMasternodePayeeVotes);
+            if (masternodePayments.mapMasternodePayeeVotes.count(winner.GetHash())) {
+                LogPrint("mnpayments", "mnw - Already seen - %s bestHeight %d\n", winner.GetHash().ToString().c_str(), nHeight);
+                masternodeSync.AddedMasternodeWinner(winner.GetHash());
+                return;
+            }
         }
 
         int nFirstBlock = nHeight - (mnodeman.CountEnabled() * 1.25);
@@ -347,9 +341,7 @@ bool CMasternodePaymentWinner::Sign(CKey& keyMasternode, CPubKey& pubKeyMasterno
     std::string errorMessage;
     std::string strMasterNodeSignMessage;
 
-    std::string strMessage = vinMasternode.prevout.ToStringShort() +
-                             boost::lexical_cast<std::string>(nBlockHeight) +
-                             payee.ToString();
+    std::string strMessage = GetStrMessage();
 
     if (!obfuScationSigner.SignMessage(strMessage, errorMessage, vchSig, keyMasternode)) {
         LogPrint("masternode","CMasternodePing::Sign() - Error: %s\n", errorMessage.c_str());
@@ -376,32 +368,76 @@ bool CMasternodePayments::GetBlockPayee(int nBlockHeight, CScript& payee)
 // Is this masternode scheduled to get paid soon?
 // -- Only look ahead up to 8 blocks to allow for propagation of the latest 2 winners
 bool CMasternodePayments::IsScheduled(CMasternode& mn, int nNotBlockHeight)
+{
+    std::set<CScript> setPayees;
+    GetScheduledPayees(nNotBlockHeight, setPayees);
+
+    return setPayees.count(GetScriptForDestination(mn.pubKeyCollateralAddress.GetID())) > 0;
+}
+
+void CMasternodePayments::GetScheduledPayees(int nNotBlockHeight, std::set<CScript>& setPayees)
 {
     LOCK(cs_mapMasternodeBlocks);
 
+    setPayees.clear();
+
     int nHeight;
     {
         TRY_LOCK(cs_main, locked);
-        if (!locked || chainActive.Tip() == NULL) return false;
+        if (!locked || chainActive.Tip() == NULL) return;
         nHeight = chainActive.Tip()->nHeight;
     }
 
-    CScript mnpayee;
-    mnpayee = GetScriptForDestination(mn.pubKeyCollateralAddress.GetID());
-
     CScript payee;
     for (int64_t h = nHeight; h <= nHeight + 8; h++) {
         if (h == nNotBlockHeight) continue;
-        if (mapMasternodeBlocks.count(h)) {
-            if (mapMasternodeBlocks[h].GetPayee(payee)) {
-                if (mnpayee == payee) {
-                    return true;
-                }
-            }
-        }
+        std::map<int, CMasternodeBlockPayees>::iterator it = mapMasternodeBlocks.find(h);
+        if (it != mapMasternodeBlocks.end() && it->second.GetPayee(payee))
+            setPayees.insert(payee);
     }
+}
 
-    return false;
+/*
+    Search for this payee, with at least 2 votes. This will aid in consensus allowing the network
+    to converge on the same payees quickly, then keep the same schedule.
+*/
+void CMasternodePayments::IndexBlockPayees(CMasternodeBlockPayees& blockPayees)
+{
+    LOCK(cs_vecPayments);
+
+    BOOST_FOREACH (CMasternodePayee& p, blockPayees.vecPayments) {
+        if (p.nVotes >= 2)
+            mapPayeePaidHeights[p.scriptPubKey].insert(blockPayees.nBlockHeight);
+    }
+}
+
+void CMasternodePayments::UnindexBlockPayees(CMasternodeBlockPayees& blockPayees)
+{
+    LOCK(cs_vecPayments);
+
+    BOOST_FOREACH (CMasternodePayee& p, blockPayees.vecPayments) {
+        std::map<CScript, std::set<int> >::iterator it = mapPayeePaidHeights.find(p.scriptPubKey);
+        if (it == mapPayeePaidHeights.end()) continue;
+        it->second.erase(blockPayees.nBlockHeight);
+        if (it->second.empty())
+            mapPayeePaidHeights.erase(it);
+    }
+}
+
+int CMasternodePayments::GetLastPaidHeight(const CScript& payee, int nTipHeight, int nBlocks)
+{
+    LOCK(cs_mapMasternodeBlocks);
+
+    std::map<CScript, std::set<int> >::iterator it = mapPayeePaidHeights.find(payee);
+    if (it == mapPayeePaidHeights.end()) return 0;
+
+    // latest height not above the tip
+    std::set<int>::iterator itHeight = it->second.upper_bound(nTipHeight);
+    if (itHeight == it->second.begin()) return 0;
+    --itHeight;
+
+    if (*itHeight <= 0 || *itHeight <= nTipHeight - nBlocks) return 0;
+    return *itHeight;
 }
 
 bool CMasternodePayments::AddWinningMasternode(CMasternodePaymentWinner& winnerIn)
@@ -418,15 +454,22 @@ bool CMasternodePayments::AddWinningMasternode(CMasternodePaymentWinner& winnerI
             return false;
         }
 
-        mapMasternodePayeeVotes[winnerIn.GetHash()] = winnerIn;
+        std::vector<std::pair<uint256, CMasternodePaymentWinner> > vEvicted;
+        mapMasternodePayeeVotes.insert(make_pair(winnerIn.GetHash(), winnerIn), &vEvicted);
+        voteVersions.touch(winnerIn.GetHash());
+        for (unsigned int i = 0; i < vEvicted.size(); i++) {
+            masternodeSync.mapSeenSyncMNW.erase(vEvicted[i].first);
+            voteVersions.erase(vEvicted[i].first);
+        }
 
         if (!mapMasternodeBlocks.count(winnerIn.nBlockHeight)) {
             CMasternodeBlockPayees blockPayees(winnerIn.nBlockHeight);
             mapMasternodeBlocks[winnerIn.nBlockHeight] = blockPayees;
         }
-    }
 
-    mapMasternodeBlocks[winnerIn.nBlockHeight].AddPayee(winnerIn.payee, 1);
+        mapMasternodeBlocks[winnerIn.nBlockHeight].AddPayee(winnerIn.payee, 1);
+        IndexBlockPayees(mapMasternodeBlocks[winnerIn.nBlockHeight]);
+    }
 
     return true;
 }
@@ -550,19 +593,25 @@ void CMasternodePayments::CleanPaymentList()
     //keep up to five cycles for historical sake
     int nLimit = std::max(int(mnodeman.size() * 1.25), 1000);
 
-    std::map<uint256, CMasternodePaymentWinner>::iterator it = mapMasternodePayeeVotes.begin();
-    while (it != mapMasternodePayeeVotes.end()) {
-        CMasternodePaymentWinner winner = (*it).second;
+    // votes and blocks are ordered by height, only what's due is looked at
+    int nCutoff = nHeight - nLimit;
 
-        if (nHeight - winner.nBlockHeight > nLimit) {
-            LogPrint("mnpayments", "CMasternodePayments::CleanPaymentList - Removing old Masternode payment - block %d\n", winner.nBlockHeight);
-            masternodeSync.mapSeenSyncMNW.erase((*it).first);
-            mapMasternodePayeeVotes.erase(it++);
-            mapMasternodeBlocks.erase(winner.nBlockHeight);
-        } else {
-            ++it;
-        }
+    std::vector<std::pair<uint256, CMasternodePaymentWinner> > vExpired;
+    mapMasternodePayeeVotes.expire(nCutoff, &vExpired);
+    for (unsigned int i = 0; i < vExpired.size(); i++) {
+        LogPrint("mnpayments", "CMasternodePayments::CleanPaymentList - Removing old Masternode payment - block %d\n", vExpired[i].second.nBlockHeight);
+        masternodeSync.mapSeenSyncMNW.erase(vExpired[i].first);
+        voteVersions.erase(vExpired[i].first);
+    }
+
+    std::map<int, CMasternodeBlockPayees>::iterator itBlock = mapMasternodeBlocks.begin();
+    while (itBlock != mapMasternodeBlocks.end() && itBlock->first < nCutoff) {
+        UnindexBlockPayees(itBlock->second);
+        mapMasternodeBlocks.erase(itBlock++);
     }
+
+    mapMasternodesLastVote.expire(nCutoff);
+    mapSyncedVoteVersions.expire(GetTime());
 }
 
 bool CMasternodePaymentWinner::IsValid(CNode* pnode, std::string& strError)
@@ -673,14 +722,19 @@ void CMasternodePaymentWinner::Relay()
     RelayInv(inv);
 }
 
+std::string CMasternodePaymentWinner::GetStrMessage() const
+{
+    return vinMasternode.prevout.ToStringShort() +
+           boost::lexical_cast<std::string>(nBlockHeight) +
+           payee.ToString();
+}
+
 bool CMasternodePaymentWinner::SignatureValid()
 {
     CMasternode* pmn = mnodeman.Find(vinMasternode);
 
     if (pmn != NULL) {
-        std::string strMessage = vinMasternode.prevout.ToStringShort() +
-                                 boost::lexical_cast<std::string>(nBlockHeight) +
-                                 payee.ToString();
+        std::string strMessage = GetStrMessage();
 
         std::string errorMessage = "";
         if (!obfuScationSigner.VerifyMessage(pmn->pubKeyMasternode, vchSig, strMessage, errorMessage)) {
@@ -693,7 +747,7 @@ bool CMasternodePaymentWinner::SignatureValid()
     return false;
 }
 
-void CMasternodePayments::Sync(CNode* node, int nCountNeeded)
+void CMasternodePayments::Sync(CNode* node, int nCountNeeded, const CMasternodeSyncVersion* pSyncFrom)
 {
     LOCK(cs_mapMasternodePayeeVotes);
 
@@ -707,17 +761,55 @@ void CMasternodePayments::Sync(CNode* node, int nCountNeeded)
     int nCount = (mnodeman.CountEnabled() * 1.25);
     if (nCountNeeded > nCount) nCountNeeded = nCount;
 
+    std::vector<vote_map_t::iterator> vecToSend;
+    if (pSyncFrom && pSyncFrom->hashList == hashVoteList) {
+        std::vector<uint256> vChanged;
+        voteVersions.since(pSyncFrom->nVersion, vChanged);
+        BOOST_FOREACH (const uint256& hash, vChanged) {
+            vote_map_t::iterator it = mapMasternodePayeeVotes.find(hash);
+            if (it != mapMasternodePayeeVotes.end())
+                vecToSend.push_back(it);
+        }
+        LogPrint("mnpayments", "CMasternodePayments::Sync - %u votes since vote version %d\n", vChanged.size(), pSyncFrom->nVersion);
+    } else {
+        for (vote_map_t::iterator it = mapMasternodePayeeVotes.begin(); it != mapMasternodePayeeVotes.end(); ++it)
+            vecToSend.push_back(it);
+    }
+
     int nInvCount = 0;
-    std::map<uint256, CMasternodePaymentWinner>::iterator it = mapMasternodePayeeVotes.begin();
-    while (it != mapMasternodePayeeVotes.end()) {
-        CMasternodePaymentWinner winner = (*it).second;
+    BOOST_FOREACH (vote_map_t::iterator it, vecToSend) {
+        const CMasternodePaymentWinner& winner = it->second;
         if (winner.nBlockHeight >= nHeight - nCountNeeded && winner.nBlockHeight <= nHeight + 20) {
-            node->PushInventory(CInv(MSG_MASTERNODE_WINNER, winner.GetHash()));
+            node->PushInventory(CInv(MSG_MASTERNODE_WINNER, it->first));
             nInvCount++;
         }
-        ++it;
     }
     node->PushMessage("ssc", MASTERNODE_SYNC_MNW, nInvCount);
+    if (pSyncFrom)
+        node->PushMessage("ssv", MASTERNODE_SYNC_MNW, hashVoteList, voteVersions.version());
+}
+
+void CMasternodePayments::RequestWinners(CNode* pnode)
+{
+    int nMnCount = mnodeman.CountEnabled();
+
+    // the vote version tells newer peers what we already have, older ones ignore it
+    CMasternodeSyncVersion syncVersion;
+    {
+        LOCK(cs_mapMasternodePayeeVotes);
+        std::map<CNetAddr, CMasternodeSyncVersion>::iterator it = mapSyncedVoteVersions.find(pnode->addr);
+        if (it != mapSyncedVoteVersions.end() && !mapMasternodePayeeVotes.empty())
+            syncVersion = it->second;
+    }
+
+    pnode->PushMessage("mnget", nMnCount, syncVersion.hashList, syncVersion.nVersion);
+}
+
+void CMasternodePayments::SetSyncVersion(const CNetAddr& addr, const CMasternodeSyncVersion& syncVersion)
+{
+    LOCK(cs_mapMasternodePayeeVotes);
+    mapSyncedVoteVersions.erase(addr);
+    mapSyncedVoteVersions.insert(std::make_pair(addr, syncVersion));
 }
 
 std::string CMasternodePayments::ToString() const
@@ -7,9 +7,14 @@
 #ifndef MASTERNODE_PAYMENTS_H
 #define MASTERNODE_PAYMENTS_H
 
+#include "expirymap.h"
 #include "key.h"
 #include "main.h"
 #include "masternode.h"
+#include "masternode-sync.h"
+#include "masternodedb.h"
+#include "versionlog.h"
+#include <set>
 #include <boost/lexical_cast.hpp>
 
 using namespace std;
@@ -26,36 +31,34 @@ extern CMasternodePayments masternodePayments;
 
 #define MNPAYMENTS_SIGNATURES_REQUIRED 6
 #define MNPAYMENTS_SIGNATURES_TOTAL 10
+#define MNPAYMENTS_VOTES_MAX 100000
+#define MNPAYMENTS_LAST_VOTES_MAX 20000
+#define MNPAYMENTS_SYNCED_PEERS_MAX 20000
 
 void ProcessMessageMasternodePayments(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
 bool IsBlockPayeeValid(const CBlock& block, int nBlockHeight);
 std::string GetRequiredPaymentsString(int nBlockHeight);
 bool FillBlockPayee(CMutableTransaction& txNew, bool fProofOfStake);
 
+/// Open the masternode payment cache and load it into masternodePayments
+void LoadMasternodePayments();
+/// Write what changed in masternodePayments to the masternode payment cache
 void DumpMasternodePayments();
+/// Dump one last time and close the masternode payment cache
+void CloseMasternodePayments();
 
-/** Save Masternode Payment Data (mnpayments.dat)
+/** Masternode payment cache, one record per payment vote and per block's payees
  */
-class CMasternodePaymentDB
+class CMasternodePaymentDB : public CMasternodeStateDB
 {
 private:
-    boost::filesystem::path pathDB;
-    std::string strMagicMessage;
+    struct CLoader;
+    bool LoadRecord(CMasternodePayments& objToLoad, CDataStream& ssKey, CDataStream& ssValue);
 
 public:
-    enum ReadResult {
-        Ok,
-        FileError,
-        HashReadError,
-        IncorrectHash,
-        IncorrectMagicMessage,
-        IncorrectMagicNumber,
-        IncorrectFormat
-    };
-
-    CMasternodePaymentDB();
+    CMasternodePaymentDB(size_t nCacheSize, bool fWipe = false);
     bool Write(const CMasternodePayments& objToSave);
-    ReadResult Read(CMasternodePayments& objToLoad, bool fDryRun = false);
+    void Read(CMasternodePayments& objToLoad);
 };
 
 class CMasternodePayee
@@ -195,6 +198,8 @@ public:
     bool Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode);
     bool IsValid(CNode* pnode, std::string& strError);
     bool SignatureValid();
+    /// The message vchSig signs
+    std::string GetStrMessage() const;
     void Relay();
 
     void AddPayee(CScript payeeIn)
@@ -225,6 +230,11 @@ public:
     }
 };
 
+/** Payment votes expire with the height they vote for */
+struct CMasternodePaymentWinnerExpiry {
+    int64_t operator()(const CMasternodePaymentWinner& winner) const { return winner.nBlockHeight; }
+};
+
 //
 // Masternode Payments Class
 // Keeps track of who should get paid for which blocks
@@ -233,18 +243,35 @@ public:
 class CMasternodePayments
 {
 private:
+    friend class CMasternodePaymentDB;
+
     int nSyncedFromPeer;
     int nLastBlockHeight;
 
+    // heights at which each payee has enough votes to count as paid, see GetLastPaidHeight
+    std::map<CScript, std::set<int> > mapPayeePaidHeights;
+
+    // identifies our vote versions to peers, with the votes by the version they came in at
+    uint256 hashVoteList;
+    versionlog<uint256> voteVersions;
+    // how far each peer synced us its votes
+    expirymap<CNetAddr, CMasternodeSyncVersion, CMasternodeSyncVersionExpiry> mapSyncedVoteVersions;
+
+    void IndexBlockPayees(CMasternodeBlockPayees& blockPayees);
+    void UnindexBlockPayees(CMasternodeBlockPayees& blockPayees);
+
 public:
-    std::map<uint256, CMasternodePaymentWinner> mapMasternodePayeeVotes;
+    typedef expirymap<uint256, CMasternodePaymentWinner, CMasternodePaymentWinnerExpiry> vote_map_t;
+
+    vote_map_t mapMasternodePayeeVotes;
     std::map<int, CMasternodeBlockPayees> mapMasternodeBlocks;
-    std::map<uint256, int> mapMasternodesLastVote; //prevout.hash + prevout.n, nBlockHeight
+    expirymap<uint256, int> mapMasternodesLastVote; //prevout.hash + prevout.n, nBlockHeight
 
-    CMasternodePayments()
+    CMasternodePayments() : mapSyncedVoteVersions(MNPAYMENTS_SYNCED_PEERS_MAX), mapMasternodePayeeVotes(MNPAYMENTS_VOTES_MAX), mapMasternodesLastVote(MNPAYMENTS_LAST_VOTES_MAX)
     {
         nSyncedFromPeer = 0;
         nLastBlockHeight = 0;
+        hashVoteList = GetRandHash();
     }
 
     void Clear()
@@ -252,18 +279,31 @@ public:
         LOCK2(cs_mapMasternodeBlocks, cs_mapMasternodePayeeVotes);
         mapMasternodeBlocks.clear();
         mapMasternodePayeeVotes.clear();
+        mapPayeePaidHeights.clear();
+        mapSyncedVoteVersions.clear();
+        hashVoteList = GetRandHash();
+        voteVersions.clear();
     }
 
     bool AddWinningMasternode(CMasternodePaymentWinner& winner);
     bool ProcessBlock(int nBlockHeight);
 
-    void Sync(CNode* node, int nCountNeeded);
+    /// Send node our votes, only the ones that came in since pSyncFrom if it's one of our versions
+    void Sync(CNode* node, int nCountNeeded, const CMasternodeSyncVersion* pSyncFrom = NULL);
+    /// Ask pnode for its votes, or only what came in since it last synced us
+    void RequestWinners(CNode* pnode);
+    /// Remember how far the peer at addr synced us its votes, once the winner stage completed
+    void SetSyncVersion(const CNetAddr& addr, const CMasternodeSyncVersion& syncVersion);
     void CleanPaymentList();
     int LastPayment(CMasternode& mn);
 
     bool GetBlockPayee(int nBlockHeight, CScript& payee);
     bool IsTransactionValid(const CTransaction& txNew, int nBlockHeight);
     bool IsScheduled(CMasternode& mn, int nNotBlockHeight);
+    /// Payees with the most votes for the next 8 blocks, except nNotBlockHeight
+    void GetScheduledPayees(int nNotBlockHeight, std::set<CScript>& setPayees);
+    /// Most recent height in the nBlocks up to nTipHeight where payee had at least 2 votes, 0 if none
+    int GetLastPaidHeight(const CScript& payee, int nTipHeight, int nBlocks);
 
     bool CanVote(COutPoint outMasternode, int nBlockHeight)
     {
@@ -287,15 +327,6 @@ public:
     std::string ToString() const;
     int GetOldestBlock();
     int GetNewestBlock();
-
-    ADD_SERIALIZE_METHODS;
-
-    template <typename Stream, typename Operation>
-    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
-    {
-        READWRITE(mapMasternodePayeeVotes);
-        READWRITE(mapMasternodeBlocks);
-    }
 };
 
 
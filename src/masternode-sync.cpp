@@ -69,6 +69,8 @@ void CMasternodeSync::Reset()
     RequestedMasternodeAssets = MASTERNODE_SYNC_INITIAL;
     RequestedMasternodeAttempt = 0;
     nAssetSyncStarted = GetTime();
+    mapPendingListVersions.clear();
+    mapPendingWinnerVersions.clear();
 }
 
 void CMasternodeSync::AddedMasternodeList(uint256 hash)
@@ -134,9 +136,11 @@ void CMasternodeSync::GetNextAsset()
         RequestedMasternodeAssets = MASTERNODE_SYNC_LIST;
         break;
     case (MASTERNODE_SYNC_LIST):
+        CommitSyncVersions(MASTERNODE_SYNC_LIST);
         RequestedMasternodeAssets = MASTERNODE_SYNC_MNW;
         break;
     case (MASTERNODE_SYNC_MNW):
+        CommitSyncVersions(MASTERNODE_SYNC_MNW);
         RequestedMasternodeAssets = MASTERNODE_SYNC_BUDGET;
         break;
     case (MASTERNODE_SYNC_BUDGET):
@@ -204,6 +208,55 @@ void CMasternodeSync::ProcessMessage(CNode* pfrom, std::string& strCommand, CDat
         }
 
         LogPrint("masternode", "CMasternodeSync:ProcessMessage - ssc - got inventory count %d %d\n", nItemID, nCount);
+    } else if (strCommand == "ssv") { //Sync status version
+        int nItemID;
+        uint256 hashList;
+        int64_t nVersion;
+        vRecv >> nItemID >> hashList >> nVersion;
+
+        // where the next sync from this peer picks up, once the inventory it
+        // announced has been fetched. A peer with nothing new for us sends no
+        // inventory, so its reply counts as progress too
+        if (nItemID != RequestedMasternodeAssets) return;
+        CMasternodeSyncVersion syncVersion(hashList, nVersion, GetTime());
+        if (nItemID == MASTERNODE_SYNC_LIST) {
+            mapPendingListVersions[pfrom->GetId()] = syncVersion;
+            lastMasternodeList = GetTime();
+        } else if (nItemID == MASTERNODE_SYNC_MNW) {
+            mapPendingWinnerVersions[pfrom->GetId()] = syncVersion;
+            lastMasternodeWinner = GetTime();
+        }
+
+        LogPrint("masternode", "CMasternodeSync:ProcessMessage - ssv - got list version %d %d\n", nItemID, nVersion);
+    }
+}
+
+/**
+ * Keep the versions of the peers that are still connected now that the stage
+ * is over, so the entries they announced had their chance to be fetched. The
+ * next sync from a peer that went away, or from a stage that failed, is a
+ * full one again.
+ */
+void CMasternodeSync::CommitSyncVersions(int nItemID)
+{
+    std::map<NodeId, CMasternodeSyncVersion>& mapPending = nItemID == MASTERNODE_SYNC_LIST ? mapPendingListVersions : mapPendingWinnerVersions;
+
+    std::vector<std::pair<CNetAddr, CMasternodeSyncVersion> > vSynced;
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH (CNode* pnode, vNodes) {
+            std::map<NodeId, CMasternodeSyncVersion>::iterator it = mapPending.find(pnode->GetId());
+            if (it != mapPending.end() && !pnode->fDisconnect)
+                vSynced.push_back(std::make_pair((CNetAddr)pnode->addr, it->second));
+        }
+    }
+    mapPending.clear();
+
+    for (unsigned int i = 0; i < vSynced.size(); i++) {
+        if (nItemID == MASTERNODE_SYNC_LIST)
+            mnodeman.SetSyncVersion(vSynced[i].first, vSynced[i].second);
+        else
+            masternodePayments.SetSyncVersion(vSynced[i].first, vSynced[i].second);
     }
 }
 
@@ -272,8 +325,7 @@ void CMasternodeSync::Process()
             } else if (RequestedMasternodeAttempt < 4) {
                 mnodeman.DsegUpdate(pnode);
             } else if (RequestedMasternodeAttempt < 6) {
-                int nMnCount = mnodeman.CountEnabled();
-                pnode->PushMessage("mnget", nMnCount); //sync payees
+                masternodePayments.RequestWinners(pnode); //sync payees
             } else {
                 RequestedMasternodeAssets = MASTERNODE_SYNC_FINISHED;
             }
@@ -361,8 +413,7 @@ void CMasternodeSync::Process()
                 CBlockIndex* pindexPrev = chainActive.Tip();
                 if (pindexPrev == NULL) return;
 
-                int nMnCount = mnodeman.CountEnabled();
-                pnode->PushMessage("mnget", nMnCount); //sync payees
+                masternodePayments.RequestWinners(pnode); //sync payees
 
                 return;
             }
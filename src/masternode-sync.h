@@ -6,6 +6,10 @@
 #ifndef MASTERNODE_SYNC_H
 #define MASTERNODE_SYNC_H
 
+#include "net.h"
+#include "serialize.h"
+#include "uint256.h"
+
 #define MASTERNODE_SYNC_INITIAL 0
 #define MASTERNODE_SYNC_SPORKS 1
 #define MASTERNODE_SYNC_LIST 2
@@ -18,10 +22,42 @@
 
 #define MASTERNODE_SYNC_TIMEOUT 5
 #define MASTERNODE_SYNC_THRESHOLD 1
+#define MASTERNODE_SYNC_VERSION_SECONDS (24 * 60 * 60)
 
 class CMasternodeSync;
 extern CMasternodeSync masternodeSync;
 
+/**
+ * How far a peer synced us its masternode list or winners, so we ask it only
+ * for what changed since. Versions only compare within the same hashList, a
+ * peer that restarted answers with a new one and sends everything once more.
+ */
+class CMasternodeSyncVersion
+{
+public:
+    uint256 hashList;
+    int64_t nVersion;
+    int64_t nTimeSynced;
+
+    CMasternodeSyncVersion() : hashList(0), nVersion(0), nTimeSynced(0) {}
+    CMasternodeSyncVersion(const uint256& hashListIn, int64_t nVersionIn, int64_t nTimeSyncedIn) : hashList(hashListIn), nVersion(nVersionIn), nTimeSynced(nTimeSyncedIn) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(hashList);
+        READWRITE(this->nVersion);
+        READWRITE(nTimeSynced);
+    }
+};
+
+/** Entries we may have dropped since then are only sent again by a full sync, so versions don't last forever */
+struct CMasternodeSyncVersionExpiry {
+    int64_t operator()(const CMasternodeSyncVersion& syncVersion) const { return syncVersion.nTimeSynced + MASTERNODE_SYNC_VERSION_SECONDS; }
+};
+
 //
 // CMasternodeSync : Sync masternode assets in stages
 //
@@ -57,6 +93,10 @@ public:
     // Time when current masternode asset sync started
     int64_t nAssetSyncStarted;
 
+    // Versions peers sent during the current stage, only kept once it completes with them still connected
+    std::map<NodeId, CMasternodeSyncVersion> mapPendingListVersions;
+    std::map<NodeId, CMasternodeSyncVersion> mapPendingWinnerVersions;
+
     CMasternodeSync();
 
     void AddedMasternodeList(uint256 hash);
@@ -74,6 +114,9 @@ public:
     bool IsBlockchainSynced();
     bool IsMasternodeListSynced() { return RequestedMasternodeAssets > MASTERNODE_SYNC_LIST; }
     void ClearFulfilledRequest();
+
+private:
+    void CommitSyncVersions(int nItemID);
 };
 
 #endif
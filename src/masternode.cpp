@@ -16,6 +16,7 @@
 map<uint256, int> mapSeenMasternodeScanningErrors;
 // cache block hashes as we calculate them
 std::map<int64_t, uint256> mapCacheBlockHashes;
+CMasternodeCollateralWatch mnCollateralWatch;
 
 //Get the last hash that matches the modulus given. Processed in reverse order
 bool GetBlockHash(uint256& hash, int nBlockHeight)
@@ -156,6 +157,83 @@ bool CMasternode::UpdateFromNewBroadcast(CMasternodeBroadcast& mnb)
     return false;
 }
 
+void CMasternodeCollateralWatch::Watch(const COutPoint& outpoint, bool fSpent)
+{
+    LOCK(cs);
+    mapWatched[outpoint] = fSpent;
+}
+
+void CMasternodeCollateralWatch::Unwatch(const COutPoint& outpoint)
+{
+    LOCK(cs);
+    mapWatched.erase(outpoint);
+}
+
+bool CMasternodeCollateralWatch::GetSpent(const COutPoint& outpoint, bool& fSpent) const
+{
+    LOCK(cs);
+    std::map<COutPoint, bool>::const_iterator it = mapWatched.find(outpoint);
+    if (it == mapWatched.end())
+        return false;
+    fSpent = it->second;
+    return true;
+}
+
+void CMasternodeCollateralWatch::BlockConnected(const CBlock& block)
+{
+    LOCK(cs);
+    if (mapWatched.empty()) return;
+
+    BOOST_FOREACH (const CTransaction& tx, block.vtx) {
+        BOOST_FOREACH (const CTxIn& txin, tx.vin) {
+            std::map<COutPoint, bool>::iterator it = mapWatched.find(txin.prevout);
+            if (it != mapWatched.end())
+                it->second = true;
+        }
+        // a collateral coming back in after a reorg
+        uint256 hash = tx.GetHash();
+        for (unsigned int i = 0; i < tx.vout.size(); i++) {
+            std::map<COutPoint, bool>::iterator it = mapWatched.find(COutPoint(hash, i));
+            if (it != mapWatched.end())
+                it->second = false;
+        }
+    }
+}
+
+void CMasternodeCollateralWatch::BlockDisconnected(const CBlock& block)
+{
+    LOCK(cs);
+    if (mapWatched.empty()) return;
+
+    // undo in reverse, as DisconnectBlock does
+    for (int i = block.vtx.size() - 1; i >= 0; i--) {
+        const CTransaction& tx = block.vtx[i];
+        uint256 hash = tx.GetHash();
+        for (unsigned int j = 0; j < tx.vout.size(); j++) {
+            std::map<COutPoint, bool>::iterator it = mapWatched.find(COutPoint(hash, j));
+            if (it != mapWatched.end())
+                it->second = true;
+        }
+        BOOST_FOREACH (const CTxIn& txin, tx.vin) {
+            std::map<COutPoint, bool>::iterator it = mapWatched.find(txin.prevout);
+            if (it != mapWatched.end())
+                it->second = false;
+        }
+    }
+}
+
+void CMasternodeCollateralWatch::Clear()
+{
+    LOCK(cs);
+    mapWatched.clear();
+}
+
+int CMasternodeCollateralWatch::size() const
+{
+    LOCK(cs);
+    return mapWatched.size();
+}
+
 //
 // Deterministically calculate a given "score" for a Masternode depending on how close it's hash is to
 // the proof of work for that block. The further away they are the better, the furthest will win the election
@@ -210,32 +288,35 @@ void CMasternode::Check(bool forceCheck)
     }
 
     if (!unitTest) {
-        CValidationState state;
-        CMutableTransaction tx = CMutableTransaction();
-        CTxOut vout = CTxOut(49999.99 * COIN, obfuScationPool.collateralPubKey);
-        tx.vin.push_back(vin);
-        tx.vout.push_back(vout);
-
-        {
+        bool fSpent;
+        if (!mnCollateralWatch.GetSpent(vin.prevout, fSpent)) {
+            // first check, look the collateral up once and follow it from now on
             TRY_LOCK(cs_main, lockMain);
             if (!lockMain) return;
 
-            if (!AcceptableInputs(mempool, state, CTransaction(tx), false, NULL)) {
+            const CCoins* coins = pcoinsTip->AccessCoins(vin.prevout.hash);
+            fSpent = !coins || !coins->IsAvailable(vin.prevout.n);
+            // an output of the wrong amount is no collateral, and a reorg won't change that
+            if (!fSpent && coins->vout[vin.prevout.n].nValue != 50000 * COIN) {
+                LogPrint("masternode", "CMasternode::Check - collateral %s is not 50000 UIDD\n", vin.prevout.ToString());
                 activeState = MASTERNODE_VIN_SPENT;
                 return;
             }
+            mnCollateralWatch.Watch(vin.prevout, fSpent);
+        }
+
+        if (fSpent) {
+            activeState = MASTERNODE_VIN_SPENT;
+            return;
         }
     }
 
     activeState = MASTERNODE_ENABLED; // OK
 }
 
-int64_t CMasternode::SecondsSincePayment()
+int64_t CMasternode::SecondsSincePayment(int nMnCount)
 {
-    CScript pubkeyScript;
-    pubkeyScript = GetScriptForDestination(pubKeyCollateralAddress.GetID());
-
-    int64_t sec = (GetAdjustedTime() - GetLastPaid());
+    int64_t sec = (GetAdjustedTime() - GetLastPaid(nMnCount));
     int64_t month = 60 * 60 * 24 * 30;
     if (sec < month) return sec; //if it's less than 30 days, give seconds
 
@@ -248,7 +329,7 @@ int64_t CMasternode::SecondsSincePayment()
     return month + hash.GetCompact(false);
 }
 
-int64_t CMasternode::GetLastPaid()
+int64_t CMasternode::GetLastPaid(int nMnCount)
 {
     CBlockIndex* pindexPrev = chainActive.Tip();
     if (pindexPrev == NULL) return false;
@@ -264,36 +345,14 @@ int64_t CMasternode::GetLastPaid()
     // use a deterministic offset to break a tie -- 2.5 minutes
     int64_t nOffset = hash.GetCompact(false) % 150;
 
-    if (chainActive.Tip() == NULL) return false;
+    if (nMnCount < 0)
+        nMnCount = mnodeman.CountEnabled();
 
-    const CBlockIndex* BlockReading = chainActive.Tip();
+    // look back over the last 1.25 payment cycles
+    int nHeight = masternodePayments.GetLastPaidHeight(mnpayee, pindexPrev->nHeight, nMnCount * 1.25);
+    if (nHeight == 0) return 0;
 
-    int nMnCount = mnodeman.CountEnabled() * 1.25;
-    int n = 0;
-    for (unsigned int i = 1; BlockReading && BlockReading->nHeight > 0; i++) {
-        if (n >= nMnCount) {
-            return 0;
-        }
-        n++;
-
-        if (masternodePayments.mapMasternodeBlocks.count(BlockReading->nHeight)) {
-            /*
-                Search for this payee, with at least 2 votes. This will aid in consensus allowing the network 
-                to converge on the same payees quickly, then keep the same schedule.
-            */
-            if (masternodePayments.mapMasternodeBlocks[BlockReading->nHeight].HasPayeeWithVotes(mnpayee, 2)) {
-                return BlockReading->nTime + nOffset;
-            }
-        }
-
-        if (BlockReading->pprev == NULL) {
-            assert(BlockReading);
-            break;
-        }
-        BlockReading = BlockReading->pprev;
-    }
-
-    return 0;
+    return chainActive[nHeight]->nTime + nOffset;
 }
 
 std::string CMasternode::GetStatus()
@@ -481,9 +540,7 @@ bool CMasternodeBroadcast::CheckAndUpdate(int& nDos)
         return false;
     }
 
-    std::string vchPubKey(pubKeyCollateralAddress.begin(), pubKeyCollateralAddress.end());
-    std::string vchPubKey2(pubKeyMasternode.begin(), pubKeyMasternode.end());
-    std::string strMessage = addr.ToString() + boost::lexical_cast<std::string>(sigTime) + vchPubKey + vchPubKey2 + boost::lexical_cast<std::string>(protocolVersion);
+    std::string strMessage = GetStrMessage();
 
     if (protocolVersion < masternodePayments.GetMinMasternodePaymentsProto()) {
         LogPrint("masternode","mnb - ignoring outdated Masternode %s protocol version %d\n", vin.prevout.hash.ToString(), protocolVersion);
@@ -548,6 +605,7 @@ bool CMasternodeBroadcast::CheckAndUpdate(int& nDos)
         //take the newest entry
         LogPrint("masternode","mnb - Got updated entry for %s\n", vin.prevout.hash.ToString());
         if (pmn->UpdateFromNewBroadcast((*this))) {
+            mnodeman.UpdateIndexes(*pmn);
             pmn->Check();
             if (pmn->IsEnabled()) Relay();
         }
@@ -646,16 +704,21 @@ void CMasternodeBroadcast::Relay()
     RelayInv(inv);
 }
 
-bool CMasternodeBroadcast::Sign(CKey& keyCollateralAddress)
+std::string CMasternodeBroadcast::GetStrMessage() const
 {
-    std::string errorMessage;
-
     std::string vchPubKey(pubKeyCollateralAddress.begin(), pubKeyCollateralAddress.end());
     std::string vchPubKey2(pubKeyMasternode.begin(), pubKeyMasternode.end());
 
+    return addr.ToString() + boost::lexical_cast<std::string>(sigTime) + vchPubKey + vchPubKey2 + boost::lexical_cast<std::string>(protocolVersion);
+}
+
+bool CMasternodeBroadcast::Sign(CKey& keyCollateralAddress)
+{
+    std::string errorMessage;
+
     sigTime = GetAdjustedTime();
 
-    std::string strMessage = addr.ToString() + boost::lexical_cast<std::string>(sigTime) + vchPubKey + vchPubKey2 + boost::lexical_cast<std::string>(protocolVersion);
+    std::string strMessage = GetStrMessage();
 
     if (!obfuScationSigner.SignMessage(strMessage, errorMessage, sig, keyCollateralAddress)) {
         LogPrint("masternode","CMasternodeBroadcast::Sign() - Error: %s\n", errorMessage);
@@ -693,7 +756,7 @@ bool CMasternodePing::Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode)
     std::string strMasterNodeSignMessage;
 
     sigTime = GetAdjustedTime();
-    std::string strMessage = vin.ToString() + blockHash.ToString() + boost::lexical_cast<std::string>(sigTime);
+    std::string strMessage = GetStrMessage();
 
     if (!obfuScationSigner.SignMessage(strMessage, errorMessage, vchSig, keyMasternode)) {
         LogPrint("masternode","CMasternodePing::Sign() - Error: %s\n", errorMessage);
@@ -708,6 +771,11 @@ bool CMasternodePing::Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode)
     return true;
 }
 
+std::string CMasternodePing::GetStrMessage() const
+{
+    return vin.ToString() + blockHash.ToString() + boost::lexical_cast<std::string>(sigTime);
+}
+
 bool CMasternodePing::CheckAndUpdate(int& nDos, bool fRequireEnabled)
 {
     if (sigTime > GetAdjustedTime() + 60 * 60) {
@@ -733,7 +801,7 @@ bool CMasternodePing::CheckAndUpdate(int& nDos, bool fRequireEnabled)
         // update only if there is no known ping for this masternode or
         // last ping was more then MASTERNODE_MIN_MNP_SECONDS-60 ago comparing to this one
         if (!pmn->IsPingedWithin(MASTERNODE_MIN_MNP_SECONDS - 60, sigTime)) {
-            std::string strMessage = vin.ToString() + blockHash.ToString() + boost::lexical_cast<std::string>(sigTime);
+            std::string strMessage = GetStrMessage();
 
             std::string errorMessage = "";
             if (!obfuScationSigner.VerifyMessage(pmn->pubKeyMasternode, vchSig, strMessage, errorMessage)) {
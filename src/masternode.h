@@ -27,10 +27,39 @@ using namespace std;
 class CMasternode;
 class CMasternodeBroadcast;
 class CMasternodePing;
+class CMasternodeCollateralWatch;
 extern map<int64_t, uint256> mapCacheBlockHashes;
+extern CMasternodeCollateralWatch mnCollateralWatch;
 
 bool GetBlockHash(uint256& hash, int nBlockHeight);
 
+//
+// Spent state of masternode collateral outputs, looked up once in the UTXO set
+// and then kept current as blocks are connected and disconnected, so Check()
+// doesn't need cs_main
+//
+
+class CMasternodeCollateralWatch
+{
+private:
+    mutable CCriticalSection cs;
+    // watched outpoint -> spent
+    std::map<COutPoint, bool> mapWatched;
+
+public:
+    /// Start watching an outpoint whose current state is known
+    void Watch(const COutPoint& outpoint, bool fSpent);
+    void Unwatch(const COutPoint& outpoint);
+    /// False if the outpoint isn't watched
+    bool GetSpent(const COutPoint& outpoint, bool& fSpent) const;
+
+    void BlockConnected(const CBlock& block);
+    void BlockDisconnected(const CBlock& block);
+
+    void Clear();
+    int size() const;
+};
+
 
 //
 // The Masternode Ping Class : Contains a different serialize method for sending pings from masternodes throughout the network
@@ -61,6 +90,8 @@ public:
 
     bool CheckAndUpdate(int& nDos, bool fRequireEnabled = true);
     bool Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode);
+    /// The message vchSig signs
+    std::string GetStrMessage() const;
     void Relay();
 
     uint256 GetHash()
@@ -217,7 +248,7 @@ public:
         READWRITE(nLastScanningErrorBlockHeight);
     }
 
-    int64_t SecondsSincePayment();
+    int64_t SecondsSincePayment(int nMnCount = -1);
 
     bool UpdateFromNewBroadcast(CMasternodeBroadcast& mnb);
 
@@ -280,7 +311,8 @@ public:
         return strStatus;
     }
 
-    int64_t GetLastPaid();
+    /// nMnCount is the number of enabled masternodes, counted here if not given
+    int64_t GetLastPaid(int nMnCount = -1);
     bool IsValidNetAddr();
 };
 
@@ -299,6 +331,8 @@ public:
     bool CheckAndUpdate(int& nDoS);
     bool CheckInputsAndAdd(int& nDos);
     bool Sign(CKey& keyCollateralAddress);
+    /// The message sig signs
+    std::string GetStrMessage() const;
     void Relay();
 
     ADD_SERIALIZE_METHODS;
@@ -0,0 +1,47 @@
+// Copyright (c) 2021 The Uidd developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "masternodedb.h"
+
+/** Stores bytes that are already serialized as they are */
+static CFlatData RawData(const std::string& str)
+{
+    return CFlatData((void*)str.data(), (void*)(str.data() + str.size()));
+}
+
+CMasternodeStateDB::CMasternodeStateDB(const std::string& strName, size_t nCacheSize, bool fWipe) : CLevelDBWrapper(GetDataDir() / strName, nCacheSize, false, fWipe) {}
+
+bool CMasternodeStateDB::Commit(unsigned int& nWritten, unsigned int& nErased)
+{
+    AssertLockHeld(cs);
+
+    CLevelDBBatch batch;
+    nWritten = nErased = 0;
+    for (std::map<std::string, std::string>::const_iterator it = mapChanged.begin(); it != mapChanged.end(); ++it) {
+        batch.Write(RawData(it->first), RawData(it->second));
+        nWritten++;
+    }
+    for (std::map<std::string, uint256>::const_iterator it = mapWritten.begin(); it != mapWritten.end(); ++it) {
+        if (!mapUpdated.count(it->first)) {
+            batch.Erase(RawData(it->first));
+            nErased++;
+        }
+    }
+
+    bool fOk = true;
+    if (nWritten > 0 || nErased > 0) {
+        try {
+            fOk = WriteBatch(batch, true);
+        } catch (const leveldb_error& e) {
+            fOk = error("%s : %s", __func__, e.what());
+        }
+    }
+
+    // On failure keep the old hashes, the next Commit() retries everything that differs from them
+    if (fOk)
+        mapWritten.swap(mapUpdated);
+    mapUpdated.clear();
+    mapChanged.clear();
+    return fOk;
+}
@@ -0,0 +1,101 @@
+// Copyright (c) 2021 The Uidd developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_MASTERNODEDB_H
+#define BITCOIN_MASTERNODEDB_H
+
+#include "hash.h"
+#include "leveldbwrapper.h"
+#include "sync.h"
+#include "util.h"
+
+#include <map>
+#include <string>
+
+#include <boost/scoped_ptr.hpp>
+
+/**
+ * LevelDB store for masternode state that is dumped as a whole, one record per
+ * entry. Update() only queues a record whose value changed since the last
+ * Commit(), and Commit() erases the records that weren't updated and writes
+ * the rest in a single synced batch. A dump costs what changed rather than
+ * the whole state, a crash mid-dump leaves the previous one intact, and
+ * LevelDB's log and background compaction take care of the files.
+ *
+ * Callers hold cs from the first Update() through Commit().
+ */
+class CMasternodeStateDB : public CLevelDBWrapper
+{
+protected:
+    CCriticalSection cs;
+
+private:
+    //! hash of each record's value as last committed, by serialized key
+    std::map<std::string, uint256> mapWritten;
+    //! every record passed to Update() since the last Commit()
+    std::map<std::string, uint256> mapUpdated;
+    //! serialized values of the updated records that changed
+    std::map<std::string, std::string> mapChanged;
+
+    CMasternodeStateDB(const CMasternodeStateDB&);
+    void operator=(const CMasternodeStateDB&);
+
+public:
+    CMasternodeStateDB(const std::string& strName, size_t nCacheSize, bool fWipe = false);
+
+    template <typename K, typename V>
+    void Update(const K& key, const V& value)
+    {
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey << key;
+        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        ssValue << value;
+
+        std::string strKey(ssKey.begin(), ssKey.end());
+        uint256 hash = Hash(ssValue.begin(), ssValue.end());
+        mapUpdated[strKey] = hash;
+
+        std::map<std::string, uint256>::const_iterator it = mapWritten.find(strKey);
+        if (it == mapWritten.end() || it->second != hash)
+            mapChanged[strKey] = std::string(ssValue.begin(), ssValue.end());
+    }
+
+    /** Write the changed records and erase the ones not updated since the last Commit() */
+    bool Commit(unsigned int& nWritten, unsigned int& nErased);
+
+    /**
+     * Pass every stored record to loader(ssKey, ssValue) and take them as the
+     * last committed state. A record the loader rejects or fails to read is
+     * counted in nSkipped and erased by the next Commit().
+     */
+    template <typename F>
+    void Load(F& loader, unsigned int& nLoaded, unsigned int& nSkipped)
+    {
+        mapWritten.clear();
+        nLoaded = nSkipped = 0;
+
+        boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
+        for (pcursor->SeekToFirst(); pcursor->Valid(); pcursor->Next()) {
+            leveldb::Slice slKey = pcursor->key();
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+
+            bool fLoaded = false;
+            try {
+                fLoaded = loader(ssKey, ssValue);
+            } catch (const std::exception& e) {
+                LogPrint("masternode", "CMasternodeStateDB::Load - %s\n", e.what());
+            }
+            if (fLoaded)
+                nLoaded++;
+            else
+                nSkipped++;
+
+            mapWritten[slKey.ToString()] = Hash(slValue.data(), slValue.data() + slValue.size());
+        }
+    }
+};
+
+#endif // BITCOIN_MASTERNODEDB_H
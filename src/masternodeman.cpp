@@ -7,12 +7,17 @@
 #include "masternodeman.h"
 #include "activemasternode.h"
 #include "addrman.h"
+#include "checkqueue.h"
 #include "masternode.h"
+#include "masternode-payments.h"
+#include "mruset.h"
 #include "obfuscation.h"
 #include "spork.h"
+#include "swifttx.h"
 #include "util.h"
 #include <boost/filesystem.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
 
 #define MN_WINNER_MINIMUM_AGE 8000    // Age in seconds. This should be > MASTERNODE_REMOVAL_SECONDS to avoid misconfigured new nodes in the list.
 
@@ -43,160 +48,276 @@ struct CompareScoreMN {
     }
 };
 
+/** A masternode message signature to check ahead of processing the message */
+struct CMessageSigCheck {
+    CPubKey pubKey;
+    std::vector<unsigned char> vchSig;
+    std::string strMessage;
+
+    CMessageSigCheck() {}
+    CMessageSigCheck(const CPubKey& pubKeyIn, const std::vector<unsigned char>& vchSigIn, const std::string& strMessageIn) : pubKey(pubKeyIn), vchSig(vchSigIn), strMessage(strMessageIn) {}
+
+    /** Only fills the signature cache, so a bad signature doesn't stop the rest of the batch */
+    bool operator()()
+    {
+        std::string errorMessage;
+        obfuScationSigner.VerifyMessage(pubKey, vchSig, strMessage, errorMessage);
+        return true;
+    }
+
+    void swap(CMessageSigCheck& check)
+    {
+        std::swap(pubKey, check.pubKey);
+        vchSig.swap(check.vchSig);
+        strMessage.swap(check.strMessage);
+    }
+};
+
+static CCheckQueue<CMessageSigCheck> mnsigcheckqueue(16);
+static int nMasternodeSigCheckThreads = 0;
+
+void StartMasternodeSigCheckThreads(boost::thread_group& threadGroup)
+{
+    nMasternodeSigCheckThreads = std::min((int)boost::thread::hardware_concurrency(), MASTERNODES_SIGCHECK_MAX_THREADS);
+    for (int i = 0; i < nMasternodeSigCheckThreads - 1; i++)
+        threadGroup.create_thread(&ThreadMasternodeSigCheck);
+}
+
+void ThreadMasternodeSigCheck()
+{
+    RenameThread("uidd-mnsigcheck");
+    mnsigcheckqueue.Thread();
+}
+
+static bool IsSignedMasternodeMessage(const std::string& strCommand)
+{
+    return strCommand == "mnb" || strCommand == "mnp" || strCommand == "mnw" || strCommand == "txlvote";
+}
+
 //
 // CMasternodeDB
 //
 
-CMasternodeDB::CMasternodeDB()
-{
-    pathMN = GetDataDir() / "mncache.dat";
-    strMagicMessage = "MasternodeCache";
-}
+/** Feeds the records of a CMasternodeDB into a CMasternodeMan */
+struct CMasternodeDB::CLoader {
+    CMasternodeDB& db;
+    CMasternodeMan& mnodemanToLoad;
+
+    CLoader(CMasternodeDB& dbIn, CMasternodeMan& mnodemanIn) : db(dbIn), mnodemanToLoad(mnodemanIn) {}
+
+    bool operator()(CDataStream& ssKey, CDataStream& ssValue)
+    {
+        return db.LoadRecord(mnodemanToLoad, ssKey, ssValue);
+    }
+};
+
+CMasternodeDB::CMasternodeDB(size_t nCacheSize, bool fWipe) : CMasternodeStateDB("mncache", nCacheSize, fWipe) {}
 
 bool CMasternodeDB::Write(const CMasternodeMan& mnodemanToSave)
 {
     int64_t nStart = GetTimeMillis();
 
-    // serialize, checksum data up to that point, then append checksum
-    CDataStream ssMasternodes(SER_DISK, CLIENT_VERSION);
-    ssMasternodes << strMagicMessage;                   // masternode cache file specific magic message
-    ssMasternodes << FLATDATA(Params().MessageStart()); // network specific magic number
-    ssMasternodes << mnodemanToSave;
-    uint256 hash = Hash(ssMasternodes.begin(), ssMasternodes.end());
-    ssMasternodes << hash;
-
-    // open output file, and associate with CAutoFile
-    FILE* file = fopen(pathMN.string().c_str(), "wb");
-    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
-    if (fileout.IsNull())
-        return error("%s : Failed to open file %s", __func__, pathMN.string());
-
-    // Write and commit header, data
-    try {
-        fileout << ssMasternodes;
-    } catch (std::exception& e) {
-        return error("%s : Serialize or I/O error - %s", __func__, e.what());
-    }
-    //    FileCommit(fileout);
-    fileout.fclose();
-
-    LogPrint("masternode","Written info to mncache.dat  %dms\n", GetTimeMillis() - nStart);
+    LOCK2(cs, mnodemanToSave.cs);
+    for (CMasternodeMan::masternode_map_t::const_iterator it = mnodemanToSave.mapMasternodes.begin(); it != mnodemanToSave.mapMasternodes.end(); ++it)
+        Update(make_pair('m', it->first), it->second);
+    for (CMasternodeMan::seen_mnb_map_t::const_iterator it = mnodemanToSave.mapSeenMasternodeBroadcast.begin(); it != mnodemanToSave.mapSeenMasternodeBroadcast.end(); ++it)
+        Update(make_pair('b', it->first), it->second);
+    for (CMasternodeMan::seen_mnp_map_t::const_iterator it = mnodemanToSave.mapSeenMasternodePing.begin(); it != mnodemanToSave.mapSeenMasternodePing.end(); ++it)
+        Update(make_pair('p', it->first), it->second);
+    Update('a', map<CNetAddr, int64_t>(mnodemanToSave.mAskedUsForMasternodeList.begin(), mnodemanToSave.mAskedUsForMasternodeList.end()));
+    Update('w', map<CNetAddr, int64_t>(mnodemanToSave.mWeAskedForMasternodeList.begin(), mnodemanToSave.mWeAskedForMasternodeList.end()));
+    Update('e', map<COutPoint, int64_t>(mnodemanToSave.mWeAskedForMasternodeListEntry.begin(), mnodemanToSave.mWeAskedForMasternodeListEntry.end()));
+    Update('s', map<CNetAddr, CMasternodeSyncVersion>(mnodemanToSave.mapSyncedListVersions.begin(), mnodemanToSave.mapSyncedListVersions.end()));
+    Update('d', mnodemanToSave.nDsqCount);
+
+    unsigned int nWritten, nErased;
+    if (!Commit(nWritten, nErased))
+        return error("%s : Failed to write masternode cache", __func__);
+
+    LogPrint("masternode","Written %u and erased %u records in mncache  %dms\n", nWritten, nErased, GetTimeMillis() - nStart);
     LogPrint("masternode","  %s\n", mnodemanToSave.ToString());
 
     return true;
 }
 
-CMasternodeDB::ReadResult CMasternodeDB::Read(CMasternodeMan& mnodemanToLoad, bool fDryRun)
+bool CMasternodeDB::LoadRecord(CMasternodeMan& mnodemanToLoad, CDataStream& ssKey, CDataStream& ssValue)
 {
-    int64_t nStart = GetTimeMillis();
-    // open input file, and associate with CAutoFile
-    FILE* file = fopen(pathMN.string().c_str(), "rb");
-    CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull()) {
-        error("%s : Failed to open file %s", __func__, pathMN.string());
-        return FileError;
+    char chType;
+    ssKey >> chType;
+
+    if (chType == 'm') {
+        CMasternode mn;
+        ssValue >> mn;
+        mnodemanToLoad.IndexMasternode(mnodemanToLoad.mapMasternodes.insert(make_pair(mn.vin.prevout, mn)).first->second);
+    } else if (chType == 'b') {
+        uint256 hash;
+        CMasternodeBroadcast mnb;
+        ssKey >> hash;
+        ssValue >> mnb;
+        mnodemanToLoad.mapSeenMasternodeBroadcast.insert(make_pair(hash, mnb));
+    } else if (chType == 'p') {
+        uint256 hash;
+        CMasternodePing mnp;
+        ssKey >> hash;
+        ssValue >> mnp;
+        mnodemanToLoad.mapSeenMasternodePing.insert(make_pair(hash, mnp));
+    } else if (chType == 'a' || chType == 'w') {
+        map<CNetAddr, int64_t> mapAsked;
+        ssValue >> mapAsked;
+        expirymap<CNetAddr, int64_t>& mapTo = chType == 'a' ? mnodemanToLoad.mAskedUsForMasternodeList : mnodemanToLoad.mWeAskedForMasternodeList;
+        for (map<CNetAddr, int64_t>::const_iterator it = mapAsked.begin(); it != mapAsked.end(); ++it)
+            mapTo.insert(*it);
+    } else if (chType == 'e') {
+        map<COutPoint, int64_t> mapAsked;
+        ssValue >> mapAsked;
+        for (map<COutPoint, int64_t>::const_iterator it = mapAsked.begin(); it != mapAsked.end(); ++it)
+            mnodemanToLoad.mWeAskedForMasternodeListEntry.insert(*it);
+    } else if (chType == 's') {
+        map<CNetAddr, CMasternodeSyncVersion> mapSynced;
+        ssValue >> mapSynced;
+        for (map<CNetAddr, CMasternodeSyncVersion>::const_iterator it = mapSynced.begin(); it != mapSynced.end(); ++it)
+            mnodemanToLoad.mapSyncedListVersions.insert(*it);
+    } else if (chType == 'd') {
+        ssValue >> mnodemanToLoad.nDsqCount;
+    } else {
+        return false;
     }
+    return true;
+}
 
-    // use file size to size memory buffer
-    int fileSize = boost::filesystem::file_size(pathMN);
-    int dataSize = fileSize - sizeof(uint256);
-    // Don't try to resize to a negative number if file is small
-    if (dataSize < 0)
-        dataSize = 0;
-    vector<unsigned char> vchData;
-    vchData.resize(dataSize);
-    uint256 hashIn;
-
-    // read data and checksum from file
-    try {
-        filein.read((char*)&vchData[0], dataSize);
-        filein >> hashIn;
-    } catch (std::exception& e) {
-        error("%s : Deserialize or I/O error - %s", __func__, e.what());
-        return HashReadError;
-    }
-    filein.fclose();
+void CMasternodeDB::Read(CMasternodeMan& mnodemanToLoad)
+{
+    int64_t nStart = GetTimeMillis();
+
+    {
+        LOCK2(cs, mnodemanToLoad.cs);
+        mnodemanToLoad.Clear();
 
-    CDataStream ssMasternodes(vchData, SER_DISK, CLIENT_VERSION);
+        // records come straight into mnodemanToLoad, one at a time
+        CLoader loader(*this, mnodemanToLoad);
+        unsigned int nLoaded, nSkipped;
+        Load(loader, nLoaded, nSkipped);
 
-    // verify stored checksum matches input data
-    uint256 hashTmp = Hash(ssMasternodes.begin(), ssMasternodes.end());
-    if (hashIn != hashTmp) {
-        error("%s : Checksum mismatch, data corrupted", __func__);
-        return IncorrectHash;
+        LogPrint("masternode","Loaded %u records from mncache, skipped %u  %dms\n", nLoaded, nSkipped, GetTimeMillis() - nStart);
+        LogPrint("masternode","  %s\n", mnodemanToLoad.ToString());
     }
 
-    unsigned char pchMsgTmp[4];
-    std::string strMagicMessageTmp;
+    LogPrint("masternode","Masternode manager - cleaning....\n");
+    mnodemanToLoad.CheckAndRemove(true);
+    LogPrint("masternode","Masternode manager - result:\n");
+    LogPrint("masternode","  %s\n", mnodemanToLoad.ToString());
+}
+
+// guards pmndb, which is opened at startup and closed at shutdown
+static CCriticalSection cs_mndb;
+static CMasternodeDB* pmndb = NULL;
+
+void LoadMasternodes()
+{
+    LOCK(cs_mndb);
+    delete pmndb;
+    pmndb = NULL;
     try {
-        // de-serialize file header (masternode cache file specific magic message) and ..
+        pmndb = new CMasternodeDB(0);
+    } catch (const leveldb_error& e) {
+        // it's only a cache, start over with an empty one
+        LogPrintf("Error opening masternode cache: %s, will try to recreate\n", e.what());
+        pmndb = new CMasternodeDB(0, true);
+    }
+    pmndb->Read(mnodeman);
+}
+
+void DumpMasternodes()
+{
+    int64_t nStart = GetTimeMillis();
 
-        ssMasternodes >> strMagicMessageTmp;
+    LOCK(cs_mndb);
+    if (pmndb == NULL)
+        return;
+    pmndb->Write(mnodeman);
 
-        // ... verify the message matches predefined one
-        if (strMagicMessage != strMagicMessageTmp) {
-            error("%s : Invalid masternode cache magic message", __func__);
-            return IncorrectMagicMessage;
-        }
+    LogPrint("masternode","Masternode dump finished  %dms\n", GetTimeMillis() - nStart);
+}
 
-        // de-serialize file header (network specific magic number) and ..
-        ssMasternodes >> FLATDATA(pchMsgTmp);
+void CloseMasternodes()
+{
+    DumpMasternodes();
 
-        // ... verify the network matches ours
-        if (memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp))) {
-            error("%s : Invalid network magic number", __func__);
-            return IncorrectMagicNumber;
-        }
-        // de-serialize data into CMasternodeMan object
-        ssMasternodes >> mnodemanToLoad;
-    } catch (std::exception& e) {
-        mnodemanToLoad.Clear();
-        error("%s : Deserialize or I/O error - %s", __func__, e.what());
-        return IncorrectFormat;
-    }
+    LOCK(cs_mndb);
+    delete pmndb;
+    pmndb = NULL;
+}
 
-    LogPrint("masternode","Loaded info from mncache.dat  %dms\n", GetTimeMillis() - nStart);
-    LogPrint("masternode","  %s\n", mnodemanToLoad.ToString());
-    if (!fDryRun) {
-        LogPrint("masternode","Masternode manager - cleaning....\n");
-        mnodemanToLoad.CheckAndRemove(true);
-        LogPrint("masternode","Masternode manager - result:\n");
-        LogPrint("masternode","  %s\n", mnodemanToLoad.ToString());
-    }
+CMasternodeIndexHasher::CMasternodeIndexHasher()
+{
+    GetRandBytes((unsigned char*)&k0, sizeof(k0));
+    GetRandBytes((unsigned char*)&k1, sizeof(k1));
+}
 
-    return Ok;
+CMasternodeMan::CMasternodeMan() : mAskedUsForMasternodeList(MASTERNODES_ASKED_MAX),
+                                   mWeAskedForMasternodeList(MASTERNODES_ASKED_MAX),
+                                   mWeAskedForMasternodeListEntry(MASTERNODES_ASKED_MAX),
+                                   mapSyncedListVersions(MASTERNODES_ASKED_MAX),
+                                   mapSeenMasternodeBroadcast(MASTERNODES_SEEN_MNB_MAX),
+                                   mapSeenMasternodePing(MASTERNODES_SEEN_MNP_MAX)
+{
+    hashList = GetRandHash();
+    nDsqCount = 0;
 }
 
-void DumpMasternodes()
+void CMasternodeMan::IndexMasternode(const CMasternode& mn)
 {
-    int64_t nStart = GetTimeMillis();
+    const COutPoint& outpoint = mn.vin.prevout;
+
+    std::pair<pubkey_index_t::iterator, pubkey_index_t::iterator> rangeKey = mapByPubKey.equal_range(mn.pubKeyMasternode);
+    pubkey_index_t::iterator itKey = rangeKey.first;
+    while (itKey != rangeKey.second && itKey->second != outpoint)
+        ++itKey;
+    if (itKey == rangeKey.second)
+        mapByPubKey.insert(std::make_pair(mn.pubKeyMasternode, outpoint));
+
+    CScript payee = GetScriptForDestination(mn.pubKeyCollateralAddress.GetID());
+    std::pair<payee_index_t::iterator, payee_index_t::iterator> rangePayee = mapByPayee.equal_range(payee);
+    payee_index_t::iterator itPayee = rangePayee.first;
+    while (itPayee != rangePayee.second && itPayee->second != outpoint)
+        ++itPayee;
+    if (itPayee == rangePayee.second)
+        mapByPayee.insert(std::make_pair(payee, outpoint));
+
+    // entries are (re)indexed for every new broadcast, which is what peers syncing from us need
+    listVersions.touch(outpoint);
+}
 
-    CMasternodeDB mndb;
-    CMasternodeMan tempMnodeman;
-
-    LogPrint("masternode","Verifying mncache.dat format...\n");
-    CMasternodeDB::ReadResult readResult = mndb.Read(tempMnodeman, true);
-    // there was an error and it was not an error on file opening => do not proceed
-    if (readResult == CMasternodeDB::FileError)
-        LogPrint("masternode","Missing masternode cache file - mncache.dat, will try to recreate\n");
-    else if (readResult != CMasternodeDB::Ok) {
-        LogPrint("masternode","Error reading mncache.dat: ");
-        if (readResult == CMasternodeDB::IncorrectFormat)
-            LogPrint("masternode","magic is ok but data has invalid format, will try to recreate\n");
-        else {
-            LogPrint("masternode","file format is unknown or invalid, please fix it manually\n");
-            return;
-        }
+void CMasternodeMan::UnindexMasternode(const CMasternode& mn)
+{
+    const COutPoint& outpoint = mn.vin.prevout;
+
+    std::pair<pubkey_index_t::iterator, pubkey_index_t::iterator> rangeKey = mapByPubKey.equal_range(mn.pubKeyMasternode);
+    for (pubkey_index_t::iterator itKey = rangeKey.first; itKey != rangeKey.second;) {
+        if (itKey->second == outpoint)
+            itKey = mapByPubKey.erase(itKey);
+        else
+            ++itKey;
     }
-    LogPrint("masternode","Writting info to mncache.dat...\n");
-    mndb.Write(mnodeman);
 
-    LogPrint("masternode","Masternode dump finished  %dms\n", GetTimeMillis() - nStart);
+    std::pair<payee_index_t::iterator, payee_index_t::iterator> rangePayee = mapByPayee.equal_range(GetScriptForDestination(mn.pubKeyCollateralAddress.GetID()));
+    for (payee_index_t::iterator itPayee = rangePayee.first; itPayee != rangePayee.second;) {
+        if (itPayee->second == outpoint)
+            itPayee = mapByPayee.erase(itPayee);
+        else
+            ++itPayee;
+    }
+
+    listVersions.erase(outpoint);
 }
 
-CMasternodeMan::CMasternodeMan()
+void CMasternodeMan::UpdateIndexes(const CMasternode& mn)
 {
-    nDsqCount = 0;
+    LOCK(cs);
+    if (mapMasternodes.count(mn.vin.prevout)) {
+        IndexMasternode(mn);
+        mapRankTables.clear();
+    }
 }
 
 bool CMasternodeMan::Add(CMasternode& mn)
@@ -209,7 +330,8 @@ bool CMasternodeMan::Add(CMasternode& mn)
     CMasternode* pmn = Find(mn.vin);
     if (pmn == NULL) {
         LogPrint("masternode", "CMasternodeMan: Adding new Masternode %s - %i now\n", mn.vin.prevout.hash.ToString(), size() + 1);
-        vMasternodes.push_back(mn);
+        IndexMasternode(mapMasternodes.insert(std::make_pair(mn.vin.prevout, mn)).first->second);
+        mapRankTables.clear();
         return true;
     }
 
@@ -236,7 +358,8 @@ void CMasternodeMan::Check()
 {
     LOCK(cs);
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (PAIRTYPE(const COutPoint, CMasternode) & mnpair, mapMasternodes) {
+        CMasternode& mn = mnpair.second;
         mn.Check();
     }
 }
@@ -248,104 +371,95 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
     LOCK(cs);
 
     //remove inactive and outdated
-    vector<CMasternode>::iterator it = vMasternodes.begin();
-    while (it != vMasternodes.end()) {
-        if ((*it).activeState == CMasternode::MASTERNODE_REMOVE ||
-            (*it).activeState == CMasternode::MASTERNODE_VIN_SPENT ||
-            (forceExpiredRemoval && (*it).activeState == CMasternode::MASTERNODE_EXPIRED) ||
-            (*it).protocolVersion < masternodePayments.GetMinMasternodePaymentsProto()) {
-            LogPrint("masternode", "CMasternodeMan: Removing inactive Masternode %s - %i now\n", (*it).vin.prevout.hash.ToString(), size() - 1);
-
-            //erase all of the broadcasts we've seen from this vin
-            // -- if we missed a few pings and the node was removed, this will allow is to get it back without them
-            //    sending a brand new mnb
-            map<uint256, CMasternodeBroadcast>::iterator it3 = mapSeenMasternodeBroadcast.begin();
-            while (it3 != mapSeenMasternodeBroadcast.end()) {
-                if ((*it3).second.vin == (*it).vin) {
-                    masternodeSync.mapSeenSyncMNB.erase((*it3).first);
-                    mapSeenMasternodeBroadcast.erase(it3++);
-                } else {
-                    ++it3;
-                }
-            }
+    std::set<COutPoint> setRemoved;
+    masternode_map_t::iterator mnit = mapMasternodes.begin();
+    while (mnit != mapMasternodes.end()) {
+        CMasternode& mn = mnit->second;
+        if (mn.activeState == CMasternode::MASTERNODE_REMOVE ||
+            mn.activeState == CMasternode::MASTERNODE_VIN_SPENT ||
+            (forceExpiredRemoval && mn.activeState == CMasternode::MASTERNODE_EXPIRED) ||
+            mn.protocolVersion < masternodePayments.GetMinMasternodePaymentsProto()) {
+            LogPrint("masternode", "CMasternodeMan: Removing inactive Masternode %s - %i now\n", mn.vin.prevout.hash.ToString(), size() - 1);
+
+            setRemoved.insert(mn.vin.prevout);
 
             // allow us to ask for this masternode again if we see another ping
-            map<COutPoint, int64_t>::iterator it2 = mWeAskedForMasternodeListEntry.begin();
-            while (it2 != mWeAskedForMasternodeListEntry.end()) {
-                if ((*it2).first == (*it).vin.prevout) {
-                    mWeAskedForMasternodeListEntry.erase(it2++);
-                } else {
-                    ++it2;
-                }
-            }
+            mWeAskedForMasternodeListEntry.erase(mn.vin.prevout);
 
-            it = vMasternodes.erase(it);
+            UnindexMasternode(mn);
+            mnCollateralWatch.Unwatch(mn.vin.prevout);
+            mnit = mapMasternodes.erase(mnit);
+            mapRankTables.clear();
         } else {
-            ++it;
+            ++mnit;
         }
     }
 
-    // check who's asked for the Masternode list
-    map<CNetAddr, int64_t>::iterator it1 = mAskedUsForMasternodeList.begin();
-    while (it1 != mAskedUsForMasternodeList.end()) {
-        if ((*it1).second < GetTime()) {
-            mAskedUsForMasternodeList.erase(it1++);
-        } else {
-            ++it1;
+    //erase all of the broadcasts we've seen from the removed vins
+    // -- if we missed a few pings and the node was removed, this will allow is to get it back without them
+    //    sending a brand new mnb
+    if (!setRemoved.empty()) {
+        seen_mnb_map_t::iterator it3 = mapSeenMasternodeBroadcast.begin();
+        while (it3 != mapSeenMasternodeBroadcast.end()) {
+            if (setRemoved.count((*it3).second.vin.prevout)) {
+                masternodeSync.mapSeenSyncMNB.erase((*it3).first);
+                mapSeenMasternodeBroadcast.erase(it3++);
+            } else {
+                ++it3;
+            }
         }
     }
 
-    // check who we asked for the Masternode list
-    it1 = mWeAskedForMasternodeList.begin();
-    while (it1 != mWeAskedForMasternodeList.end()) {
-        if ((*it1).second < GetTime()) {
-            mWeAskedForMasternodeList.erase(it1++);
-        } else {
-            ++it1;
-        }
+    // drop index entries left behind by key changes
+    pubkey_index_t::iterator itKey = mapByPubKey.begin();
+    while (itKey != mapByPubKey.end()) {
+        masternode_map_t::iterator mi = mapMasternodes.find(itKey->second);
+        if (mi == mapMasternodes.end() || mi->second.pubKeyMasternode != itKey->first)
+            itKey = mapByPubKey.erase(itKey);
+        else
+            ++itKey;
     }
-
-    // check which Masternodes we've asked for
-    map<COutPoint, int64_t>::iterator it2 = mWeAskedForMasternodeListEntry.begin();
-    while (it2 != mWeAskedForMasternodeListEntry.end()) {
-        if ((*it2).second < GetTime()) {
-            mWeAskedForMasternodeListEntry.erase(it2++);
-        } else {
-            ++it2;
-        }
+    payee_index_t::iterator itPayee = mapByPayee.begin();
+    while (itPayee != mapByPayee.end()) {
+        masternode_map_t::iterator mi = mapMasternodes.find(itPayee->second);
+        if (mi == mapMasternodes.end() || GetScriptForDestination(mi->second.pubKeyCollateralAddress.GetID()) != itPayee->first)
+            itPayee = mapByPayee.erase(itPayee);
+        else
+            ++itPayee;
     }
 
-    // remove expired mapSeenMasternodeBroadcast
-    map<uint256, CMasternodeBroadcast>::iterator it3 = mapSeenMasternodeBroadcast.begin();
-    while (it3 != mapSeenMasternodeBroadcast.end()) {
-        if ((*it3).second.lastPing.sigTime < GetTime() - (MASTERNODE_REMOVAL_SECONDS * 2)) {
-            mapSeenMasternodeBroadcast.erase(it3++);
-            masternodeSync.mapSeenSyncMNB.erase((*it3).second.GetHash());
-        } else {
-            ++it3;
-        }
-    }
+    // the request and seen maps are indexed by expiry, only what's due is looked at
+    int64_t nNow = GetTime();
+    mAskedUsForMasternodeList.expire(nNow);
+    mWeAskedForMasternodeList.expire(nNow);
+    mWeAskedForMasternodeListEntry.expire(nNow);
+    mapSyncedListVersions.expire(nNow);
 
-    // remove expired mapSeenMasternodePing
-    map<uint256, CMasternodePing>::iterator it4 = mapSeenMasternodePing.begin();
-    while (it4 != mapSeenMasternodePing.end()) {
-        if ((*it4).second.sigTime < GetTime() - (MASTERNODE_REMOVAL_SECONDS * 2)) {
-            mapSeenMasternodePing.erase(it4++);
-        } else {
-            ++it4;
-        }
-    }
+    std::vector<std::pair<uint256, CMasternodeBroadcast> > vExpired;
+    mapSeenMasternodeBroadcast.expire(nNow, &vExpired);
+    for (unsigned int i = 0; i < vExpired.size(); i++)
+        masternodeSync.mapSeenSyncMNB.erase(vExpired[i].first);
+
+    mapSeenMasternodePing.expire(nNow);
 }
 
 void CMasternodeMan::Clear()
 {
     LOCK(cs);
-    vMasternodes.clear();
+    mapMasternodes.clear();
+    mapByPubKey.clear();
+    mapByPayee.clear();
+    mapRankTables.clear();
+    mnCollateralWatch.Clear();
     mAskedUsForMasternodeList.clear();
     mWeAskedForMasternodeList.clear();
     mWeAskedForMasternodeListEntry.clear();
+    mapSyncedListVersions.clear();
     mapSeenMasternodeBroadcast.clear();
     mapSeenMasternodePing.clear();
+    // versions of the new list don't compare to the ones peers have from the old
+    hashList = GetRandHash();
+    listVersions.clear();
     nDsqCount = 0;
 }
 
@@ -356,7 +470,8 @@ int CMasternodeMan::stable_size ()
     int64_t nMasternode_Min_Age = MN_WINNER_MINIMUM_AGE;
     int64_t nMasternode_Age = 0;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (PAIRTYPE(const COutPoint, CMasternode) & mnpair, mapMasternodes) {
+        CMasternode& mn = mnpair.second;
         if (mn.protocolVersion < nMinProtocol) {
             continue; // Skip obsolete versions
         }
@@ -381,7 +496,8 @@ int CMasternodeMan::CountEnabled(int protocolVersion)
     int i = 0;
     protocolVersion = protocolVersion == -1 ? masternodePayments.GetMinMasternodePaymentsProto() : protocolVersion;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (PAIRTYPE(const COutPoint, CMasternode) & mnpair, mapMasternodes) {
+        CMasternode& mn = mnpair.second;
         mn.Check();
         if (mn.protocolVersion < protocolVersion || !mn.IsEnabled()) continue;
         i++;
@@ -394,7 +510,8 @@ void CMasternodeMan::CountNetworks(int protocolVersion, int& ipv4, int& ipv6, in
 {
     protocolVersion = protocolVersion == -1 ? masternodePayments.GetMinMasternodePaymentsProto() : protocolVersion;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (PAIRTYPE(const COutPoint, CMasternode) & mnpair, mapMasternodes) {
+        CMasternode& mn = mnpair.second;
         mn.Check();
         std::string strHost;
         int port;
@@ -430,21 +547,35 @@ void CMasternodeMan::DsegUpdate(CNode* pnode)
             }
         }
     }
-	LogPrint("masternode", "DsegUpdate - pushmessage\n");
-    pnode->PushMessage("dseg", CTxIn());
+
+    // the list version tells newer peers what we already have, older ones ignore it
+    CMasternodeSyncVersion syncVersion;
+    std::map<CNetAddr, CMasternodeSyncVersion>::iterator itSynced = mapSyncedListVersions.find(pnode->addr);
+    if (itSynced != mapSyncedListVersions.end() && !mapMasternodes.empty())
+        syncVersion = itSynced->second;
+
+    LogPrint("masternode", "DsegUpdate - pushmessage, list version %d\n", syncVersion.nVersion);
+    pnode->PushMessage("dseg", CTxIn(), syncVersion.hashList, syncVersion.nVersion);
     int64_t askAgain = GetTime() + MASTERNODES_DSEG_SECONDS;
     mWeAskedForMasternodeList[pnode->addr] = askAgain;
 }
 
+void CMasternodeMan::SetSyncVersion(const CNetAddr& addr, const CMasternodeSyncVersion& syncVersion)
+{
+    LOCK(cs);
+    mapSyncedListVersions.erase(addr);
+    mapSyncedListVersions.insert(std::make_pair(addr, syncVersion));
+}
+
 CMasternode* CMasternodeMan::Find(const CScript& payee)
 {
     LOCK(cs);
-    CScript payee2;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        payee2 = GetScriptForDestination(mn.pubKeyCollateralAddress.GetID());
-        if (payee2 == payee)
-            return &mn;
+    std::pair<payee_index_t::iterator, payee_index_t::iterator> range = mapByPayee.equal_range(payee);
+    for (payee_index_t::iterator it = range.first; it != range.second; ++it) {
+        masternode_map_t::iterator mi = mapMasternodes.find(it->second);
+        if (mi != mapMasternodes.end() && GetScriptForDestination(mi->second.pubKeyCollateralAddress.GetID()) == payee)
+            return &mi->second;
     }
     return NULL;
 }
@@ -453,10 +584,9 @@ CMasternode* CMasternodeMan::Find(const CTxIn& vin)
 {
     LOCK(cs);
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        if (mn.vin.prevout == vin.prevout)
-            return &mn;
-    }
+    masternode_map_t::iterator mi = mapMasternodes.find(vin.prevout);
+    if (mi != mapMasternodes.end())
+        return &mi->second;
     return NULL;
 }
 
@@ -465,13 +595,27 @@ CMasternode* CMasternodeMan::Find(const CPubKey& pubKeyMasternode)
 {
     LOCK(cs);
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        if (mn.pubKeyMasternode == pubKeyMasternode)
-            return &mn;
+    std::pair<pubkey_index_t::iterator, pubkey_index_t::iterator> range = mapByPubKey.equal_range(pubKeyMasternode);
+    for (pubkey_index_t::iterator it = range.first; it != range.second; ++it) {
+        masternode_map_t::iterator mi = mapMasternodes.find(it->second);
+        if (mi != mapMasternodes.end() && mi->second.pubKeyMasternode == pubKeyMasternode)
+            return &mi->second;
     }
     return NULL;
 }
 
+std::vector<CMasternode> CMasternodeMan::GetFullMasternodeVector()
+{
+    Check();
+
+    LOCK(cs);
+    std::vector<CMasternode> vMasternodes;
+    vMasternodes.reserve(mapMasternodes.size());
+    for (masternode_map_t::iterator it = mapMasternodes.begin(); it != mapMasternodes.end(); ++it)
+        vMasternodes.push_back(it->second);
+    return vMasternodes;
+}
+
 //
 // Deterministically select the oldest/best masternode to pay on the network
 //
@@ -487,7 +631,11 @@ CMasternode* CMasternodeMan::GetNextMasternodeInQueueForPayment(int nBlockHeight
     */
 
     int nMnCount = CountEnabled();
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    std::set<CScript> setScheduled;
+    masternodePayments.GetScheduledPayees(nBlockHeight, setScheduled);
+
+    BOOST_FOREACH (PAIRTYPE(const COutPoint, CMasternode) & mnpair, mapMasternodes) {
+        CMasternode& mn = mnpair.second;
         mn.Check();
         if (!mn.IsEnabled()) continue;
 
@@ -495,7 +643,7 @@ CMasternode* CMasternodeMan::GetNextMasternodeInQueueForPayment(int nBlockHeight
         if (mn.protocolVersion < masternodePayments.GetMinMasternodePaymentsProto()) continue;
 
         //it's in the list (up to 8 entries ahead of current block to allow propagation) -- so let's skip it
-        if (masternodePayments.IsScheduled(mn, nBlockHeight)) continue;
+        if (setScheduled.count(GetScriptForDestination(mn.pubKeyCollateralAddress.GetID()))) continue;
 
         //it's too new, wait for a cycle
         if (fFilterSigTime && mn.sigTime + (nMnCount * 2.6 * 60) > GetAdjustedTime()) continue;
@@ -503,7 +651,7 @@ CMasternode* CMasternodeMan::GetNextMasternodeInQueueForPayment(int nBlockHeight
         //make sure it has as many confirmations as there are masternodes
         if (mn.GetMasternodeInputAge() < nMnCount) continue;
 
-        vecMasternodeLastPaid.push_back(make_pair(mn.SecondsSincePayment(), mn.vin));
+        vecMasternodeLastPaid.push_back(make_pair(mn.SecondsSincePayment(nMnCount), mn.vin));
     }
 
     nCount = (int)vecMasternodeLastPaid.size();
@@ -550,7 +698,8 @@ CMasternode* CMasternodeMan::FindRandomNotInVec(std::vector<CTxIn>& vecToExclude
     LogPrint("masternode", "CMasternodeMan::FindRandomNotInVec - rand %d\n", rand);
     bool found;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (PAIRTYPE(const COutPoint, CMasternode) & mnpair, mapMasternodes) {
+        CMasternode& mn = mnpair.second;
         if (mn.protocolVersion < protocolVersion || !mn.IsEnabled()) continue;
         found = false;
         BOOST_FOREACH (CTxIn& usedVin, vecToExclude) {
@@ -568,143 +717,132 @@ CMasternode* CMasternodeMan::FindRandomNotInVec(std::vector<CTxIn>& vecToExclude
     return NULL;
 }
 
-CMasternode* CMasternodeMan::GetCurrentMasterNode(int mod, int64_t nBlockHeight, int minProtocol)
+const CMasternodeRankTable* CMasternodeMan::GetRankTable(int64_t nBlockHeight, int minProtocol, int nFlags)
 {
-    int64_t score = 0;
-    CMasternode* winner = NULL;
-
-    // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        mn.Check();
-        if (mn.protocolVersion < minProtocol || !mn.IsEnabled()) continue;
-
-        // calculate the score for each Masternode
-        uint256 n = mn.CalculateScore(mod, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
-
-        // determine the winner
-        if (n2 > score) {
-            score = n2;
-            winner = &mn;
-        }
-    }
-
-    return winner;
-}
-
-int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
-{
-    std::vector<pair<int64_t, CTxIn> > vecMasternodeScores;
-    int64_t nMasternode_Min_Age = MN_WINNER_MINIMUM_AGE;
-    int64_t nMasternode_Age = 0;
+    AssertLockHeld(cs);
 
     //make sure we know about this block
     uint256 hash = 0;
-    if (!GetBlockHash(hash, nBlockHeight)) return -1;
-
-    // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        if (mn.protocolVersion < minProtocol) {
-            LogPrint("masternode","Skipping Masternode with obsolete version %d\n", mn.protocolVersion);
-            continue;                                                       // Skip obsolete versions
-        }
+    if (!GetBlockHash(hash, nBlockHeight)) return NULL;
+
+    // masternode states and ages move with time, so a table is only reused within one check interval
+    pair<int64_t, pair<int, int> > key = make_pair(nBlockHeight, make_pair(minProtocol, nFlags));
+    std::map<pair<int64_t, pair<int, int> >, CMasternodeRankTable>::iterator it = mapRankTables.find(key);
+    if (it != mapRankTables.end() && it->second.hashBlock == hash && GetTime() - it->second.nTimeCreated < MASTERNODE_CHECK_SECONDS)
+        return &it->second;
+
+    if (it == mapRankTables.end() && mapRankTables.size() >= MASTERNODES_RANK_CACHE_SIZE)
+        mapRankTables.erase(mapRankTables.begin()); // lowest height
+
+    CMasternodeRankTable& table = mapRankTables[key];
+    table = CMasternodeRankTable();
+    table.hashBlock = hash;
+    table.nTimeCreated = GetTime();
+    table.vecScores.reserve(mapMasternodes.size());
+
+    bool fMinAge = (nFlags & CMasternodeRankTable::MIN_AGE) && IsSporkActive(SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT);
+    BOOST_FOREACH (PAIRTYPE(const COutPoint, CMasternode) & mnpair, mapMasternodes) {
+        CMasternode& mn = mnpair.second;
+        if (mn.protocolVersion < minProtocol) continue;
 
-        if (IsSporkActive(SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT)) {
-            nMasternode_Age = GetAdjustedTime() - mn.sigTime;
-            if ((nMasternode_Age) < nMasternode_Min_Age) {
+        if (fMinAge) {
+            int64_t nMasternode_Age = GetAdjustedTime() - mn.sigTime;
+            if (nMasternode_Age < MN_WINNER_MINIMUM_AGE) {
                 if (fDebug) LogPrint("masternode","Skipping just activated Masternode. Age: %ld\n", nMasternode_Age);
-                continue;                                                   // Skip masternodes younger than (default) 1 hour
+                continue;
             }
         }
-        if (fOnlyActive) {
+        if (nFlags & (CMasternodeRankTable::ONLY_ACTIVE | CMasternodeRankTable::DISABLED_LAST)) {
             mn.Check();
-            if (!mn.IsEnabled()) continue;
+            if (!mn.IsEnabled()) {
+                if (nFlags & CMasternodeRankTable::DISABLED_LAST)
+                    table.vecScores.push_back(make_pair(9999, mn.vin));
+                continue;
+            }
         }
+
         uint256 n = mn.CalculateScore(1, nBlockHeight);
         int64_t n2 = n.GetCompact(false);
 
-        vecMasternodeScores.push_back(make_pair(n2, mn.vin));
+        table.vecScores.push_back(make_pair(n2, mn.vin));
     }
 
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreTxIn());
+    sort(table.vecScores.rbegin(), table.vecScores.rend(), CompareScoreTxIn());
 
-    int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(int64_t, CTxIn) & s, vecMasternodeScores) {
-        rank++;
-        if (s.second.prevout == vin.prevout) {
-            return rank;
-        }
-    }
+    for (unsigned int i = 0; i < table.vecScores.size(); i++)
+        table.mapRanks[table.vecScores[i].second.prevout] = i + 1;
 
-    return -1;
+    return &table;
 }
 
-std::vector<pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t nBlockHeight, int minProtocol)
+CMasternode* CMasternodeMan::GetCurrentMasterNode(int64_t nBlockHeight, int minProtocol)
 {
-    std::vector<pair<int64_t, CMasternode> > vecMasternodeScores;
-    std::vector<pair<int, CMasternode> > vecMasternodeRanks;
+    LOCK(cs);
 
-    //make sure we know about this block
-    uint256 hash = 0;
-    if (!GetBlockHash(hash, nBlockHeight)) return vecMasternodeRanks;
+    const CMasternodeRankTable* table = GetRankTable(nBlockHeight, minProtocol, CMasternodeRankTable::ONLY_ACTIVE);
+    if (table == NULL || table->vecScores.empty() || table->vecScores[0].first <= 0)
+        return NULL;
 
-    // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        mn.Check();
+    return Find(table->vecScores[0].second);
+}
 
-        if (mn.protocolVersion < minProtocol) continue;
+int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
+{
+    LOCK(cs);
 
-        if (!mn.IsEnabled()) {
-            vecMasternodeScores.push_back(make_pair(9999, mn));
-            continue;
-        }
+    const CMasternodeRankTable* table = GetRankTable(nBlockHeight, minProtocol, CMasternodeRankTable::MIN_AGE | (fOnlyActive ? CMasternodeRankTable::ONLY_ACTIVE : 0));
+    if (table == NULL) return -1;
 
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
+    std::map<COutPoint, int>::const_iterator it = table->mapRanks.find(vin.prevout);
+    if (it == table->mapRanks.end()) return -1;
 
-        vecMasternodeScores.push_back(make_pair(n2, mn));
-    }
+    return it->second;
+}
+
+std::vector<pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t nBlockHeight, int minProtocol)
+{
+    std::vector<pair<int, CMasternode> > vecMasternodeRanks;
+
+    LOCK(cs);
 
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreMN());
+    const CMasternodeRankTable* table = GetRankTable(nBlockHeight, minProtocol, CMasternodeRankTable::DISABLED_LAST);
+    if (table == NULL) return vecMasternodeRanks;
 
     int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(int64_t, CMasternode) & s, vecMasternodeScores) {
+    BOOST_FOREACH (const PAIRTYPE(int64_t, CTxIn) & s, table->vecScores) {
         rank++;
-        vecMasternodeRanks.push_back(make_pair(rank, s.second));
+        CMasternode* pmn = Find(s.second);
+        if (pmn != NULL)
+            vecMasternodeRanks.push_back(make_pair(rank, *pmn));
     }
 
     return vecMasternodeRanks;
 }
 
-CMasternode* CMasternodeMan::GetMasternodeByRank(int nRank, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
+bool CMasternodeMan::GetMasternodeQuorum(int64_t nBlockHeight, int minProtocol, unsigned int nCount, std::vector<CTxIn>& vecQuorum)
 {
-    std::vector<pair<int64_t, CTxIn> > vecMasternodeScores;
+    vecQuorum.clear();
 
-    // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        if (mn.protocolVersion < minProtocol) continue;
-        if (fOnlyActive) {
-            mn.Check();
-            if (!mn.IsEnabled()) continue;
-        }
+    LOCK(cs);
 
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
+    const CMasternodeRankTable* table = GetRankTable(nBlockHeight, minProtocol, CMasternodeRankTable::MIN_AGE | CMasternodeRankTable::ONLY_ACTIVE);
+    if (table == NULL) return false;
 
-        vecMasternodeScores.push_back(make_pair(n2, mn.vin));
-    }
+    for (unsigned int i = 0; i < nCount && i < table->vecScores.size(); i++)
+        vecQuorum.push_back(table->vecScores[i].second);
 
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreTxIn());
+    return true;
+}
 
-    int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(int64_t, CTxIn) & s, vecMasternodeScores) {
-        rank++;
-        if (rank == nRank) {
-            return Find(s.second);
-        }
-    }
+CMasternode* CMasternodeMan::GetMasternodeByRank(int nRank, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
+{
+    LOCK(cs);
 
-    return NULL;
+    const CMasternodeRankTable* table = GetRankTable(nBlockHeight, minProtocol, fOnlyActive ? CMasternodeRankTable::ONLY_ACTIVE : 0);
+    if (table == NULL || nRank < 1 || nRank > (int)table->vecScores.size())
+        return NULL;
+
+    return Find(table->vecScores[nRank - 1].second);
 }
 
 void CMasternodeMan::ProcessMasternodeConnections()
@@ -803,6 +941,15 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         vRecv >> vin;
 		LogPrint("masternode", "dseg - peer asked me for the masternode list\n");
 
+        // newer peers send the list version we last synced them, to get only what changed since
+        bool fVersioned = false;
+        uint256 hashListFrom = 0;
+        int64_t nVersionFrom = 0;
+        if (vin == CTxIn() && !vRecv.empty()) {
+            vRecv >> hashListFrom >> nVersionFrom;
+            fVersioned = true;
+        }
+
         if (vin == CTxIn()) { //only should ask for this once
             //local network
             bool isLocal = (pfrom->addr.IsRFC1918() || pfrom->addr.IsLocal());
@@ -822,32 +969,53 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
             }
         } //else, asking for a specific node which is ok
 
+        LOCK(cs);
+
+        std::vector<CMasternode*> vecToSend;
+        if (vin != CTxIn()) {
+            masternode_map_t::iterator it = mapMasternodes.find(vin.prevout);
+            if (it != mapMasternodes.end() && it->second.vin == vin)
+                vecToSend.push_back(&it->second);
+        } else if (fVersioned && hashListFrom == hashList) {
+            std::vector<COutPoint> vChanged;
+            listVersions.since(nVersionFrom, vChanged);
+            BOOST_FOREACH (const COutPoint& outpoint, vChanged) {
+                masternode_map_t::iterator it = mapMasternodes.find(outpoint);
+                if (it != mapMasternodes.end())
+                    vecToSend.push_back(&it->second);
+            }
+            LogPrint("masternode", "dseg - %u Masternode entries changed since list version %d\n", vChanged.size(), nVersionFrom);
+        } else {
+            for (masternode_map_t::iterator it = mapMasternodes.begin(); it != mapMasternodes.end(); ++it)
+                vecToSend.push_back(&it->second);
+        }
 
         int nInvCount = 0;
 
-        BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+        BOOST_FOREACH (CMasternode* pmn, vecToSend) {
+            CMasternode& mn = *pmn;
             if (mn.addr.IsRFC1918()) continue; //local network
 
             if (mn.IsEnabled()) {
                 LogPrint("masternode", "dseg - Sending Masternode entry - %s \n", mn.vin.prevout.hash.ToString());
-                if (vin == CTxIn() || vin == mn.vin) {
-                    CMasternodeBroadcast mnb = CMasternodeBroadcast(mn);
-                    uint256 hash = mnb.GetHash();
-                    pfrom->PushInventory(CInv(MSG_MASTERNODE_ANNOUNCE, hash));
-                    nInvCount++;
+                CMasternodeBroadcast mnb = CMasternodeBroadcast(mn);
+                uint256 hash = mnb.GetHash();
+                pfrom->PushInventory(CInv(MSG_MASTERNODE_ANNOUNCE, hash));
+                nInvCount++;
 
-                    if (!mapSeenMasternodeBroadcast.count(hash)) mapSeenMasternodeBroadcast.insert(make_pair(hash, mnb));
+                if (!mapSeenMasternodeBroadcast.count(hash)) mapSeenMasternodeBroadcast.insert(make_pair(hash, mnb));
 
-                    if (vin == mn.vin) {
-                        LogPrint("masternode", "dseg - Sent 1 Masternode entry to peer %i\n", pfrom->GetId());
-                        return;
-                    }
+                if (vin == mn.vin) {
+                    LogPrint("masternode", "dseg - Sent 1 Masternode entry to peer %i\n", pfrom->GetId());
+                    return;
                 }
             }
         }
 
         if (vin == CTxIn()) {
             pfrom->PushMessage("ssc", MASTERNODE_SYNC_LIST, nInvCount);
+            if (fVersioned)
+                pfrom->PushMessage("ssv", MASTERNODE_SYNC_LIST, hashList, listVersions.version());
             LogPrint("masternode", "dseg - Sent %d Masternode entries to peer %i\n", nInvCount, pfrom->GetId());
         }
     }
@@ -944,6 +1112,7 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
                     LogPrint("masternode", "dsee - Got updated entry for %s\n", vin.prevout.hash.ToString());
                     if (pmn->protocolVersion < GETHEADERS_VERSION) {
                         pmn->pubKeyMasternode = pubkey2;
+                        UpdateIndexes(*pmn);
                         pmn->sigTime = sigTime;
                         pmn->sig = vchSig;
                         pmn->protocolVersion = protocolVersion;
@@ -954,11 +1123,15 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
                     pmn->nLastDsee = sigTime;
                     pmn->Check();
                     if (pmn->IsEnabled()) {
+                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+                        ss << vin << addr << vchSig << sigTime << pubkey << pubkey2 << count << current << lastUpdated << protocolVersion << donationAddress << donationPercentage;
+                        CSerializedNetMsg msg = MakeNetMessage("dsee", ss);
+
                         TRY_LOCK(cs_vNodes, lockNodes);
                         if (!lockNodes) return;
                         BOOST_FOREACH (CNode* pnode, vNodes)
                             if (pnode->nVersion >= masternodePayments.GetMinMasternodePaymentsProto())
-                                pnode->PushMessage("dsee", vin, addr, vchSig, sigTime, pubkey, pubkey2, count, current, lastUpdated, protocolVersion, donationAddress, donationPercentage);
+                                pnode->PushSerializedMessage(msg);
                     }
                 }
             }
@@ -1042,12 +1215,19 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
                 LogPrint("masternode", "dsee - Accepted OLD Masternode entry %i %i\n", count, current);
                 Add(mn);
             }
+            // Check() started watching the collateral, only indexed entries keep it watched
+            if (!Find(vin))
+                mnCollateralWatch.Unwatch(vin.prevout);
             if (mn.IsEnabled()) {
+                CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+                ss << vin << addr << vchSig << sigTime << pubkey << pubkey2 << count << current << lastUpdated << protocolVersion << donationAddress << donationPercentage;
+                CSerializedNetMsg msg = MakeNetMessage("dsee", ss);
+
                 TRY_LOCK(cs_vNodes, lockNodes);
                 if (!lockNodes) return;
                 BOOST_FOREACH (CNode* pnode, vNodes)
                     if (pnode->nVersion >= masternodePayments.GetMinMasternodePaymentsProto())
-                        pnode->PushMessage("dsee", vin, addr, vchSig, sigTime, pubkey, pubkey2, count, current, lastUpdated, protocolVersion, donationAddress, donationPercentage);
+                        pnode->PushSerializedMessage(msg);
             }
         } else {
             LogPrint("masternode","dsee - Rejected Masternode entry %s\n", vin.prevout.hash.ToString());
@@ -1112,12 +1292,16 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
                 pmn->nLastDseep = sigTime;
                 pmn->Check();
                 if (pmn->IsEnabled()) {
+                    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+                    ss << vin << vchSig << sigTime << stop;
+                    CSerializedNetMsg msg = MakeNetMessage("dseep", ss);
+
                     TRY_LOCK(cs_vNodes, lockNodes);
                     if (!lockNodes) return;
                     LogPrint("masternode", "dseep - relaying %s \n", vin.prevout.hash.ToString());
                     BOOST_FOREACH (CNode* pnode, vNodes)
                         if (pnode->nVersion >= masternodePayments.GetMinMasternodePaymentsProto())
-                            pnode->PushMessage("dseep", vin, vchSig, sigTime, stop);
+                            pnode->PushSerializedMessage(msg);
                 }
             }
             return;
@@ -1133,18 +1317,96 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
      */
 }
 
+void CMasternodeMan::PrecheckSignatures(std::deque<CNetMessage>::iterator itBegin, std::deque<CNetMessage>::iterator itEnd)
+{
+    // Messages that already went into a batch; only the message handler thread gets here
+    static mruset<uint256> setPrechecked(MASTERNODES_SIGCHECK_BATCH * 4);
+
+    if (nMasternodeSigCheckThreads < 2 || itBegin == itEnd || setPrechecked.count(itBegin->GetMessageHash()))
+        return;
+    std::string strCommand = itBegin->hdr.GetCommand();
+    if (!IsSignedMasternodeMessage(strCommand))
+        return;
+
+    std::vector<CMessageSigCheck> vChecks;
+    int nMessages = 0;
+    for (std::deque<CNetMessage>::iterator it = itBegin; it != itEnd && nMessages < MASTERNODES_SIGCHECK_BATCH; ++it) {
+        if (!it->complete())
+            break;
+        strCommand = it->hdr.GetCommand();
+        if (!IsSignedMasternodeMessage(strCommand))
+            continue;
+        unsigned int nChecksum = 0;
+        memcpy(&nChecksum, &it->GetMessageHash(), sizeof(nChecksum));
+        if (nChecksum != it->hdr.nChecksum)
+            continue;
+
+        nMessages++;
+        setPrechecked.insert(it->GetMessageHash());
+
+        CDataStream vRecv(it->vRecv.begin(), it->vRecv.end(), it->vRecv.GetType(), it->vRecv.GetVersion());
+        try {
+            if (strCommand == "mnb") {
+                CMasternodeBroadcast mnb;
+                vRecv >> mnb;
+                vChecks.push_back(CMessageSigCheck(mnb.pubKeyCollateralAddress, mnb.sig, mnb.GetStrMessage()));
+
+                LOCK(cs);
+                CMasternode* pmn = Find(mnb.vin);
+                vChecks.push_back(CMessageSigCheck(pmn ? pmn->pubKeyMasternode : mnb.pubKeyMasternode, mnb.lastPing.vchSig, mnb.lastPing.GetStrMessage()));
+            } else if (strCommand == "mnp") {
+                CMasternodePing mnp;
+                vRecv >> mnp;
+
+                LOCK(cs);
+                CMasternode* pmn = Find(mnp.vin);
+                if (pmn)
+                    vChecks.push_back(CMessageSigCheck(pmn->pubKeyMasternode, mnp.vchSig, mnp.GetStrMessage()));
+            } else if (strCommand == "mnw") {
+                CMasternodePaymentWinner winner;
+                vRecv >> winner;
+
+                LOCK(cs);
+                CMasternode* pmn = Find(winner.vinMasternode);
+                if (pmn)
+                    vChecks.push_back(CMessageSigCheck(pmn->pubKeyMasternode, winner.vchSig, winner.GetStrMessage()));
+            } else {
+                CConsensusVote vote;
+                vRecv >> vote;
+
+                LOCK(cs);
+                CMasternode* pmn = Find(vote.vinMasternode);
+                if (pmn)
+                    vChecks.push_back(CMessageSigCheck(pmn->pubKeyMasternode, vote.vchMasterNodeSignature, vote.GetStrMessage()));
+            }
+        } catch (std::exception& e) {
+            // malformed, the handler will reject it
+        }
+    }
+
+    // The handler checks a lone signature just as fast
+    if (vChecks.size() < 2)
+        return;
+
+    size_t nChecks = vChecks.size();
+    int64_t nStart = GetTimeMicros();
+    CCheckQueueControl<CMessageSigCheck> control(&mnsigcheckqueue);
+    control.Add(vChecks);
+    control.Wait();
+    LogPrint("bench", "- Masternode message signatures: %u in %.2fms on %d threads\n", nChecks, (GetTimeMicros() - nStart) * 0.001, nMasternodeSigCheckThreads);
+}
+
 void CMasternodeMan::Remove(CTxIn vin)
 {
     LOCK(cs);
 
-    vector<CMasternode>::iterator it = vMasternodes.begin();
-    while (it != vMasternodes.end()) {
-        if ((*it).vin == vin) {
-            LogPrint("masternode", "CMasternodeMan: Removing Masternode %s - %i now\n", (*it).vin.prevout.hash.ToString(), size() - 1);
-            vMasternodes.erase(it);
-            break;
-        }
-        ++it;
+    masternode_map_t::iterator it = mapMasternodes.find(vin.prevout);
+    if (it != mapMasternodes.end() && it->second.vin == vin) {
+        LogPrint("masternode", "CMasternodeMan: Removing Masternode %s - %i now\n", it->second.vin.prevout.hash.ToString(), size() - 1);
+        UnindexMasternode(it->second);
+        mnCollateralWatch.Unwatch(it->second.vin.prevout);
+        mapMasternodes.erase(it);
+        mapRankTables.clear();
     }
 }
 
@@ -1163,6 +1425,8 @@ void CMasternodeMan::UpdateMasternodeList(CMasternodeBroadcast mnb)
             masternodeSync.AddedMasternodeList(mnb.GetHash());
         }
     } else if (pmn->UpdateFromNewBroadcast(mnb)) {
+        IndexMasternode(*pmn);
+        mapRankTables.clear();
         masternodeSync.AddedMasternodeList(mnb.GetHash());
     }
 }
@@ -1171,7 +1435,7 @@ std::string CMasternodeMan::ToString() const
 {
     std::ostringstream info;
 
-    info << "Masternodes: " << (int)vMasternodes.size() << ", peers who asked us for Masternode list: " << (int)mAskedUsForMasternodeList.size() << ", peers we asked for Masternode list: " << (int)mWeAskedForMasternodeList.size() << ", entries in Masternode list we asked for: " << (int)mWeAskedForMasternodeListEntry.size() << ", nDsqCount: " << (int)nDsqCount;
+    info << "Masternodes: " << (int)mapMasternodes.size() << ", peers who asked us for Masternode list: " << (int)mAskedUsForMasternodeList.size() << ", peers we asked for Masternode list: " << (int)mWeAskedForMasternodeList.size() << ", entries in Masternode list we asked for: " << (int)mWeAskedForMasternodeListEntry.size() << ", nDsqCount: " << (int)nDsqCount;
 
     return info.str();
 }
@@ -7,90 +7,169 @@
 #define MASTERNODEMAN_H
 
 #include "base58.h"
+#include "expirymap.h"
+#include "hash.h"
 #include "key.h"
 #include "main.h"
 #include "masternode.h"
+#include "masternode-sync.h"
+#include "masternodedb.h"
 #include "net.h"
 #include "sync.h"
 #include "util.h"
+#include "versionlog.h"
+
+#include <boost/unordered_map.hpp>
 
 #define MASTERNODES_DUMP_SECONDS (15 * 60)
 #define MASTERNODES_DSEG_SECONDS (3 * 60 * 60)
+#define MASTERNODES_RANK_CACHE_SIZE 16
+#define MASTERNODES_SIGCHECK_BATCH 128
+#define MASTERNODES_SIGCHECK_MAX_THREADS 8
+#define MASTERNODES_SEEN_MNB_MAX 50000
+#define MASTERNODES_SEEN_MNP_MAX 300000
+#define MASTERNODES_ASKED_MAX 20000
 
 using namespace std;
 
 class CMasternodeMan;
 
 extern CMasternodeMan mnodeman;
+/// Open the masternode cache and load it into mnodeman
+void LoadMasternodes();
+/// Write what changed in mnodeman to the masternode cache
 void DumpMasternodes();
-
-/** Access to the MN database (mncache.dat)
+/// Dump one last time and close the masternode cache
+void CloseMasternodes();
+/// Start the threads that verify batches of masternode message signatures
+void StartMasternodeSigCheckThreads(boost::thread_group& threadGroup);
+/// Worker thread of the masternode message signature queue
+void ThreadMasternodeSigCheck();
+
+/** Masternode list cache, one record per masternode, seen message and request map
  */
-class CMasternodeDB
+class CMasternodeDB : public CMasternodeStateDB
 {
 private:
-    boost::filesystem::path pathMN;
-    std::string strMagicMessage;
+    struct CLoader;
+    bool LoadRecord(CMasternodeMan& mnodemanToLoad, CDataStream& ssKey, CDataStream& ssValue);
+
+public:
+    CMasternodeDB(size_t nCacheSize, bool fWipe = false);
+    bool Write(const CMasternodeMan& mnodemanToSave);
+    void Read(CMasternodeMan& mnodemanToLoad);
+};
+
+/** Seen broadcasts are kept until their last ping is twice the removal time old */
+struct CMasternodeBroadcastExpiry {
+    int64_t operator()(const CMasternodeBroadcast& mnb) const { return mnb.lastPing.sigTime + MASTERNODE_REMOVAL_SECONDS * 2; }
+};
+
+/** Seen pings are kept until they are twice the removal time old */
+struct CMasternodePingExpiry {
+    int64_t operator()(const CMasternodePing& mnp) const { return mnp.sigTime + MASTERNODE_REMOVAL_SECONDS * 2; }
+};
+
+/** Salted hasher for the masternode registry and its indexes, peers can't aim collisions at one bucket */
+class CMasternodeIndexHasher
+{
+private:
+    uint64_t k0, k1;
+
+public:
+    CMasternodeIndexHasher();
+
+    size_t operator()(const COutPoint& outpoint) const
+    {
+        return SipHashUint256Extra(k0, k1, outpoint.hash, outpoint.n);
+    }
+    size_t operator()(const CPubKey& pubKey) const
+    {
+        return CSipHasher(k0, k1).Write(pubKey.begin(), pubKey.size()).Finalize();
+    }
+    size_t operator()(const CScript& script) const
+    {
+        return CSipHasher(k0, k1).Write(script.empty() ? NULL : &script[0], script.size()).Finalize();
+    }
+};
 
+/** Masternodes ordered by score for one block, built once and shared by the rank lookups
+ */
+class CMasternodeRankTable
+{
 public:
-    enum ReadResult {
-        Ok,
-        FileError,
-        HashReadError,
-        IncorrectHash,
-        IncorrectMagicMessage,
-        IncorrectMagicNumber,
-        IncorrectFormat
+    enum Flags {
+        ONLY_ACTIVE = (1 << 0),   //! leave out masternodes that aren't enabled
+        MIN_AGE = (1 << 1),       //! leave out masternodes younger than MN_WINNER_MINIMUM_AGE while payments are enforced
+        DISABLED_LAST = (1 << 2), //! keep masternodes that aren't enabled, behind the enabled ones
     };
 
-    CMasternodeDB();
-    bool Write(const CMasternodeMan& mnodemanToSave);
-    ReadResult Read(CMasternodeMan& mnodemanToLoad, bool fDryRun = false);
+    uint256 hashBlock;
+    int64_t nTimeCreated;
+    // best score first
+    std::vector<pair<int64_t, CTxIn> > vecScores;
+    std::map<COutPoint, int> mapRanks;
+
+    CMasternodeRankTable() : hashBlock(0), nTimeCreated(0) {}
 };
 
 class CMasternodeMan
 {
+public:
+    typedef boost::unordered_map<COutPoint, CMasternode, CMasternodeIndexHasher> masternode_map_t;
+    typedef boost::unordered_multimap<CPubKey, COutPoint, CMasternodeIndexHasher> pubkey_index_t;
+    typedef boost::unordered_multimap<CScript, COutPoint, CMasternodeIndexHasher> payee_index_t;
+    typedef expirymap<uint256, CMasternodeBroadcast, CMasternodeBroadcastExpiry> seen_mnb_map_t;
+    typedef expirymap<uint256, CMasternodePing, CMasternodePingExpiry> seen_mnp_map_t;
+
 private:
+    friend class CMasternodeDB;
+
     // critical section to protect the inner data structures
     mutable CCriticalSection cs;
 
     // critical section to protect the inner data structures specifically on messaging
     mutable CCriticalSection cs_process_message;
 
-    // map to hold all MNs
-    std::vector<CMasternode> vMasternodes;
-    // who's asked for the Masternode list and the last time
-    std::map<CNetAddr, int64_t> mAskedUsForMasternodeList;
-    // who we asked for the Masternode list and the last time
-    std::map<CNetAddr, int64_t> mWeAskedForMasternodeList;
-    // which Masternodes we've asked for
-    std::map<COutPoint, int64_t> mWeAskedForMasternodeListEntry;
+    // map to hold all MNs, by collateral outpoint. Entries don't move until
+    // they are removed, so the pointers handed out by Find() stay valid until then
+    masternode_map_t mapMasternodes;
+    // collateral outpoints by masternode key and by payee script; a key can
+    // change under an entry, so lookups check the entry still matches
+    pubkey_index_t mapByPubKey;
+    payee_index_t mapByPayee;
+    // who's asked for the Masternode list and when they may ask again
+    expirymap<CNetAddr, int64_t> mAskedUsForMasternodeList;
+    // who we asked for the Masternode list and when we may ask again
+    expirymap<CNetAddr, int64_t> mWeAskedForMasternodeList;
+    // which Masternodes we've asked for and when we may ask again
+    expirymap<COutPoint, int64_t> mWeAskedForMasternodeListEntry;
+    // how far each peer synced us its Masternode list
+    expirymap<CNetAddr, CMasternodeSyncVersion, CMasternodeSyncVersionExpiry> mapSyncedListVersions;
+
+    // identifies our list versions to peers, changes whenever they start over
+    uint256 hashList;
+    // collateral outpoints by the list version their broadcast last changed at
+    versionlog<COutPoint> listVersions;
+
+    // rank tables by height, minimum protocol and CMasternodeRankTable::Flags
+    std::map<pair<int64_t, pair<int, int> >, CMasternodeRankTable> mapRankTables;
+
+    void IndexMasternode(const CMasternode& mn);
+    void UnindexMasternode(const CMasternode& mn);
+
+    /// Rank table for the block at nBlockHeight, from cache while it's fresh. Needs cs.
+    const CMasternodeRankTable* GetRankTable(int64_t nBlockHeight, int minProtocol, int nFlags);
 
 public:
     // Keep track of all broadcasts I've seen
-    map<uint256, CMasternodeBroadcast> mapSeenMasternodeBroadcast;
+    seen_mnb_map_t mapSeenMasternodeBroadcast;
     // Keep track of all pings I've seen
-    map<uint256, CMasternodePing> mapSeenMasternodePing;
+    seen_mnp_map_t mapSeenMasternodePing;
 
     // keep track of dsq count to prevent masternodes from gaming obfuscation queue
     int64_t nDsqCount;
 
-    ADD_SERIALIZE_METHODS;
-
-    template <typename Stream, typename Operation>
-    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
-    {
-        LOCK(cs);
-        READWRITE(vMasternodes);
-        READWRITE(mAskedUsForMasternodeList);
-        READWRITE(mWeAskedForMasternodeList);
-        READWRITE(mWeAskedForMasternodeListEntry);
-        READWRITE(nDsqCount);
-
-        READWRITE(mapSeenMasternodeBroadcast);
-        READWRITE(mapSeenMasternodePing);
-    }
-
     CMasternodeMan();
     CMasternodeMan(CMasternodeMan& other);
 
@@ -113,7 +192,10 @@ public:
 
     void CountNetworks(int protocolVersion, int& ipv4, int& ipv6, int& onion);
 
+    /// Ask pnode for its Masternode list, or only what changed since it last synced us
     void DsegUpdate(CNode* pnode);
+    /// Remember how far the peer at addr synced us its list, once the list stage completed
+    void SetSyncVersion(const CNetAddr& addr, const CMasternodeSyncVersion& syncVersion);
 
     /// Find an entry
     CMasternode* Find(const CScript& payee);
@@ -127,24 +209,28 @@ public:
     CMasternode* FindRandomNotInVec(std::vector<CTxIn>& vecToExclude, int protocolVersion = -1);
 
     /// Get the current winner for this block
-    CMasternode* GetCurrentMasterNode(int mod = 1, int64_t nBlockHeight = 0, int minProtocol = 0);
+    CMasternode* GetCurrentMasterNode(int64_t nBlockHeight = 0, int minProtocol = 0);
 
-    std::vector<CMasternode> GetFullMasternodeVector()
-    {
-        Check();
-        return vMasternodes;
-    }
+    std::vector<CMasternode> GetFullMasternodeVector();
 
     std::vector<pair<int, CMasternode> > GetMasternodeRanks(int64_t nBlockHeight, int minProtocol = 0);
     int GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, int minProtocol = 0, bool fOnlyActive = true);
     CMasternode* GetMasternodeByRank(int nRank, int64_t nBlockHeight, int minProtocol = 0, bool fOnlyActive = true);
+    /// The nCount best ranked masternodes at nBlockHeight as GetMasternodeRank() ranks them, false if the block is unknown
+    bool GetMasternodeQuorum(int64_t nBlockHeight, int minProtocol, unsigned int nCount, std::vector<CTxIn>& vecQuorum);
 
     void ProcessMasternodeConnections();
 
     void ProcessMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
 
+    /**
+     * Verify the signatures of the mnb, mnp, mnw and txlvote messages waiting from itBegin on, in one
+     * batch on the signature check threads, so they are found valid in the signature cache once their turn comes
+     */
+    void PrecheckSignatures(std::deque<CNetMessage>::iterator itBegin, std::deque<CNetMessage>::iterator itEnd);
+
     /// Return the number of (unique) Masternodes
-    int size() { return vMasternodes.size(); }
+    int size() { return mapMasternodes.size(); }
 
     /// Return the number of Masternodes older than (default) 8000 seconds
     int stable_size ();
@@ -153,6 +239,9 @@ public:
 
     void Remove(CTxIn vin);
 
+    /// Reindex an entry and drop cached ranks, call after updating it in place (e.g. from a new broadcast)
+    void UpdateIndexes(const CMasternode& mn);
+
     /// Update masternode list and maps using provided CMasternodeBroadcast
     void UpdateMasternodeList(CMasternodeBroadcast mnb);
 };
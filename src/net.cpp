@@ -34,12 +34,19 @@
 #include <miniupnpc/upnperrors.h>
 #endif
 
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
 #include <boost/filesystem.hpp>
 #include <boost/thread.hpp>
 
 // Dump addresses to peers.dat every 15 minutes (900s)
 #define DUMP_ADDRESSES_INTERVAL 900
 
+// A message body is allocated at most this far ahead of the data received for it
+#define RECV_ALLOC_AHEAD (256 * 1024)
+
 #if !defined(HAVE_MSG_NOSIGNAL) && !defined(MSG_NOSIGNAL)
 #define MSG_NOSIGNAL 0
 #endif
@@ -88,7 +95,7 @@ bool fAddressesInitialized = false;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
+map<CInv, CSerializedNetMsg> mapRelay;
 deque<pair<int64_t, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
 limitedmap<CInv, int64_t> mapAlreadyAskedFor(MAX_INV_SZ);
@@ -341,6 +348,7 @@ uint64_t CNode::nTotalBytesRecv = 0;
 uint64_t CNode::nTotalBytesSent = 0;
 CCriticalSection CNode::cs_totalBytesRecv;
 CCriticalSection CNode::cs_totalBytesSent;
+CNetMsgTypeCounters CNode::msgTypeTotals[NUM_NET_MSG_TYPES];
 
 CNode* FindNode(const CNetAddr& ip)
 {
@@ -385,6 +393,50 @@ CNode* FindNode(const CService& addr)
     return NULL;
 }
 
+#ifdef USE_EPOLL
+//! epoll instance ThreadSocketHandler waits on, or -1 when it uses select()
+static int hEpollSocket = -1;
+
+//! Nodes with readiness not yet acted on; only touched by the socket handler thread
+static std::set<CNode*> setNodesRecvReady;
+static std::set<CNode*> setNodesSendReady;
+
+//! Most readiness events taken from the kernel per epoll_wait()
+static const int MAX_EPOLL_EVENTS = 256;
+#endif
+
+/** Whether ThreadSocketHandler can service this socket */
+static bool IsServiceableSocket(SOCKET hSocket)
+{
+#ifdef USE_EPOLL
+    if (hEpollSocket != -1)
+        return true;
+#endif
+    return IsSelectableSocket(hSocket);
+}
+
+/**
+ * Register a socket with the socket handler's epoll instance, if there is one.
+ * Peers are registered once for both directions and edge-triggered; listening
+ * sockets are level-triggered so one accept per wakeup is enough.
+ */
+static bool WatchSocket(SOCKET hSocket, void* pdata, bool fEdgeTriggered)
+{
+#ifdef USE_EPOLL
+    if (hEpollSocket == -1)
+        return true;
+
+    struct epoll_event event;
+    event.events = fEdgeTriggered ? (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET) : EPOLLIN;
+    event.data.ptr = pdata;
+    if (epoll_ctl(hEpollSocket, EPOLL_CTL_ADD, hSocket, &event) != 0) {
+        LogPrintf("socket epoll_ctl error %s\n", NetworkErrorString(errno));
+        return false;
+    }
+#endif
+    return true;
+}
+
 CNode* ConnectNode(CAddress addrConnect, const char* pszDest, bool obfuScationMaster)
 {
     if (pszDest == NULL) {
@@ -413,7 +465,7 @@ CNode* ConnectNode(CAddress addrConnect, const char* pszDest, bool obfuScationMa
     bool proxyConnectionFailed = false;
     if (pszDest ? ConnectSocketByName(addrConnect, hSocket, pszDest, Params().GetDefaultPort(), nConnectTimeout, &proxyConnectionFailed) :
                   ConnectSocket(addrConnect, hSocket, nConnectTimeout, &proxyConnectionFailed)) {
-        if (!IsSelectableSocket(hSocket)) {
+        if (!IsServiceableSocket(hSocket)) {
             LogPrintf("Cannot create connection: non-selectable socket created (fd >= FD_SETSIZE ?)\n");
             CloseSocket(hSocket);
             return NULL;
@@ -429,6 +481,8 @@ CNode* ConnectNode(CAddress addrConnect, const char* pszDest, bool obfuScationMa
             LOCK(cs_vNodes);
             vNodes.push_back(pnode);
         }
+        if (!WatchSocket(hSocket, pnode, true))
+            pnode->fDisconnect = true;
 
         pnode->nTimeConnected = GetTime();
         if (obfuScationMaster) pnode->fObfuScationMaster = true;
@@ -691,16 +745,23 @@ void CNode::copyStats(CNodeStats& stats)
     // So, if a ping is taking an unusually long time in flight,
     // the caller can immediately detect that this is happening.
     int64_t nPingUsecWait = 0;
-    if ((0 != nPingNonceSent) && (0 != nPingUsecStart)) {
-        nPingUsecWait = GetTimeMicros() - nPingUsecStart;
-    }
+    {
+        LOCK(cs_ping);
+        if ((0 != nPingNonceSent) && (0 != nPingUsecStart)) {
+            nPingUsecWait = GetTimeMicros() - nPingUsecStart;
+        }
 
-    // Raw ping time is in microseconds, but show it to user as whole seconds (Uidd users should be well used to small numbers with many decimal places by now :)
-    stats.dPingTime = (((double)nPingUsecTime) / 1e6);
+        // Raw ping time is in microseconds, but show it to user as whole seconds (Uidd users should be well used to small numbers with many decimal places by now :)
+        stats.dPingTime = (((double)nPingUsecTime) / 1e6);
+    }
     stats.dPingWait = (((double)nPingUsecWait) / 1e6);
 
     // Leave string empty if addrLocal invalid (not filled in yet)
     stats.addrLocal = addrLocal.IsValid() ? addrLocal.ToString() : "";
+
+    stats.vMsgTypeStats.resize(NUM_NET_MSG_TYPES);
+    for (unsigned int i = 0; i < NUM_NET_MSG_TYPES; i++)
+        msgTypeCounters[i].Get(stats.vMsgTypeStats[i]);
 }
 #undef X
 
@@ -733,15 +794,44 @@ bool CNode::ReceiveMsgBytes(const char* pch, unsigned int nBytes)
         pch += handled;
         nBytes -= handled;
 
-        if (msg.complete()) {
-            msg.nTime = GetTimeMicros();
-            messageHandlerCondition.notify_one();
-        }
+        if (msg.complete())
+            MessageComplete(msg);
     }
 
     return true;
 }
 
+char* CNode::GetRecvBuffer(unsigned int nMinSize, unsigned int& nSize)
+{
+    if (vRecvMsg.empty() || !vRecvMsg.back().in_data || vRecvMsg.back().complete())
+        return NULL;
+
+    CNetMessage& msg = vRecvMsg.back();
+    if (msg.hdr.nMessageSize - msg.nDataPos < nMinSize)
+        return NULL;
+    // Don't trust the declared size, only grow the body as data actually arrives
+    nSize = std::min(msg.hdr.nMessageSize - msg.nDataPos, (unsigned int)RECV_ALLOC_AHEAD);
+    return msg.prepareData(nSize);
+}
+
+void CNode::RecvBufferFilled(unsigned int nBytes)
+{
+    CNetMessage& msg = vRecvMsg.back();
+    msg.commitData(nBytes);
+    if (msg.complete())
+        MessageComplete(msg);
+}
+
+void CNode::MessageComplete(CNetMessage& msg)
+{
+    msg.nTime = GetTimeMicros();
+    msg.nMsgType = GetNetMsgTypeIndex(msg.hdr.GetCommand());
+    uint64_t nBytes = msg.hdr.nMessageSize + CMessageHeader::HEADER_SIZE;
+    msgTypeCounters[msg.nMsgType].AddRecv(nBytes);
+    msgTypeTotals[msg.nMsgType].AddRecv(nBytes);
+    messageHandlerCondition.notify_one();
+}
+
 int CNetMessage::readHeader(const char* pch, unsigned int nBytes)
 {
     // copy data to temporary parsing buffer
@@ -768,34 +858,54 @@ int CNetMessage::readHeader(const char* pch, unsigned int nBytes)
 
     // switch state to reading message data
     in_data = true;
+    if (complete())
+        hasher.Finalize(data_hash.begin());
 
     return nCopy;
 }
 
 int CNetMessage::readData(const char* pch, unsigned int nBytes)
+{
+    unsigned int nCopy = nBytes;
+    char* pchDest = prepareData(nCopy);
+    memcpy(pchDest, pch, nCopy);
+    commitData(nCopy);
+
+    return nCopy;
+}
+
+char* CNetMessage::prepareData(unsigned int& nSize)
 {
     unsigned int nRemaining = hdr.nMessageSize - nDataPos;
-    unsigned int nCopy = std::min(nRemaining, nBytes);
+    unsigned int nWant = std::min(nRemaining, nSize);
 
-    if (vRecv.size() < nDataPos + nCopy) {
+    if (vRecv.size() < nDataPos + nWant) {
         // Allocate up to 256 KiB ahead, but never more than the total message size.
-        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
+        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + std::max(nWant, (unsigned int)RECV_ALLOC_AHEAD)));
     }
 
-    memcpy(&vRecv[nDataPos], pch, nCopy);
-    nDataPos += nCopy;
+    nSize = std::min(nRemaining, (unsigned int)vRecv.size() - nDataPos);
+    return &vRecv[nDataPos];
+}
 
-    return nCopy;
+void CNetMessage::commitData(unsigned int nBytes)
+{
+    if (nBytes == 0)
+        return;
+    hasher.Write((const unsigned char*)&vRecv[nDataPos], nBytes);
+    nDataPos += nBytes;
+    if (complete())
+        hasher.Finalize(data_hash.begin());
 }
 
 
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode* pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    std::deque<CSerializedNetMsg>::iterator it = pnode->vSendMsg.begin();
 
     while (it != pnode->vSendMsg.end()) {
-        const CSerializeData& data = *it;
+        const CSerializeData& data = **it;
         assert(data.size() > pnode->nSendOffset);
         int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
         if (nBytes > 0) {
@@ -834,71 +944,341 @@ void SocketSendData(CNode* pnode)
 
 static list<CNode*> vNodesDisconnected;
 
-void ThreadSocketHandler()
+static void DisconnectNodes(unsigned int& nPrevNodeCount)
 {
-    unsigned int nPrevNodeCount = 0;
-    while (true) {
-        //
-        // Disconnect nodes
-        //
-        {
-            LOCK(cs_vNodes);
-            // Disconnect unused nodes
-            vector<CNode*> vNodesCopy = vNodes;
-            BOOST_FOREACH (CNode* pnode, vNodesCopy) {
-                if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty())) {
-                    // remove from vNodes
-                    vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+    //
+    // Disconnect nodes
+    //
+    {
+        LOCK(cs_vNodes);
+        // Disconnect unused nodes
+        vector<CNode*> vNodesCopy = vNodes;
+        BOOST_FOREACH (CNode* pnode, vNodesCopy) {
+            if (pnode->fDisconnect ||
+                (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty())) {
+                // remove from vNodes
+                vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+#ifdef USE_EPOLL
+                setNodesRecvReady.erase(pnode);
+                setNodesSendReady.erase(pnode);
+#endif
 
-                    // release outbound grant (if any)
-                    pnode->grantOutbound.Release();
+                // release outbound grant (if any)
+                pnode->grantOutbound.Release();
 
-                    // close socket and cleanup
-                    pnode->CloseSocketDisconnect();
+                // close socket and cleanup
+                pnode->CloseSocketDisconnect();
 
-                    // hold in disconnected pool until all refs are released
-                    if (pnode->fNetworkNode || pnode->fInbound)
-                        pnode->Release();
-                    vNodesDisconnected.push_back(pnode);
-                }
+                // hold in disconnected pool until all refs are released
+                if (pnode->fNetworkNode || pnode->fInbound)
+                    pnode->Release();
+                vNodesDisconnected.push_back(pnode);
             }
         }
-        {
-            // Delete disconnected nodes
-            list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
-            BOOST_FOREACH (CNode* pnode, vNodesDisconnectedCopy) {
-                // wait until threads are done using it
-                if (pnode->GetRefCount() <= 0) {
-                    bool fDelete = false;
-                    {
-                        TRY_LOCK(pnode->cs_vSend, lockSend);
-                        if (lockSend) {
-                            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                            if (lockRecv) {
-                                TRY_LOCK(pnode->cs_inventory, lockInv);
-                                if (lockInv)
-                                    fDelete = true;
-                            }
+    }
+    {
+        // Delete disconnected nodes
+        list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
+        BOOST_FOREACH (CNode* pnode, vNodesDisconnectedCopy) {
+            // wait until threads are done using it
+            if (pnode->GetRefCount() <= 0) {
+                bool fDelete = false;
+                {
+                    TRY_LOCK(pnode->cs_vSend, lockSend);
+                    if (lockSend) {
+                        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                        if (lockRecv) {
+                            TRY_LOCK(pnode->cs_inventory, lockInv);
+                            if (lockInv)
+                                fDelete = true;
                         }
                     }
-                    if (fDelete) {
-                        vNodesDisconnected.remove(pnode);
-                        delete pnode;
-                    }
+                }
+                if (fDelete) {
+                    vNodesDisconnected.remove(pnode);
+                    delete pnode;
                 }
             }
         }
-        size_t vNodesSize;
+    }
+    size_t vNodesSize;
+    {
+        LOCK(cs_vNodes);
+        vNodesSize = vNodes.size();
+    }
+    if(vNodesSize != nPrevNodeCount) {
+        nPrevNodeCount = vNodesSize;
+        uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+    }
+}
+
+static void AcceptConnection(const ListenSocket& hListenSocket)
+{
+    struct sockaddr_storage sockaddr;
+    socklen_t len = sizeof(sockaddr);
+    SOCKET hSocket = accept(hListenSocket.socket, (struct sockaddr*)&sockaddr, &len);
+    CAddress addr;
+    int nInbound = 0;
+
+    if (hSocket != INVALID_SOCKET)
+        if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
+            LogPrintf("Warning: Unknown socket family\n");
+
+    bool whitelisted = hListenSocket.whitelisted || CNode::IsWhitelistedRange(addr);
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH (CNode* pnode, vNodes)
+            if (pnode->fInbound)
+                nInbound++;
+    }
+
+    if (hSocket == INVALID_SOCKET) {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK)
+            LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
+    } else if (!IsServiceableSocket(hSocket)) {
+        LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
+        CloseSocket(hSocket);
+    } else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS) {
+        LogPrint("net", "connection from %s dropped (full)\n", addr.ToString());
+        CloseSocket(hSocket);
+    } else if (CNode::IsBanned(addr) && !whitelisted) {
+        LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
+        CloseSocket(hSocket);
+    } else {
+        CNode* pnode = new CNode(hSocket, addr, "", true);
+        pnode->AddRef();
+        pnode->fWhitelisted = whitelisted;
+
         {
             LOCK(cs_vNodes);
-            vNodesSize = vNodes.size();
+            vNodes.push_back(pnode);
+        }
+        if (!WatchSocket(hSocket, pnode, true))
+            pnode->fDisconnect = true;
+    }
+}
+
+/**
+ * Read one buffer's worth from the node's socket.
+ * Returns 1 if there may be more to read, 0 once the socket would block,
+ * and -1 if the connection was closed.
+ */
+// requires LOCK(cs_vRecvMsg)
+static int SocketRecvData(CNode* pnode)
+{
+    // typical socket buffer is 8K-64K
+    char pchBuf[0x10000];
+    // The rest of a large message body goes straight into the message
+    unsigned int nDirect = 0;
+    char* pchDirect = pnode->GetRecvBuffer(sizeof(pchBuf), nDirect);
+    int nBytes = pchDirect ? recv(pnode->hSocket, pchDirect, nDirect, MSG_DONTWAIT) : recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+    if (nBytes > 0) {
+        if (pchDirect)
+            pnode->RecvBufferFilled(nBytes);
+        else if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+            pnode->CloseSocketDisconnect();
+        pnode->nLastRecv = GetTime();
+        pnode->nRecvBytes += nBytes;
+        pnode->RecordBytesRecv(nBytes);
+        return 1;
+    } else if (nBytes == 0) {
+        // socket closed gracefully
+        if (!pnode->fDisconnect)
+            LogPrint("net", "socket closed\n");
+        pnode->CloseSocketDisconnect();
+        return -1;
+    }
+
+    // error
+    int nErr = WSAGetLastError();
+    if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS) {
+        if (!pnode->fDisconnect)
+            LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
+        pnode->CloseSocketDisconnect();
+        return -1;
+    }
+    return nErr == WSAEWOULDBLOCK ? 0 : 1;
+}
+
+/** Whether the node has room for more received data; requires LOCK(cs_vRecvMsg) */
+static bool CanReceive(CNode* pnode)
+{
+    return pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+           pnode->GetTotalRecvSize() <= ReceiveFloodSize();
+}
+
+static void InactivityCheck(CNode* pnode)
+{
+    int64_t nTime = GetTime();
+    if (nTime - pnode->nTimeConnected > 60) {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0) {
+            LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
+            pnode->fDisconnect = true;
+        } else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL) {
+            LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
+            pnode->fDisconnect = true;
+        } else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90 * 60)) {
+            LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
+            pnode->fDisconnect = true;
+        } else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros()) {
+            LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
+            pnode->fDisconnect = true;
+        }
+    }
+}
+
+#ifdef USE_EPOLL
+static const ListenSocket* FindListenSocket(const void* pdata)
+{
+    BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket)
+        if (&hListenSocket == pdata)
+            return &hListenSocket;
+    return NULL;
+}
+
+/**
+ * Socket loop on top of epoll. Peers are registered once when they connect and
+ * closing their socket unregisters them, so nothing is rebuilt per iteration.
+ * vNodes is only walked by the once-a-second sweep, which also drops the peers
+ * marked for disconnection.
+ * Readiness is edge-triggered: a node stays in setNodesRecvReady until recv()
+ * would block, and in setNodesSendReady until its queued data has been handed
+ * to SocketSendData(), which other threads also call directly.
+ */
+static void ThreadSocketHandlerEpoll()
+{
+    unsigned int nPrevNodeCount = 0;
+    int64_t nLastSweep = 0;
+    bool fProgress = false;
+    struct epoll_event vEvents[MAX_EPOLL_EVENTS];
+
+    while (true) {
+        // Don't wait if the last pass still had data to read
+        int nEvents = epoll_wait(hEpollSocket, vEvents, MAX_EPOLL_EVENTS, fProgress ? 0 : 50);
+        boost::this_thread::interruption_point();
+
+        if (nEvents < 0) {
+            int nErr = errno;
+            if (nErr != EINTR) {
+                LogPrintf("socket epoll_wait error %s\n", NetworkErrorString(nErr));
+                MilliSleep(50);
+            }
+            nEvents = 0;
+        }
+
+        for (int i = 0; i < nEvents; i++) {
+            const ListenSocket* pListenSocket = FindListenSocket(vEvents[i].data.ptr);
+            if (pListenSocket) {
+                AcceptConnection(*pListenSocket);
+                continue;
+            }
+
+            CNode* pnode = (CNode*)vEvents[i].data.ptr;
+            if (vEvents[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP))
+                setNodesRecvReady.insert(pnode);
+            if (vEvents[i].events & EPOLLOUT)
+                setNodesSendReady.insert(pnode);
         }
-        if(vNodesSize != nPrevNodeCount) {
-            nPrevNodeCount = vNodesSize;
-            uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+
+        //
+        // Send
+        //
+        for (std::set<CNode*>::iterator it = setNodesSendReady.begin(); it != setNodesSendReady.end();) {
+            CNode* pnode = *it;
+            if (pnode->hSocket != INVALID_SOCKET) {
+                TRY_LOCK(pnode->cs_vSend, lockSend);
+                if (!lockSend) {
+                    ++it;
+                    continue;
+                }
+                if (!pnode->vSendMsg.empty())
+                    SocketSendData(pnode);
+            }
+            setNodesSendReady.erase(it++);
         }
 
+        //
+        // Receive
+        //
+        fProgress = false;
+        for (std::set<CNode*>::iterator it = setNodesRecvReady.begin(); it != setNodesRecvReady.end();) {
+            boost::this_thread::interruption_point();
+
+            CNode* pnode = *it;
+            if (pnode->hSocket == INVALID_SOCKET) {
+                setNodesRecvReady.erase(it++);
+                continue;
+            }
+            {
+                // As in the select() loop, drain the write buffer before receiving more
+                TRY_LOCK(pnode->cs_vSend, lockSend);
+                if (lockSend && !pnode->vSendMsg.empty()) {
+                    ++it;
+                    continue;
+                }
+            }
+            int nResult = 1;
+            {
+                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                if (lockRecv && CanReceive(pnode)) {
+                    nResult = SocketRecvData(pnode);
+                    fProgress |= (nResult > 0);
+                }
+            }
+            if (nResult > 0)
+                ++it;
+            else
+                setNodesRecvReady.erase(it++);
+        }
+
+        //
+        // Disconnects, inactivity checking, and a sweep for queued data whose
+        // send attempt failed without leaving the socket blocked (EINTR)
+        //
+        int64_t nNow = GetTime();
+        if (nNow != nLastSweep) {
+            nLastSweep = nNow;
+            DisconnectNodes(nPrevNodeCount);
+
+            vector<CNode*> vNodesCopy;
+            {
+                LOCK(cs_vNodes);
+                vNodesCopy = vNodes;
+                BOOST_FOREACH (CNode* pnode, vNodesCopy)
+                    pnode->AddRef();
+            }
+            BOOST_FOREACH (CNode* pnode, vNodesCopy) {
+                if (pnode->hSocket == INVALID_SOCKET)
+                    continue;
+                {
+                    TRY_LOCK(pnode->cs_vSend, lockSend);
+                    if (lockSend && !pnode->vSendMsg.empty())
+                        setNodesSendReady.insert(pnode);
+                }
+                InactivityCheck(pnode);
+            }
+            {
+                LOCK(cs_vNodes);
+                BOOST_FOREACH (CNode* pnode, vNodesCopy)
+                    pnode->Release();
+            }
+        }
+    }
+}
+#endif
+
+void ThreadSocketHandler()
+{
+#ifdef USE_EPOLL
+    if (hEpollSocket != -1)
+        return ThreadSocketHandlerEpoll();
+#endif
+
+    unsigned int nPrevNodeCount = 0;
+    while (true) {
+        DisconnectNodes(nPrevNodeCount);
+
         //
         // Find which sockets have data to receive
         //
@@ -954,8 +1334,7 @@ void ThreadSocketHandler()
                 }
                 {
                     TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
+                    if (lockRecv && CanReceive(pnode))
                         FD_SET(pnode->hSocket, &fdsetRecv);
                 }
             }
@@ -981,49 +1360,8 @@ void ThreadSocketHandler()
         // Accept new connections
         //
         BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
-            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv)) {
-                struct sockaddr_storage sockaddr;
-                socklen_t len = sizeof(sockaddr);
-                SOCKET hSocket = accept(hListenSocket.socket, (struct sockaddr*)&sockaddr, &len);
-                CAddress addr;
-                int nInbound = 0;
-
-                if (hSocket != INVALID_SOCKET)
-                    if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
-                        LogPrintf("Warning: Unknown socket family\n");
-
-                bool whitelisted = hListenSocket.whitelisted || CNode::IsWhitelistedRange(addr);
-                {
-                    LOCK(cs_vNodes);
-                    BOOST_FOREACH (CNode* pnode, vNodes)
-                        if (pnode->fInbound)
-                            nInbound++;
-                }
-
-                if (hSocket == INVALID_SOCKET) {
-                    int nErr = WSAGetLastError();
-                    if (nErr != WSAEWOULDBLOCK)
-                        LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
-                } else if (!IsSelectableSocket(hSocket)) {
-                    LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
-                    CloseSocket(hSocket);
-                } else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS) {
-                    LogPrint("net", "connection from %s dropped (full)\n", addr.ToString());
-                    CloseSocket(hSocket);
-                } else if (CNode::IsBanned(addr) && !whitelisted) {
-                    LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
-                    CloseSocket(hSocket);
-                } else {
-                    CNode* pnode = new CNode(hSocket, addr, "", true);
-                    pnode->AddRef();
-                    pnode->fWhitelisted = whitelisted;
-
-                    {
-                        LOCK(cs_vNodes);
-                        vNodes.push_back(pnode);
-                    }
-                }
-            }
+            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
+                AcceptConnection(hListenSocket);
         }
 
         //
@@ -1046,33 +1384,8 @@ void ThreadSocketHandler()
                 continue;
             if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError)) {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv) {
-                    {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0) {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
-                                pnode->CloseSocketDisconnect();
-                            pnode->nLastRecv = GetTime();
-                            pnode->nRecvBytes += nBytes;
-                            pnode->RecordBytesRecv(nBytes);
-                        } else if (nBytes == 0) {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                LogPrint("net", "socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        } else if (nBytes < 0) {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS) {
-                                if (!pnode->fDisconnect)
-                                    LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-                }
+                if (lockRecv)
+                    SocketRecvData(pnode);
             }
 
             //
@@ -1089,22 +1402,7 @@ void ThreadSocketHandler()
             //
             // Inactivity checking
             //
-            int64_t nTime = GetTime();
-            if (nTime - pnode->nTimeConnected > 60) {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0) {
-                    LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
-                    pnode->fDisconnect = true;
-                } else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL) {
-                    LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
-                    pnode->fDisconnect = true;
-                } else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90 * 60)) {
-                    LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
-                    pnode->fDisconnect = true;
-                } else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros()) {
-                    LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
-                    pnode->fDisconnect = true;
-                }
-            }
+            InactivityCheck(pnode);
         }
         {
             LOCK(cs_vNodes);
@@ -1751,6 +2049,16 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
     // Map ports with UPnP
     MapPort(GetBoolArg("-upnp", DEFAULT_UPNP));
 
+#ifdef USE_EPOLL
+    if (GetBoolArg("-useepoll", DEFAULT_USE_EPOLL)) {
+        hEpollSocket = epoll_create1(EPOLL_CLOEXEC);
+        if (hEpollSocket == -1)
+            LogPrintf("epoll_create1 failed (%s), falling back to select()\n", NetworkErrorString(errno));
+        BOOST_FOREACH (ListenSocket& hListenSocket, vhListenSocket)
+            WatchSocket(hListenSocket.socket, &hListenSocket, false);
+    }
+#endif
+
     // Send and receive from sockets, accept connections
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "net", &ThreadSocketHandler));
 
@@ -1811,6 +2119,12 @@ public:
         vNodes.clear();
         vNodesDisconnected.clear();
         vhListenSocket.clear();
+#ifdef USE_EPOLL
+        if (hEpollSocket != -1) {
+            close(hEpollSocket);
+            hEpollSocket = -1;
+        }
+#endif
         delete semOutbound;
         semOutbound = NULL;
         delete pnodeLocalHost;
@@ -1850,8 +2164,9 @@ void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
             vRelayExpiration.pop_front();
         }
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
+        // Save original serialized message so newer versions are preserved,
+        // finished once so every peer that asks is sent the same buffer
+        mapRelay.insert(std::make_pair(inv, MakeNetMessage("tx", ss)));
         vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
     }
     LOCK(cs_vNodes);
@@ -1869,7 +2184,7 @@ void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
 
 void RelayTransactionLockReq(const CTransaction& tx, bool relayToAll)
 {
-    CInv inv(MSG_TXLOCK_REQUEST, tx.GetHash());
+    CSerializedNetMsg msg = MakeNetMessage("ix", tx);
 
     //broadcast the new lock
     LOCK(cs_vNodes);
@@ -1877,7 +2192,7 @@ void RelayTransactionLockReq(const CTransaction& tx, bool relayToAll)
         if (!relayToAll && !pnode->fRelayTxes)
             continue;
 
-        pnode->PushMessage("ix", tx);
+        pnode->PushSerializedMessage(msg);
     }
 }
 
@@ -1915,6 +2230,28 @@ uint64_t CNode::GetTotalBytesSent()
     return nTotalBytesSent;
 }
 
+void CNode::RecordMsgProcessed(unsigned int nMsgType, int64_t nMicros)
+{
+    msgTypeCounters[nMsgType].AddProcessTime(nMicros);
+    msgTypeTotals[nMsgType].AddProcessTime(nMicros);
+}
+
+void CNode::GetTotalMsgTypeStats(std::vector<CNetMsgTypeStats>& vStats)
+{
+    vStats.resize(NUM_NET_MSG_TYPES);
+    for (unsigned int i = 0; i < NUM_NET_MSG_TYPES; i++)
+        msgTypeTotals[i].Get(vStats[i]);
+}
+
+void CNetMsgTypeCounters::Get(CNetMsgTypeStats& stats) const
+{
+    stats.nSendBytes = nSendBytes.load(std::memory_order_relaxed);
+    stats.nSendMsgs = nSendMsgs.load(std::memory_order_relaxed);
+    stats.nRecvBytes = nRecvBytes.load(std::memory_order_relaxed);
+    stats.nRecvMsgs = nRecvMsgs.load(std::memory_order_relaxed);
+    stats.nProcessMicros = nProcessMicros.load(std::memory_order_relaxed);
+}
+
 void CNode::Fuzz(int nChance)
 {
     if (!fSuccessfullyConnected) return; // Don't fuzz initial handshake
@@ -1965,19 +2302,20 @@ bool CAddrDB::Write(const CAddrMan& addr)
     GetRandBytes((unsigned char*)&randv, sizeof(randv));
     std::string tmpfn = strprintf("peers.dat.%04x", randv);
 
-    // serialize addresses, checksum data up to that point, then append csum
+    // serialize addresses, checksum data up to that point, then append csum.
+    // Only the serialization holds the addrman lock; hashing and disk I/O don't.
     CDataStream ssPeers(SER_DISK, CLIENT_VERSION);
     ssPeers << FLATDATA(Params().MessageStart());
     ssPeers << addr;
     uint256 hash = Hash(ssPeers.begin(), ssPeers.end());
     ssPeers << hash;
 
-    // open output file, and associate with CAutoFile
-    boost::filesystem::path pathAddr = GetDataDir() / "peers.dat";
-    FILE* file = fopen(pathAddr.string().c_str(), "wb");
+    // open temp output file, and associate with CAutoFile
+    boost::filesystem::path pathTmp = GetDataDir() / tmpfn;
+    FILE* file = fopen(pathTmp.string().c_str(), "wb");
     CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
     if (fileout.IsNull())
-        return error("%s : Failed to open file %s", __func__, pathAddr.string());
+        return error("%s : Failed to open file %s", __func__, pathTmp.string());
 
     // Write and commit header, data
     try {
@@ -1988,6 +2326,10 @@ bool CAddrDB::Write(const CAddrMan& addr)
     FileCommit(fileout.Get());
     fileout.fclose();
 
+    // replace existing peers.dat, if any, with new peers.dat.XXXX
+    if (!RenameOver(pathTmp, pathAddr))
+        return error("%s : Rename-into-place failed", __func__);
+
     return true;
 }
 
@@ -2046,7 +2388,10 @@ bool CAddrDB::Read(CAddrMan& addr)
 unsigned int ReceiveFloodSize() { return 1000 * GetArg("-maxreceivebuffer", 5 * 1000); }
 unsigned int SendBufferSize() { return 1000 * GetArg("-maxsendbuffer", 1 * 1000); }
 
-CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fInboundIn) : ssSend(SER_NETWORK, INIT_PROTO_VERSION), setAddrKnown(5000)
+CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fInboundIn) : ssSend(SER_NETWORK, INIT_PROTO_VERSION),
+                                                                                          filterAddrKnown(ADDR_KNOWN_WINDOW, ADDR_KNOWN_FP_RATE),
+                                                                                          filterInventoryKnown(std::max(1u, SendBufferSize() / 1000), INVENTORY_KNOWN_FP_RATE),
+                                                                                          askForWheel(ASKFOR_TICK_MICROS, ASKFOR_WHEEL_SLOTS, ASKFOR_MAX_SZ)
 {
     nServices = 0;
     hSocket = hSocketIn;
@@ -2075,7 +2420,6 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
     nStartingHeight = -1;
     fGetAddr = false;
     fRelayTxes = false;
-    setInventoryKnown.max_size(SendBufferSize() / 1000);
     pfilter = new CBloomFilter();
     nPingNonceSent = 0;
     nPingUsecStart = 0;
@@ -2112,9 +2456,9 @@ CNode::~CNode()
 
 void CNode::AskFor(const CInv& inv)
 {
-    if (mapAskFor.size() > MAPASKFOR_MAX_SZ)
+    if (askForWheel.size() >= askForWheel.max_size())
         return;
-    // We're using mapAskFor as a priority queue,
+    // The wheel hands requests back once their time comes,
     // the key is the earliest time the request can be sent
     int64_t nRequestTime;
     limitedmap<CInv, int64_t>::const_iterator it = mapAlreadyAskedFor.find(inv);
@@ -2124,12 +2468,7 @@ void CNode::AskFor(const CInv& inv)
         nRequestTime = 0;
     LogPrint("net", "askfor %s  %d (%s) peer=%d\n", inv.ToString(), nRequestTime, DateTimeStrFormat("%H:%M:%S", nRequestTime / 1000000), id);
 
-    // Make sure not to reuse time indexes to keep things in the same order
     int64_t nNow = GetTimeMicros() - 1000000;
-    static int64_t nLastTime;
-    ++nLastTime;
-    nNow = std::max(nNow, nLastTime);
-    nLastTime = nNow;
 
     // Each retry is 2 minutes after the last
     nRequestTime = std::max(nRequestTime + 2 * 60 * 1000000, nNow);
@@ -2137,7 +2476,7 @@ void CNode::AskFor(const CInv& inv)
         mapAlreadyAskedFor.update(it, nRequestTime);
     else
         mapAlreadyAskedFor.insert(std::make_pair(inv, nRequestTime));
-    mapAskFor.insert(std::make_pair(nRequestTime, inv));
+    askForWheel.insert(nRequestTime, inv);
 }
 
 void CNode::BeginMessage(const char* pszCommand) EXCLUSIVE_LOCK_FUNCTION(cs_vSend)
@@ -2173,28 +2512,107 @@ void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
     if (ssSend.size() == 0)
         return;
 
+    LogPrint("net", "(%d bytes) peer=%d\n", ssSend.size() - CMessageHeader::HEADER_SIZE, id);
+
+    QueueSendMsg(FinalizeNetMessage(ssSend));
+
+    LEAVE_CRITICAL_SECTION(cs_vSend);
+}
+
+/** Command of a message built by FinalizeNetMessage */
+static std::string GetNetMsgCommand(const CSerializeData& msg)
+{
+    const char* pchCommand = &msg[MESSAGE_START_SIZE];
+    return std::string(pchCommand, pchCommand + strnlen(pchCommand, CMessageHeader::COMMAND_SIZE));
+}
+
+void CNode::PushSerializedMessage(const CSerializedNetMsg& msg)
+{
+    LOCK(cs_vSend);
+    if (fDebug)
+        LogPrint("net", "sending: %s (%d bytes) peer=%d\n", SanitizeString(GetNetMsgCommand(*msg)), msg->size() - CMessageHeader::HEADER_SIZE, id);
+    QueueSendMsg(msg);
+}
+
+void CNode::QueueSendMsg(const CSerializedNetMsg& msg)
+{
+    unsigned int nMsgType = GetNetMsgTypeIndex(GetNetMsgCommand(*msg));
+    msgTypeCounters[nMsgType].AddSend(msg->size());
+    msgTypeTotals[nMsgType].AddSend(msg->size());
+
+    vSendMsg.push_back(msg);
+    nSendSize += msg->size();
+
+    // If write queue empty, attempt "optimistic write"
+    if (vSendMsg.size() == 1)
+        SocketSendData(this);
+}
+
+CSerializedNetMsg FinalizeNetMessage(CDataStream& ss)
+{
     // Set the size
-    unsigned int nSize = ssSend.size() - CMessageHeader::HEADER_SIZE;
-    memcpy((char*)&ssSend[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
+    unsigned int nSize = ss.size() - CMessageHeader::HEADER_SIZE;
+    memcpy((char*)&ss[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
 
     // Set the checksum
-    uint256 hash = Hash(ssSend.begin() + CMessageHeader::HEADER_SIZE, ssSend.end());
+    uint256 hash = Hash(ss.begin() + CMessageHeader::HEADER_SIZE, ss.end());
     unsigned int nChecksum = 0;
     memcpy(&nChecksum, &hash, sizeof(nChecksum));
-    assert(ssSend.size() >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
-    memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+    assert(ss.size() >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
+    memcpy((char*)&ss[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
 
-    LogPrint("net", "(%d bytes) peer=%d\n", nSize, id);
+    boost::shared_ptr<CSerializeData> pdata(new CSerializeData());
+    ss.GetAndClear(*pdata);
+    return pdata;
+}
 
-    std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-    ssSend.GetAndClear(*it);
-    nSendSize += (*it).size();
+CSerializedNetMsg MakeNetMessage(const char* pszCommand, const CDataStream& ssPayload)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss.reserve(CMessageHeader::HEADER_SIZE + ssPayload.size());
+    ss << CMessageHeader(pszCommand, 0) << ssPayload;
+    return FinalizeNetMessage(ss);
+}
 
-    // If write queue empty, attempt "optimistic write"
-    if (it == vSendMsg.begin())
-        SocketSendData(this);
+//
+// CNetMessageCache
+//
 
-    LEAVE_CRITICAL_SECTION(cs_vSend);
+void CNetMessageCache::SetMaxBytes(size_t nMaxBytesIn)
+{
+    LOCK(cs);
+    nMaxBytes = nMaxBytesIn;
+    Trim();
+}
+
+CSerializedNetMsg CNetMessageCache::Get(const uint256& hash)
+{
+    LOCK(cs);
+    std::map<uint256, entry_list::iterator>::iterator it = mapEntries.find(hash);
+    if (it == mapEntries.end())
+        return CSerializedNetMsg();
+    lru.splice(lru.begin(), lru, it->second);
+    return it->second->second;
+}
+
+void CNetMessageCache::Insert(const uint256& hash, const CSerializedNetMsg& msg)
+{
+    LOCK(cs);
+    if (msg->size() > nMaxBytes || mapEntries.count(hash))
+        return;
+    lru.push_front(std::make_pair(hash, msg));
+    mapEntries[hash] = lru.begin();
+    nBytes += msg->size();
+    Trim();
+}
+
+void CNetMessageCache::Trim()
+{
+    while (nBytes > nMaxBytes && !lru.empty()) {
+        nBytes -= lru.back().second->size();
+        mapEntries.erase(lru.back().first);
+        lru.pop_back();
+    }
 }
 
 //
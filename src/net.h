@@ -11,16 +11,19 @@
 #include "compat.h"
 #include "hash.h"
 #include "limitedmap.h"
-#include "mruset.h"
 #include "netbase.h"
 #include "protocol.h"
 #include "random.h"
 #include "streams.h"
 #include "sync.h"
+#include "timerwheel.h"
 #include "uint256.h"
 #include "utilstrencodings.h"
 
+#include <atomic>
 #include <deque>
+#include <list>
+#include <map>
 #include <stdint.h>
 
 #ifndef WIN32
@@ -29,11 +32,13 @@
 
 #include <boost/filesystem/path.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/signals2/signal.hpp>
 
 class CAddrMan;
 class CBlockIndex;
 class CScheduler;
+class CNetMessage;
 class CNode;
 
 namespace boost
@@ -49,6 +54,12 @@ static const int TIMEOUT_INTERVAL = 20 * 60;
 static const unsigned int MAX_INV_SZ = 50000;
 /** The maximum number of new addresses to accumulate before announcing. */
 static const unsigned int MAX_ADDR_TO_SEND = 1000;
+/** False-positive rate of the known-inventory filter; a false positive suppresses one announcement to one peer */
+static const double INVENTORY_KNOWN_FP_RATE = 0.000001;
+/** Number of recent addresses remembered per peer */
+static const unsigned int ADDR_KNOWN_WINDOW = 5000;
+/** False-positive rate of the known-address filter */
+static const double ADDR_KNOWN_FP_RATE = 0.001;
 /** Maximum length of incoming protocol messages (no message over 2 MiB is currently acceptable). */
 static const unsigned int MAX_PROTOCOL_MESSAGE_LENGTH = 2 * 1024 * 1024;
 /** -listen default */
@@ -59,8 +70,13 @@ static const bool DEFAULT_UPNP = USE_UPNP;
 #else
 static const bool DEFAULT_UPNP = false;
 #endif
-/** The maximum number of entries in mapAskFor */
-static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
+/** -useepoll default */
+static const bool DEFAULT_USE_EPOLL = true;
+/** The maximum number of getdata requests a peer can have scheduled */
+static const size_t ASKFOR_MAX_SZ = MAX_INV_SZ;
+/** Granularity and number of buckets of the getdata retry wheel; one turn covers the 2 minute retry delay */
+static const int64_t ASKFOR_TICK_MICROS = 1000000;
+static const size_t ASKFOR_WHEEL_SLOTS = 256;
 
 unsigned int ReceiveFloodSize();
 unsigned int SendBufferSize();
@@ -83,6 +99,55 @@ void SocketSendData(CNode* pnode);
 
 typedef int NodeId;
 
+/** A complete serialized message, header included; immutable so it can be queued to any number of peers */
+typedef boost::shared_ptr<const CSerializeData> CSerializedNetMsg;
+
+/**
+ * Fill in the size and checksum of a message serialized into ss after its
+ * CMessageHeader and move it into a shareable buffer, leaving ss empty.
+ */
+CSerializedNetMsg FinalizeNetMessage(CDataStream& ss);
+
+/** Build a complete pszCommand message around an already serialized payload, e.g. one with several fields */
+CSerializedNetMsg MakeNetMessage(const char* pszCommand, const CDataStream& ssPayload);
+
+/** Serialize obj once as a complete pszCommand message for queueing to any number of peers */
+template <typename T>
+CSerializedNetMsg MakeNetMessage(const char* pszCommand, const T& obj)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss.reserve(CMessageHeader::HEADER_SIZE + ::GetSerializeSize(obj, SER_NETWORK, PROTOCOL_VERSION));
+    ss << CMessageHeader(pszCommand, 0) << obj;
+    return FinalizeNetMessage(ss);
+}
+
+/**
+ * LRU of serialized messages keyed by hash and capped by their total size.
+ * Entries are shared with the send queues holding them, so evicting one never
+ * disturbs a message that is still being sent.
+ */
+class CNetMessageCache
+{
+public:
+    CNetMessageCache(size_t nMaxBytesIn = 0) : nBytes(0), nMaxBytes(nMaxBytesIn) {}
+
+    void SetMaxBytes(size_t nMaxBytesIn);
+    /** Returns an empty pointer if hash isn't cached */
+    CSerializedNetMsg Get(const uint256& hash);
+    void Insert(const uint256& hash, const CSerializedNetMsg& msg);
+
+private:
+    typedef std::list<std::pair<uint256, CSerializedNetMsg> > entry_list;
+
+    void Trim();
+
+    CCriticalSection cs;
+    entry_list lru; //! most recently used first
+    std::map<uint256, entry_list::iterator> mapEntries;
+    size_t nBytes;
+    size_t nMaxBytes;
+};
+
 // Signals for message handling
 struct CNodeSignals {
     boost::signals2::signal<int()> GetHeight;
@@ -131,7 +196,7 @@ extern int nMaxConnections;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
+extern std::map<CInv, CSerializedNetMsg> mapRelay;
 extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
 extern limitedmap<CInv, int64_t> mapAlreadyAskedFor;
@@ -150,6 +215,50 @@ struct LocalServiceInfo {
 extern CCriticalSection cs_mapLocalHost;
 extern std::map<CNetAddr, LocalServiceInfo> mapLocalHost;
 
+/** Traffic and handling time of one message type, see GetNetMsgTypeIndex() */
+struct CNetMsgTypeStats {
+    uint64_t nSendBytes;
+    uint64_t nSendMsgs;
+    uint64_t nRecvBytes;
+    uint64_t nRecvMsgs;
+    uint64_t nProcessMicros; //! time from dispatch to completion of the handler
+};
+
+/**
+ * Counters behind CNetMsgTypeStats. They are bumped on every message sent
+ * or received, from whichever thread handles it, so they are relaxed
+ * atomics rather than lock-guarded: readers only need a recent value of
+ * each counter, not a consistent snapshot of all of them.
+ */
+class CNetMsgTypeCounters
+{
+public:
+    CNetMsgTypeCounters() : nSendBytes(0), nSendMsgs(0), nRecvBytes(0), nRecvMsgs(0), nProcessMicros(0) {}
+
+    void AddSend(uint64_t nBytes)
+    {
+        nSendBytes.fetch_add(nBytes, std::memory_order_relaxed);
+        nSendMsgs.fetch_add(1, std::memory_order_relaxed);
+    }
+    void AddRecv(uint64_t nBytes)
+    {
+        nRecvBytes.fetch_add(nBytes, std::memory_order_relaxed);
+        nRecvMsgs.fetch_add(1, std::memory_order_relaxed);
+    }
+    void AddProcessTime(uint64_t nMicros)
+    {
+        nProcessMicros.fetch_add(nMicros, std::memory_order_relaxed);
+    }
+    void Get(CNetMsgTypeStats& stats) const;
+
+private:
+    std::atomic<uint64_t> nSendBytes;
+    std::atomic<uint64_t> nSendMsgs;
+    std::atomic<uint64_t> nRecvBytes;
+    std::atomic<uint64_t> nRecvMsgs;
+    std::atomic<uint64_t> nProcessMicros;
+};
+
 class CNodeStats
 {
 public:
@@ -170,6 +279,7 @@ public:
     double dPingTime;
     double dPingWait;
     std::string addrLocal;
+    std::vector<CNetMsgTypeStats> vMsgTypeStats; //! indexed by GetNetMsgTypeIndex()
 };
 
 
@@ -186,7 +296,13 @@ public:
     unsigned int nDataPos;
 
     int64_t nTime; // time (in microseconds) of message receipt.
+    unsigned int nMsgType; // GetNetMsgTypeIndex() of the command, set once complete
 
+private:
+    CHash256 hasher;    // checksum state, fed as the payload arrives
+    uint256 data_hash;  // hash of the payload once complete
+
+public:
     CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn)
     {
         hdrbuf.resize(24);
@@ -194,6 +310,7 @@ public:
         nHdrPos = 0;
         nDataPos = 0;
         nTime = 0;
+        nMsgType = NUM_NET_MSG_TYPES - 1;
     }
 
     bool complete() const
@@ -211,6 +328,21 @@ public:
 
     int readHeader(const char* pch, unsigned int nBytes);
     int readData(const char* pch, unsigned int nBytes);
+
+    /**
+     * Make room for up to nSize more payload bytes and return where they go,
+     * setting nSize to the room available. Bytes written there must be
+     * accounted for with commitData().
+     */
+    char* prepareData(unsigned int& nSize);
+    void commitData(unsigned int nBytes);
+
+    /** Double-SHA256 of the payload, whose first four bytes are the checksum; requires complete() */
+    const uint256& GetMessageHash() const
+    {
+        assert(complete());
+        return data_hash;
+    }
 };
 
 
@@ -287,7 +419,7 @@ public:
     size_t nSendSize;   // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CSerializedNetMsg> vSendMsg;
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
@@ -350,21 +482,25 @@ protected:
     // Basic fuzz-testing
     void Fuzz(int nChance); // modifies ssSend
 
+    // requires LOCK(cs_vSend)
+    void QueueSendMsg(const CSerializedNetMsg& msg);
+
 public:
     uint256 hashContinue;
     int nStartingHeight;
 
     // flood relay
     std::vector<CAddress> vAddrToSend;
-    mruset<CAddress> setAddrKnown;
+    CRollingBloomFilter filterAddrKnown;
+    CCriticalSection cs_addrKnown; // guards vAddrToSend and filterAddrKnown
     bool fGetAddr;
     std::set<uint256> setKnown;
 
     // inventory based relay
-    mruset<CInv> setInventoryKnown;
+    CRollingBloomFilter filterInventoryKnown;
     std::vector<CInv> vInventoryToSend;
     CCriticalSection cs_inventory;
-    std::multimap<int64_t, CInv> mapAskFor;
+    timerwheel<CInv> askForWheel; //! getdata requests keyed by the earliest time they can be sent
     std::vector<uint256> vBlockRequested;
 
     // Ping time measurement:
@@ -376,6 +512,10 @@ public:
     int64_t nPingUsecTime;
     // Whether a ping is requested.
     bool fPingQueued;
+    CCriticalSection cs_ping;
+
+    // Traffic per message type, indexed by GetNetMsgTypeIndex()
+    CNetMsgTypeCounters msgTypeCounters[NUM_NET_MSG_TYPES];
 
     CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn = false);
     ~CNode();
@@ -386,6 +526,10 @@ private:
     static CCriticalSection cs_totalBytesSent;
     static uint64_t nTotalBytesRecv;
     static uint64_t nTotalBytesSent;
+    static CNetMsgTypeCounters msgTypeTotals[NUM_NET_MSG_TYPES];
+
+    /** Stamp a fully received message and wake the message handler */
+    void MessageComplete(CNetMessage& msg);
 
     CNode(const CNode&);
     void operator=(const CNode&);
@@ -414,6 +558,16 @@ public:
     // requires LOCK(cs_vRecvMsg)
     bool ReceiveMsgBytes(const char* pch, unsigned int nBytes);
 
+    /**
+     * Where to recv() the body of a large message directly, skipping the copy
+     * through ReceiveMsgBytes. Returns NULL unless a message body with at least
+     * nMinSize bytes still to come is being received; nSize is the room there.
+     * requires LOCK(cs_vRecvMsg)
+     */
+    char* GetRecvBuffer(unsigned int nMinSize, unsigned int& nSize);
+    // requires LOCK(cs_vRecvMsg)
+    void RecvBufferFilled(unsigned int nBytes);
+
     // requires LOCK(cs_vRecvMsg)
     void SetRecvVersion(int nVersionIn)
     {
@@ -436,7 +590,8 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
-        setAddrKnown.insert(addr);
+        LOCK(cs_addrKnown);
+        filterAddrKnown.insert(addr.GetKey());
     }
 
     void PushAddress(const CAddress& addr)
@@ -444,7 +599,8 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
-        if (addr.IsValid() && !setAddrKnown.count(addr)) {
+        LOCK(cs_addrKnown);
+        if (addr.IsValid() && !filterAddrKnown.contains(addr.GetKey())) {
             if (vAddrToSend.size() >= MAX_ADDR_TO_SEND) {
                 vAddrToSend[insecure_rand() % vAddrToSend.size()] = addr;
             } else {
@@ -458,7 +614,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            setInventoryKnown.insert(inv);
+            filterInventoryKnown.insert(inv);
         }
     }
 
@@ -466,7 +622,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
+            if (!filterInventoryKnown.contains(inv))
                 vInventoryToSend.push_back(inv);
         }
     }
@@ -482,6 +638,9 @@ public:
     // TODO: Document the precondition of this function.  Is cs_vSend locked?
     void EndMessage() UNLOCK_FUNCTION(cs_vSend);
 
+    /** Queue a message built by FinalizeNetMessage without copying it */
+    void PushSerializedMessage(const CSerializedNetMsg& msg);
+
     void PushVersion();
 
 
@@ -726,6 +885,11 @@ public:
 
     static uint64_t GetTotalBytesRecv();
     static uint64_t GetTotalBytesSent();
+
+    /** Account the time spent handling a message of type nMsgType */
+    void RecordMsgProcessed(unsigned int nMsgType, int64_t nMicros);
+    /** Traffic per message type since startup, over all peers, indexed by GetNetMsgTypeIndex() */
+    static void GetTotalMsgTypeStats(std::vector<CNetMsgTypeStats>& vStats);
 };
 
 class CExplicitNetCleanup
@@ -19,6 +19,8 @@
 
 #include <algorithm>
 #include <boost/assign/list_of.hpp>
+#include <boost/thread.hpp>
+#include <boost/tuple/tuple_comparison.hpp>
 #include <openssl/rand.h>
 
 using namespace std;
@@ -37,6 +39,115 @@ map<uint256, CObfuscationBroadcastTx> mapObfuscationBroadcastTxes;
 // Keep track of the active Masternode
 CActiveMasternode activeMasternode;
 
+//
+// Obfuscation pool thread
+//
+// Mixing session state is only touched by ThreadObfuscationPool. The message
+// handler queues the pool's messages and new blocks for it rather than
+// processing them inline, so a busy session doesn't hold up other messages.
+//
+
+/** A message waiting for the pool thread, which holds a reference to pfrom until it's processed */
+struct CObfuscationMessage {
+    CNode* pfrom;
+    std::string strCommand;
+    CDataStream vRecv;
+
+    CObfuscationMessage(CNode* pfromIn, const std::string& strCommandIn, const CDataStream& vRecvIn) : pfrom(pfromIn), strCommand(strCommandIn), vRecv(vRecvIn) {}
+};
+
+static boost::mutex mutexPoolMsg;
+static boost::condition_variable condPoolMsg;
+static std::deque<CObfuscationMessage> vPoolMsg;
+static bool fPoolNewBlock = false;
+
+static bool IsPoolCommand(const std::string& strCommand)
+{
+    return strCommand == "dsa" || strCommand == "dsq" || strCommand == "dsi" || strCommand == "dssu" ||
+           strCommand == "dss" || strCommand == "dsf" || strCommand == "dsc";
+}
+
+/**
+ * Check the inputs of a transaction offered to the pool like AcceptableInputs()
+ * does, against a snapshot of the coins it spends: cs_main and the mempool are
+ * only locked while those coins are copied out and the cheap input checks run.
+ * fCollateral applies the relay fee rules and verifies the signatures, after the
+ * locks are released; pool entries are only signed once the session is final.
+ */
+static bool CheckPoolInputs(const CTransaction& tx, CAmount& nValueIn, bool& fMissingInputs, bool fCollateral)
+{
+    nValueIn = 0;
+    fMissingInputs = false;
+
+    if (tx.IsCoinBase() || tx.IsZerocoinSpend())
+        return false;
+
+    CValidationState state;
+    CCoinsView dummy;
+    CCoinsViewCache view(&dummy);
+    std::vector<CScriptCheck> vChecks;
+    int nHeight;
+    {
+        LOCK2(cs_main, mempool.cs);
+        nHeight = chainActive.Height();
+        if (mempool.exists(tx.GetHash()))
+            return false;
+
+        BOOST_FOREACH (const CTxIn& txin, tx.vin) {
+            std::map<COutPoint, uint256>::const_iterator it = mapLockedInputs.find(txin.prevout);
+            if (it != mapLockedInputs.end() && it->second != tx.GetHash())
+                return false;
+            // already spent by a transaction in the mempool
+            if (mempool.mapNextTx.count(txin.prevout))
+                return false;
+        }
+
+        CCoinsViewMemPool viewMemPool(pcoinsTip, mempool);
+        view.SetBackend(viewMemPool);
+        BOOST_FOREACH (const CTxIn& txin, tx.vin) {
+            if (!view.HaveCoins(txin.prevout.hash)) {
+                fMissingInputs = true;
+                return false;
+            }
+        }
+        if (!view.HaveInputs(tx))
+            return false;
+
+        // Bring the best block into scope, CheckInputs() reads it for the coinbase/coinstake maturity
+        view.GetBestBlock();
+        nValueIn = view.GetValueIn(tx);
+
+        // everything but the signatures, which are queued into vChecks for collateral
+        if (!CheckInputs(tx, state, view, fCollateral, STANDARD_SCRIPT_VERIFY_FLAGS, true, &vChecks))
+            return false;
+
+        // we have all inputs cached now, so switch back to dummy
+        view.SetBackend(dummy);
+    }
+
+    if (!CheckTransaction(tx, nHeight >= Params().Zerocoin_StartHeight(), state))
+        return false;
+    if (GetLegacySigOpCount(tx) + GetP2SHSigOpCount(tx, view) > MAX_TX_SIGOPS_CURRENT)
+        return false;
+
+    if (fCollateral) {
+        CAmount nFees = nValueIn - tx.GetValueOut();
+        unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+        if (nFees < GetMinRelayFee(tx, nSize, true))
+            return false;
+        // collateral always pays a fee, so free ones are turned down rather than rate limited
+        if (nFees < ::minRelayTxFee.GetFee(nSize))
+            return false;
+    }
+
+    BOOST_FOREACH (CScriptCheck& check, vChecks) {
+        if (!check())
+            return false;
+    }
+
+    return true;
+}
+
 /* *** BEGIN OBFUSCATION MAGIC - UIDD **********
     Copyright (c) 2014-2015, Dash Developers
         eduffield - evan@dashpay.io
@@ -46,8 +157,24 @@ CActiveMasternode activeMasternode;
 void CObfuscationPool::ProcessMessageObfuscation(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
 {
     if (fLiteMode) return; //disable all Obfuscation/Masternode related functionality
+    if (!IsPoolCommand(strCommand)) return;
     if (!masternodeSync.IsBlockchainSynced()) return;
 
+    boost::unique_lock<boost::mutex> lock(mutexPoolMsg);
+    if (vPoolMsg.size() >= OBFUSCATION_MSG_QUEUE_MAX) {
+        LogPrint("obfuscation", "%s -- queue full, dropping %s from peer=%d\n", __func__, strCommand, pfrom->id);
+        return;
+    }
+    {
+        LOCK(cs_vNodes);
+        pfrom->AddRef();
+    }
+    vPoolMsg.push_back(CObfuscationMessage(pfrom, strCommand, vRecv));
+    condPoolMsg.notify_one();
+}
+
+void CObfuscationPool::ProcessPoolMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
+{
     if (strCommand == "dsa") { //Obfuscation Accept Into Pool
 
         int errorID;
@@ -200,7 +327,6 @@ void CObfuscationPool::ProcessMessageObfuscation(CNode* pfrom, std::string& strC
             CAmount nValueOut = 0;
             bool missingTx = false;
 
-            CValidationState state;
             CMutableTransaction tx;
 
             BOOST_FOREACH (const CTxOut o, out) {
@@ -225,16 +351,18 @@ void CObfuscationPool::ProcessMessageObfuscation(CNode* pfrom, std::string& strC
                 tx.vin.push_back(i);
 
                 LogPrint("obfuscation", "dsi -- tx in %s\n", i.ToString());
+            }
 
-                CTransaction tx2;
-                uint256 hash;
-                if (GetTransaction(i.prevout.hash, tx2, hash, true)) {
-                    if (tx2.vout.size() > i.prevout.n) {
-                        nValueIn += tx2.vout[i.prevout.n].nValue;
-                    }
+            if (!CheckPoolInputs(CTransaction(tx), nValueIn, missingTx, false)) {
+                if (missingTx) {
+                    LogPrintf("dsi -- missing input tx! %s\n", tx.ToString());
+                    errorID = ERR_MISSING_TX;
                 } else {
-                    missingTx = true;
+                    LogPrintf("dsi -- transaction not valid! \n");
+                    errorID = ERR_INVALID_TX;
                 }
+                pfrom->PushMessage("dssu", sessionID, GetState(), GetEntriesCount(), MASTERNODE_REJECTED, errorID);
+                return;
             }
 
             if (nValueIn > OBFUSCATION_POOL_MAX) {
@@ -244,29 +372,12 @@ void CObfuscationPool::ProcessMessageObfuscation(CNode* pfrom, std::string& strC
                 return;
             }
 
-            if (!missingTx) {
-                if (nValueIn - nValueOut > nValueIn * .01) {
-                    LogPrintf("dsi -- fees are too high! %s\n", tx.ToString());
-                    errorID = ERR_FEES;
-                    pfrom->PushMessage("dssu", sessionID, GetState(), GetEntriesCount(), MASTERNODE_REJECTED, errorID);
-                    return;
-                }
-            } else {
-                LogPrintf("dsi -- missing input tx! %s\n", tx.ToString());
-                errorID = ERR_MISSING_TX;
+            if (nValueIn - nValueOut > nValueIn * .01) {
+                LogPrintf("dsi -- fees are too high! %s\n", tx.ToString());
+                errorID = ERR_FEES;
                 pfrom->PushMessage("dssu", sessionID, GetState(), GetEntriesCount(), MASTERNODE_REJECTED, errorID);
                 return;
             }
-
-            {
-                LOCK(cs_main);
-                if (!AcceptableInputs(mempool, state, CTransaction(tx), false, NULL, false, true)) {
-                    LogPrintf("dsi -- transaction not valid! \n");
-                    errorID = ERR_INVALID_TX;
-                    pfrom->PushMessage("dssu", sessionID, GetState(), GetEntriesCount(), MASTERNODE_REJECTED, errorID);
-                    return;
-                }
-            }
         }
 
         if (AddEntry(in, nAmount, txCollateral, out, errorID)) {
@@ -966,20 +1077,11 @@ bool CObfuscationPool::IsCollateralValid(const CTransaction& txCollateral)
         }
     }
 
-    BOOST_FOREACH (const CTxIn i, txCollateral.vin) {
-        CTransaction tx2;
-        uint256 hash;
-        if (GetTransaction(i.prevout.hash, tx2, hash, true)) {
-            if (tx2.vout.size() > i.prevout.n) {
-                nValueIn += tx2.vout[i.prevout.n].nValue;
-            }
-        } else {
-            missingTx = true;
-        }
-    }
-
-    if (missingTx) {
-        LogPrint("obfuscation", "CObfuscationPool::IsCollateralValid - Unknown inputs in collateral transaction - %s\n", txCollateral.ToString());
+    if (!CheckPoolInputs(txCollateral, nValueIn, missingTx, true)) {
+        if (missingTx)
+            LogPrint("obfuscation", "CObfuscationPool::IsCollateralValid - Unknown inputs in collateral transaction - %s\n", txCollateral.ToString());
+        else if (fDebug)
+            LogPrintf("CObfuscationPool::IsCollateralValid - didn't pass IsAcceptable\n");
         return false;
     }
 
@@ -991,15 +1093,6 @@ bool CObfuscationPool::IsCollateralValid(const CTransaction& txCollateral)
 
     LogPrint("obfuscation", "CObfuscationPool::IsCollateralValid %s\n", txCollateral.ToString());
 
-    {
-        LOCK(cs_main);
-        CValidationState state;
-        if (!AcceptableInputs(mempool, state, txCollateral, true, NULL)) {
-            if (fDebug) LogPrintf("CObfuscationPool::IsCollateralValid - didn't pass IsAcceptable\n");
-            return false;
-        }
-    }
-
     return true;
 }
 
@@ -1336,11 +1429,18 @@ void CObfuscationPool::NewBlock()
 {
     LogPrint("obfuscation", "CObfuscationPool::NewBlock \n");
 
+    boost::unique_lock<boost::mutex> lock(mutexPoolMsg);
+    fPoolNewBlock = true;
+    condPoolMsg.notify_one();
+}
+
+void CObfuscationPool::ProcessPoolNewBlock()
+{
     //we we're processing lots of blocks, we'll just leave
     if (GetTime() - lastNewBlock < 10) return;
     lastNewBlock = GetTime();
 
-    obfuScationPool.CheckTimeout();
+    CheckTimeout();
 }
 
 // Obfuscation transaction was completed (failed or successful)
@@ -2162,22 +2262,71 @@ bool CObfuScationSigner::SignMessage(std::string strMessage, std::string& errorM
     return true;
 }
 
+namespace {
+
+/**
+ * Valid message signature cache, so a masternode message whose signature was
+ * verified ahead of time in a batch doesn't need its key recovered again
+ */
+class CMessageSignatureCache
+{
+private:
+    //! sigdata_type is (message hash, signature, key id):
+    typedef boost::tuple<uint256, std::vector<unsigned char>, CKeyID> sigdata_type;
+    std::set<sigdata_type> setValid;
+    boost::shared_mutex cs_sigcache;
+
+public:
+    bool Get(const uint256& hash, const std::vector<unsigned char>& vchSig, const CKeyID& keyID)
+    {
+        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
+        return setValid.count(sigdata_type(hash, vchSig, keyID)) > 0;
+    }
+
+    void Set(const uint256& hash, const std::vector<unsigned char>& vchSig, const CKeyID& keyID)
+    {
+        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
+
+        while (setValid.size() >= OBFUSCATION_SIGCACHE_SIZE) {
+            // Evict a random entry, see CSignatureCache
+            std::set<sigdata_type>::iterator it = setValid.lower_bound(sigdata_type(GetRandHash(), std::vector<unsigned char>(), CKeyID()));
+            if (it == setValid.end())
+                it = setValid.begin();
+            setValid.erase(it);
+        }
+
+        setValid.insert(sigdata_type(hash, vchSig, keyID));
+    }
+};
+
+CMessageSignatureCache messageSignatureCache;
+
+} // anon namespace
+
 bool CObfuScationSigner::VerifyMessage(CPubKey pubkey, vector<unsigned char>& vchSig, std::string strMessage, std::string& errorMessage)
 {
     CHashWriter ss(SER_GETHASH, 0);
     ss << strMessageMagic;
     ss << strMessage;
+    uint256 hash = ss.GetHash();
+
+    if (messageSignatureCache.Get(hash, vchSig, pubkey.GetID()))
+        return true;
 
     CPubKey pubkey2;
-    if (!pubkey2.RecoverCompact(ss.GetHash(), vchSig)) {
+    if (!pubkey2.RecoverCompact(hash, vchSig)) {
         errorMessage = _("Error recovering public key.");
         return false;
     }
 
-    if (fDebug && pubkey2.GetID() != pubkey.GetID())
-        LogPrintf("CObfuScationSigner::VerifyMessage -- keys don't match: %s %s\n", pubkey2.GetID().ToString(), pubkey.GetID().ToString());
+    if (pubkey2.GetID() != pubkey.GetID()) {
+        if (fDebug)
+            LogPrintf("CObfuScationSigner::VerifyMessage -- keys don't match: %s %s\n", pubkey2.GetID().ToString(), pubkey.GetID().ToString());
+        return false;
+    }
 
-    return (pubkey2.GetID() == pubkey.GetID());
+    messageSignatureCache.Set(hash, vchSig, pubkey.GetID());
+    return true;
 }
 
 bool CObfuscationQueue::Sign()
@@ -2210,10 +2359,11 @@ bool CObfuscationQueue::Sign()
 
 bool CObfuscationQueue::Relay()
 {
+    CSerializedNetMsg msg = MakeNetMessage("dsq", *this);
     LOCK(cs_vNodes);
     BOOST_FOREACH (CNode* pnode, vNodes) {
         // always relay to everyone
-        pnode->PushMessage("dsq", (*this));
+        pnode->PushSerializedMessage(msg);
     }
 
     return true;
@@ -2240,9 +2390,13 @@ bool CObfuscationQueue::CheckSignature()
 
 void CObfuscationPool::RelayFinalTransaction(const int sessionID, const CTransaction& txNew)
 {
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << sessionID << txNew;
+    CSerializedNetMsg msg = MakeNetMessage("dsf", ss);
+
     LOCK(cs_vNodes);
     BOOST_FOREACH (CNode* pnode, vNodes) {
-        pnode->PushMessage("dsf", sessionID, txNew);
+        pnode->PushSerializedMessage(msg);
     }
 }
 
@@ -2311,7 +2465,56 @@ void ThreadCheckObfuScationPool()
                 CleanTransactionLocksList();
             }
 
-            //if(c % MASTERNODES_DUMP_SECONDS == 0) DumpMasternodes();
+            if (c % MASTERNODES_DUMP_SECONDS == 0) {
+                DumpMasternodes();
+                DumpMasternodePayments();
+            }
+        }
+    }
+}
+
+void ThreadObfuscationPool()
+{
+    if (fLiteMode) return; //disable all Obfuscation/Masternode related functionality
+
+    RenameThread("uidd-obfpool");
+
+    unsigned int c = 0;
+    int64_t nLastCheck = GetTime();
+
+    while (true) {
+        std::deque<CObfuscationMessage> vMsg;
+        bool fNewBlock;
+        {
+            boost::unique_lock<boost::mutex> lock(mutexPoolMsg);
+            if (vPoolMsg.empty() && !fPoolNewBlock)
+                condPoolMsg.timed_wait(lock, boost::posix_time::microsec_clock::universal_time() + boost::posix_time::seconds(1));
+            vMsg.swap(vPoolMsg);
+            fNewBlock = fPoolNewBlock;
+            fPoolNewBlock = false;
+        }
+
+        for (std::deque<CObfuscationMessage>::iterator it = vMsg.begin(); it != vMsg.end(); ++it) {
+            if (!it->pfrom->fDisconnect) {
+                try {
+                    obfuScationPool.ProcessPoolMessage(it->pfrom, it->strCommand, it->vRecv);
+                } catch (const std::exception& e) {
+                    LogPrint("obfuscation", "ThreadObfuscationPool -- %s from peer=%d: %s\n", it->strCommand, it->pfrom->id, e.what());
+                }
+            }
+            LOCK(cs_vNodes);
+            it->pfrom->Release();
+        }
+
+        if (fNewBlock)
+            obfuScationPool.ProcessPoolNewBlock();
+
+        // the once a second checks
+        if (GetTime() == nLastCheck) continue;
+        nLastCheck = GetTime();
+
+        if (masternodeSync.IsBlockchainSynced()) {
+            c++;
 
             obfuScationPool.CheckTimeout();
             obfuScationPool.CheckForCompleteQueue();
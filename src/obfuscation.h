@@ -41,6 +41,12 @@ class CActiveMasternode;
 #define OBFUSCATION_QUEUE_TIMEOUT 30
 #define OBFUSCATION_SIGNING_TIMEOUT 15
 
+// message signatures remembered as valid by CObfuScationSigner::VerifyMessage
+#define OBFUSCATION_SIGCACHE_SIZE 20000
+
+// messages waiting for the pool thread, more are dropped
+#define OBFUSCATION_MSG_QUEUE_MAX 1000
+
 // used for anonymous relaying of inputs/outputs/sigs
 #define OBFUSCATION_RELAY_IN 1
 #define OBFUSCATION_RELAY_OUT 2
@@ -345,7 +351,7 @@ public:
         SetNull();
     }
 
-    /** Process a Obfuscation message using the Obfuscation protocol
+    /** Queue a Obfuscation message for ThreadObfuscationPool, which processes it using the Obfuscation protocol
      * \param pfrom
      * \param strCommand lower case command string; valid values are:
      *        Command  | Description
@@ -361,6 +367,8 @@ public:
      * \param vRecv
      */
     void ProcessMessageObfuscation(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
+    /// Process a queued Obfuscation message, only called from ThreadObfuscationPool
+    void ProcessPoolMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
 
     void InitCollateralAddress()
     {
@@ -476,8 +484,10 @@ public:
 
     /// Get the last valid block hash for a given modulus
     bool GetLastValidBlockHash(uint256& hash, int mod = 1, int nBlockHeight = 0);
-    /// Process a new block
+    /// Have ThreadObfuscationPool process a new block
     void NewBlock();
+    /// Process a new block, only called from ThreadObfuscationPool
+    void ProcessPoolNewBlock();
     void CompletedTransaction(bool error, int errorID);
     void ClearLastMessage();
     /// Used for liquidity providers
@@ -512,5 +522,7 @@ public:
 };
 
 void ThreadCheckObfuScationPool();
+/** Runs the mixing sessions: processes the queued Obfuscation messages and new blocks, and checks the pool every second */
+void ThreadObfuscationPool();
 
 #endif
@@ -13,6 +13,8 @@
 #include <arpa/inet.h>
 #endif
 
+#include <algorithm>
+
 static const char* ppszTypeName[] =
     {
         "ERROR",
@@ -31,7 +33,81 @@ static const char* ppszTypeName[] =
         "mn quorum",
         "mn announce",
         "mn ping",
-        "dstx"};
+        "dstx",
+        "compact block"};
+
+/** Commands we count traffic for, sorted for binary search; keep NUM_NET_MSG_TYPES in sync */
+static const char* ppszNetMsgTypeName[] =
+    {
+        "addr",
+        "alert",
+        "block",
+        "blocktxn",
+        "cmpctblock",
+        "dsa",
+        "dsc",
+        "dsee",
+        "dseep",
+        "dseg",
+        "dsf",
+        "dsi",
+        "dsq",
+        "dsr",
+        "dss",
+        "dssu",
+        "dstx",
+        "filteradd",
+        "filterclear",
+        "filterload",
+        "getaddr",
+        "getblocks",
+        "getblocktxn",
+        "getdata",
+        "getheaders",
+        "getsporks",
+        "headers",
+        "inv",
+        "ix",
+        "mempool",
+        "merkleblock",
+        "mnb",
+        "mnget",
+        "mnp",
+        "mnvs",
+        "mnw",
+        "notfound",
+        "ping",
+        "pong",
+        "reject",
+        "spork",
+        "ssc",
+        "ssv",
+        "tx",
+        "txlvote",
+        "verack",
+        "version",
+        "*other*"};
+
+static bool CompareNetMsgType(const char* a, const std::string& b)
+{
+    return b.compare(a) > 0;
+}
+
+unsigned int GetNetMsgTypeIndex(const std::string& strCommand)
+{
+    static_assert(ARRAYLEN(ppszNetMsgTypeName) == NUM_NET_MSG_TYPES, "NUM_NET_MSG_TYPES doesn't match the message type table");
+    const char** pend = ppszNetMsgTypeName + NUM_NET_MSG_TYPES - 1;
+    const char** it = std::lower_bound((const char**)ppszNetMsgTypeName, pend, strCommand, CompareNetMsgType);
+    if (it != pend && strCommand == *it)
+        return it - ppszNetMsgTypeName;
+    return NUM_NET_MSG_TYPES - 1;
+}
+
+const char* GetNetMsgTypeName(unsigned int nIndex)
+{
+    assert(nIndex < NUM_NET_MSG_TYPES);
+    return ppszNetMsgTypeName[nIndex];
+}
 
 CMessageHeader::CMessageHeader()
 {
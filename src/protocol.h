@@ -63,6 +63,14 @@ public:
     unsigned int nChecksum;
 };
 
+/** Number of message types with their own traffic counters, including the catch-all for unknown commands */
+static const unsigned int NUM_NET_MSG_TYPES = 48;
+
+/** Index of a command among the message types we count traffic for; unknown commands share the last index */
+unsigned int GetNetMsgTypeIndex(const std::string& strCommand);
+/** Command name of the message type at nIndex, "*other*" for the catch-all */
+const char* GetNetMsgTypeName(unsigned int nIndex);
+
 /** nServices flags */
 enum {
     NODE_NETWORK = (1 << 0),
@@ -170,7 +178,10 @@ enum {
     MSG_MASTERNODE_QUORUM,
     MSG_MASTERNODE_ANNOUNCE,
     MSG_MASTERNODE_PING,
-    MSG_DSTX
+    MSG_DSTX,
+    // Only requested in getdata, answered with a "cmpctblock" for recent blocks
+    // and a full "block" otherwise. Peers must be at COMPACT_BLOCKS_VERSION.
+    MSG_CMPCT_BLOCK
 };
 
 #endif // BITCOIN_PROTOCOL_H
@@ -102,6 +102,11 @@ quint64 ClientModel::getTotalBytesSent() const
     return CNode::GetTotalBytesSent();
 }
 
+void ClientModel::getNetMsgTypeStats(std::vector<CNetMsgTypeStats>& vStats) const
+{
+    CNode::GetTotalMsgTypeStats(vStats);
+}
+
 QDateTime ClientModel::getLastBlockDate() const
 {
     LOCK(cs_main);
@@ -10,6 +10,8 @@
 #include <QObject>
 #include <QDateTime>
 
+#include <vector>
+
 class AddressTableModel;
 class BanTableModel;
 class OptionsModel;
@@ -17,6 +19,7 @@ class PeerTableModel;
 class TransactionTableModel;
 
 class CWallet;
+struct CNetMsgTypeStats;
 
 QT_BEGIN_NAMESPACE
 class QDateTime;
@@ -58,6 +61,8 @@ public:
 
     quint64 getTotalBytesRecv() const;
     quint64 getTotalBytesSent() const;
+    //! Traffic per message type since startup, indexed by GetNetMsgTypeIndex()
+    void getNetMsgTypeStats(std::vector<CNetMsgTypeStats>& vStats) const;
 
     double getVerificationProgress() const;
     QDateTime getLastBlockDate() const;
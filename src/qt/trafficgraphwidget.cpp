@@ -9,13 +9,17 @@
 #include <QPainter>
 #include <QTimer>
 
+#include <algorithm>
 #include <cmath>
+#include <utility>
 
 #define DESIRED_SAMPLES 800
 
 #define XMARGIN 10
 #define YMARGIN 10
 
+#define TOOLTIP_MSG_TYPES 8
+
 TrafficGraphWidget::TrafficGraphWidget(QWidget* parent) : QWidget(parent),
                                                           timer(0),
                                                           fMax(0.0f),
@@ -36,6 +40,7 @@ void TrafficGraphWidget::setClientModel(ClientModel* model)
     if (model) {
         nLastBytesIn = model->getTotalBytesRecv();
         nLastBytesOut = model->getTotalBytesSent();
+        model->getNetMsgTypeStats(vMsgTypeStatsAtClear);
     }
 }
 
@@ -145,9 +150,46 @@ void TrafficGraphWidget::updateRates()
         if (f > tmax) tmax = f;
     }
     fMax = tmax;
+    updateToolTip();
     update();
 }
 
+void TrafficGraphWidget::updateToolTip()
+{
+    std::vector<CNetMsgTypeStats> vStats;
+    clientModel->getNetMsgTypeStats(vStats);
+    if (vMsgTypeStatsAtClear.size() != vStats.size())
+        return;
+
+    // (bytes moved, index) for every message type that saw traffic
+    std::vector<std::pair<quint64, unsigned int> > vBusiest;
+    for (unsigned int i = 0; i < vStats.size(); i++) {
+        quint64 nBytes = (vStats[i].nRecvBytes - vMsgTypeStatsAtClear[i].nRecvBytes) +
+                         (vStats[i].nSendBytes - vMsgTypeStatsAtClear[i].nSendBytes);
+        if (nBytes > 0)
+            vBusiest.push_back(std::make_pair(nBytes, i));
+    }
+    if (vBusiest.empty()) {
+        setToolTip(QString());
+        return;
+    }
+    std::sort(vBusiest.rbegin(), vBusiest.rend());
+    if (vBusiest.size() > TOOLTIP_MSG_TYPES)
+        vBusiest.resize(TOOLTIP_MSG_TYPES);
+
+    QString strToolTip = "<table><tr><th align=\"left\">" + tr("Message") + "</th><th>" + tr("In") + "</th><th>" + tr("Out") + "</th></tr>";
+    for (unsigned int n = 0; n < vBusiest.size(); n++) {
+        unsigned int i = vBusiest[n].second;
+        strToolTip += QString("<tr><td>%1</td><td align=\"right\">%2 %4</td><td align=\"right\">%3 %4</td></tr>")
+                          .arg(GetNetMsgTypeName(i))
+                          .arg((vStats[i].nRecvBytes - vMsgTypeStatsAtClear[i].nRecvBytes) / 1024.0, 0, 'f', 1)
+                          .arg((vStats[i].nSendBytes - vMsgTypeStatsAtClear[i].nSendBytes) / 1024.0, 0, 'f', 1)
+                          .arg(tr("KB"));
+    }
+    strToolTip += "</table>";
+    setToolTip(strToolTip);
+}
+
 void TrafficGraphWidget::setGraphRangeMins(int mins)
 {
     nMins = mins;
@@ -169,6 +211,8 @@ void TrafficGraphWidget::clear()
     if (clientModel) {
         nLastBytesIn = clientModel->getTotalBytesRecv();
         nLastBytesOut = clientModel->getTotalBytesSent();
+        clientModel->getNetMsgTypeStats(vMsgTypeStatsAtClear);
     }
+    setToolTip(QString());
     timer->start();
 }
@@ -5,9 +5,13 @@
 #ifndef BITCOIN_QT_TRAFFICGRAPHWIDGET_H
 #define BITCOIN_QT_TRAFFICGRAPHWIDGET_H
 
+#include "net.h"
+
 #include <QQueue>
 #include <QWidget>
 
+#include <vector>
+
 class ClientModel;
 
 QT_BEGIN_NAMESPACE
@@ -34,6 +38,8 @@ public slots:
 
 private:
     void paintPath(QPainterPath& path, QQueue<float>& samples);
+    /** Show the message types that moved the most data since the graph was cleared */
+    void updateToolTip();
 
     QTimer* timer;
     float fMax;
@@ -42,6 +48,7 @@ private:
     QQueue<float> vSamplesOut;
     quint64 nLastBytesIn;
     quint64 nLastBytesOut;
+    std::vector<CNetMsgTypeStats> vMsgTypeStatsAtClear;
     ClientModel* clientModel;
 };
 
@@ -46,4 +46,25 @@ static inline uint32_t insecure_rand(void)
     return (insecure_rand_Rw << 16) + insecure_rand_Rz;
 }
 
+/**
+ * The same MWC generator with its own state, for hot loops that would
+ * otherwise pull every draw from OpenSSL. Seeded once with secure random
+ * data, deterministic after that. Not thread-safe.
+ */
+class FastRandomContext
+{
+public:
+    explicit FastRandomContext(bool fDeterministic = false);
+
+    uint32_t rand32()
+    {
+        Rz = 36969 * (Rz & 65535) + (Rz >> 16);
+        Rw = 18000 * (Rw & 65535) + (Rw >> 16);
+        return (Rw << 16) + Rz;
+    }
+
+    uint32_t Rz;
+    uint32_t Rw;
+};
+
 #endif // BITCOIN_RANDOM_H
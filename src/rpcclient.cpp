@@ -99,6 +99,7 @@ static const CRPCConvertParam vRPCConvertParams[] =
         {"prioritisetransaction", 2},
         {"setban", 2},
         {"setban", 3},
+        {"getnetstats", 0},
         {"spork", 1},
        /* {"mnbudget", 3},
         {"mnbudget", 4},
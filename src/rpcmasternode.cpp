@@ -432,7 +432,7 @@ UniValue masternodecurrent (const UniValue& params, bool fHelp)
             "\nExamples:\n" +
             HelpExampleCli("masternodecurrent", "") + HelpExampleRpc("masternodecurrent", ""));
 
-    CMasternode* winner = mnodeman.GetCurrentMasterNode(1);
+    CMasternode* winner = mnodeman.GetCurrentMasterNode();
     if (winner) {
         UniValue obj(UniValue::VOBJ);
 
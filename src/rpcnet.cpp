@@ -104,7 +104,16 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
             "    \"inflight\": [\n"
             "       n,                        (numeric) The heights of blocks we're currently asking from this peer\n"
             "       ...\n"
-            "    ]\n"
+            "    ],\n"
+            "    \"whitelisted\": true|false, (boolean) Whether the peer is whitelisted\n"
+            "    \"bytessent_per_msg\": {\n"
+            "       \"command\": n,            (numeric) The total bytes sent aggregated by message type\n"
+            "       ...\n"
+            "    },\n"
+            "    \"bytesrecv_per_msg\": {\n"
+            "       \"command\": n,            (numeric) The total bytes received aggregated by message type\n"
+            "       ...\n"
+            "    }\n"
             "  }\n"
             "  ,...\n"
             "]\n"
@@ -155,6 +164,18 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
         }
         obj.push_back(Pair("whitelisted", stats.fWhitelisted));
 
+        UniValue sendPerMsg(UniValue::VOBJ);
+        UniValue recvPerMsg(UniValue::VOBJ);
+        for (unsigned int i = 0; i < stats.vMsgTypeStats.size(); i++) {
+            const CNetMsgTypeStats& msgStats = stats.vMsgTypeStats[i];
+            if (msgStats.nSendBytes)
+                sendPerMsg.push_back(Pair(GetNetMsgTypeName(i), msgStats.nSendBytes));
+            if (msgStats.nRecvBytes)
+                recvPerMsg.push_back(Pair(GetNetMsgTypeName(i), msgStats.nRecvBytes));
+        }
+        obj.push_back(Pair("bytessent_per_msg", sendPerMsg));
+        obj.push_back(Pair("bytesrecv_per_msg", recvPerMsg));
+
         ret.push_back(obj);
     }
 
@@ -353,6 +374,65 @@ UniValue getnettotals(const UniValue& params, bool fHelp)
     return obj;
 }
 
+UniValue getnetstats(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "getnetstats ( nodeid )\n"
+            "\nReturns network traffic and message handling time by message type, since startup\n"
+            "or for a single connected peer. Message types that were never seen are left out.\n"
+            "\nArguments:\n"
+            "1. nodeid     (numeric, optional) The peer to report on (see getpeerinfo for ids)\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"command\": {             (string) The message type, \"*other*\" for unknown ones\n"
+            "    \"bytessent\": n,         (numeric) Bytes sent, including message headers\n"
+            "    \"msgssent\": n,          (numeric) Messages sent\n"
+            "    \"bytesrecv\": n,         (numeric) Bytes received, including message headers\n"
+            "    \"msgsrecv\": n,          (numeric) Messages received\n"
+            "    \"processtime\": n        (numeric) Milliseconds spent handling received messages\n"
+            "  },\n"
+            "  ...\n"
+            "}\n"
+            "\nExamples:\n" +
+            HelpExampleCli("getnetstats", "") + HelpExampleCli("getnetstats", "3") + HelpExampleRpc("getnetstats", "3"));
+
+    std::vector<CNetMsgTypeStats> vMsgTypeStats;
+    if (params.size() > 0) {
+        NodeId nodeid = params[0].get_int();
+        LOCK(cs_vNodes);
+        CNode* pnode = NULL;
+        BOOST_FOREACH (CNode* pnodeIt, vNodes) {
+            if (pnodeIt->GetId() == nodeid) {
+                pnode = pnodeIt;
+                break;
+            }
+        }
+        if (!pnode)
+            throw JSONRPCError(RPC_CLIENT_NODE_NOT_CONNECTED, "Node not found in connected nodes");
+        CNodeStats stats;
+        pnode->copyStats(stats);
+        vMsgTypeStats.swap(stats.vMsgTypeStats);
+    } else {
+        CNode::GetTotalMsgTypeStats(vMsgTypeStats);
+    }
+
+    UniValue ret(UniValue::VOBJ);
+    for (unsigned int i = 0; i < vMsgTypeStats.size(); i++) {
+        const CNetMsgTypeStats& msgStats = vMsgTypeStats[i];
+        if (!msgStats.nSendMsgs && !msgStats.nRecvMsgs)
+            continue;
+        UniValue obj(UniValue::VOBJ);
+        obj.push_back(Pair("bytessent", msgStats.nSendBytes));
+        obj.push_back(Pair("msgssent", msgStats.nSendMsgs));
+        obj.push_back(Pair("bytesrecv", msgStats.nRecvBytes));
+        obj.push_back(Pair("msgsrecv", msgStats.nRecvMsgs));
+        obj.push_back(Pair("processtime", msgStats.nProcessMicros / 1000));
+        ret.push_back(Pair(GetNetMsgTypeName(i), obj));
+    }
+    return ret;
+}
+
 static UniValue GetNetworksInfo()
 {
     UniValue networks(UniValue::VARR);
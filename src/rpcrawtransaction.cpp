@@ -701,19 +701,30 @@ UniValue signrawtransaction(const UniValue& params, bool fHelp)
     UniValue vErrors(UniValue::VARR);
 
     // Sign what we can:
+    vector<CScript> vPrevPubKeys(mergedTx.vin.size());
+    vector<CScript> vFromPubKeys(mergedTx.vin.size());
     for (unsigned int i = 0; i < mergedTx.vin.size(); i++) {
         CTxIn& txin = mergedTx.vin[i];
         const CCoins* coins = view.AccessCoins(txin.prevout.hash);
-        if (coins == NULL || !coins->IsAvailable(txin.prevout.n)) {
-            TxInErrorToJSON(txin, vErrors, "Input not found or already spent");
+        if (coins == NULL || !coins->IsAvailable(txin.prevout.n))
             continue;
-        }
-        const CScript& prevPubKey = coins->vout[txin.prevout.n].scriptPubKey;
+        vPrevPubKeys[i] = coins->vout[txin.prevout.n].scriptPubKey;
 
         txin.scriptSig.clear();
         // Only sign SIGHASH_SINGLE if there's a corresponding output:
         if (!fHashSingle || (i < mergedTx.vout.size()))
-            SignSignature(keystore, prevPubKey, mergedTx, i, nHashType);
+            vFromPubKeys[i] = vPrevPubKeys[i];
+    }
+    SignTransaction(keystore, vFromPubKeys, mergedTx, nHashType);
+
+    for (unsigned int i = 0; i < mergedTx.vin.size(); i++) {
+        CTxIn& txin = mergedTx.vin[i];
+        const CCoins* coins = view.AccessCoins(txin.prevout.hash);
+        if (coins == NULL || !coins->IsAvailable(txin.prevout.n)) {
+            TxInErrorToJSON(txin, vErrors, "Input not found or already spent");
+            continue;
+        }
+        const CScript& prevPubKey = vPrevPubKeys[i];
 
         // ... and merge in other signatures:
         BOOST_FOREACH (const CMutableTransaction& txv, txVariants) {
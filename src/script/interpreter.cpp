@@ -12,6 +12,7 @@
 #include "eccryptoverify.h"
 #include "pubkey.h"
 #include "script/script.h"
+#include "streams.h"
 #include "uint256.h"
 
 using namespace std;
@@ -1031,9 +1032,25 @@ public:
     }
 };
 
+/** Serialized size of an input with a blank script: prevout, empty script and nSequence */
+static const size_t BLANK_INPUT_SIZE = 32 + 4 + 1 + 4;
+
 } // anon namespace
 
-uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType)
+PrecomputedTransactionData::PrecomputedTransactionData(const CTransaction& txTo)
+{
+    CDataStream ssInputs(SER_GETHASH, 0);
+    for (unsigned int i = 0; i < txTo.vin.size(); i++)
+        ssInputs << txTo.vin[i].prevout << CScript() << txTo.vin[i].nSequence;
+    vchInputs.assign(ssInputs.begin(), ssInputs.end());
+    assert(vchInputs.size() == txTo.vin.size() * BLANK_INPUT_SIZE);
+
+    CDataStream ssOutputs(SER_GETHASH, 0);
+    ssOutputs << txTo.vout;
+    vchOutputs.assign(ssOutputs.begin(), ssOutputs.end());
+}
+
+uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const PrecomputedTransactionData* txdata)
 {
     if (nIn >= txTo.vin.size()) {
         //  nIn out of range
@@ -1053,6 +1070,18 @@ uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsig
 
     // Serialize and hash
     CHashWriter ss(SER_GETHASH, 0);
+    if (txdata && !(nHashType & SIGHASH_ANYONECANPAY) && (nHashType & 0x1f) != SIGHASH_SINGLE && (nHashType & 0x1f) != SIGHASH_NONE) {
+        // Same bytes as below: only the input being signed differs from txdata
+        const char* pchInputs = (const char*)&txdata->vchInputs[0];
+        ss << txTo.nVersion;
+        ::WriteCompactSize(ss, txTo.vin.size());
+        ss.write(pchInputs, nIn * BLANK_INPUT_SIZE);
+        txTmp.SerializeInput(ss, nIn, SER_GETHASH, 0);
+        ss.write(pchInputs + (nIn + 1) * BLANK_INPUT_SIZE, (txTo.vin.size() - nIn - 1) * BLANK_INPUT_SIZE);
+        ss.write((const char*)&txdata->vchOutputs[0], txdata->vchOutputs.size());
+        ss << txTo.nLockTime << nHashType;
+        return ss.GetHash();
+    }
     ss << txTmp << nHashType;
     return ss.GetHash();
 }
@@ -1075,7 +1104,7 @@ bool TransactionSignatureChecker::CheckSig(const vector<unsigned char>& vchSigIn
     int nHashType = vchSig.back();
     vchSig.pop_back();
 
-    uint256 sighash = SignatureHash(scriptCode, *txTo, nIn, nHashType);
+    uint256 sighash = SignatureHash(scriptCode, *txTo, nIn, nHashType, txdata);
 
     if (!VerifySignature(vchSig, pubkey, sighash))
         return false;
@@ -72,7 +72,20 @@ enum
 
 };
 
-uint256 SignatureHash(const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+/**
+ * The serialized inputs (with blank scripts) and outputs of a transaction, which
+ * the SIGHASH_ALL hash of each of its inputs shares. Computing them once lets
+ * many inputs of one transaction be hashed without re-serializing all of it.
+ */
+struct PrecomputedTransactionData
+{
+    std::vector<unsigned char> vchInputs;
+    std::vector<unsigned char> vchOutputs;
+
+    PrecomputedTransactionData(const CTransaction& tx);
+};
+
+uint256 SignatureHash(const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const PrecomputedTransactionData* txdata = NULL);
 
 class BaseSignatureChecker
 {
@@ -90,12 +103,13 @@ class TransactionSignatureChecker : public BaseSignatureChecker
 private:
     const CTransaction* txTo;
     unsigned int nIn;
+    const PrecomputedTransactionData* txdata;
 
 protected:
     virtual bool VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& vchPubKey, const uint256& sighash) const;
 
 public:
-    TransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn) : txTo(txToIn), nIn(nInIn) {}
+    TransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn, const PrecomputedTransactionData* txdataIn = NULL) : txTo(txToIn), nIn(nInIn), txdata(txdataIn) {}
     bool CheckSig(const std::vector<unsigned char>& scriptSig, const std::vector<unsigned char>& vchPubKey, const CScript& scriptCode) const;
 };
 
@@ -5,14 +5,19 @@
 
 #include "script/sign.h"
 
+#include "checkqueue.h"
 #include "primitives/transaction.h"
 #include "key.h"
 #include "keystore.h"
 #include "script/standard.h"
+#include "sync.h"
 #include "uint256.h"
 #include "util.h"
 
+#include <algorithm>
+
 #include <boost/foreach.hpp>
+#include <boost/thread.hpp>
 
 using namespace std;
 
@@ -109,17 +114,21 @@ bool Solver(const CKeyStore& keystore, const CScript& scriptPubKey, uint256 hash
     return false;
 }
 
-bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CMutableTransaction& txTo, unsigned int nIn, int nHashType)
+/**
+ * Produce the scriptSig for input nIn of txTo. txTo itself is left untouched, so
+ * several inputs of the same transaction can be signed concurrently: the signature
+ * hash of one input never covers the scriptSig of another.
+ */
+static bool SignInput(const CKeyStore& keystore, const CScript& fromPubKey, const CTransaction& txTo, const PrecomputedTransactionData* txdata, unsigned int nIn, int nHashType, CScript& scriptSigRet)
 {
     assert(nIn < txTo.vin.size());
-    CTxIn& txin = txTo.vin[nIn];
 
     // Leave out the signature from the hash, since a signature can't sign itself.
     // The checksig op will also drop the signatures from its hash.
-    uint256 hash = SignatureHash(fromPubKey, txTo, nIn, nHashType);
+    uint256 hash = SignatureHash(fromPubKey, txTo, nIn, nHashType, txdata);
 
     txnouttype whichType;
-    if (!Solver(keystore, fromPubKey, hash, nHashType, txin.scriptSig, whichType))
+    if (!Solver(keystore, fromPubKey, hash, nHashType, scriptSigRet, whichType))
         return false;
 
     if (whichType == TX_SCRIPTHASH)
@@ -127,21 +136,28 @@ bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CMutabl
         // Solver returns the subscript that need to be evaluated;
         // the final scriptSig is the signatures from that
         // and then the serialized subscript:
-        CScript subscript = txin.scriptSig;
+        CScript subscript = scriptSigRet;
 
         // Recompute txn hash using subscript in place of scriptPubKey:
-        uint256 hash2 = SignatureHash(subscript, txTo, nIn, nHashType);
+        uint256 hash2 = SignatureHash(subscript, txTo, nIn, nHashType, txdata);
 
         txnouttype subType;
         bool fSolved =
-            Solver(keystore, subscript, hash2, nHashType, txin.scriptSig, subType) && subType != TX_SCRIPTHASH;
+            Solver(keystore, subscript, hash2, nHashType, scriptSigRet, subType) && subType != TX_SCRIPTHASH;
         // Append serialized subscript whether or not it is completely signed:
-        txin.scriptSig << static_cast<valtype>(subscript);
+        scriptSigRet << static_cast<valtype>(subscript);
         if (!fSolved) return false;
     }
 
     // Test solution
-    return VerifyScript(txin.scriptSig, fromPubKey, STANDARD_SCRIPT_VERIFY_FLAGS, MutableTransactionSignatureChecker(&txTo, nIn));
+    return VerifyScript(scriptSigRet, fromPubKey, STANDARD_SCRIPT_VERIFY_FLAGS, TransactionSignatureChecker(&txTo, nIn, txdata));
+}
+
+bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CMutableTransaction& txTo, unsigned int nIn, int nHashType)
+{
+    assert(nIn < txTo.vin.size());
+    const CTransaction txConst(txTo);
+    return SignInput(keystore, fromPubKey, txConst, NULL, nIn, nHashType, txTo.vin[nIn].scriptSig);
 }
 
 bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CMutableTransaction& txTo, unsigned int nIn, int nHashType)
@@ -154,6 +170,199 @@ bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CMutab
     return SignSignature(keystore, txout.scriptPubKey, txTo, nIn, nHashType);
 }
 
+namespace {
+
+/**
+ * Keystore holding only the keys and redeem scripts needed for one transaction.
+ * Filling it decrypts each key once; afterwards it is only read, so signing
+ * threads can share it without touching the wallet or its locks.
+ */
+class CSigningKeyStore : public CBasicKeyStore
+{
+private:
+    std::map<CKeyID, CPubKey> mapPubKeys;
+
+    void CopyKey(const CKeyStore& keystore, const CKeyID& keyID)
+    {
+        if (mapPubKeys.count(keyID))
+            return;
+
+        CKey key;
+        CPubKey pubkey;
+        if (!keystore.GetKey(keyID, key))
+            return;
+        if (!keystore.GetPubKey(keyID, pubkey))
+            pubkey = key.GetPubKey();
+        AddKeyPubKey(key, pubkey);
+        mapPubKeys[keyID] = pubkey;
+    }
+
+public:
+    void CopyFrom(const CKeyStore& keystore, const CScript& scriptPubKey)
+    {
+        txnouttype whichType;
+        vector<valtype> vSolutions;
+        if (!Solver(scriptPubKey, whichType, vSolutions))
+            return;
+
+        switch (whichType) {
+        case TX_PUBKEY:
+            CopyKey(keystore, CPubKey(vSolutions[0]).GetID());
+            break;
+        case TX_PUBKEYHASH:
+            CopyKey(keystore, CKeyID(uint160(vSolutions[0])));
+            break;
+        case TX_MULTISIG:
+            for (unsigned int i = 1; i < vSolutions.size() - 1; i++)
+                CopyKey(keystore, CPubKey(vSolutions[i]).GetID());
+            break;
+        case TX_SCRIPTHASH: {
+            CScriptID scriptID = CScriptID(uint160(vSolutions[0]));
+            CScript subscript;
+            if (!HaveCScript(scriptID) && keystore.GetCScript(scriptID, subscript)) {
+                AddCScript(subscript);
+                CopyFrom(keystore, subscript);
+            }
+            break;
+        }
+        default:
+            break;
+        }
+    }
+
+    bool GetPubKey(const CKeyID& address, CPubKey& vchPubKeyOut) const
+    {
+        std::map<CKeyID, CPubKey>::const_iterator it = mapPubKeys.find(address);
+        if (it == mapPubKeys.end())
+            return false;
+        vchPubKeyOut = it->second;
+        return true;
+    }
+
+    // Only read once filled, so the signing threads skip cs_KeyStore
+    bool HaveKey(const CKeyID& address) const { return mapKeys.count(address) > 0; }
+
+    bool GetKey(const CKeyID& address, CKey& keyOut) const
+    {
+        KeyMap::const_iterator it = mapKeys.find(address);
+        if (it == mapKeys.end())
+            return false;
+        keyOut = it->second;
+        return true;
+    }
+
+    bool HaveCScript(const CScriptID& hash) const { return mapScripts.count(hash) > 0; }
+
+    bool GetCScript(const CScriptID& hash, CScript& redeemScriptOut) const
+    {
+        ScriptMap::const_iterator it = mapScripts.find(hash);
+        if (it == mapScripts.end())
+            return false;
+        redeemScriptOut = it->second;
+        return true;
+    }
+};
+
+} // anon namespace
+
+/** Signs one input of a transaction into its own slot of SignTransaction's results */
+class CSignInputCheck
+{
+private:
+    const CKeyStore* keystore;
+    const CScript* fromPubKey;
+    const CTransaction* txTo;
+    const PrecomputedTransactionData* txdata;
+    unsigned int nIn;
+    int nHashType;
+    CScript* scriptSigRet;
+    char* fSignedRet;
+
+public:
+    CSignInputCheck() : keystore(NULL), fromPubKey(NULL), txTo(NULL), txdata(NULL), nIn(0), nHashType(0), scriptSigRet(NULL), fSignedRet(NULL) {}
+    CSignInputCheck(const CKeyStore& keystoreIn, const CScript& fromPubKeyIn, const CTransaction& txToIn, const PrecomputedTransactionData& txdataIn, unsigned int nInIn, int nHashTypeIn, CScript& scriptSigRetIn, char& fSignedRetIn) :
+        keystore(&keystoreIn), fromPubKey(&fromPubKeyIn), txTo(&txToIn), txdata(&txdataIn), nIn(nInIn), nHashType(nHashTypeIn), scriptSigRet(&scriptSigRetIn), fSignedRet(&fSignedRetIn) {}
+
+    /** The result goes to fSignedRet, so an unsigned input doesn't stop the rest of the batch */
+    bool operator()()
+    {
+        *fSignedRet = SignInput(*keystore, *fromPubKey, *txTo, txdata, nIn, nHashType, *scriptSigRet);
+        return true;
+    }
+
+    void swap(CSignInputCheck& check)
+    {
+        std::swap(keystore, check.keystore);
+        std::swap(fromPubKey, check.fromPubKey);
+        std::swap(txTo, check.txTo);
+        std::swap(txdata, check.txdata);
+        std::swap(nIn, check.nIn);
+        std::swap(nHashType, check.nHashType);
+        std::swap(scriptSigRet, check.scriptSigRet);
+        std::swap(fSignedRet, check.fSignedRet);
+    }
+};
+
+static CCheckQueue<CSignInputCheck> signcheckqueue(SIGN_PARALLEL_MIN_INPUTS);
+static int nSignThreads = 0;
+/** A CCheckQueue serves one control at a time, so concurrent signers take turns */
+static CCriticalSection cs_signcheckqueue;
+
+void StartSigningThreads(boost::thread_group& threadGroup)
+{
+    nSignThreads = std::min((int)boost::thread::hardware_concurrency(), MAX_SIGN_THREADS);
+    for (int i = 0; i < nSignThreads - 1; i++)
+        threadGroup.create_thread(&ThreadSignInputs);
+}
+
+void ThreadSignInputs()
+{
+    RenameThread("uidd-sign");
+    signcheckqueue.Thread();
+}
+
+bool SignTransaction(const CKeyStore& keystore, const vector<CScript>& vFromPubKeys, CMutableTransaction& txTo, int nHashType)
+{
+    assert(vFromPubKeys.size() == txTo.vin.size());
+
+    CSigningKeyStore keys;
+    BOOST_FOREACH (const CScript& fromPubKey, vFromPubKeys)
+        keys.CopyFrom(keystore, fromPubKey);
+
+    // Every input is hashed against the unsigned transaction, serialized once
+    const CTransaction txConst(txTo);
+    const PrecomputedTransactionData txdata(txConst);
+
+    unsigned int nInputs = vFromPubKeys.size();
+    vector<CScript> vScriptSigs(nInputs);
+    vector<char> vSigned(nInputs, true);
+    if (nSignThreads < 2 || nInputs < SIGN_PARALLEL_MIN_INPUTS) {
+        for (unsigned int i = 0; i < nInputs; i++)
+            if (!vFromPubKeys[i].empty())
+                vSigned[i] = SignInput(keys, vFromPubKeys[i], txConst, &txdata, i, nHashType, vScriptSigs[i]);
+    } else {
+        vector<CSignInputCheck> vChecks;
+        vChecks.reserve(nInputs);
+        for (unsigned int i = 0; i < nInputs; i++)
+            if (!vFromPubKeys[i].empty())
+                vChecks.push_back(CSignInputCheck(keys, vFromPubKeys[i], txConst, txdata, i, nHashType, vScriptSigs[i], vSigned[i]));
+
+        LOCK(cs_signcheckqueue);
+        CCheckQueueControl<CSignInputCheck> control(&signcheckqueue);
+        control.Add(vChecks);
+        control.Wait();
+    }
+
+    bool fComplete = true;
+    for (unsigned int i = 0; i < nInputs; i++) {
+        if (vFromPubKeys[i].empty())
+            continue;
+        txTo.vin[i].scriptSig.swap(vScriptSigs[i]);
+        fComplete &= (bool)vSigned[i];
+    }
+    return fComplete;
+}
+
 static CScript PushAll(const vector<valtype>& values)
 {
     CScript result;
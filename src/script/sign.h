@@ -17,10 +17,31 @@ class CTransaction;
 
 struct CMutableTransaction;
 
+namespace boost {
+class thread_group;
+} // namespace boost
+
+/** Transactions with fewer inputs than this are signed on the calling thread */
+static const unsigned int SIGN_PARALLEL_MIN_INPUTS = 8;
+/** Maximum number of threads used to sign one transaction */
+static const int MAX_SIGN_THREADS = 8;
+
+/** Start the threads SignTransaction hands the inputs of large transactions to */
+void StartSigningThreads(boost::thread_group& threadGroup);
+void ThreadSignInputs();
+
 bool Sign1(const CKeyID& address, const CKeyStore& keystore, uint256 hash, int nHashType, CScript& scriptSigRet);
 bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, CMutableTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
 bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CMutableTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
 
+/**
+ * Sign each input of txTo whose entry in vFromPubKeys is not empty, with the same
+ * result as calling SignSignature on each of them in turn. The keys involved are
+ * fetched (and decrypted) from keystore once, and large transactions are signed
+ * on the signing threads. Returns false if any of those inputs is not fully signed.
+ */
+bool SignTransaction(const CKeyStore& keystore, const std::vector<CScript>& vFromPubKeys, CMutableTransaction& txTo, int nHashType=SIGHASH_ALL);
+
 /**
  * Given two sets of signatures for scriptPubKey, possibly with OP_0 placeholders,
  * combine them intelligently and return the result.
@@ -26,11 +26,59 @@ using namespace boost;
 std::map<uint256, CTransaction> mapTxLockReq;
 std::map<uint256, CTransaction> mapTxLockReqRejected;
 std::map<uint256, CConsensusVote> mapTxLockVote;
-std::map<uint256, CTransactionLock> mapTxLocks;
+expirymap<uint256, CTransactionLock, CTransactionLockExpiry> mapTxLocks;
 std::map<COutPoint, uint256> mapLockedInputs;
 std::map<uint256, int64_t> mapUnknownVotes; //track votes with no tx for DOS
 int nCompleteTXLocks;
 
+/** The masternodes entitled to vote on locks at a block height, best ranked first */
+struct CSwiftTXQuorum {
+    uint256 hashBlock;
+    int64_t nTimeCreated;
+    std::vector<CTxIn> vecMembers;
+};
+
+CCriticalSection cs_mapQuorums;
+std::map<int, CSwiftTXQuorum> mapQuorums;
+
+/**
+ * Rank of vin among the masternodes voting on locks at nBlockHeight: up to
+ * SWIFTTX_SIGNATURES_TOTAL inside the quorum, above it outside, -1 if the
+ * block is unknown or the masternode isn't ranked, as GetMasternodeRank(). Quorums are cached per height, so the
+ * votes on a lock don't each rank the whole masternode list.
+ */
+static int GetQuorumRank(const CTxIn& vin, int nBlockHeight)
+{
+    uint256 hashBlock;
+    if (!GetBlockHash(hashBlock, nBlockHeight)) return -1;
+
+    {
+        LOCK(cs_mapQuorums);
+        std::map<int, CSwiftTXQuorum>::iterator it = mapQuorums.find(nBlockHeight);
+        if (it == mapQuorums.end() || it->second.hashBlock != hashBlock || GetTime() - it->second.nTimeCreated >= SWIFTTX_QUORUM_CACHE_SECONDS) {
+            std::vector<CTxIn> vecQuorum;
+            if (!mnodeman.GetMasternodeQuorum(nBlockHeight, MIN_SWIFTTX_PROTO_VERSION, SWIFTTX_SIGNATURES_TOTAL, vecQuorum)) return -1;
+
+            if (it == mapQuorums.end()) {
+                if (mapQuorums.size() >= SWIFTTX_QUORUM_CACHE_SIZE)
+                    mapQuorums.erase(mapQuorums.begin()); // lowest height
+                it = mapQuorums.insert(make_pair(nBlockHeight, CSwiftTXQuorum())).first;
+            }
+            it->second.hashBlock = hashBlock;
+            it->second.nTimeCreated = GetTime();
+            it->second.vecMembers.swap(vecQuorum);
+        }
+
+        const std::vector<CTxIn>& vecMembers = it->second.vecMembers;
+        for (unsigned int i = 0; i < vecMembers.size(); i++)
+            if (vecMembers[i].prevout == vin.prevout)
+                return i + 1;
+    }
+
+    // outside the quorum, the rank table knows whether it ranks at all
+    return mnodeman.GetMasternodeRank(vin, nBlockHeight, MIN_SWIFTTX_PROTO_VERSION);
+}
+
 //txlock - Locks transaction
 //
 //step 1.) Broadcast intention to lock transaction inputs, "txlreg", CTransaction
@@ -266,7 +314,7 @@ void DoConsensusVote(CTransaction& tx, int64_t nBlockHeight)
 {
     if (!fMasterNode) return;
 
-    int n = mnodeman.GetMasternodeRank(activeMasternode.vin, nBlockHeight, MIN_SWIFTTX_PROTO_VERSION);
+    int n = GetQuorumRank(activeMasternode.vin, nBlockHeight);
 
     if (n == -1) {
         LogPrint("swiftx", "SwiftX::DoConsensusVote - Unknown Masternode\n");
@@ -305,7 +353,7 @@ void DoConsensusVote(CTransaction& tx, int64_t nBlockHeight)
 //received a consensus vote
 bool ProcessConsensusVote(CNode* pnode, CConsensusVote& ctx)
 {
-    int n = mnodeman.GetMasternodeRank(ctx.vinMasternode, ctx.nBlockHeight, MIN_SWIFTTX_PROTO_VERSION);
+    int n = GetQuorumRank(ctx.vinMasternode, ctx.nBlockHeight);
 
     CMasternode* pmn = mnodeman.Find(ctx.vinMasternode);
     if (pmn != NULL)
@@ -394,6 +442,16 @@ bool ProcessConsensusVote(CNode* pnode, CConsensusVote& ctx)
     return false;
 }
 
+/** Make a lock expire now, it goes with the next CleanTransactionLocksList() */
+static void ExpireLock(const uint256& txHash)
+{
+    std::map<uint256, CTransactionLock>::iterator it = mapTxLocks.find(txHash);
+    if (it != mapTxLocks.end()) {
+        it->second.nExpiration = GetTime();
+        mapTxLocks.refile(it);
+    }
+}
+
 bool CheckForConflictingLocks(CTransaction& tx)
 {
     /*
@@ -404,13 +462,12 @@ bool CheckForConflictingLocks(CTransaction& tx)
         rescan the blocks and find they're acceptable and then take the chain with the most work.
     */
     BOOST_FOREACH (const CTxIn& in, tx.vin) {
-        if (mapLockedInputs.count(in.prevout)) {
-            if (mapLockedInputs[in.prevout] != tx.GetHash()) {
-                LogPrintf("SwiftX::CheckForConflictingLocks - found two complete conflicting locks - removing both. %s %s", tx.GetHash().ToString().c_str(), mapLockedInputs[in.prevout].ToString().c_str());
-                if (mapTxLocks.count(tx.GetHash())) mapTxLocks[tx.GetHash()].nExpiration = GetTime();
-                if (mapTxLocks.count(mapLockedInputs[in.prevout])) mapTxLocks[mapLockedInputs[in.prevout]].nExpiration = GetTime();
-                return true;
-            }
+        std::map<COutPoint, uint256>::iterator itLocked = mapLockedInputs.find(in.prevout);
+        if (itLocked != mapLockedInputs.end() && itLocked->second != tx.GetHash()) {
+            LogPrintf("SwiftX::CheckForConflictingLocks - found two complete conflicting locks - removing both. %s %s", tx.GetHash().ToString().c_str(), itLocked->second.ToString().c_str());
+            ExpireLock(tx.GetHash());
+            ExpireLock(itLocked->second);
+            return true;
         }
     }
 
@@ -436,28 +493,24 @@ void CleanTransactionLocksList()
 {
     if (chainActive.Tip() == NULL) return;
 
-    std::map<uint256, CTransactionLock>::iterator it = mapTxLocks.begin();
-
-    while (it != mapTxLocks.end()) {
-        if (GetTime() > it->second.nExpiration) { //keep them for an hour
-            LogPrintf("Removing old transaction lock %s\n", it->second.txHash.ToString().c_str());
+    // locks are indexed by expiry, only the ones due are looked at
+    std::vector<std::pair<uint256, CTransactionLock> > vExpired;
+    mapTxLocks.expire(GetTime(), &vExpired);
 
-            if (mapTxLockReq.count(it->second.txHash)) {
-                CTransaction& tx = mapTxLockReq[it->second.txHash];
+    for (unsigned int i = 0; i < vExpired.size(); i++) {
+        CTransactionLock& lock = vExpired[i].second;
+        LogPrintf("Removing old transaction lock %s\n", lock.txHash.ToString().c_str());
 
-                BOOST_FOREACH (const CTxIn& in, tx.vin)
-                    mapLockedInputs.erase(in.prevout);
+        std::map<uint256, CTransaction>::iterator itReq = mapTxLockReq.find(lock.txHash);
+        if (itReq != mapTxLockReq.end()) {
+            BOOST_FOREACH (const CTxIn& in, itReq->second.vin)
+                mapLockedInputs.erase(in.prevout);
 
-                mapTxLockReq.erase(it->second.txHash);
-                mapTxLockReqRejected.erase(it->second.txHash);
+            mapTxLockReq.erase(itReq);
+            mapTxLockReqRejected.erase(lock.txHash);
 
-                BOOST_FOREACH (CConsensusVote& v, it->second.vecConsensusVotes)
-                    mapTxLockVote.erase(v.GetHash());
-            }
-
-            mapTxLocks.erase(it++);
-        } else {
-            it++;
+            BOOST_FOREACH (CConsensusVote& v, lock.vecConsensusVotes)
+                mapTxLockVote.erase(v.GetHash());
         }
     }
 }
@@ -478,11 +531,16 @@ uint256 CConsensusVote::GetHash() const
     return vinMasternode.prevout.hash + vinMasternode.prevout.n + txHash;
 }
 
+std::string CConsensusVote::GetStrMessage() const
+{
+    return txHash.ToString() + boost::lexical_cast<std::string>(nBlockHeight);
+}
+
 
 bool CConsensusVote::SignatureValid()
 {
     std::string errorMessage;
-    std::string strMessage = txHash.ToString().c_str() + boost::lexical_cast<std::string>(nBlockHeight);
+    std::string strMessage = GetStrMessage();
     //LogPrintf("verify strMessage %s \n", strMessage.c_str());
 
     CMasternode* pmn = mnodeman.Find(vinMasternode);
@@ -506,7 +564,7 @@ bool CConsensusVote::Sign()
 
     CKey key2;
     CPubKey pubkey2;
-    std::string strMessage = txHash.ToString().c_str() + boost::lexical_cast<std::string>(nBlockHeight);
+    std::string strMessage = GetStrMessage();
     //LogPrintf("signing strMessage %s \n", strMessage.c_str());
     //LogPrintf("signing privkey %s \n", strMasterNodePrivKey.c_str());
 
@@ -532,7 +590,7 @@ bool CConsensusVote::Sign()
 bool CTransactionLock::SignaturesValid()
 {
     BOOST_FOREACH (CConsensusVote vote, vecConsensusVotes) {
-        int n = mnodeman.GetMasternodeRank(vote.vinMasternode, vote.nBlockHeight, MIN_SWIFTTX_PROTO_VERSION);
+        int n = GetQuorumRank(vote.vinMasternode, vote.nBlockHeight);
 
         if (n == -1) {
             LogPrintf("CTransactionLock::SignaturesValid() - Unknown Masternode\n");
@@ -8,6 +8,7 @@
 #define SWIFTTX_H
 
 #include "base58.h"
+#include "expirymap.h"
 #include "key.h"
 #include "main.h"
 #include "net.h"
@@ -26,6 +27,8 @@
 */
 #define SWIFTTX_SIGNATURES_REQUIRED 6
 #define SWIFTTX_SIGNATURES_TOTAL 10
+#define SWIFTTX_QUORUM_CACHE_SIZE 128
+#define SWIFTTX_QUORUM_CACHE_SECONDS 60
 
 using namespace std;
 using namespace boost;
@@ -33,13 +36,14 @@ using namespace boost;
 class CConsensusVote;
 class CTransaction;
 class CTransactionLock;
+struct CTransactionLockExpiry;
 
 static const int MIN_SWIFTTX_PROTO_VERSION = 70103;
 
 extern map<uint256, CTransaction> mapTxLockReq;
 extern map<uint256, CTransaction> mapTxLockReqRejected;
 extern map<uint256, CConsensusVote> mapTxLockVote;
-extern map<uint256, CTransactionLock> mapTxLocks;
+extern expirymap<uint256, CTransactionLock, CTransactionLockExpiry> mapTxLocks;
 extern std::map<COutPoint, uint256> mapLockedInputs;
 extern int nCompleteTXLocks;
 
@@ -76,6 +80,7 @@ public:
     std::vector<unsigned char> vchMasterNodeSignature;
 
     uint256 GetHash() const;
+    std::string GetStrMessage() const;
 
     bool SignatureValid();
     bool Sign();
@@ -111,5 +116,10 @@ public:
     }
 };
 
+/** Locks are dropped once they expire, see CleanTransactionLocksList() */
+struct CTransactionLockExpiry {
+    int64_t operator()(const CTransactionLock& lock) const { return lock.nExpiration; }
+};
+
 
 #endif
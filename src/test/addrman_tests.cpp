@@ -0,0 +1,86 @@
+// Copyright (c) 2021 The Uidd developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "addrman.h"
+
+#include "clientversion.h"
+#include "netbase.h"
+#include "streams.h"
+#include "utilstrencodings.h"
+
+#include <string>
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+/** Routable IPv4 address with the given last two bytes */
+static CAddress MakeAddress(int n, unsigned short nPort = 9999)
+{
+    CAddress addr(CService(strprintf("250.7.%d.%d", (n >> 8) & 0xff, n & 0xff), nPort));
+    addr.nTime = GetAdjustedTime();
+    return addr;
+}
+
+BOOST_AUTO_TEST_SUITE(addrman_tests)
+
+BOOST_AUTO_TEST_CASE(addrman_add_find)
+{
+    CAddrMan addrman;
+    CNetAddr source("252.2.2.2");
+
+    BOOST_CHECK_EQUAL(addrman.size(), 0);
+    BOOST_CHECK(!addrman.Select().IsValid());
+
+    BOOST_CHECK(addrman.Add(MakeAddress(1), source));
+    BOOST_CHECK_EQUAL(addrman.size(), 1);
+    BOOST_CHECK(addrman.Select() == MakeAddress(1));
+
+    // same address, another port: one entry per network address
+    BOOST_CHECK(!addrman.Add(MakeAddress(1, 10000), source));
+    BOOST_CHECK_EQUAL(addrman.size(), 1);
+
+    // unroutable addresses are ignored
+    BOOST_CHECK(!addrman.Add(CAddress(CService("127.0.0.1", 9999)), source));
+    BOOST_CHECK_EQUAL(addrman.size(), 1);
+
+    // many addresses, some collide in the "new" buckets and are dropped
+    vector<CAddress> vAddr;
+    for (int i = 2; i < 5000; i++)
+        vAddr.push_back(MakeAddress(i));
+    BOOST_CHECK(addrman.Add(vAddr, source));
+    BOOST_CHECK(addrman.size() > 1);
+    BOOST_CHECK(addrman.size() <= 5000);
+
+    addrman.Good(MakeAddress(1));
+    addrman.Attempt(MakeAddress(2));
+    BOOST_CHECK(addrman.GetAddr().size() > 0);
+}
+
+BOOST_AUTO_TEST_CASE(addrman_serialize)
+{
+    CAddrMan addrman;
+    for (int s = 0; s < 100; s++) {
+        CNetAddr source(strprintf("252.%d.2.2", s));
+        for (int i = 0; i < 50; i++)
+            addrman.Add(MakeAddress(s * 50 + i), source);
+    }
+    for (int i = 0; i < 500; i += 7)
+        addrman.Good(MakeAddress(i));
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << addrman;
+    CAddrMan addrman2;
+    ss >> addrman2;
+    BOOST_CHECK_EQUAL(addrman2.size(), addrman.size());
+
+    BOOST_CHECK(!addrman2.GetAddr().empty());
+
+    // the same entries and bucket references serialize to the same size
+    CDataStream ss2(SER_DISK, CLIENT_VERSION);
+    ss2 << addrman2;
+    BOOST_CHECK_EQUAL(ss2.size(), addrman.GetSerializeSize(SER_DISK, CLIENT_VERSION));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,219 @@
+// Copyright (c) 2021 The Uidd developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+
+#include "chainparams.h"
+#include "checkpoints.h"
+#include "main.h"
+#include "pow.h"
+#include "random.h"
+#include "streams.h"
+#include "timedata.h"
+#include "txmempool.h"
+#include "version.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(blockencodings_tests)
+
+/** A proof-of-stake shaped block: coinbase, coinstake, then nTxs spends */
+static CBlock BuildBlock(int nTxs)
+{
+    CBlock block;
+    block.nTime = 1600000000;
+
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vin[0].scriptSig = CScript() << OP_1 << OP_2;
+    coinbase.vout.resize(1);
+    block.vtx.push_back(coinbase);
+
+    CMutableTransaction coinstake;
+    coinstake.vin.resize(1);
+    coinstake.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    coinstake.vout.resize(2);
+    coinstake.vout[1].nValue = 10 * COIN;
+    coinstake.vout[1].scriptPubKey = CScript() << OP_TRUE;
+    block.vtx.push_back(coinstake);
+
+    for (int i = 0; i < nTxs; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(GetRandHash(), i);
+        tx.vout.resize(1);
+        tx.vout[0].nValue = (i + 1) * COIN;
+        tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+        block.vtx.push_back(tx);
+    }
+
+    block.vchBlockSig.assign(72, 0x30);
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+static CBlockHeaderAndShortTxIDs RoundTrip(const CBlockHeaderAndShortTxIDs& cmpctblock)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << cmpctblock;
+    CBlockHeaderAndShortTxIDs ret;
+    ss >> ret;
+    return ret;
+}
+
+BOOST_AUTO_TEST_CASE(reconstruct_from_mempool)
+{
+    CBlock block = BuildBlock(4);
+    BOOST_CHECK(block.IsProofOfStake());
+
+    CTxMemPool pool(CFeeRate(0));
+    for (size_t i = 2; i < block.vtx.size(); i++)
+        pool.addUnchecked(block.vtx[i].GetHash(), CTxMemPoolEntry(block.vtx[i], 0, 0, 0.0, 1));
+
+    CBlockHeaderAndShortTxIDs cmpctblock = RoundTrip(CBlockHeaderAndShortTxIDs(block));
+    BOOST_CHECK_EQUAL(cmpctblock.BlockTxCount(), block.vtx.size());
+    BOOST_CHECK(cmpctblock.header.GetHash() == block.GetHash());
+
+    PartiallyDownloadedBlock partialBlock;
+    BOOST_CHECK(partialBlock.InitData(cmpctblock, pool) == READ_STATUS_OK);
+    BOOST_CHECK_EQUAL(partialBlock.GetMempoolCount(), 4U);
+    for (size_t i = 0; i < block.vtx.size(); i++)
+        BOOST_CHECK(partialBlock.IsTxAvailable(i));
+
+    CBlock block2;
+    BOOST_CHECK(partialBlock.FillBlock(block2, vector<CTransaction>()) == READ_STATUS_OK);
+    BOOST_CHECK(block2.GetHash() == block.GetHash());
+    BOOST_CHECK(block2.vchBlockSig == block.vchBlockSig);
+    BOOST_CHECK(block2.BuildMerkleTree() == block.hashMerkleRoot);
+}
+
+BOOST_AUTO_TEST_CASE(reconstruct_with_missing)
+{
+    CBlock block = BuildBlock(4);
+
+    // only the first and last spends are in our mempool
+    CTxMemPool pool(CFeeRate(0));
+    pool.addUnchecked(block.vtx[2].GetHash(), CTxMemPoolEntry(block.vtx[2], 0, 0, 0.0, 1));
+    pool.addUnchecked(block.vtx[5].GetHash(), CTxMemPoolEntry(block.vtx[5], 0, 0, 0.0, 1));
+
+    PartiallyDownloadedBlock partialBlock;
+    BOOST_CHECK(partialBlock.InitData(RoundTrip(CBlockHeaderAndShortTxIDs(block)), pool) == READ_STATUS_OK);
+
+    vector<uint16_t> vMissing;
+    partialBlock.GetMissing(vMissing);
+    BOOST_CHECK_EQUAL(vMissing.size(), 2U);
+    BOOST_CHECK_EQUAL(vMissing[0], 3);
+    BOOST_CHECK_EQUAL(vMissing[1], 4);
+
+    // the request survives its differential encoding
+    BlockTransactionsRequest req;
+    req.blockhash = block.GetHash();
+    req.indexes = vMissing;
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << req;
+    BlockTransactionsRequest req2;
+    ss >> req2;
+    BOOST_CHECK(req2.blockhash == req.blockhash);
+    BOOST_CHECK(req2.indexes == req.indexes);
+
+    BlockTransactions resp(req2);
+    for (size_t i = 0; i < req2.indexes.size(); i++)
+        resp.txn[i] = block.vtx[req2.indexes[i]];
+
+    // too few transactions is the peer's fault
+    CBlock block2;
+    BOOST_CHECK(partialBlock.FillBlock(block2, vector<CTransaction>(1, resp.txn[0])) == READ_STATUS_INVALID);
+
+    // the wrong transaction shows up as a merkle mismatch
+    vector<CTransaction> vWrong(resp.txn);
+    vWrong[1] = block.vtx[2];
+    BOOST_CHECK(partialBlock.FillBlock(block2, vWrong) == READ_STATUS_FAILED);
+
+    BOOST_CHECK(partialBlock.FillBlock(block2, resp.txn) == READ_STATUS_OK);
+    BOOST_CHECK(block2.GetHash() == block.GetHash());
+    BOOST_CHECK(block2.BuildMerkleTree() == block.hashMerkleRoot);
+}
+
+BOOST_AUTO_TEST_CASE(invalid_compact_block)
+{
+    CTxMemPool pool(CFeeRate(0));
+    PartiallyDownloadedBlock partialBlock;
+
+    // an empty announcement is rejected
+    BOOST_CHECK(partialBlock.InitData(CBlockHeaderAndShortTxIDs(), pool) == READ_STATUS_INVALID);
+
+    // a prefilled index past the end of the block is rejected
+    CBlock block = BuildBlock(1);
+    CBlockHeaderAndShortTxIDs cmpctblock(block);
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << cmpctblock;
+    // header, block signature, nonce and the single short id are followed by the prefilled count
+    size_t nPrefilledPos = ::GetSerializeSize(cmpctblock.header, SER_NETWORK, PROTOCOL_VERSION) +
+                           ::GetSerializeSize(block.vchBlockSig, SER_NETWORK, PROTOCOL_VERSION) + 8 + 1 + 6;
+    BOOST_CHECK_EQUAL(ss[nPrefilledPos], 2);
+    ss[nPrefilledPos + 1] = 5;
+    CBlockHeaderAndShortTxIDs bad;
+    ss >> bad;
+    BOOST_CHECK(partialBlock.InitData(bad, pool) == READ_STATUS_INVALID);
+}
+
+BOOST_AUTO_TEST_CASE(reconstructed_block_connects)
+{
+    ModifiableParams()->setSkipProofOfWorkCheck(true);
+    Checkpoints::fEnabled = false;
+
+    CBlock block;
+    {
+        LOCK(cs_main);
+        CBlockIndex* pindexPrev = chainActive.Tip();
+        block.hashPrevBlock = pindexPrev->GetBlockHash();
+        block.nTime = std::max(pindexPrev->GetMedianTimePast() + 1, GetAdjustedTime());
+        block.nBits = GetNextWorkRequired(pindexPrev, &block);
+
+        CMutableTransaction coinbase;
+        coinbase.vin.resize(1);
+        coinbase.vin[0].prevout.SetNull();
+        coinbase.vin[0].scriptSig = CScript() << (pindexPrev->nHeight + 1) << OP_0;
+        coinbase.vout.resize(1);
+        coinbase.vout[0].scriptPubKey = CScript() << OP_TRUE;
+        block.vtx.push_back(coinbase);
+        block.hashMerkleRoot = block.BuildMerkleTree();
+    }
+    BOOST_CHECK(block.IsProofOfWork());
+
+    CTxMemPool pool(CFeeRate(0));
+    CBlockHeaderAndShortTxIDs cmpctblock = RoundTrip(CBlockHeaderAndShortTxIDs(block));
+
+    // the header is checked without being indexed, or the rebuilt block is taken as already processed
+    {
+        LOCK(cs_main);
+        CValidationState state;
+        BOOST_CHECK(CheckUnindexedBlockHeader(cmpctblock.header, state));
+        BOOST_CHECK(!mapBlockIndex.count(block.GetHash()));
+    }
+
+    PartiallyDownloadedBlock partialBlock;
+    BOOST_CHECK(partialBlock.InitData(cmpctblock, pool) == READ_STATUS_OK);
+    CBlock block2;
+    BOOST_CHECK(partialBlock.FillBlock(block2, vector<CTransaction>()) == READ_STATUS_OK);
+    BOOST_CHECK(block2.GetHash() == block.GetHash());
+
+    CValidationState state;
+    BOOST_CHECK(ProcessNewBlock(state, NULL, &block2));
+    BOOST_CHECK(state.IsValid());
+    {
+        LOCK(cs_main);
+        BOOST_CHECK(chainActive.Tip()->GetBlockHash() == block.GetHash());
+        BOOST_CHECK(chainActive.Tip()->nStatus & BLOCK_HAVE_DATA);
+    }
+
+    Checkpoints::fEnabled = true;
+    ModifiableParams()->setSkipProofOfWorkCheck(false);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -8,11 +8,15 @@
 #include "clientversion.h"
 #include "key.h"
 #include "merkleblock.h"
+#include "net.h"
+#include "protocol.h"
+#include "random.h"
 #include "serialize.h"
 #include "streams.h"
 #include "uint256.h"
 #include "util.h"
 #include "utilstrencodings.h"
+#include "utiltime.h"
 
 #include <vector>
 
@@ -459,4 +463,125 @@ BOOST_AUTO_TEST_CASE(merkle_block_4_test_update_none)
     BOOST_CHECK(!filter.contains(COutPoint(uint256("0x02981fa052f0481dbc5868f4fc2166035a10f27a03cfd2de67326471df5bc041"), 0)));
 }
 
+static std::vector<unsigned char> RandomData()
+{
+    uint256 r = GetRandHash();
+    return std::vector<unsigned char>(r.begin(), r.end());
+}
+
+BOOST_AUTO_TEST_CASE(rolling_bloom)
+{
+    // last-100-entry, 1% false positive:
+    CRollingBloomFilter rb1(100, 0.01);
+
+    // Overfill:
+    static const int DATASIZE = 399;
+    std::vector<unsigned char> data[DATASIZE];
+    for (int i = 0; i < DATASIZE; i++) {
+        data[i] = RandomData();
+        rb1.insert(data[i]);
+    }
+    // Last 100 guaranteed to be remembered:
+    for (int i = 299; i < DATASIZE; i++) {
+        BOOST_CHECK(rb1.contains(data[i]));
+    }
+
+    // false positive rate is 1%, so we should get about 100 hits if
+    // testing 10,000 random keys. We get worst-case false positive
+    // behavior when the filter is as full as possible, which is
+    // when we've inserted one minus an integer multiple of nElement*2.
+    unsigned int nHits = 0;
+    for (int i = 0; i < 10000; i++) {
+        if (rb1.contains(RandomData()))
+            ++nHits;
+    }
+    // Run test_uidd with --log_level=message to see BOOST_TEST_MESSAGEs:
+    BOOST_TEST_MESSAGE("RollingBloomFilter got " << nHits << " false positives (~100 expected)");
+
+    // Insanely unlikely to get a fp count outside this range:
+    BOOST_CHECK(nHits > 25);
+    BOOST_CHECK(nHits < 175);
+
+    BOOST_CHECK(rb1.contains(data[DATASIZE - 1]));
+    rb1.reset();
+    BOOST_CHECK(!rb1.contains(data[DATASIZE - 1]));
+
+    // Now roll through data, make sure last 100 entries
+    // are always remembered:
+    for (int i = 0; i < DATASIZE; i++) {
+        if (i >= 100)
+            BOOST_CHECK(rb1.contains(data[i - 100]));
+        rb1.insert(data[i]);
+        BOOST_CHECK(rb1.contains(data[i]));
+    }
+
+    // Insert 999 more random entries:
+    for (int i = 0; i < 999; i++) {
+        rb1.insert(RandomData());
+    }
+    // Sanity check to make sure the filter isn't just filling up:
+    nHits = 0;
+    for (int i = 0; i < DATASIZE; i++) {
+        if (rb1.contains(data[i]))
+            ++nHits;
+    }
+    // Expect about 5 false positives, more than 100 means
+    // something is definitely broken.
+    BOOST_TEST_MESSAGE("RollingBloomFilter got " << nHits << " false positives (~5 expected)");
+    BOOST_CHECK(nHits < 100);
+
+    // last-1000-entry, 0.1% false positive:
+    CRollingBloomFilter rb2(1000, 0.001);
+    for (int i = 0; i < DATASIZE; i++) {
+        rb2.insert(data[i]);
+    }
+    // ... room for all of them:
+    for (int i = 0; i < DATASIZE; i++) {
+        BOOST_CHECK(rb2.contains(data[i]));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(rolling_bloom_inv)
+{
+    CRollingBloomFilter filter(1000, 0.000001);
+    uint256 hash = GetRandHash();
+
+    // The inventory type is part of the key: a transaction and its lock
+    // request share a hash but are announced separately
+    filter.insert(CInv(MSG_TX, hash));
+    BOOST_CHECK(filter.contains(CInv(MSG_TX, hash)));
+    BOOST_CHECK(!filter.contains(CInv(MSG_TXLOCK_REQUEST, hash)));
+    BOOST_CHECK(!filter.contains(hash));
+
+    filter.insert(hash);
+    BOOST_CHECK(filter.contains(hash));
+    BOOST_CHECK(!filter.contains(std::vector<unsigned char>(hash.begin(), hash.end())));
+}
+
+/** Time insert and lookup against the per-peer known-inventory filter, sized as CNode sizes it */
+BOOST_AUTO_TEST_CASE(benchmark_rollingbloom)
+{
+    static const int nItems = 1000000;
+    const unsigned int nWindow = std::max(1u, SendBufferSize() / 1000);
+    std::vector<CInv> vInv;
+    vInv.reserve(nItems);
+    for (int i = 0; i < nItems; i++)
+        vInv.push_back(CInv(MSG_TX, GetRandHash()));
+
+    CRollingBloomFilter filter(nWindow, INVENTORY_KNOWN_FP_RATE);
+    int64_t nStart = GetTimeMicros();
+    for (int i = 0; i < nItems; i++)
+        filter.insert(vInv[i]);
+    int64_t nInserted = GetTimeMicros();
+    int nFound = 0;
+    for (int i = 0; i < nItems; i++)
+        nFound += filter.contains(vInv[i]);
+    int64_t nDone = GetTimeMicros();
+
+    // only the most recent window is guaranteed to be remembered
+    BOOST_CHECK(nFound >= (int)nWindow);
+    BOOST_TEST_MESSAGE(strprintf("rolling bloom filter (%u bytes): %d inserts %.2fms, %d lookups %.2fms",
+        filter.DynamicMemoryUsage(), nItems, (nInserted - nStart) * 0.001, nItems, (nDone - nInserted) * 0.001));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,184 @@
+// Copyright (c) 2021 The Uidd developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "coinselection.h"
+#include "random.h"
+#include "utiltime.h"
+#include "wallet.h"
+
+#include <cstdlib>
+#include <set>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+typedef set<pair<const CWalletTx*, unsigned int> > CoinSet;
+
+BOOST_AUTO_TEST_SUITE(coinselection_tests)
+
+static CWallet wallet;
+
+static vector<CSelectCoin> MakeCoins(const vector<CAmount>& vValues)
+{
+    vector<CSelectCoin> vCoins;
+    for (size_t i = 0; i < vValues.size(); i++) {
+        CSelectCoin coin;
+        coin.nValue = coin.nEffectiveValue = vValues[i];
+        coin.tx = NULL;
+        coin.i = i;
+        coin.nDepth = 6;
+        vCoins.push_back(coin);
+    }
+    return vCoins;
+}
+
+static vector<CAmount> SuffixSums(const vector<CSelectCoin>& vCoins)
+{
+    vector<CAmount> vSuffix(vCoins.size() + 1, 0);
+    for (size_t i = vCoins.size(); i > 0; i--)
+        vSuffix[i - 1] = vSuffix[i] + vCoins[i - 1].nEffectiveValue;
+    return vSuffix;
+}
+
+BOOST_AUTO_TEST_CASE(branch_and_bound)
+{
+    vector<CAmount> vValues;
+    vValues.push_back(20 * CENT);
+    vValues.push_back(10 * CENT);
+    vValues.push_back(5 * CENT);
+    vValues.push_back(2 * CENT);
+    vValues.push_back(1 * CENT);
+    vector<CSelectCoin> vCoins = MakeCoins(vValues);
+    vector<CAmount> vSuffix = SuffixSums(vCoins);
+    vector<size_t> vBest;
+    CAmount nBest;
+
+    // exact matches
+    BOOST_CHECK(SelectBranchAndBound(vCoins, vSuffix, 0, 8 * CENT, vBest, nBest));
+    BOOST_CHECK_EQUAL(nBest, 8 * CENT);
+    BOOST_CHECK_EQUAL(vBest.size(), 3U);
+    BOOST_CHECK(SelectBranchAndBound(vCoins, vSuffix, 0, 38 * CENT, vBest, nBest));
+    BOOST_CHECK_EQUAL(vBest.size(), 5U);
+
+    // no exact match: smallest overshoot wins
+    BOOST_CHECK(!SelectBranchAndBound(vCoins, vSuffix, 0, 34 * CENT, vBest, nBest));
+    BOOST_CHECK_EQUAL(nBest, 35 * CENT);
+    BOOST_CHECK(!SelectBranchAndBound(vCoins, vSuffix, 0, 9 * CENT, vBest, nBest));
+    BOOST_CHECK_EQUAL(nBest, 10 * CENT);
+
+    // starting past the large coins
+    BOOST_CHECK(!SelectBranchAndBound(vCoins, vSuffix, 2, 9 * CENT, vBest, nBest));
+    BOOST_CHECK(vBest.empty());
+    BOOST_CHECK(SelectBranchAndBound(vCoins, vSuffix, 2, 7 * CENT, vBest, nBest));
+    BOOST_CHECK_EQUAL(vBest[0], 2U);
+
+    // many identical coins don't blow up the search
+    vector<CSelectCoin> vSame = MakeCoins(vector<CAmount>(1000, COIN));
+    vector<CAmount> vSameSuffix = SuffixSums(vSame);
+    BOOST_CHECK(!SelectBranchAndBound(vSame, vSameSuffix, 0, 500 * COIN + 1, vBest, nBest, 10000));
+    BOOST_CHECK_EQUAL(nBest, 501 * COIN);
+}
+
+BOOST_AUTO_TEST_CASE(selector_reuse)
+{
+    LOCK(wallet.cs_wallet);
+
+    CMutableTransaction tx;
+    tx.vout.resize(4);
+    tx.vout[0].nValue = 1 * COIN;
+    tx.vout[1].nValue = 2 * COIN;
+    tx.vout[2].nValue = 3 * COIN;
+    tx.vout[3].nValue = 4 * COIN;
+    CWalletTx wtx(&wallet, tx);
+
+    vector<COutput> vCoins;
+    for (int i = 0; i < 4; i++)
+        vCoins.push_back(COutput(&wtx, i, i == 3 ? 0 : 10, true));
+
+    CCoinSelector selector(wallet, vCoins);
+    BOOST_CHECK_EQUAL(selector.size(), 4U);
+
+    CoinSet setCoinsRet;
+    CAmount nValueRet;
+
+    // the unconfirmed 4 COIN output is only used once we accept zero confirmations
+    BOOST_CHECK(selector.Select(4 * COIN, 1, 1, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 4 * COIN);
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 2U);
+    BOOST_CHECK(selector.Select(4 * COIN, 0, 0, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 1U);
+    BOOST_CHECK(!selector.Select(7 * COIN, 1, 1, setCoinsRet, nValueRet));
+
+    // repeated passes of the fee loop see the same outputs
+    for (int i = 0; i < 10; i++) {
+        BOOST_CHECK(selector.Select(5 * COIN + i * CENT, 1, 1, setCoinsRet, nValueRet));
+        BOOST_CHECK(nValueRet >= 5 * COIN + i * CENT);
+    }
+
+    // an input cost that outweighs the smallest output drops it from selection
+    CCoinSelector costly(wallet, vCoins, COIN);
+    BOOST_CHECK_EQUAL(costly.size(), 3U);
+}
+
+/** Build a selector over nOutputs small staking-sized outputs and time ten passes of the fee loop */
+static void SelectFromSyntheticWallet(size_t nOutputs)
+{
+    LOCK(wallet.cs_wallet);
+
+    CMutableTransaction tx;
+    tx.vout.resize(nOutputs);
+    for (size_t i = 0; i < nOutputs; i++)
+        tx.vout[i].nValue = COIN / 10 + GetRand(10 * COIN);
+    CWalletTx wtx(&wallet, tx);
+
+    vector<COutput> vCoins;
+    vCoins.reserve(nOutputs);
+    for (size_t i = 0; i < nOutputs; i++)
+        vCoins.push_back(COutput(&wtx, i, 100, true));
+
+    int64_t nStart = GetTimeMicros();
+    CCoinSelector selector(wallet, vCoins);
+    int64_t nBuilt = GetTimeMicros();
+
+    CoinSet setCoinsRet;
+    CAmount nValueRet;
+    for (int nPass = 0; nPass < 10; nPass++) {
+        CAmount nTarget = 123 * COIN + nPass * 1000;
+        BOOST_CHECK(selector.Select(nTarget, 1, 6, setCoinsRet, nValueRet));
+        BOOST_CHECK(nValueRet >= nTarget);
+    }
+    int64_t nDone = GetTimeMicros();
+
+    BOOST_TEST_MESSAGE(strprintf("coin selection over %d outputs: build %.2fms, 10 selections %.2fms",
+        nOutputs, (nBuilt - nStart) * 0.001, (nDone - nBuilt) * 0.001));
+}
+
+BOOST_AUTO_TEST_CASE(coinselection_many_outputs)
+{
+    SelectFromSyntheticWallet(1000);
+    SelectFromSyntheticWallet(5000);
+}
+
+/**
+ * Benchmark over synthetic wallets of 10k to 1M outputs. It takes a while, so
+ * it only runs with BENCHMARK_COINSELECTION set in the environment; run
+ * test_uidd with --log_level=message to see the timings.
+ */
+BOOST_AUTO_TEST_CASE(benchmark_coinselection)
+{
+    if (!getenv("BENCHMARK_COINSELECTION")) {
+        BOOST_TEST_MESSAGE("benchmark_coinselection skipped, set BENCHMARK_COINSELECTION to run it");
+        return;
+    }
+
+    const size_t vSizes[] = {10000, 100000, 1000000};
+    for (size_t s = 0; s < sizeof(vSizes) / sizeof(vSizes[0]); s++)
+        SelectFromSyntheticWallet(vSizes[s]);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,149 @@
+// Copyright (c) 2021 The Uidd developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "expirymap.h"
+
+#include "random.h"
+
+#include <map>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(expirymap_tests)
+
+BOOST_AUTO_TEST_CASE(expirymap_basic)
+{
+    expirymap<int, int64_t> map(4);
+    vector<pair<int, int64_t> > vErased;
+
+    map.insert(make_pair(1, 30));
+    map.insert(make_pair(2, 10));
+    map[3] = 20; // filed under the default value, due right away
+    BOOST_CHECK_EQUAL(map.size(), 3U);
+
+    map.expire(15, &vErased);
+    BOOST_CHECK_EQUAL(vErased.size(), 1U);
+    BOOST_CHECK_EQUAL(vErased[0].first, 2);
+    BOOST_CHECK_EQUAL(map.size(), 2U);
+    BOOST_CHECK(map.count(3));
+
+    // pushed later in place, kept past its first expiry
+    map.find(3)->second = 40;
+    vErased.clear();
+    map.expire(35, &vErased);
+    BOOST_CHECK_EQUAL(vErased.size(), 1U);
+    BOOST_CHECK_EQUAL(vErased[0].first, 1);
+    BOOST_CHECK(map.count(3));
+
+    // pulled earlier, only goes early once filed again
+    map.insert(make_pair(5, 80));
+    map.find(5)->second = 36;
+    map.expire(40);
+    BOOST_CHECK(map.count(5));
+    map.refile(map.find(5));
+    map.expire(40);
+    BOOST_CHECK(!map.count(5));
+
+    // erased keys don't come back when their old expiry is due
+    map.insert(make_pair(4, 50));
+    map.erase(4);
+    vErased.clear();
+    map.expire(100, &vErased);
+    BOOST_CHECK_EQUAL(vErased.size(), 1U);
+    BOOST_CHECK_EQUAL(vErased[0].first, 3);
+    BOOST_CHECK(map.empty());
+
+    // bounded, evicting what's due soonest
+    for (int i = 0; i < 4; i++)
+        map.insert(make_pair(i, 200 - i));
+    map.insert(make_pair(4, 300));
+    BOOST_CHECK_EQUAL(map.size(), 4U);
+    BOOST_CHECK(!map.count(3));
+    BOOST_CHECK(map.count(4));
+    map.clear();
+    BOOST_CHECK(map.empty());
+}
+
+BOOST_AUTO_TEST_CASE(expirymap_evict_current_expiry)
+{
+    expirymap<int, int64_t> map(2);
+    vector<pair<int, int64_t> > vErased;
+
+    // re-inserted after an erase, its old expiry is gone
+    map.insert(make_pair(1, 10));
+    map.erase(1);
+    map.insert(make_pair(1, 50));
+    map.insert(make_pair(2, 30));
+    map.insert(make_pair(3, 40), &vErased);
+    BOOST_CHECK_EQUAL(vErased.size(), 1U);
+    BOOST_CHECK_EQUAL(vErased[0].first, 2);
+    BOOST_CHECK(map.count(1));
+    BOOST_CHECK(map.count(3));
+
+    // pushed later in place, evicted by its current expiry
+    map.clear();
+    map.insert(make_pair(1, 10));
+    map.find(1)->second = 50;
+    map.insert(make_pair(2, 30));
+    vErased.clear();
+    map.insert(make_pair(3, 40), &vErased);
+    BOOST_CHECK_EQUAL(vErased.size(), 1U);
+    BOOST_CHECK_EQUAL(vErased[0].first, 2);
+
+    // refiled earlier, the entry under the later expiry is stale
+    map.find(1)->second = 20;
+    map.refile(map.find(1));
+    map.find(1)->second = 60;
+    map.refile(map.find(1));
+    vErased.clear();
+    map.insert(make_pair(4, 70), &vErased);
+    BOOST_CHECK_EQUAL(vErased.size(), 1U);
+    BOOST_CHECK_EQUAL(vErased[0].first, 3);
+    BOOST_CHECK(map.count(1));
+    BOOST_CHECK(map.count(4));
+}
+
+// Compare against a plain map swept entry by entry
+BOOST_AUTO_TEST_CASE(expirymap_like_map)
+{
+    expirymap<int, int64_t> map;
+    std::map<int, int64_t> mapRef;
+    int64_t nNow = 0;
+    for (int i = 0; i < 10000; i++) {
+        int k = insecure_rand() % 1000;
+        int nAction = insecure_rand() % 4;
+        if (nAction == 0) {
+            int64_t nTime = nNow + insecure_rand() % 5000;
+            map.insert(make_pair(k, nTime));
+            mapRef.insert(make_pair(k, nTime));
+        } else if (nAction == 1) {
+            // only ever pushed later
+            if (map.count(k) && mapRef[k] < nNow + 5000) {
+                map[k] = nNow + 5000;
+                mapRef[k] = nNow + 5000;
+            }
+        } else if (nAction == 2) {
+            map.erase(k);
+            mapRef.erase(k);
+        } else {
+            nNow += insecure_rand() % 500;
+            map.expire(nNow);
+            std::map<int, int64_t>::iterator it = mapRef.begin();
+            while (it != mapRef.end()) {
+                if (it->second < nNow)
+                    mapRef.erase(it++);
+                else
+                    ++it;
+            }
+        }
+        BOOST_CHECK_EQUAL(map.size(), mapRef.size());
+    }
+    std::map<int, int64_t> mapLeft(map.begin(), map.end());
+    BOOST_CHECK(mapLeft == mapRef);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
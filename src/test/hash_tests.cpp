@@ -46,4 +46,36 @@ BOOST_AUTO_TEST_CASE(murmurhash3)
 #undef T
 }
 
+BOOST_AUTO_TEST_CASE(siphash)
+{
+    // Test vectors from the SipHash reference implementation, key 00..0f and message 00..n-1
+    CSipHasher hasher(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0x726fdb47dd0e0e31ull);
+    hasher.Write(0x0706050403020100ULL);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0x93f5f5799a932462ull);
+    hasher.Write(0x0F0E0D0C0B0A0908ULL);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0x3f2acc7f57c29bdbull);
+    hasher.Write(0x1716151413121110ULL);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0xb8ad50c6f649af94ull);
+    hasher.Write(0x1F1E1D1C1B1A1918ULL);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0x7127512f72f27cceull);
+
+    // SipHashUint256 matches writing the four little-endian words
+    uint256 x;
+    for (int i = 0; i < 32; i++)
+        x.begin()[i] = i;
+    BOOST_CHECK_EQUAL(SipHashUint256(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL, x), 0x7127512f72f27cceull);
+    BOOST_CHECK_EQUAL(SipHashUint256(1, 2, x), 0x16f97b9187bc4e8bull);
+    BOOST_CHECK_EQUAL(SipHashUint256Extra(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL, x, 0x11223344), 0xd6063a89fea7a5aaull);
+
+    // Byte writes give the same result as word writes, across partial words
+    CSipHasher hasher2(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL);
+    hasher2.Write(x.begin(), 8);
+    BOOST_CHECK_EQUAL(hasher2.Finalize(), 0x93f5f5799a932462ull);
+    hasher2.Write(x.begin() + 8, 7);
+    BOOST_CHECK_EQUAL(hasher2.Finalize(), 0xa129ca6149be45e5ull);
+    hasher2.Write(x.begin() + 15, 1);
+    BOOST_CHECK_EQUAL(hasher2.Finalize(), 0x3f2acc7f57c29bdbull);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
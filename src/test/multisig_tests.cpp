@@ -18,6 +18,7 @@
 #include <boost/assign/std/vector.hpp>
 #include <boost/foreach.hpp>
 #include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
 
 using namespace std;
 using namespace boost::assign;
@@ -319,5 +320,80 @@ BOOST_AUTO_TEST_CASE(multisig_Sign)
     }
 }
 
+BOOST_AUTO_TEST_CASE(multisig_SignTransaction)
+{
+    // SignTransaction() must give the same scriptSigs as SignSignature() on each input,
+    // including when the inputs are split across signing threads
+    CBasicKeyStore keystore;
+    CKey key[3];
+    for (int i = 0; i < 3; i++)
+    {
+        key[i].MakeNewKey(i != 2);
+        keystore.AddKey(key[i]);
+    }
+
+    CScript escrow;
+    escrow << OP_2 << ToByteVector(key[0].GetPubKey()) << ToByteVector(key[1].GetPubKey()) << ToByteVector(key[2].GetPubKey()) << OP_3 << OP_CHECKMULTISIG;
+    keystore.AddCScript(escrow);
+
+    const unsigned int nInputs = 4 * SIGN_PARALLEL_MIN_INPUTS + 3;
+    CMutableTransaction txFrom;
+    txFrom.vout.resize(nInputs);
+    for (unsigned int i = 0; i < nInputs; i++)
+    {
+        if (i % 3 == 0)
+            txFrom.vout[i].scriptPubKey = GetScriptForDestination(key[i % 2].GetPubKey().GetID());
+        else if (i % 3 == 1)
+            txFrom.vout[i].scriptPubKey = GetScriptForDestination(CScriptID(escrow));
+        else
+            txFrom.vout[i].scriptPubKey = escrow;
+    }
+
+    CMutableTransaction txTo;
+    txTo.vin.resize(nInputs);
+    txTo.vout.resize(1);
+    txTo.vout[0].nValue = 1;
+    vector<CScript> vFromPubKeys;
+    for (unsigned int i = 0; i < nInputs; i++)
+    {
+        txTo.vin[i].prevout.n = i;
+        txTo.vin[i].prevout.hash = txFrom.GetHash();
+        vFromPubKeys.push_back(txFrom.vout[i].scriptPubKey);
+    }
+
+    // the shared serialization gives the same hashes as serializing per input
+    const CTransaction txUnsigned(txTo);
+    const PrecomputedTransactionData txdata(txUnsigned);
+    for (unsigned int i = 0; i < nInputs; i++)
+    {
+        BOOST_CHECK(SignatureHash(escrow, txUnsigned, i, SIGHASH_ALL, &txdata) == SignatureHash(escrow, txUnsigned, i, SIGHASH_ALL));
+        BOOST_CHECK(SignatureHash(escrow, txUnsigned, i, SIGHASH_NONE, &txdata) == SignatureHash(escrow, txUnsigned, i, SIGHASH_NONE));
+    }
+
+    CMutableTransaction txSerial = txTo;
+    for (unsigned int i = 0; i < nInputs; i++)
+        BOOST_CHECK(SignSignature(keystore, txFrom, txSerial, i));
+
+    CMutableTransaction txInline = txTo;
+    BOOST_CHECK(SignTransaction(keystore, vFromPubKeys, txInline));
+    BOOST_CHECK(CTransaction(txInline) == CTransaction(txSerial));
+
+    boost::thread_group threadGroup;
+    StartSigningThreads(threadGroup);
+    CMutableTransaction txParallel = txTo;
+    BOOST_CHECK(SignTransaction(keystore, vFromPubKeys, txParallel));
+    BOOST_CHECK(CTransaction(txParallel) == CTransaction(txSerial));
+
+    // inputs with no script are left alone, and missing keys are reported
+    vFromPubKeys[1] = CScript();
+    vFromPubKeys[0] = GetScriptForDestination(CKeyID());
+    CMutableTransaction txPartial = txTo;
+    BOOST_CHECK(!SignTransaction(keystore, vFromPubKeys, txPartial));
+    BOOST_CHECK(txPartial.vin[1].scriptSig.empty());
+    BOOST_CHECK(txPartial.vin[2].scriptSig == txSerial.vin[2].scriptSig);
+
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+}
 
 BOOST_AUTO_TEST_SUITE_END()
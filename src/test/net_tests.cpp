@@ -0,0 +1,168 @@
+// Copyright (c) 2021 The Uidd developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "net.h"
+
+#include "hash.h"
+#include "serialize.h"
+#include "streams.h"
+#include "version.h"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(net_tests)
+
+static CSerializedNetMsg MakeMsg(const char* pszCommand, size_t nPayloadSize)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << CMessageHeader(pszCommand, 0) << vector<unsigned char>(nPayloadSize, 0x42);
+    return FinalizeNetMessage(ss);
+}
+
+BOOST_AUTO_TEST_CASE(finalize_net_message)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << CMessageHeader("block", 0) << string("payload");
+    CSerializedNetMsg msg = FinalizeNetMessage(ss);
+    BOOST_CHECK(ss.empty());
+
+    CDataStream ssMsg(msg->begin(), msg->end(), SER_NETWORK, PROTOCOL_VERSION);
+    CMessageHeader hdr;
+    ssMsg >> hdr;
+    BOOST_CHECK(hdr.IsValid());
+    BOOST_CHECK_EQUAL(hdr.GetCommand(), "block");
+    BOOST_CHECK_EQUAL(hdr.nMessageSize, ssMsg.size());
+
+    uint256 hash = Hash(ssMsg.begin(), ssMsg.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    BOOST_CHECK_EQUAL(hdr.nChecksum, nChecksum);
+
+    string strPayload;
+    ssMsg >> strPayload;
+    BOOST_CHECK_EQUAL(strPayload, "payload");
+
+    // Built from an object or from its serialized payload, the message is the same
+    CDataStream ssPayload(SER_NETWORK, PROTOCOL_VERSION);
+    ssPayload << string("payload");
+    BOOST_CHECK(*MakeNetMessage("block", string("payload")) == *msg);
+    BOOST_CHECK(*MakeNetMessage("block", ssPayload) == *msg);
+}
+
+BOOST_AUTO_TEST_CASE(net_message_cache)
+{
+    // Room for three 1000 byte payloads plus headers, but not four
+    CNetMessageCache cache(3 * 1100);
+    uint256 hash[4];
+    CSerializedNetMsg msg[4];
+    for (int i = 0; i < 4; i++) {
+        hash[i] = i + 1;
+        msg[i] = MakeMsg("block", 1000);
+    }
+
+    for (int i = 0; i < 3; i++)
+        cache.Insert(hash[i], msg[i]);
+    BOOST_CHECK(cache.Get(hash[0]) == msg[0]);
+
+    // hash[1] is now the least recently used
+    cache.Insert(hash[3], msg[3]);
+    BOOST_CHECK(!cache.Get(hash[1]));
+    BOOST_CHECK(cache.Get(hash[0]) == msg[0]);
+    BOOST_CHECK(cache.Get(hash[2]) == msg[2]);
+    BOOST_CHECK(cache.Get(hash[3]) == msg[3]);
+
+    // Evicted messages stay valid for whoever still holds them
+    BOOST_CHECK_EQUAL(msg[1]->size(), msg[0]->size());
+
+    // Shrinking drops the oldest entries; a message larger than the cache is never kept
+    cache.SetMaxBytes(1100);
+    BOOST_CHECK(!cache.Get(hash[0]));
+    BOOST_CHECK(!cache.Get(hash[2]));
+    BOOST_CHECK(cache.Get(hash[3]) == msg[3]);
+    cache.Insert(hash[1], MakeMsg("block", 2000));
+    BOOST_CHECK(!cache.Get(hash[1]));
+
+    cache.SetMaxBytes(0);
+    BOOST_CHECK(!cache.Get(hash[3]));
+}
+
+BOOST_AUTO_TEST_CASE(net_message_incremental_hash)
+{
+    CSerializedNetMsg msg = MakeMsg("tx", 100000);
+    const char* pch = &(*msg)[0];
+    uint256 hashExpected = Hash(msg->begin() + CMessageHeader::HEADER_SIZE, msg->end());
+
+    // Fed in odd-sized pieces, as from the socket
+    CNetMessage msgCopied(SER_NETWORK, PROTOCOL_VERSION);
+    size_t nPos = 0;
+    while (nPos < msg->size()) {
+        unsigned int nChunk = std::min((size_t)997, msg->size() - nPos);
+        int nHandled = msgCopied.in_data ? msgCopied.readData(pch + nPos, nChunk) : msgCopied.readHeader(pch + nPos, nChunk);
+        BOOST_CHECK(nHandled > 0);
+        nPos += nHandled;
+    }
+    BOOST_CHECK(msgCopied.complete());
+    BOOST_CHECK(msgCopied.GetMessageHash() == hashExpected);
+
+    // Body written straight into the message buffer
+    CNetMessage msgDirect(SER_NETWORK, PROTOCOL_VERSION);
+    BOOST_CHECK_EQUAL(msgDirect.readHeader(pch, CMessageHeader::HEADER_SIZE), (int)CMessageHeader::HEADER_SIZE);
+    nPos = CMessageHeader::HEADER_SIZE;
+    while (!msgDirect.complete()) {
+        unsigned int nSize = 0x10000;
+        char* pchDest = msgDirect.prepareData(nSize);
+        BOOST_CHECK(nSize > 0 && nSize <= msg->size() - nPos);
+        memcpy(pchDest, pch + nPos, nSize);
+        msgDirect.commitData(nSize);
+        nPos += nSize;
+    }
+    BOOST_CHECK(msgDirect.GetMessageHash() == hashExpected);
+
+    // An empty payload is complete as soon as the header is
+    CDataStream ssEmpty(SER_NETWORK, PROTOCOL_VERSION);
+    ssEmpty << CMessageHeader("verack", 0);
+    CSerializedNetMsg msgVerack = FinalizeNetMessage(ssEmpty);
+    CNetMessage msgHeaderOnly(SER_NETWORK, PROTOCOL_VERSION);
+    msgHeaderOnly.readHeader(&(*msgVerack)[0], msgVerack->size());
+    BOOST_CHECK(msgHeaderOnly.complete());
+    BOOST_CHECK(msgHeaderOnly.GetMessageHash() == Hash(msgVerack->end(), msgVerack->end()));
+}
+
+BOOST_AUTO_TEST_CASE(net_msg_type_index)
+{
+    // the table must stay sorted for the binary search
+    for (unsigned int i = 1; i + 1 < NUM_NET_MSG_TYPES; i++)
+        BOOST_CHECK(string(GetNetMsgTypeName(i - 1)) < string(GetNetMsgTypeName(i)));
+
+    for (unsigned int i = 0; i + 1 < NUM_NET_MSG_TYPES; i++)
+        BOOST_CHECK_EQUAL(GetNetMsgTypeIndex(GetNetMsgTypeName(i)), i);
+
+    unsigned int nOther = NUM_NET_MSG_TYPES - 1;
+    BOOST_CHECK_EQUAL(string(GetNetMsgTypeName(nOther)), "*other*");
+    BOOST_CHECK_EQUAL(GetNetMsgTypeIndex("*other*"), nOther);
+    BOOST_CHECK_EQUAL(GetNetMsgTypeIndex(""), nOther);
+    BOOST_CHECK_EQUAL(GetNetMsgTypeIndex("zzz"), nOther);
+    BOOST_CHECK_EQUAL(GetNetMsgTypeIndex("blocks"), nOther);
+
+    CNetMsgTypeCounters counters;
+    counters.AddSend(100);
+    counters.AddSend(20);
+    counters.AddRecv(7);
+    counters.AddProcessTime(1500);
+    CNetMsgTypeStats stats;
+    counters.Get(stats);
+    BOOST_CHECK_EQUAL(stats.nSendBytes, 120U);
+    BOOST_CHECK_EQUAL(stats.nSendMsgs, 2U);
+    BOOST_CHECK_EQUAL(stats.nRecvBytes, 7U);
+    BOOST_CHECK_EQUAL(stats.nRecvMsgs, 1U);
+    BOOST_CHECK_EQUAL(stats.nProcessMicros, 1500U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
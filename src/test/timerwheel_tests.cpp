@@ -0,0 +1,90 @@
+// Copyright (c) 2021 The Uidd developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "timerwheel.h"
+
+#include "random.h"
+
+#include <map>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(timerwheel_tests)
+
+BOOST_AUTO_TEST_CASE(timerwheel_basic)
+{
+    timerwheel<int> wheel(10, 8, 5);
+    vector<int> vOut;
+
+    BOOST_CHECK(wheel.insert(25, 1));
+    BOOST_CHECK(wheel.insert(21, 2));
+    BOOST_CHECK(wheel.insert(5, 3));
+    // far beyond one turn of the wheel, shares a bucket with 25
+    BOOST_CHECK(wheel.insert(105, 4));
+    BOOST_CHECK_EQUAL(wheel.size(), 4U);
+
+    wheel.pop_due(20, vOut);
+    BOOST_CHECK_EQUAL(vOut.size(), 1U);
+    BOOST_CHECK_EQUAL(vOut[0], 3);
+
+    // due within the current tick, earliest first
+    vOut.clear();
+    wheel.pop_due(25, vOut);
+    BOOST_CHECK_EQUAL(vOut.size(), 2U);
+    BOOST_CHECK_EQUAL(vOut[0], 2);
+    BOOST_CHECK_EQUAL(vOut[1], 1);
+
+    // something already overdue pops on the next call
+    BOOST_CHECK(wheel.insert(0, 5));
+    vOut.clear();
+    wheel.pop_due(26, vOut);
+    BOOST_CHECK_EQUAL(vOut.size(), 1U);
+    BOOST_CHECK_EQUAL(vOut[0], 5);
+
+    vOut.clear();
+    wheel.pop_due(104, vOut);
+    BOOST_CHECK(vOut.empty());
+    wheel.pop_due(1000, vOut);
+    BOOST_CHECK_EQUAL(vOut.size(), 1U);
+    BOOST_CHECK_EQUAL(vOut[0], 4);
+    BOOST_CHECK(wheel.empty());
+
+    // bounded
+    for (int i = 0; i < 5; i++)
+        BOOST_CHECK(wheel.insert(2000 + i, i));
+    BOOST_CHECK(!wheel.insert(2000, 5));
+    wheel.clear();
+    BOOST_CHECK(wheel.empty());
+}
+
+// Compare against a multimap under random inserts and pops
+BOOST_AUTO_TEST_CASE(timerwheel_like_multimap)
+{
+    timerwheel<int> wheel(1000, 16, 100000);
+    multimap<int64_t, int> mapRef;
+    int64_t nNow = 0;
+    for (int i = 0; i < 10000; i++) {
+        if (insecure_rand() % 3) {
+            int64_t nTime = nNow - 5000 + insecure_rand() % 50000;
+            wheel.insert(nTime, i);
+            mapRef.insert(make_pair(nTime, i));
+        } else {
+            nNow += insecure_rand() % 3000;
+            vector<int> vOut;
+            wheel.pop_due(nNow, vOut);
+            vector<int> vRef;
+            while (!mapRef.empty() && mapRef.begin()->first <= nNow) {
+                vRef.push_back(mapRef.begin()->second);
+                mapRef.erase(mapRef.begin());
+            }
+            BOOST_CHECK(vOut == vRef);
+        }
+        BOOST_CHECK_EQUAL(wheel.size(), mapRef.size());
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
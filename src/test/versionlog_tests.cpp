@@ -0,0 +1,95 @@
+// Copyright (c) 2021 The Uidd developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "versionlog.h"
+
+#include "random.h"
+
+#include <map>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(versionlog_tests)
+
+BOOST_AUTO_TEST_CASE(versionlog_basic)
+{
+    versionlog<int> log;
+    vector<int> vChanged;
+
+    BOOST_CHECK_EQUAL(log.version(), 0);
+    log.since(0, vChanged);
+    BOOST_CHECK(vChanged.empty());
+
+    BOOST_CHECK_EQUAL(log.touch(1), 1);
+    BOOST_CHECK_EQUAL(log.touch(2), 2);
+    BOOST_CHECK_EQUAL(log.touch(3), 3);
+    int64_t nSynced = log.version();
+
+    // touched again, moves up to the latest version
+    BOOST_CHECK_EQUAL(log.touch(1), 4);
+    log.since(nSynced, vChanged);
+    BOOST_CHECK_EQUAL(vChanged.size(), 1U);
+    BOOST_CHECK_EQUAL(vChanged[0], 1);
+
+    // everything, oldest change first
+    vChanged.clear();
+    log.since(0, vChanged);
+    BOOST_CHECK_EQUAL(vChanged.size(), 3U);
+    BOOST_CHECK_EQUAL(vChanged[0], 2);
+    BOOST_CHECK_EQUAL(vChanged[1], 3);
+    BOOST_CHECK_EQUAL(vChanged[2], 1);
+
+    // erased keys aren't sent, the version stays
+    log.erase(1);
+    log.erase(5);
+    BOOST_CHECK_EQUAL(log.size(), 2U);
+    BOOST_CHECK(!log.count(1));
+    BOOST_CHECK_EQUAL(log.version(), 4);
+    vChanged.clear();
+    log.since(nSynced, vChanged);
+    BOOST_CHECK(vChanged.empty());
+
+    // versions don't go back after clear()
+    log.clear();
+    BOOST_CHECK(log.empty());
+    BOOST_CHECK_EQUAL(log.touch(2), 5);
+}
+
+// Compare against a plain map of versions scanned in full
+BOOST_AUTO_TEST_CASE(versionlog_like_map)
+{
+    versionlog<int> log;
+    std::map<int, int64_t> mapRef;
+    for (int i = 0; i < 10000; i++) {
+        int k = insecure_rand() % 500;
+        if (insecure_rand() % 3) {
+            mapRef[k] = log.touch(k);
+        } else {
+            log.erase(k);
+            mapRef.erase(k);
+        }
+        BOOST_CHECK_EQUAL(log.size(), mapRef.size());
+
+        if (i % 100 == 0) {
+            int64_t nSince = insecure_rand() % (log.version() + 1);
+            vector<int> vChanged;
+            log.since(nSince, vChanged);
+
+            std::map<int64_t, int> mapRefChanged;
+            for (std::map<int, int64_t>::const_iterator it = mapRef.begin(); it != mapRef.end(); ++it)
+                if (it->second > nSince)
+                    mapRefChanged[it->second] = it->first;
+            BOOST_CHECK_EQUAL(vChanged.size(), mapRefChanged.size());
+            vector<int> vRefChanged;
+            for (std::map<int64_t, int>::const_iterator it = mapRefChanged.begin(); it != mapRefChanged.end(); ++it)
+                vRefChanged.push_back(it->second);
+            BOOST_CHECK(vChanged == vRefChanged);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,107 @@
+// Copyright (c) 2021 The Uidd developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_TIMERWHEEL_H
+#define BITCOIN_TIMERWHEEL_H
+
+#include <algorithm>
+#include <assert.h>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+/**
+ * Bounded hashed timer wheel: holds up to nMaxSize elements, each due at a
+ * given time. Elements are hashed into nSlots buckets of nTick time units each,
+ * so inserting is O(1) and popping what's due only looks at the buckets for
+ * the ticks that elapsed since the last pop. Elements due further out than one
+ * turn of the wheel wait in their bucket until their turn comes around.
+ */
+template <typename T>
+class timerwheel
+{
+public:
+    typedef std::pair<int64_t, T> entry_type;
+
+protected:
+    std::vector<std::vector<entry_type> > vSlots;
+    int64_t nTick;
+    int64_t nNextTick; //! first tick whose bucket hasn't been fully drained
+    size_t nSize;
+    size_t nMaxSize;
+
+    std::vector<entry_type>& Slot(int64_t nTickIn) { return vSlots[nTickIn % (int64_t)vSlots.size()]; }
+
+public:
+    timerwheel(int64_t nTickIn, size_t nSlotsIn, size_t nMaxSizeIn) : vSlots(nSlotsIn), nTick(nTickIn), nNextTick(0), nSize(0), nMaxSize(nMaxSizeIn)
+    {
+        assert(nTickIn > 0 && nSlotsIn > 0);
+    }
+
+    size_t size() const { return nSize; }
+    bool empty() const { return nSize == 0; }
+    size_t max_size() const { return nMaxSize; }
+
+    /** Schedule x for nTime. Returns false, dropping x, if the wheel is full. */
+    bool insert(int64_t nTime, const T& x)
+    {
+        if (nSize >= nMaxSize)
+            return false;
+        if (nTime < 0)
+            nTime = 0;
+        // Already due: file it under the next bucket to be drained
+        Slot(std::max(nTime / nTick, nNextTick)).push_back(std::make_pair(nTime, x));
+        nSize++;
+        return true;
+    }
+
+    /** Remove everything due at or before nNow and append it to vOut, earliest first */
+    void pop_due(int64_t nNow, std::vector<T>& vOut)
+    {
+        int64_t nNowTick = nNow / nTick;
+        if (nNowTick < nNextTick)
+            return;
+        if (nSize == 0) {
+            nNextTick = nNowTick;
+            return;
+        }
+        // After one full turn every bucket has been visited
+        int64_t nFirst = std::max(nNextTick, nNowTick - (int64_t)vSlots.size() + 1);
+
+        std::vector<entry_type> vDue;
+        for (int64_t t = nFirst; t <= nNowTick; t++) {
+            std::vector<entry_type>& slot = Slot(t);
+            size_t nKeep = 0;
+            for (size_t i = 0; i < slot.size(); i++) {
+                if (slot[i].first <= nNow)
+                    vDue.push_back(slot[i]);
+                else
+                    slot[nKeep++] = slot[i];
+            }
+            slot.resize(nKeep);
+        }
+        // The current tick's bucket may still hold entries due later in the tick
+        nNextTick = nNowTick;
+        nSize -= vDue.size();
+
+        std::stable_sort(vDue.begin(), vDue.end(), CompareTime());
+        vOut.reserve(vOut.size() + vDue.size());
+        for (size_t i = 0; i < vDue.size(); i++)
+            vOut.push_back(vDue[i].second);
+    }
+
+    void clear()
+    {
+        for (size_t i = 0; i < vSlots.size(); i++)
+            vSlots[i].clear();
+        nSize = 0;
+    }
+
+private:
+    struct CompareTime {
+        bool operator()(const entry_type& a, const entry_type& b) const { return a.first < b.first; }
+    };
+};
+
+#endif // BITCOIN_TIMERWHEEL_H
@@ -0,0 +1,68 @@
+// Copyright (c) 2021 The Uidd developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_VERSIONLOG_H
+#define BITCOIN_VERSIONLOG_H
+
+#include <map>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/**
+ * Keys ordered by the version they last changed at. Every touch() takes the
+ * next version, so whoever was sent everything up to some version only needs
+ * the keys touched since. Erased keys are forgotten, and versions never go
+ * back, not even across clear().
+ */
+template <typename K>
+class versionlog
+{
+protected:
+    std::map<K, int64_t> mapVersions;
+    std::map<int64_t, K> mapLog;
+    int64_t nVersion;
+
+public:
+    versionlog() : nVersion(0) {}
+
+    /** Version of the latest change, 0 if nothing changed yet */
+    int64_t version() const { return nVersion; }
+    size_t size() const { return mapVersions.size(); }
+    bool empty() const { return mapVersions.empty(); }
+    bool count(const K& k) const { return mapVersions.count(k); }
+
+    /** Record a change to k, returns the version it changed at */
+    int64_t touch(const K& k)
+    {
+        erase(k);
+        mapVersions.insert(std::make_pair(k, ++nVersion));
+        mapLog.insert(std::make_pair(nVersion, k));
+        return nVersion;
+    }
+
+    void erase(const K& k)
+    {
+        typename std::map<K, int64_t>::iterator it = mapVersions.find(k);
+        if (it != mapVersions.end()) {
+            mapLog.erase(it->second);
+            mapVersions.erase(it);
+        }
+    }
+
+    void clear()
+    {
+        mapVersions.clear();
+        mapLog.clear();
+    }
+
+    /** Append the keys that changed after nSince to vOut, oldest change first */
+    void since(int64_t nSince, std::vector<K>& vOut) const
+    {
+        for (typename std::map<int64_t, K>::const_iterator it = mapLog.upper_bound(nSince); it != mapLog.end(); ++it)
+            vOut.push_back(it->second);
+    }
+};
+
+#endif // BITCOIN_VERSIONLOG_H
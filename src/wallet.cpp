@@ -12,6 +12,7 @@
 #include "base58.h"
 #include "checkpoints.h"
 #include "coincontrol.h"
+#include "coinselection.h"
 #include "kernel.h"
 //#include "masternode-budget.h"
 #include "net.h"
@@ -29,6 +30,7 @@
 #include <assert.h>
 
 #include <boost/algorithm/string/replace.hpp>
+#include <boost/bind.hpp>
 #include <boost/thread.hpp>
 #include <boost/filesystem/operations.hpp>
 
@@ -57,14 +59,6 @@ int64_t nStartupTime = GetAdjustedTime();
  * @{
  */
 
-struct CompareValueOnly {
-    bool operator()(const pair<CAmount, pair<const CWalletTx*, unsigned int> >& t1,
-        const pair<CAmount, pair<const CWalletTx*, unsigned int> >& t2) const
-    {
-        return t1.first < t2.first;
-    }
-};
-
 std::string COutput::ToString() const
 {
     return strprintf("COutput(%s, %d, %d) [%s]", tx->GetHash().ToString(), i, nDepth, FormatMoney(tx->vout[i].nValue));
@@ -95,21 +89,41 @@ CPubKey CWallet::GenerateNewKey()
     CPubKey pubkey = secret.GetPubKey();
     assert(secret.VerifyPubKey(pubkey));
 
+    AddNewKey(NULL, secret, pubkey);
+    return pubkey;
+}
+
+/** Record metadata for a freshly generated key and add it to the wallet */
+void CWallet::AddNewKey(CWalletDB* pwalletdb, const CKey& secret, const CPubKey& pubkey)
+{
+    AssertLockHeld(cs_wallet); // mapKeyMetadata
+
     // Create new metadata
     int64_t nCreationTime = GetTime();
     mapKeyMetadata[pubkey.GetID()] = CKeyMetadata(nCreationTime);
     if (!nTimeFirstKey || nCreationTime < nTimeFirstKey)
         nTimeFirstKey = nCreationTime;
 
-    if (!AddKeyPubKey(secret, pubkey))
-        throw std::runtime_error("CWallet::GenerateNewKey() : AddKey failed");
-    return pubkey;
+    if (!AddKeyPubKeyWithDB(pwalletdb, secret, pubkey))
+        throw std::runtime_error("CWallet::AddNewKey() : AddKey failed");
 }
 
 bool CWallet::AddKeyPubKey(const CKey& secret, const CPubKey& pubkey)
+{
+    return AddKeyPubKeyWithDB(NULL, secret, pubkey);
+}
+
+/** As AddKeyPubKey, but writes through pwalletdb (if given) so a batch of keys can share one database transaction */
+bool CWallet::AddKeyPubKeyWithDB(CWalletDB* pwalletdb, const CKey& secret, const CPubKey& pubkey)
 {
     AssertLockHeld(cs_wallet); // mapKeyMetadata
-    if (!CCryptoKeyStore::AddKeyPubKey(secret, pubkey))
+
+    // CCryptoKeyStore calls back into AddCryptedKey, which writes through
+    // pwalletdbKeyPool when it is set
+    pwalletdbKeyPool = pwalletdb;
+    bool fAdded = CCryptoKeyStore::AddKeyPubKey(secret, pubkey);
+    pwalletdbKeyPool = NULL;
+    if (!fAdded)
         return false;
 
     // check if we need to remove from watch-only
@@ -121,6 +135,8 @@ bool CWallet::AddKeyPubKey(const CKey& secret, const CPubKey& pubkey)
     if (!fFileBacked)
         return true;
     if (!IsCrypted()) {
+        if (pwalletdb)
+            return pwalletdb->WriteKey(pubkey, secret.GetPrivKey(), mapKeyMetadata[pubkey.GetID()]);
         return CWalletDB(strWalletFile).WriteKey(pubkey, secret.GetPrivKey(), mapKeyMetadata[pubkey.GetID()]);
     }
     return true;
@@ -135,7 +151,9 @@ bool CWallet::AddCryptedKey(const CPubKey& vchPubKey,
         return true;
     {
         LOCK(cs_wallet);
-        if (pwalletdbEncryption)
+        if (pwalletdbKeyPool)
+            return pwalletdbKeyPool->WriteCryptedKey(vchPubKey, vchCryptedSecret, mapKeyMetadata[vchPubKey.GetID()]);
+        else if (pwalletdbEncryption)
             return pwalletdbEncryption->WriteCryptedKey(vchPubKey,
                 vchCryptedSecret,
                 mapKeyMetadata[vchPubKey.GetID()]);
@@ -447,6 +465,31 @@ void CWallet::AddToSpends(const COutPoint& outpoint, const uint256& wtxid)
 }
 
 
+/**
+ * Index the spends of every loaded transaction at once. Metadata only needs
+ * syncing for outpoints with several spenders, and only once per outpoint
+ * rather than after each insert.
+ */
+void CWallet::LoadSpends()
+{
+    AssertLockHeld(cs_wallet);
+    mapTxSpends.clear();
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
+        if (it->second.IsCoinBase())
+            continue;
+        BOOST_FOREACH (const CTxIn& txin, it->second.vin)
+            mapTxSpends.insert(make_pair(txin.prevout, it->first));
+    }
+
+    TxSpends::iterator it = mapTxSpends.begin();
+    while (it != mapTxSpends.end()) {
+        TxSpends::iterator itEnd = mapTxSpends.upper_bound(it->first);
+        if (std::distance(it, itEnd) > 1)
+            SyncMetaData(make_pair(it, itEnd));
+        it = itEnd;
+    }
+}
+
 void CWallet::AddToSpends(const uint256& wtxid)
 {
     assert(mapWallet.count(wtxid));
@@ -637,11 +680,11 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
     uint256 hash = wtxIn.GetHash();
 
     if (fFromLoadWallet) {
+        // Spends are indexed in one pass by LoadSpends() once every transaction is in
         mapWallet[hash] = wtxIn;
         CWalletTx& wtx = mapWallet[hash];
         wtx.BindWallet(this);
         wtxOrdered.insert(make_pair(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
-        AddToSpends(hash);
     } else {
         LOCK(cs_wallet);
         // Inserts only if not already there, returns tx inserted or tx found
@@ -655,6 +698,8 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
 			wtxOrdered.insert(make_pair(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
             wtx.nTimeSmart = ComputeTimeSmart(wtx);
             AddToSpends(hash);
+            if (fAddressCoinsIndexed)
+                IndexAddressCoins(wtx);
         }
 
         bool fUpdated = false;
@@ -2086,63 +2131,6 @@ map<CBitcoinAddress, vector<COutput> > CWallet::AvailableCoinsByAddress(bool fCo
     return mapCoins;
 }
 
-static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*, unsigned int> > > vValue, const CAmount& nTotalLower, const CAmount& nTargetValue, vector<char>& vfBest, CAmount& nBest, int iterations = 1000)
-{
-    vector<char> vfIncluded;
-
-    vfBest.assign(vValue.size(), true);
-    nBest = nTotalLower;
-
-    seed_insecure_rand();
-
-    for (int nRep = 0; nRep < iterations && nBest != nTargetValue; nRep++) {
-        vfIncluded.assign(vValue.size(), false);
-        CAmount nTotal = 0;
-        bool fReachedTarget = false;
-        for (int nPass = 0; nPass < 2 && !fReachedTarget; nPass++) {
-            for (unsigned int i = 0; i < vValue.size(); i++) {
-                //The solver here uses a randomized algorithm,
-                //the randomness serves no real security purpose but is just
-                //needed to prevent degenerate behavior and it is important
-                //that the rng is fast. We do not use a constant random sequence,
-                //because there may be some privacy improvement by making
-                //the selection random.
-                if (nPass == 0 ? insecure_rand() & 1 : !vfIncluded[i]) {
-                    nTotal += vValue[i].first;
-                    vfIncluded[i] = true;
-                    if (nTotal >= nTargetValue) {
-                        fReachedTarget = true;
-                        if (nTotal < nBest) {
-                            nBest = nTotal;
-                            vfBest = vfIncluded;
-                        }
-                        nTotal -= vValue[i].first;
-                        vfIncluded[i] = false;
-                    }
-                }
-            }
-        }
-    }
-}
-
-
-// TODO: find appropriate place for this sort function
-// move denoms down
-bool less_then_denom(const COutput& out1, const COutput& out2)
-{
-    const CWalletTx* pcoin1 = out1.tx;
-    const CWalletTx* pcoin2 = out2.tx;
-
-    bool found1 = false;
-    bool found2 = false;
-    BOOST_FOREACH (CAmount d, obfuScationDenominations) // loop through predefined denoms
-    {
-        if (pcoin1->vout[out1.i].nValue == d) found1 = true;
-        if (pcoin2->vout[out2.i].nValue == d) found2 = true;
-    }
-    return (!found1 && found2);
-}
-
 bool CWallet::SelectStakeCoins(std::set<std::pair<const CWalletTx*, unsigned int> >& setCoins, CAmount nTargetAmount) const
 {
     vector<COutput> vCoins;
@@ -2203,119 +2191,26 @@ bool CWallet::MintableCoins()
     return false;
 }
 
-bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, vector<COutput> vCoins, set<pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet) const
+bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, const vector<COutput>& vCoins, set<pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet) const
 {
-    setCoinsRet.clear();
-    nValueRet = 0;
-
-    // List of values less than target
-    pair<CAmount, pair<const CWalletTx*, unsigned int> > coinLowestLarger;
-    coinLowestLarger.first = std::numeric_limits<CAmount>::max();
-    coinLowestLarger.second.first = NULL;
-    vector<pair<CAmount, pair<const CWalletTx*, unsigned int> > > vValue;
-    CAmount nTotalLower = 0;
-
-    random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
-
-    // move denoms down on the list
-    sort(vCoins.begin(), vCoins.end(), less_then_denom);
-
-    // try to find nondenom first to prevent unneeded spending of mixed coins
-    for (unsigned int tryDenom = 0; tryDenom < 2; tryDenom++) {
-        if (fDebug) LogPrint("selectcoins", "tryDenom: %d\n", tryDenom);
-        vValue.clear();
-        nTotalLower = 0;
-        BOOST_FOREACH (const COutput& output, vCoins) {
-            if (!output.fSpendable)
-                continue;
-
-            const CWalletTx* pcoin = output.tx;
-
-            //            if (fDebug) LogPrint("selectcoins", "value %s confirms %d\n", FormatMoney(pcoin->vout[output.i].nValue), output.nDepth);
-            if (output.nDepth < (pcoin->IsFromMe(ISMINE_ALL) ? nConfMine : nConfTheirs))
-                continue;
-
-            int i = output.i;
-            CAmount n = pcoin->vout[i].nValue;
-            if (tryDenom == 0 && IsDenominatedAmount(n)) continue; // we don't want denom values on first run
-
-            pair<CAmount, pair<const CWalletTx*, unsigned int> > coin = make_pair(n, make_pair(pcoin, i));
-
-            if (n == nTargetValue) {
-                setCoinsRet.insert(coin.second);
-                nValueRet += coin.first;
-                return true;
-            } else if (n < nTargetValue + CENT) {
-                vValue.push_back(coin);
-                nTotalLower += n;
-            } else if (n < coinLowestLarger.first) {
-                coinLowestLarger = coin;
-            }
-        }
-
-        if (nTotalLower == nTargetValue) {
-            for (unsigned int i = 0; i < vValue.size(); ++i) {
-                setCoinsRet.insert(vValue[i].second);
-                nValueRet += vValue[i].first;
-            }
-            return true;
-        }
-
-        if (nTotalLower < nTargetValue) {
-            if (coinLowestLarger.second.first == NULL) // there is no input larger than nTargetValue
-            {
-                if (tryDenom == 0)
-                    // we didn't look at denom yet, let's do it
-                    continue;
-                else
-                    // we looked at everything possible and didn't find anything, no luck
-                    return false;
-            }
-            setCoinsRet.insert(coinLowestLarger.second);
-            nValueRet += coinLowestLarger.first;
-            return true;
-        }
-
-        // nTotalLower > nTargetValue
-        break;
-    }
-
-    // Solve subset sum by stochastic approximation
-    sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
-    vector<char> vfBest;
-    CAmount nBest;
-
-    ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, 1000);
-    if (nBest != nTargetValue && nTotalLower >= nTargetValue + CENT)
-        ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, 1000);
+    CCoinSelector selector(*this, vCoins);
+    return selector.Select(nTargetValue, nConfMine, nConfTheirs, setCoinsRet, nValueRet);
+}
 
-    // If we have a bigger coin and (either the stochastic approximation didn't find a good solution,
-    //                                   or the next bigger coin is closer), return the bigger coin
-    if (coinLowestLarger.second.first &&
-        ((nBest != nTargetValue && nBest < nTargetValue + CENT) || coinLowestLarger.first <= nBest)) {
-        setCoinsRet.insert(coinLowestLarger.second);
-        nValueRet += coinLowestLarger.first;
-    } else {
-        string s = "CWallet::SelectCoinsMinConf best subset: ";
-        for (unsigned int i = 0; i < vValue.size(); i++) {
-            if (vfBest[i]) {
-                setCoinsRet.insert(vValue[i].second);
-                nValueRet += vValue[i].first;
-                s += FormatMoney(vValue[i].first) + " ";
-            }
-        }
-        LogPrintf("%s - total %s\n", s, FormatMoney(nBest));
-    }
+bool CWallet::SelectCoins(const CAmount& nTargetValue, set<pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet, const CCoinControl* coinControl, AvailableCoinsType coin_type, bool useIX) const
+{
+    vector<COutput> vCoins;
+    AvailableCoins(vCoins, true, coinControl, false, coin_type, useIX);
 
-    return true;
+    CCoinSelector selector(*this, vCoins);
+    return SelectCoins(selector, nTargetValue, setCoinsRet, nValueRet, coinControl, coin_type);
 }
 
-bool CWallet::SelectCoins(const CAmount& nTargetValue, set<pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet, const CCoinControl* coinControl, AvailableCoinsType coin_type, bool useIX) const
+bool CWallet::SelectCoins(const CCoinSelector& selector, const CAmount& nTargetValue, set<pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet, const CCoinControl* coinControl, AvailableCoinsType coin_type) const
 {
     // Note: this function should never be used for "always free" tx types like dstx
 
-    vector<COutput> vCoins;
-    AvailableCoins(vCoins, true, coinControl, false, coin_type, useIX);
+    const vector<COutput>& vCoins = selector.GetCoins();
 
     // coin control -> return all selected outputs (we want all selected to go into the transaction for sure)
     if (coinControl && coinControl->HasSelected())
@@ -2357,9 +2252,9 @@ bool CWallet::SelectCoins(const CAmount& nTargetValue, set<pair<const CWalletTx*
         return (nValueRet >= nTargetValue);
     }
 
-    return (SelectCoinsMinConf(nTargetValue, 1, 6, vCoins, setCoinsRet, nValueRet) ||
-            SelectCoinsMinConf(nTargetValue, 1, 1, vCoins, setCoinsRet, nValueRet) ||
-            (bSpendZeroConfChange && SelectCoinsMinConf(nTargetValue, 0, 1, vCoins, setCoinsRet, nValueRet)));
+    return (selector.Select(nTargetValue, 1, 6, setCoinsRet, nValueRet) ||
+            selector.Select(nTargetValue, 1, 1, setCoinsRet, nValueRet) ||
+            (bSpendZeroConfChange && selector.Select(nTargetValue, 0, 1, setCoinsRet, nValueRet)));
 }
 
 struct CompareByPriority {
@@ -2722,6 +2617,11 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, CAmount> >& vecSend,
     {
         LOCK2(cs_main, cs_wallet);
         {
+            // Gather and sort the spendable outputs once; every pass of the fee loop selects from them
+            vector<COutput> vAvailableCoins;
+            AvailableCoins(vAvailableCoins, true, coinControl, false, coin_type, useIX);
+            CCoinSelector selector(*this, vAvailableCoins);
+
 			if (nFeePay > 0) nFeeRet = nFeePay;
 			else nFeeRet = 0;
             while (true) {
@@ -2766,7 +2666,7 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, CAmount> >& vecSend,
                 set<pair<const CWalletTx*, unsigned int> > setCoins;
                 CAmount nValueIn = 0;
 
-                if (!SelectCoins(nTotalValue, setCoins, nValueIn, coinControl, coin_type, useIX)) {
+                if (!SelectCoins(selector, nTotalValue, setCoins, nValueIn, coinControl, coin_type)) {
                     if (coin_type == ALL_COINS) {
                         strFailReason = _("Insufficient funds.");
                     } else if (coin_type == ONLY_NOT1000IFMN) {
@@ -2889,12 +2789,13 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, CAmount> >& vecSend,
                     txNew.vin.push_back(CTxIn(coin.first->GetHash(), coin.second));
 
                 // Sign
-                int nIn = 0;
+                vector<CScript> vFromPubKeys;
                 BOOST_FOREACH (const PAIRTYPE(const CWalletTx*, unsigned int) & coin, setCoins)
-                    if (!SignSignature(*this, *coin.first, txNew, nIn++)) {
-                        strFailReason = _("Signing transaction failed");
-                        return false;
-                    }
+                    vFromPubKeys.push_back(coin.first->vout[coin.second].scriptPubKey);
+                if (!SignTransaction(*this, vFromPubKeys, txNew)) {
+                    strFailReason = _("Signing transaction failed");
+                    return false;
+                }
 
                 // Embed the constructed transaction data in wtxNew.
                 *static_cast<CTransaction*>(&wtxNew) = CTransaction(txNew);
@@ -3126,12 +3027,12 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
 	if (nBytes >= DEFAULT_BLOCK_MAX_SIZE / 5) return error("CreateCoinStake : exceeded coinstake size limit");
 
     // Sign
-    int nIn = 0;
-    BOOST_FOREACH (const CWalletTx* pcoin, vwtxPrev) {
-        if (!SignSignature(*this, *pcoin, txNew, nIn++))
-            return error("CreateCoinStake : failed to sign coinstake");
-    }
-	LogPrintf("Successfully generated coinstake\n");
+    vector<CScript> vFromPubKeys;
+    for (unsigned int nIn = 0; nIn < txNew.vin.size(); nIn++)
+        vFromPubKeys.push_back(vwtxPrev[nIn]->vout[txNew.vin[nIn].prevout.n].scriptPubKey);
+    if (!SignTransaction(*this, vFromPubKeys, txNew))
+        return error("CreateCoinStake : failed to sign coinstake");
+    LogPrintf("Successfully generated coinstake\n");
     // Successfully generated coinstake
     nLastStakeSetUpdate = 0; //this will trigger stake set to repopulate next round
     return true;
@@ -3489,50 +3390,157 @@ bool CWallet::NewKeyPool()
         if (IsLocked())
             return false;
 
-        int64_t nKeys = max(GetArg("-keypool", 1000), (int64_t)0);
-        for (int i = 0; i < nKeys; i++) {
-            int64_t nIndex = i + 1;
-            walletdb.WritePool(nIndex, CKeyPool(GenerateNewKey()));
-            setKeyPool.insert(nIndex);
-        }
-        LogPrintf("CWallet::NewKeyPool wrote %d new keys\n", nKeys);
+        if (!TopUpKeyPool())
+            return false;
+        LogPrintf("CWallet::NewKeyPool wrote %d new keys\n", setKeyPool.size());
     }
     return true;
 }
 
-bool CWallet::TopUpKeyPool(unsigned int kpSize)
+static void GenerateKeyRange(vector<CKey>& vKeys, vector<CPubKey>& vPubKeys, bool fCompressed, size_t nFirst, size_t nStride)
+{
+    for (size_t i = nFirst; i < vKeys.size(); i += nStride) {
+        vKeys[i].MakeNewKey(fCompressed);
+        vPubKeys[i] = vKeys[i].GetPubKey();
+        assert(vKeys[i].VerifyPubKey(vPubKeys[i]));
+    }
+}
+
+/**
+ * Generate keys on several threads, then add them to the wallet in batches of
+ * KEYPOOL_BATCH_SIZE. cs_wallet is only taken to store each batch, and each
+ * batch is written in a single database transaction. Background refills by
+ * the keypool thread don't report progress as wallet loading.
+ */
+bool CWallet::TopUpKeyPool(unsigned int kpSize, bool fBackground)
 {
+    // Top up key pool
+    unsigned int nTargetSize;
+    if (kpSize > 0)
+        nTargetSize = kpSize;
+    else
+        nTargetSize = max(GetArg("-keypool", 1000), (int64_t)0);
+
+    bool fCompressed;
+    unsigned int nMissing;
     {
         LOCK(cs_wallet);
-
         if (IsLocked())
             return false;
+        if (setKeyPool.size() >= nTargetSize + 1)
+            return true;
+        nMissing = nTargetSize + 1 - setKeyPool.size();
+        nKeyPoolTopUpProgress = 0;
 
-        CWalletDB walletdb(strWalletFile);
+        // Compressed public keys were introduced in version 0.6.0
+        fCompressed = CanSupportFeature(FEATURE_COMPRPUBKEY); // default to compressed public keys if we want 0.6.0 wallets
+        if (fCompressed)
+            SetMinVersion(FEATURE_COMPRPUBKEY);
+    }
 
-        // Top up key pool
-        unsigned int nTargetSize;
-        if (kpSize > 0)
-            nTargetSize = kpSize;
-        else
-            nTargetSize = max(GetArg("-keypool", 1000), (int64_t)0);
+    RandAddSeedPerfmon();
+    int nThreads = std::max(1, std::min((int)boost::thread::hardware_concurrency(), MAX_KEYGEN_THREADS));
+    unsigned int nTotal = nMissing;
+    bool fShowProgress = nTotal > KEYPOOL_BATCH_SIZE;
+    if (fShowProgress)
+        ShowProgress(_("Generating keys..."), 0);
 
-        while (setKeyPool.size() < (nTargetSize + 1)) {
-            int64_t nEnd = 1;
-            if (!setKeyPool.empty())
-                nEnd = *(--setKeyPool.end()) + 1;
-            if (!walletdb.WritePool(nEnd, CKeyPool(GenerateNewKey())))
-                throw runtime_error("TopUpKeyPool() : writing generated key failed");
-            setKeyPool.insert(nEnd);
-            LogPrintf("keypool added key %d, size=%u\n", nEnd, setKeyPool.size());
-            double dProgress = 100.f * nEnd / (nTargetSize + 1);
-            std::string strMsg = strprintf(_("Loading wallet... (%3.2f %%)"), dProgress);
-            uiInterface.InitMessage(strMsg);
+    try {
+        while (nMissing > 0) {
+            // Keys are generated without holding cs_wallet
+            vector<CKey> vKeys(std::min(nMissing, KEYPOOL_BATCH_SIZE));
+            vector<CPubKey> vPubKeys(vKeys.size());
+            {
+                boost::this_thread::disable_interruption di;
+                boost::thread_group threadGroup;
+                for (int n = 1; n < nThreads; n++)
+                    threadGroup.create_thread(boost::bind(&GenerateKeyRange, boost::ref(vKeys), boost::ref(vPubKeys), fCompressed, n, nThreads));
+                GenerateKeyRange(vKeys, vPubKeys, fCompressed, 0, nThreads);
+                threadGroup.join_all();
+            }
+
+            LOCK(cs_wallet);
+            if (IsLocked()) {
+                nKeyPoolTopUpProgress = -1;
+                if (fShowProgress)
+                    ShowProgress("", 100);
+                return false;
+            }
+
+            // Someone else may have topped up the pool meanwhile
+            nMissing = setKeyPool.size() < nTargetSize + 1 ? nTargetSize + 1 - setKeyPool.size() : 0;
+            size_t nAdd = std::min((size_t)nMissing, vKeys.size());
+
+            CWalletDB walletdb(strWalletFile);
+            bool fTxn = fFileBacked && walletdb.TxnBegin();
+            int64_t nEnd = setKeyPool.empty() ? 1 : *(--setKeyPool.end()) + 1;
+            for (size_t i = 0; i < nAdd; i++) {
+                AddNewKey(fTxn ? &walletdb : NULL, vKeys[i], vPubKeys[i]);
+                if (!walletdb.WritePool(nEnd + i, CKeyPool(vPubKeys[i]))) {
+                    if (fTxn)
+                        walletdb.TxnAbort();
+                    throw runtime_error("TopUpKeyPool() : writing generated key failed");
+                }
+            }
+            if (fTxn && !walletdb.TxnCommit())
+                throw runtime_error("TopUpKeyPool() : committing generated keys failed");
+            for (size_t i = 0; i < nAdd; i++)
+                setKeyPool.insert(nEnd + i);
+            nMissing -= nAdd;
+
+            nKeyPoolTopUpProgress = nMissing > 0 ? 100 * (nTotal - std::min(nTotal, nMissing)) / nTotal : -1;
+            LogPrintf("keypool added keys %d to %d, size=%u\n", nEnd, nEnd + nAdd - 1, setKeyPool.size());
+            double dProgress = 100.f * (nTotal - std::min(nTotal, nMissing)) / nTotal;
+            if (!fBackground) {
+                std::string strMsg = strprintf(_("Loading wallet... (%3.2f %%)"), dProgress);
+                uiInterface.InitMessage(strMsg);
+            }
+            if (fShowProgress)
+                ShowProgress(_("Generating keys..."), std::max(1, std::min(99, (int)dProgress)));
+        }
+    } catch (...) {
+        // Don't leave getwalletinfo and the progress dialog reporting a top-up that has stopped
+        {
+            LOCK(cs_wallet);
+            nKeyPoolTopUpProgress = -1;
         }
+        if (fShowProgress)
+            ShowProgress("", 100);
+        throw;
     }
+    if (fShowProgress)
+        ShowProgress(_("Generating keys..."), 100);
     return true;
 }
 
+void CWallet::RequestKeyPoolTopUp()
+{
+    {
+        boost::lock_guard<boost::mutex> lock(mutexKeyPoolTopUp);
+        fKeyPoolTopUpRequested = true;
+    }
+    condKeyPoolTopUp.notify_one();
+}
+
+void CWallet::ThreadKeyPoolTopUp()
+{
+    RenameThread("uidd-keypool");
+
+    while (true) {
+        {
+            boost::unique_lock<boost::mutex> lock(mutexKeyPoolTopUp);
+            while (!fKeyPoolTopUpRequested)
+                condKeyPoolTopUp.wait(lock);
+            fKeyPoolTopUpRequested = false;
+        }
+        try {
+            TopUpKeyPool(0, true);
+        } catch (std::exception& e) {
+            PrintExceptionContinue(&e, "ThreadKeyPoolTopUp()");
+        }
+    }
+}
+
 void CWallet::ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool)
 {
     nIndex = -1;
@@ -3540,8 +3548,14 @@ void CWallet::ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool)
     {
         LOCK(cs_wallet);
 
-        if (!IsLocked())
-            TopUpKeyPool();
+        if (!IsLocked()) {
+            // Only generate keys in the caller's thread once the pool has run dry;
+            // otherwise the keypool thread refills it in the background
+            if (setKeyPool.empty())
+                TopUpKeyPool(1);
+            if (setKeyPool.size() <= (unsigned int)max(GetArg("-keypool", 1000), (int64_t)0))
+                RequestKeyPoolTopUp();
+        }
 
         // Get the oldest key
         if (setKeyPool.empty())
@@ -4155,25 +4169,79 @@ void CWallet::AutoZeromint()
     }
 }
 
-void CWallet::AutoCombineDust()
+void CWallet::IndexAddressCoins(const CWalletTx& wtx)
 {
-    if (chainActive.Tip()->nTime < (GetAdjustedTime() - 40) || IsLocked()) {
-        return;
+    AssertLockHeld(cs_wallet);
+    for (unsigned int i = 0; i < wtx.vout.size(); i++) {
+        if (IsMine(wtx.vout[i]) == ISMINE_NO)
+            continue;
+
+        CTxDestination address;
+        if (!ExtractDestination(wtx.vout[i].scriptPubKey, address))
+            continue;
+
+        mapAddressCoins[address].insert(COutPoint(wtx.GetHash(), i));
     }
+}
+
+bool CWallet::AutoCombineDust()
+{
+    unsigned int nSent = 0;
+    bool fFailed = false;
 
-    map<CBitcoinAddress, vector<COutput> > mapCoinsByAddress = AvailableCoinsByAddress(true, nAutoCombineThreshold * COIN);
+    while (true) {
+        LOCK2(cs_main, cs_wallet);
+        if (chainActive.Tip()->nTime < (GetAdjustedTime() - 40) || IsLocked()) {
+            return true;
+        }
+
+        // Built once from mapWallet; AddToWallet keeps it current afterwards
+        if (!fAddressCoinsIndexed) {
+            for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+                IndexAddressCoins(it->second);
+            fAddressCoinsIndexed = true;
+        }
 
-    //coins are sectioned by address. This combination code only wants to combine inputs that belong to the same address
-    for (map<CBitcoinAddress, vector<COutput> >::iterator it = mapCoinsByAddress.begin(); it != mapCoinsByAddress.end(); it++) {
+        // Addresses are visited in order across runs, one per lock acquisition
+        map<CTxDestination, set<COutPoint> >::iterator it = fCombineResume ? mapAddressCoins.upper_bound(destCombineCursor) : mapAddressCoins.begin();
+        if (it == mapAddressCoins.end()) {
+            fCombineResume = false;
+            return !fFailed;
+        }
+        destCombineCursor = it->first;
+        fCombineResume = true;
+
+        //coins are sectioned by address. This combination code only wants to combine inputs that belong to the same address
         vector<COutput> vCoins, vRewardCoins;
-        vCoins = it->second;
+        for (set<COutPoint>::iterator itOut = it->second.begin(); itOut != it->second.end();) {
+            map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(itOut->hash);
+            if (mi == mapWallet.end() || IsSpent(itOut->hash, itOut->n)) {
+                it->second.erase(itOut++);
+                continue;
+            }
+
+            const CWalletTx* pcoin = &mi->second;
+            const CTxOut& txout = pcoin->vout[itOut->n];
+            int nDepth = pcoin->GetDepthInMainChain(false);
+            isminetype mine = IsMine(txout);
+            if (CheckFinalTx(*pcoin) && pcoin->IsTrusted() && nDepth > 0 &&
+                !((pcoin->IsCoinBase() || pcoin->IsCoinStake()) && pcoin->GetBlocksToMaturity() > 0) &&
+                !IsLockedCoin(itOut->hash, itOut->n) && txout.nValue > 0 && txout.nValue <= nAutoCombineThreshold * COIN) {
+                vCoins.push_back(COutput(pcoin, itOut->n, nDepth, (mine & (ISMINE_SPENDABLE | ISMINE_MULTISIG)) != ISMINE_NO));
+            }
+            ++itOut;
+        }
+        if (it->second.empty()) {
+            mapAddressCoins.erase(it);
+            continue;
+        }
 
         // We don't want the tx to be refused for being too large
         // we use 50 bytes as a base tx size (2 output: 2*34 + overhead: 10 -> 90 to be certain)
         unsigned int txSizeEstimate = 90;
 
         //find masternode rewards that need to be combined
-        CCoinControl* coinControl = new CCoinControl();
+        CCoinControl coinControl;
         CAmount nTotalRewardsValue = 0;
         BOOST_FOREACH (const COutput& out, vCoins) {
             if (!out.fSpendable)
@@ -4183,7 +4251,7 @@ void CWallet::AutoCombineDust()
                 continue;
 
             COutPoint outpt(out.tx->GetHash(), out.i);
-            coinControl->Select(outpt);
+            coinControl.Select(outpt);
             vRewardCoins.push_back(out);
             nTotalRewardsValue += out.Value();
 
@@ -4198,7 +4266,7 @@ void CWallet::AutoCombineDust()
         }
 
         //if no inputs found then return
-        if (!coinControl->HasSelected())
+        if (!coinControl.HasSelected())
             continue;
 
         //we cannot combine one coin with itself
@@ -4206,16 +4274,11 @@ void CWallet::AutoCombineDust()
             continue;
 
         vector<pair<CScript, CAmount> > vecSend;
-        CScript scriptPubKey = GetScriptForDestination(it->first.Get());
+        CScript scriptPubKey = GetScriptForDestination(it->first);
         vecSend.push_back(make_pair(scriptPubKey, nTotalRewardsValue));
 
         //Send change to same address
-        CTxDestination destMyAddress;
-        if (!ExtractDestination(scriptPubKey, destMyAddress)) {
-            LogPrintf("AutoCombineDust: failed to extract destination\n");
-            continue;
-        }
-        coinControl->destChange = destMyAddress;
+        coinControl.destChange = it->first;
 
         // Create the transaction and commit it to the network
         CWalletTx wtx;
@@ -4226,8 +4289,9 @@ void CWallet::AutoCombineDust()
         // 10% safety margin to avoid "Insufficient funds" errors
         vecSend[0].second = nTotalRewardsValue - (nTotalRewardsValue / 10);
 
-        if (!CreateTransaction(vecSend, wtx, keyChange, nFeeRet, strErr, coinControl, ALL_COINS, false, CAmount(0))) {
+        if (!CreateTransaction(vecSend, wtx, keyChange, nFeeRet, strErr, &coinControl, ALL_COINS, false, CAmount(0))) {
             LogPrintf("AutoCombineDust createtransaction failed, reason: %s\n", strErr);
+            fFailed = true;
             continue;
         }
 
@@ -4237,35 +4301,51 @@ void CWallet::AutoCombineDust()
 
         if (!CommitTransaction(wtx, keyChange)) {
             LogPrintf("AutoCombineDust transaction commit failed\n");
+            fFailed = true;
             continue;
         }
 
         LogPrintf("AutoCombineDust sent transaction\n");
 
-        delete coinControl;
+        // Leave the remaining addresses for the next run rather than flooding the network
+        if (++nSent >= MAX_AUTOCOMBINE_TX_PER_RUN)
+            return !fFailed;
     }
 }
 
 bool CWallet::MultiSend()
 {
-    // Stop the old blocks from sending multisends
+    LOCK2(cs_main, cs_wallet);
+
+    // Stop the old blocks from sending multisends. Skipped blocks aren't caught up on later,
+    // so only the block connected next is scanned once sending resumes
     if (chainActive.Tip()->nTime < (GetAdjustedTime() - 40) || IsLocked()) {
+        nMultiSendScanHeight = -1;
         return false;
     }
 
     if (chainActive.Tip()->nHeight <= nLastMultiSendHeight) {
         LogPrintf("Multisend: lastmultisendheight is higher than current best height\n");
+        nMultiSendScanHeight = -1;
         return false;
     }
 
+    // Blocks connected since the last scan; outputs that matured in any of them are sent
+    int nHeight = chainActive.Height();
+    int nNewBlocks = nMultiSendScanHeight < 0 ? 1 : nHeight - nMultiSendScanHeight;
+    nMultiSendScanHeight = nHeight;
+    if (nNewBlocks <= 0)
+        return false;
+
     std::vector<COutput> vCoins;
     AvailableCoins(vCoins);
     bool stakeSent = false;
     bool mnSent = false;
     for (const COutput& out : vCoins) {
 
-        //need output with precise confirm count - this is how we identify which is the output to send
-        if (out.tx->GetDepthInMainChain() != Params().COINBASE_MATURITY() + 1)
+        //need output that reached maturity since the last scan - this is how we identify which is the output to send
+        int nDepth = out.tx->GetDepthInMainChain();
+        if (nDepth < Params().COINBASE_MATURITY() + 1 || nDepth > Params().COINBASE_MATURITY() + nNewBlocks)
             continue;
 
         COutPoint outpoint(out.tx->GetHash(), out.i);
@@ -4361,6 +4441,34 @@ bool CWallet::MultiSend()
     return true;
 }
 
+void CWallet::RunMaintenance()
+{
+    int nHeight;
+    {
+        LOCK(cs_main);
+        if (!chainActive.Tip())
+            return;
+        nHeight = chainActive.Height();
+    }
+
+    // Nothing to do until a new block arrives, unless the last run was cut short
+    if (nHeight == nMaintenanceHeight && !fCombineResume)
+        return;
+    nMaintenanceHeight = nHeight;
+
+    // If turned on MultiSend will send a transaction (or more) on the after maturity of a stake
+    if (isMultiSendEnabled()) {
+        MultiSend();
+    } else {
+        LOCK(cs_wallet);
+        nMultiSendScanHeight = -1;
+    }
+
+    // If turned on Auto Combine will scan wallet for dust to combine
+    if (fCombineDust && !AutoCombineDust())
+        LogPrintf("RunMaintenance : AutoCombineDust failed to combine some dust, those addresses are retried on its next pass\n");
+}
+
 CKeyPool::CKeyPool()
 {
     nTime = GetTime();
@@ -4607,12 +4715,12 @@ bool CWallet::CreateZerocoinMintTransaction(const CAmount nValue, CMutableTransa
 
     // Sign if these are uidd outputs - NOTE that zUIDD outputs are signed later in SoK
     if (!isZCSpendChange) {
-        int nIn = 0;
-        for (const std::pair<const CWalletTx*, unsigned int>& coin : setCoins) {
-            if (!SignSignature(*this, *coin.first, txNew, nIn++)) {
-                strFailReason = _("Signing transaction failed");
-                return false;
-            }
+        std::vector<CScript> vFromPubKeys;
+        for (const std::pair<const CWalletTx*, unsigned int>& coin : setCoins)
+            vFromPubKeys.push_back(coin.first->vout[coin.second].scriptPubKey);
+        if (!SignTransaction(*this, vFromPubKeys, txNew)) {
+            strFailReason = _("Signing transaction failed");
+            return false;
         }
     }
 
@@ -54,12 +54,21 @@ static const CAmount DEFAULT_TRANSACTION_MAXFEE = 1 * COIN;
 static const CAmount nHighTransactionMaxFeeWarning = 100 * nHighTransactionFeeWarning;
 //! Largest (in bytes) free transaction we're willing to create
 static const unsigned int MAX_FREE_TRANSACTION_CREATE_SIZE = 1000;
+//! Seconds between runs of the wallet maintenance task (MultiSend, dust combining)
+static const int64_t WALLET_MAINTENANCE_INTERVAL = 10;
+//! Most auto-combine transactions broadcast per maintenance run
+static const unsigned int MAX_AUTOCOMBINE_TX_PER_RUN = 5;
+//! Keypool keys generated, and written in one database transaction, per batch
+static const unsigned int KEYPOOL_BATCH_SIZE = 500;
+//! Maximum number of threads generating keypool keys
+static const int MAX_KEYGEN_THREADS = 8;
 
 // Zerocoin denomination which creates exactly one of each of the denominations
 static const int ZQ_262625 = 262625;
 
 class CAccountingEntry;
 class CCoinControl;
+class CCoinSelector;
 class COutput;
 class CReserveKey;
 class CScript;
@@ -160,9 +169,20 @@ class CWallet : public CCryptoKeyStore, public CValidationInterface
 {
 private:
     bool SelectCoins(const CAmount& nTargetValue, std::set<std::pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet, const CCoinControl* coinControl = NULL, AvailableCoinsType coin_type = ALL_COINS, bool useIX = true) const;
+    bool SelectCoins(const CCoinSelector& selector, const CAmount& nTargetValue, std::set<std::pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet, const CCoinControl* coinControl, AvailableCoinsType coin_type) const;
     //it was public bool SelectCoins(int64_t nTargetValue, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet, const CCoinControl *coinControl = NULL, AvailableCoinsType coin_type=ALL_COINS, bool useIX = true) const;
 
     CWalletDB* pwalletdbEncryption;
+    //! Database transaction of the keypool batch being stored, AddCryptedKey writes through it
+    CWalletDB* pwalletdbKeyPool;
+
+    //! Set by RequestKeyPoolTopUp, cleared by the keypool thread
+    boost::mutex mutexKeyPoolTopUp;
+    boost::condition_variable condKeyPoolTopUp;
+    bool fKeyPoolTopUpRequested;
+
+    bool AddKeyPubKeyWithDB(CWalletDB* pwalletdb, const CKey& key, const CPubKey& pubkey);
+    void AddNewKey(CWalletDB* pwalletdb, const CKey& key, const CPubKey& pubkey);
 
     //! the current wallet version: clients below this version are not able to load the wallet
     int nWalletVersion;
@@ -228,6 +248,8 @@ public:
 
     std::set<int64_t> setKeyPool;
     std::map<CKeyID, CKeyMetadata> mapKeyMetadata;
+    //! Percentage done of a running keypool top-up, -1 when none is running
+    int nKeyPoolTopUpProgress;
 
     typedef std::map<unsigned int, CMasterKey> MasterKeyMap;
     MasterKeyMap mapMasterKeys;
@@ -252,6 +274,16 @@ public:
     bool fCombineDust;
     CAmount nAutoCombineThreshold;
 
+    //! Our outputs by destination, extended as transactions are added; spent entries are pruned by AutoCombineDust
+    std::map<CTxDestination, std::set<COutPoint> > mapAddressCoins;
+    bool fAddressCoinsIndexed;
+    //! Where AutoCombineDust resumes after hitting MAX_AUTOCOMBINE_TX_PER_RUN
+    CTxDestination destCombineCursor;
+    bool fCombineResume;
+    //! Chain heights already handled by RunMaintenance and MultiSend
+    int nMaintenanceHeight;
+    int nMultiSendScanHeight;
+
     CWallet()
     {
         SetNull();
@@ -277,6 +309,9 @@ public:
         fFileBacked = false;
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
+        pwalletdbKeyPool = NULL;
+        fKeyPoolTopUpRequested = false;
+        nKeyPoolTopUpProgress = -1;
         nOrderPosNext = 0;
         nNextResend = 0;
         nLastResend = 0;
@@ -302,6 +337,13 @@ public:
         //Auto Combine Dust
         fCombineDust = false;
         nAutoCombineThreshold = 0;
+        mapAddressCoins.clear();
+        fAddressCoinsIndexed = false;
+        destCombineCursor = CNoDestination();
+        fCombineResume = false;
+
+        nMaintenanceHeight = -1;
+        nMultiSendScanHeight = -1;
     }
 
     int getZeromintPercentage()
@@ -360,7 +402,7 @@ public:
     void AvailableCoins(std::vector<COutput>& vCoins, bool fOnlyConfirmed = true, const CCoinControl* coinControl = NULL, bool fIncludeZeroValue = false, AvailableCoinsType nCoinType = ALL_COINS, bool fUseIX = false, int nWatchonlyConfig = 1) const;
     std::map<CBitcoinAddress, std::vector<COutput> > AvailableCoinsByAddress(bool fConfirmed = true, CAmount maxCoinValue = 0);
 	CAmount GetSpendableCoinsOfAddress(CBitcoinAddress &theAddress, CCoinControl* ToCoinControl, int minConfirmations = 0, CAmount StopAtAmount = Params().MaxMoneyOut());
-	bool SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, std::vector<COutput> vCoins, std::set<std::pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet) const;
+	bool SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, const std::vector<COutput>& vCoins, std::set<std::pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet) const;
 
     /// Get 1000 UIDD output and keys which can be used for the Masternode
     bool GetMasternodeVinAndKeys(CTxIn& txinRet, CPubKey& pubKeyRet, CKey& keyRet, std::string strTxHash = "", std::string strOutputIndex = "");
@@ -438,6 +480,7 @@ public:
 
     void MarkDirty();
     bool AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet = false);
+    void LoadSpends();
     void SyncTransaction(const CTransaction& tx, const CBlock* pblock);
     bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate);
     void EraseFromWallet(const uint256& hash);
@@ -482,14 +525,20 @@ public:
     bool ConvertList(std::vector<CTxIn> vCoins, std::vector<int64_t>& vecAmounts);
     bool CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int64_t nSearchInterval, CMutableTransaction& txNew, unsigned int& nTxNewTime, CAmount theTXFees);
     bool MultiSend();
-    void AutoCombineDust();
+    //! Returns false if a combining transaction could not be created or committed
+    bool AutoCombineDust();
+    void IndexAddressCoins(const CWalletTx& wtx);
+    void RunMaintenance();
     void AutoZeromint();
 
     static CFeeRate minTxFee;
     static CAmount GetMinimumFee(unsigned int nTxBytes, unsigned int nConfirmTarget, const CTxMemPool& pool);
 
     bool NewKeyPool();
-    bool TopUpKeyPool(unsigned int kpSize = 0);
+    bool TopUpKeyPool(unsigned int kpSize = 0, bool fBackground = false);
+    //! Have the keypool thread top up the keypool instead of the caller
+    void RequestKeyPoolTopUp();
+    void ThreadKeyPoolTopUp();
     void ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool);
     void KeepKey(int64_t nIndex);
     void ReturnKey(int64_t nIndex);
@@ -16,6 +16,8 @@
 #include "utiltime.h"
 #include "wallet.h"
 
+#include <algorithm>
+
 #include <boost/filesystem.hpp>
 #include <boost/foreach.hpp>
 #include <boost/scoped_ptr.hpp>
@@ -373,11 +375,8 @@ DBErrors CWalletDB::ReorderTransactions(CWallet* pwallet)
             } else if (!WriteAccountingEntry(pacentry->nEntryNo, *pacentry))
                 return DB_LOAD_FAIL;
         } else {
-            int64_t nOrderPosOff = 0;
-            BOOST_FOREACH (const int64_t& nOffsetStart, nOrderPosOffsets) {
-                if (nOrderPos >= nOffsetStart)
-                    ++nOrderPosOff;
-            }
+            // nOrderPosOffsets is filled in increasing order, so count the offsets at or below nOrderPos by bisection
+            int64_t nOrderPosOff = std::upper_bound(nOrderPosOffsets.begin(), nOrderPosOffsets.end(), nOrderPos) - nOrderPosOffsets.begin();
             nOrderPos += nOrderPosOff;
             nOrderPosNext = std::max(nOrderPosNext, nOrderPos + 1);
 
@@ -731,6 +730,13 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
         result = DB_CORRUPT;
     }
 
+    // Index spends before any early return, a wallet loaded with noncritical
+    // errors is still used and must not see its spent outputs as unspent
+    {
+        LOCK(pwallet->cs_wallet);
+        pwallet->LoadSpends();
+    }
+
     if (fNoncriticalErrors && result == DB_LOAD_OK)
         result = DB_NONCRITICAL_ERROR;
 